@@ -4,7 +4,15 @@
 #include "PayUtils/Utils.h"
 #include "PayUtils/RSAUtils.h"
 #include "PayUtils/HttpClient.h"
+#include "PayUtils/PayMetrics.h"
+#include "PayUtils/PayJournal.h"
+#include "PayUtils/PaySingleFlight.h"
+#include "PayUtils/PayRefundLedger.h"
+#include "PayUtils/PaySigner.h"
+#include "PayUtils/PayFieldTable.h"
+#include "PayUtils/PayArena.h"
 #include "PayHeader.h"
+#include "PayGateway.h"
 #include <boost/format.hpp>
 
 using namespace std;
@@ -29,28 +37,64 @@ int CAlipay::verifyAlipayResps(const string& strRespsContent, const string& strS
 	return CRSAUtils::rsa_verify_from_pubKey_with_base64(strRespsContent, strSign, pubKey) ? 0 : -1;
 }
 
-int CAlipay::verifyAlipayNotify(const map<string, string>& mapNotify, const string& pubKey)
+void CAlipay::makeNotifySignContent(const map<string, string>& mapNotify, string& content, string& sign)
 {
-	string content(""), sign("");
-	vector<string>& vecDictionary = CUtils::createDictionaryWithMap(mapNotify);
-	for (auto itr = vecDictionary.begin(); itr != vecDictionary.end(); ++itr)
+	//the map is already in dictionary order
+	for (auto itr = mapNotify.begin(); itr != mapNotify.end(); ++itr)
 	{
-		if (*itr == ALIPAY_NOTIFY_SIGN_TYPE)
+		if (itr->first == ALIPAY_NOTIFY_SIGN_TYPE)
 			continue;
-		auto itrr = mapNotify.find(*itr);
-		if (itrr != mapNotify.end())
+		if (itr->first == ALIPAY_NOTIFY_SIGN)
 		{
-			if (*itr == ALIPAY_NOTIFY_SIGN)
-			{
-				sign = itrr->second;
-				continue;
-			}
-			CUtils::AppendContentWithoutUrlEncode(*itr, itrr->second, content, !content.empty());
+			sign = itr->second;
+			continue;
 		}
+		CUtils::AppendPair(content, itr->first, itr->second, !content.empty());
 	}
+}
+
+int CAlipay::verifyAlipayNotify(const map<string, string>& mapNotify, const string& pubKey)
+{
+	string content(""), sign("");
+	makeNotifySignContent(mapNotify, content, sign);
 	return CRSAUtils::rsa_verify_from_pubKey_with_base64(content, sign, pubKey) ? 0 : -1;
 }
 
+int CAlipay::verifyAndApplyNotify(const map<string, string>& mapNotify)
+{
+	string content(""), sign("");
+	makeNotifySignContent(mapNotify, content, sign);
+	if (!CRSAUtils::rsa_verify_with_base64(content, sign, m_pPubKey.get()))
+		return -1;
+
+	auto itrAppId = mapNotify.find(ALIPAY_NOTIFY_APP_ID);
+	if (itrAppId != mapNotify.end() && itrAppId->second != m_strAppId)
+		return -1;
+
+	auto itrOutTradeNo = mapNotify.find(ALIPAY_NOTIFY_OUT_TRADE_NO);
+	auto itrTradeStatus = mapNotify.find(ALIPAY_NOTIFY_TRADE_STATUS);
+	if (!m_pOrderCache || itrOutTradeNo == mapNotify.end() || itrTradeStatus == mapNotify.end())
+		return 0;
+
+	CAlipayResps alipayResps;
+	alipayResps.strOutTradeNo = itrOutTradeNo->second;
+	alipayResps.iTradeStatus = parseTradeStatus(itrTradeStatus->second);
+	auto itrTradeNo = mapNotify.find(ALIPAY_NOTIFY_TRADE_NO);
+	auto itrTotalAmount = mapNotify.find(ALIPAY_NOTIFY_TOTAL_AMOUNT);
+	auto itrBuyerLogonId = mapNotify.find(ALIPAY_NOTIFY_BUYER_LOGON_ID);
+	auto itrBuyerId = mapNotify.find(ALIPAY_NOTIFY_BUYER_ID);
+	if (itrTradeNo != mapNotify.end())
+		alipayResps.strTradeNo = itrTradeNo->second;
+	if (itrTotalAmount != mapNotify.end())
+		alipayResps.strTotalAmount = itrTotalAmount->second;
+	if (itrBuyerLogonId != mapNotify.end())
+		alipayResps.strBuyerLogonId = itrBuyerLogonId->second;
+	if (itrBuyerId != mapNotify.end())
+		alipayResps.strBuyerUserId = itrBuyerId->second;
+	m_pOrderCache->put(CAlipayOrderCache::makeKey(m_strAppId, alipayResps.strOutTradeNo), alipayResps);
+	return 0;
+}
+
 template<typename T>
 static string convertJsonToString(const T& tValue)
 {
@@ -60,6 +104,40 @@ static string convertJsonToString(const T& tValue)
 	return buffer.GetString();
 }
 
+static void countAlipayError(const CAlipayError& e)
+{
+	if (CPayMetricsScope::current() == nullptr)
+		return;
+
+	switch (e.getErrorCode())
+	{
+	case ALIPAY_RET_NETWORK_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_NETWORK, CUtils::i2str(e.getNetWorkCode()));
+		break;
+	case ALIPAY_RET_PARSE_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_PARSE, "");
+		break;
+	case ALIPAY_RET_VERIFY_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_VERIFY, "");
+		break;
+	case ALIPAY_RET_SUB_CODE_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_SUB_CODE, e.getErrInfo());
+		break;
+	case ALIPAY_RET_CIRCUIT_OPEN:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_CIRCUIT_OPEN, "");
+		break;
+	case ALIPAY_RET_RATE_LIMITED:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_RATE_LIMITED, "");
+		break;
+	case ALIPAY_RET_REFUND_EXCEEDED:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_REFUND_EXCEEDED, "");
+		break;
+	default:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_UNKNOW, "");
+		break;
+	}
+}
+
 CAlipay::CAlipay(
 	const string& strAppId,
 	const string& strPubKey,
@@ -69,99 +147,329 @@ CAlipay::CAlipay(
 	m_strAppId(strAppId),
 	m_strPubKey(strPubKey),
 	m_strPrivKey(strPrivKey),
-	m_bIsDevMode(bIsDevMode)
+	m_bIsDevMode(bIsDevMode),
+	m_pPubKey(CRSAUtils::load_pubKey(strPubKey)),
+	m_pPrivKey(CRSAUtils::load_privKey(strPrivKey)),
+	m_pCircuitBreaker(CPayCircuitBreaker::get(bIsDevMode ? ALIPAY_HREF_DEV : ALIPAY_HREF))
 {
+	const char* methods[] = { ALIPAY_METHOD_TRANSFER, ALIPAY_METHOD_REFUND, ALIPAY_METHOD_QUERY, ALIPAY_METHOD_QUERY_REFUND, ALIPAY_METHOD_BILL_DOWNLOAD_URL };
+	for (const char* szMethod : methods)
+		m_mapRateLimiters[szMethod] = CPayRateLimiter::get(CPayRateLimiter::makeKey(m_strAppId, szMethod));
+
+	m_setThrottleCodes.insert(ALIPAY_SUB_CODE_APP_CALL_LIMITED);
+	m_setThrottleCodes.insert(ALIPAY_SUB_CODE_API_CALL_LIMITED);
 }
 
-void CAlipay::sendReqAndParseResps(
-	const string& strReq,
-	const string& strRespsName,
-	ParseFunc func
-)
+void CAlipay::setRateLimit(const string& strMethod, const CPayRateLimit& rateLimit)
+{
+	CPayRateLimiter* pRateLimiter = getRateLimiter(strMethod);
+	if (pRateLimiter)
+		pRateLimiter->configure(rateLimit);
+}
+
+void CAlipay::setThrottleCodes(const vector<string>& vecSubCodes)
+{
+	m_setThrottleCodes = set<string>(vecSubCodes.begin(), vecSubCodes.end());
+}
+
+CPayRateLimiter* CAlipay::getRateLimiter(const string& strMethod) const
+{
+	auto itr = m_mapRateLimiters.find(strMethod);
+	return itr != m_mapRateLimiters.end() ? itr->second : nullptr;
+}
+
+const char* CAlipay::checkThrottled(CPayRateLimiter* pRateLimiter, const char* szSubCode) const
+{
+	if (pRateLimiter && m_setThrottleCodes.count(szSubCode))
+		pRateLimiter->onThrottled();
+	return szSubCode;
+}
+
+//only a definite answer of the gateway closes a journaled operation, TOp names its in doubt sub_code
+template<typename TOp>
+static CPayJournalOutcome journalOutcome(const boost::optional<CAlipayError>& error)
+{
+	if (!error)
+		return PAY_JOURNAL_SUCCEEDED;
+	switch (error->getErrorCode())
+	{
+	case ALIPAY_RET_SUB_CODE_ERROR:
+		//the gateway itself does not know yet
+		return error->getErrInfo() == TOp::systemErrorSubCode() ? PAY_JOURNAL_UNKNOWN : PAY_JOURNAL_FAILED;
+	case ALIPAY_RET_CIRCUIT_OPEN:
+	case ALIPAY_RET_RATE_LIMITED:
+		return PAY_JOURNAL_FAILED;
+	default:
+		return PAY_JOURNAL_UNKNOWN;
+	}
+}
+
+using CAlipayFlight = CPaySingleFlight<CAlipayResps, CAlipayError>;
+
+static bool setAlipayError(boost::optional<CAlipayError>& error, CAlipayError&& e)
+{
+	countAlipayError(e);
+	error = std::move(e);
+	return false;
+}
+
+//the json + rsa2 side of CPayGateway. every api posts to the one gateway, ops name the resps node and the rate limiter
+struct SAPay::CAlipayCodec
 {
-	string strResps("");
-	int iNetWorkRet = CHttpClient::post(m_bIsDevMode ? ALIPAY_HREF_DEV : ALIPAY_HREF, strReq, strResps);
-	if (iNetWorkRet)
+	using CClient = CAlipay;
+	using CError = CAlipayError;
+
+	//pContent points into document
+	struct CMessage
 	{
-		throw CAlipayError(ALIPAY_RET_NETWORK_ERROR, strReq, strResps, iNetWorkRet);
+		CMessage() :pContent(nullptr) {}
+
+		rapidjson::Document document;
+		rapidjson::Value* pContent;
+	};
+
+	static const CAlipayRet RET_RATE_LIMITED = ALIPAY_RET_RATE_LIMITED;
+	static const CAlipayRet RET_CIRCUIT_OPEN = ALIPAY_RET_CIRCUIT_OPEN;
+	static const CAlipayRet RET_NETWORK_ERROR = ALIPAY_RET_NETWORK_ERROR;
+	static const CAlipayRet RET_PARSE_ERROR = ALIPAY_RET_PARSE_ERROR;
+
+	static bool fail(boost::optional<CAlipayError>& error, CAlipayError&& e)
+	{
+		return setAlipayError(error, std::move(e));
 	}
 
-	rapidjson::Document respsDocument;
-	respsDocument.Parse(strResps.c_str(), strResps.length());
-	if (!respsDocument.IsObject() ||
-		!respsDocument.HasMember(strRespsName.c_str()) ||
-		!respsDocument[strRespsName.c_str()].IsObject())
+	template<typename TOp>
+	static bool makeAttempt(
+		const CAlipay& alipay,
+		const CPayContextPtr& pContext,
+		int iTimeOut,
+		CPayHttpAttempt& attempt,
+		boost::optional<CAlipayError>& /*error*/
+	)
 	{
-		throw CAlipayError(ALIPAY_RET_PARSE_ERROR, strReq, strResps, iNetWorkRet);
+		const char* szHref = alipay.m_bIsDevMode ? ALIPAY_HREF_DEV : ALIPAY_HREF;
+		attempt = [szHref, pContext, iTimeOut](string& strAttemptResps, CHttpTimings* pTimings, const CHttpHedge* pHedge)
+		{
+			return CHttpClient::post(szHref, pContext->strReq, strAttemptResps, nullptr,
+				iTimeOut, vector<string>(), pTimings, pHedge);
+		};
+		return true;
 	}
 
+	static const CPayRetryPolicy& getRetryPolicy(const CAlipay& alipay) { return alipay.m_retryPolicy; }
+
+	template<typename TOp>
+	static CPayCircuitBreaker* getCircuitBreaker(const CAlipay& alipay) { return alipay.m_pCircuitBreaker; }
 
-	rapidjson::Value& respsContent = respsDocument[strRespsName.c_str()];
-	if (!respsDocument.HasMember(ALIPAY_RESPS_SIGN) ||
-		!respsDocument[ALIPAY_RESPS_SIGN].IsString())
+	template<typename TOp>
+	static CPayRateLimiter* getRateLimiter(const CAlipay& alipay) { return alipay.getRateLimiter(TOp::method()); }
+
+	//the sign covers the resps node, code and msg are checked once it verifies
+	template<typename TOp>
+	static bool decode(
+		const CAlipay& alipay,
+		const CPayContextPtr& pContext,
+		CPayRateLimiter* pRateLimiter,
+		CMessage& message,
+		boost::optional<CAlipayError>& error
+	)
 	{
-		if (respsContent.HasMember(ALIPAY_RESPS_SUB_CODE) &&
-			respsContent[ALIPAY_RESPS_SUB_CODE].IsString())
+		rapidjson::Document& respsDocument = message.document;
 		{
-			throw CAlipayError(ALIPAY_RET_SUB_CODE_ERROR, strReq, strResps, respsContent[ALIPAY_RESPS_SUB_CODE].GetString());
+			CPayPhaseTimer parseTimer(PAY_PHASE_PARSE);
+			//not in place, the resps stays intact for the error context
+			respsDocument.Parse(pContext->strResps.data(), pContext->strResps.size());
 		}
-		else
+		if (!respsDocument.IsObject() ||
+			!respsDocument.HasMember(TOp::respsName()) ||
+			!respsDocument[TOp::respsName()].IsObject())
 		{
-			throw CAlipayError(ALIPAY_RET_UNKNOW_ERROR, strReq, strResps);
+			return fail(error, CAlipayError(ALIPAY_RET_PARSE_ERROR, pContext));
 		}
-	}
 
-	//check sign
-	if (verifyAlipayResps(
-		convertJsonToString(respsContent),
-		respsDocument[ALIPAY_RESPS_SIGN].GetString(),
-		m_strPubKey) < 0)
-	{
-		throw CAlipayError(ALIPAY_RET_VERIFY_ERROR, strReq, strResps);
-	}
+		rapidjson::Value& respsContent = respsDocument[TOp::respsName()];
+		message.pContent = &respsContent;
+		if (!respsDocument.HasMember(ALIPAY_RESPS_SIGN) ||
+			!respsDocument[ALIPAY_RESPS_SIGN].IsString())
+		{
+			if (respsContent.HasMember(ALIPAY_RESPS_SUB_CODE) &&
+				respsContent[ALIPAY_RESPS_SUB_CODE].IsString())
+			{
+				return fail(error, CAlipayError(ALIPAY_RET_SUB_CODE_ERROR, pContext, alipay.checkThrottled(pRateLimiter, respsContent[ALIPAY_RESPS_SUB_CODE].GetString())));
+			}
+			else
+			{
+				return fail(error, CAlipayError(ALIPAY_RET_UNKNOW_ERROR, pContext));
+			}
+		}
 
-	if (!respsContent.HasMember(ALIPAY_RESPS_CODE) ||
-		!respsContent[ALIPAY_RESPS_CODE].IsString() ||
-		!respsContent.HasMember(ALIPAY_RESPS_MSG) ||
-		!respsContent[ALIPAY_RESPS_MSG].IsString())
-	{
-		throw CAlipayError(ALIPAY_RET_PARSE_ERROR, strReq, strResps);
-	}
+		//check sign
+		int iVerifyRet = 0;
+		{
+			CPayPhaseTimer verifyTimer(PAY_PHASE_VERIFY);
+			iVerifyRet = CRSAUtils::rsa_verify_with_base64(
+				convertJsonToString(respsContent),
+				respsDocument[ALIPAY_RESPS_SIGN].GetString(),
+				alipay.m_pPubKey.get()) ? 0 : -1;
+		}
+		if (iVerifyRet < 0)
+		{
+			return fail(error, CAlipayError(ALIPAY_RET_VERIFY_ERROR, pContext));
+		}
 
-	//check code and msg
-	const char* code = respsContent[ALIPAY_RESPS_CODE].GetString();
-	const char* msg = respsContent[ALIPAY_RESPS_MSG].GetString();
-	if (strcmp(code, "10000") != 0 || strcmp(msg, "Success") != 0)
-	{
-		if (respsContent.HasMember(ALIPAY_RESPS_SUB_CODE) &&
-			respsContent[ALIPAY_RESPS_SUB_CODE].IsString())
+		if (!respsContent.HasMember(ALIPAY_RESPS_CODE) ||
+			!respsContent[ALIPAY_RESPS_CODE].IsString() ||
+			!respsContent.HasMember(ALIPAY_RESPS_MSG) ||
+			!respsContent[ALIPAY_RESPS_MSG].IsString())
 		{
-			throw CAlipayError(ALIPAY_RET_SUB_CODE_ERROR, strReq, strResps, respsContent[ALIPAY_RESPS_SUB_CODE].GetString());
+			return fail(error, CAlipayError(ALIPAY_RET_PARSE_ERROR, pContext));
 		}
-		else
+
+		//check code and msg
+		const char* code = respsContent[ALIPAY_RESPS_CODE].GetString();
+		const char* msg = respsContent[ALIPAY_RESPS_MSG].GetString();
+		if (strcmp(code, "10000") != 0 || strcmp(msg, "Success") != 0)
 		{
-			throw CAlipayError(ALIPAY_RET_UNKNOW_ERROR, strReq, strResps);
+			if (respsContent.HasMember(ALIPAY_RESPS_SUB_CODE) &&
+				respsContent[ALIPAY_RESPS_SUB_CODE].IsString())
+			{
+				return fail(error, CAlipayError(ALIPAY_RET_SUB_CODE_ERROR, pContext, alipay.checkThrottled(pRateLimiter, respsContent[ALIPAY_RESPS_SUB_CODE].GetString())));
+			}
+			else
+			{
+				return fail(error, CAlipayError(ALIPAY_RET_UNKNOW_ERROR, pContext));
+			}
 		}
+
+		if (pRateLimiter)
+			pRateLimiter->onSuccess();
+
+		return true;
 	}
 
-	func(strReq, strResps, respsContent);
-}
+	static rapidjson::Value& content(CMessage& message) { return *message.pContent; }
+};
+
+struct CAlipayRefundOp
+{
+	static const char* method() { return ALIPAY_METHOD_REFUND; }
+	static const char* respsName() { return ALIPAY_RESPS_RFND; }
+
+	//the same out_request_no is refunded once
+	static CPayIdempotency idempotency() { return PAY_CALL_IDEMPOTENT; }
+	static const char* systemErrorSubCode() { return ALIPAY_SUB_CODE_SYSTEM_ERROR; }
+	static bool parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps);
+};
+
+struct CAlipayTransferOp
+{
+	static const char* method() { return ALIPAY_METHOD_TRANSFER; }
+	static const char* respsName() { return ALIPAY_RESPS_TRSFR; }
+	static CPayIdempotency idempotency() { return PAY_CALL_NON_IDEMPOTENT; }
+	static const char* systemErrorSubCode() { return ALIPAY_TRANSFER_SUB_CODE_SYSTEM_ERROR; }
+	static bool parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps);
+};
+
+struct CAlipayQueryOp
+{
+	static const char* method() { return ALIPAY_METHOD_QUERY; }
+	static const char* respsName() { return ALIPAY_RESPS_QUERY; }
+	static CPayIdempotency idempotency() { return PAY_CALL_READ_ONLY; }
+	static bool parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps);
+};
+
+struct CAlipayQueryRefundOp
+{
+	static const char* method() { return ALIPAY_METHOD_QUERY_REFUND; }
+	static const char* respsName() { return ALIPAY_RESPS_QUERY_REFUND; }
+	static CPayIdempotency idempotency() { return PAY_CALL_READ_ONLY; }
+	static bool parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps);
+};
+
+struct CAlipayBillDownloadUrlOp
+{
+	static const char* method() { return ALIPAY_METHOD_BILL_DOWNLOAD_URL; }
+	static const char* respsName() { return ALIPAY_RESPS_BILL_DOWNLOAD_URL_QUERY; }
+	static CPayIdempotency idempotency() { return PAY_CALL_READ_ONLY; }
+	static bool parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps);
+};
+
+using CAlipayGateway = CPayGateway<CAlipayCodec>;
 
 void CAlipay::refund(
 	int iAmount,
 	const string& strTradingCode,
 	const string& strOutTradingCode,
-	CAlipayResps& alipayResps
+	CAlipayResps& alipayResps,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
 )
 {
-	string strReq;
-	appendRefundContent(strReq, iAmount, strTradingCode, strOutTradingCode);
-	sendReqAndParseResps(strReq, ALIPAY_RESPS_RFND, bind(&CAlipay::parseRefundResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &alipayResps));
+	boost::optional<CAlipayError> error;
+	if (!doRefund(iAmount, strTradingCode, strOutTradingCode, options, alipayResps, error))
+		throw *error;
 }
 
-void CAlipay::parseRefundResps(const string& strReq, const string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps)
+CAlipayResult CAlipay::tryRefund(
+	int iAmount,
+	const string& strTradingCode,
+	const string& strOutTradingCode,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
+)
+{
+	CAlipayResps alipayResps;
+	boost::optional<CAlipayError> error;
+	doRefund(iAmount, strTradingCode, strOutTradingCode, options, alipayResps, error);
+	return CAlipayResult(std::move(alipayResps), std::move(error));
+}
+
+bool CAlipay::doRefund(
+	int iAmount,
+	const string& strTradingCode,
+	const string& strOutTradingCode,
+	const CAlipayCallOptions& options,
+	CAlipayResps& alipayResps,
+	boost::optional<CAlipayError>& error
+)
+{
+	//transient buffers of the whole call, from the caller's resource if it passed one
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_REFUND);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	pContext->iTimeOut = options.iTimeOut;
+	string strLedgerKey = CPayRefundLedger::makeKey(m_strAppId, strOutTradingCode);
+	if (m_pRefundLedger && m_pRefundLedger->reserve(strLedgerKey, strTradingCode, iAmount) == PAY_REFUND_EXCEEDED)
+		return setAlipayError(error, CAlipayError(ALIPAY_RET_REFUND_EXCEEDED, pContext));
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendRefundContent(pContext->strReq, iAmount, strTradingCode, strOutTradingCode);
+	}
+	unsigned long long llJournalId = m_pJournal ? m_pJournal->begin(PAY_PROVIDER_ALIPAY, PAY_OP_REFUND, m_strAppId, strOutTradingCode, strTradingCode) : 0;
+	bool bRet = CAlipayGateway::call<CAlipayRefundOp>(*this, pContext, alipayResps, error);
+	CPayJournalOutcome iOutcome = journalOutcome<CAlipayRefundOp>(error);
+	if (m_pJournal)
+		m_pJournal->end(llJournalId, iOutcome);
+
+	//an unknown outcome keeps the reservation until a retry or queryRefund settles it
+	//refund_fee is the trade's running total, not this refund, the ledger only sums refund numbers
+	if (m_pRefundLedger && iOutcome == PAY_JOURNAL_SUCCEEDED)
+		m_pRefundLedger->commit(strLedgerKey, strTradingCode, iAmount);
+	else if (m_pRefundLedger && iOutcome == PAY_JOURNAL_FAILED)
+	{
+		//a gateway answer settles earlier in doubt sends of the number too, a send that never left drops only its own hold
+		if (error->getErrorCode() == ALIPAY_RET_SUB_CODE_ERROR)
+			m_pRefundLedger->release(strLedgerKey, strTradingCode);
+		else
+			m_pRefundLedger->cancel(strLedgerKey, strTradingCode);
+	}
+
+	//a full refund closes the trade
+	if (bRet && m_pOrderCache)
+		m_pOrderCache->erase(CAlipayOrderCache::makeKey(m_strAppId, strOutTradingCode));
+	return bRet;
+}
+
+bool CAlipayRefundOp::parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps)
 {
-	CAlipayResps& alipayResps = *pAlipayResps;
 	if (!respsContent.HasMember(ALIPAY_RESPS_BUYER_LOGON_ID) ||
 		!respsContent[ALIPAY_RESPS_BUYER_LOGON_ID].IsString() ||
 		!respsContent.HasMember(ALIPAY_RESPS_BUYER_USER_ID) ||
@@ -177,7 +485,7 @@ void CAlipay::parseRefundResps(const string& strReq, const string& strResps, rap
 		!respsContent.HasMember(ALIPAY_RESPS_REFUND_FEE) ||
 		!respsContent[ALIPAY_RESPS_REFUND_FEE].IsString())
 	{
-		throw CAlipayError(ALIPAY_RET_PARSE_ERROR, strReq, strResps);
+		return false;
 	}
 
 	alipayResps.strBuyerLogonId = respsContent[ALIPAY_RESPS_BUYER_LOGON_ID].GetString();
@@ -187,6 +495,7 @@ void CAlipay::parseRefundResps(const string& strReq, const string& strResps, rap
 	alipayResps.strRefundFee = respsContent[ALIPAY_RESPS_REFUND_FEE].GetString();
 	alipayResps.strOutTradeNo = respsContent[ALIPAY_RESPS_OUT_TRADE_NO].GetString();
 	alipayResps.strTradeNo = respsContent[ALIPAY_RESPS_TRADE_NO].GetString();
+	return true;
 }
 
 void CAlipay::withdraw(
@@ -195,17 +504,58 @@ void CAlipay::withdraw(
 	const string& strAlipayAccount,
 	const string& strTrueName,
 	CAlipayResps& alipayResps,
-	const string& strRemarks /*= string("")*/
+	const string& strRemarks /*= string("")*/,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
+)
+{
+	boost::optional<CAlipayError> error;
+	if (!doWithdraw(iAmount, strTradingCode, strAlipayAccount, strTrueName, strRemarks, options, alipayResps, error))
+		throw *error;
+}
+
+CAlipayResult CAlipay::tryWithdraw(
+	int iAmount,
+	const string& strTradingCode,
+	const string& strAlipayAccount,
+	const string& strTrueName,
+	const string& strRemarks /*= string("")*/,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
 )
 {
-	string strReq;
-	appendTransferContent(strReq, iAmount, strAlipayAccount, strTrueName, strTradingCode, strRemarks);
-	sendReqAndParseResps(strReq, ALIPAY_RESPS_TRSFR, bind(&CAlipay::parseTransferResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &alipayResps));
+	CAlipayResps alipayResps;
+	boost::optional<CAlipayError> error;
+	doWithdraw(iAmount, strTradingCode, strAlipayAccount, strTrueName, strRemarks, options, alipayResps, error);
+	return CAlipayResult(std::move(alipayResps), std::move(error));
 }
 
-void CAlipay::parseTransferResps(const string& strReq, const string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps)
+bool CAlipay::doWithdraw(
+	int iAmount,
+	const string& strTradingCode,
+	const string& strAlipayAccount,
+	const string& strTrueName,
+	const string& strRemarks,
+	const CAlipayCallOptions& options,
+	CAlipayResps& alipayResps,
+	boost::optional<CAlipayError>& error
+)
+{
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_WITHDRAW);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	pContext->iTimeOut = options.iTimeOut;
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendTransferContent(pContext->strReq, iAmount, strAlipayAccount, strTrueName, strTradingCode, strRemarks);
+	}
+	unsigned long long llJournalId = m_pJournal ? m_pJournal->begin(PAY_PROVIDER_ALIPAY, PAY_OP_WITHDRAW, m_strAppId, strTradingCode) : 0;
+	bool bRet = CAlipayGateway::call<CAlipayTransferOp>(*this, pContext, alipayResps, error);
+	if (m_pJournal)
+		m_pJournal->end(llJournalId, journalOutcome<CAlipayTransferOp>(error));
+	return bRet;
+}
+
+bool CAlipayTransferOp::parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps)
 {
-	CAlipayResps& alipayResps = *pAlipayResps;
 	if (!respsContent.HasMember(ALIPAY_RESPS_ORDER_ID) ||
 		!respsContent[ALIPAY_RESPS_ORDER_ID].IsString() ||
 		!respsContent.HasMember(ALIPAY_RESPS_OUT_BIZ_NO) ||
@@ -213,73 +563,206 @@ void CAlipay::parseTransferResps(const string& strReq, const string& strResps, r
 		!respsContent.HasMember(ALIPAY_RESPS_PAY_DATE) ||
 		!respsContent[ALIPAY_RESPS_PAY_DATE].IsString())
 	{
-		throw CAlipayError(ALIPAY_RET_PARSE_ERROR, strReq, strResps);
+		return false;
 	}
 
 	alipayResps.strOrderId = respsContent[ALIPAY_RESPS_ORDER_ID].GetString();
 	alipayResps.strPayDate = respsContent[ALIPAY_RESPS_PAY_DATE].GetString();
 	alipayResps.strOutBizNo = respsContent[ALIPAY_RESPS_OUT_BIZ_NO].GetString();
+	return true;
 }
 
-void CAlipay::queryPayStatus(const string& strOutTradingCode, CAlipayResps& alipayResps)
+void CAlipay::queryPayStatus(
+	const string& strOutTradingCode,
+	CAlipayResps& alipayResps,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
+)
 {
-	string strReq;
-	appendQueryStatusContent(strReq, strOutTradingCode);
-	sendReqAndParseResps(strReq, ALIPAY_RESPS_QUERY, bind(&CAlipay::parseQueryStatusResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &alipayResps));
+	boost::optional<CAlipayError> error;
+	if (!doQueryPayStatus(strOutTradingCode, options, alipayResps, error))
+		throw *error;
 }
 
-void CAlipay::parseQueryStatusResps(const string& strReq, const string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps)
+CAlipayResult CAlipay::tryQueryPayStatus(const string& strOutTradingCode, const CAlipayCallOptions& options /*= CAlipayCallOptions()*/)
 {
-	CAlipayResps& alipayResps = *pAlipayResps;
-	if (!respsContent.HasMember(ALIPAY_RESPS_BUYER_LOGON_ID) ||
-		!respsContent[ALIPAY_RESPS_BUYER_LOGON_ID].IsString() ||
-		!respsContent.HasMember(ALIPAY_RESPS_BUYER_USER_ID) ||
-		!respsContent[ALIPAY_RESPS_BUYER_USER_ID].IsString() ||
-		!respsContent.HasMember(ALIPAY_RESPS_OUT_TRADE_NO) ||
-		!respsContent[ALIPAY_RESPS_OUT_TRADE_NO].IsString() ||
-		!respsContent.HasMember(ALIPAY_RESPS_TRADE_NO) ||
-		!respsContent[ALIPAY_RESPS_TRADE_NO].IsString() ||
-		!respsContent.HasMember(ALIPAY_RESPS_TRADE_STATUS) ||
-		!respsContent[ALIPAY_RESPS_TRADE_STATUS].IsString() ||
-		!respsContent.HasMember(ALIPAY_RESPS_TOTAL_AMOUNT) ||
-		!respsContent[ALIPAY_RESPS_TOTAL_AMOUNT].IsString())
+	CAlipayResps alipayResps;
+	boost::optional<CAlipayError> error;
+	doQueryPayStatus(strOutTradingCode, options, alipayResps, error);
+	return CAlipayResult(std::move(alipayResps), std::move(error));
+}
+
+bool CAlipay::doQueryPayStatus(
+	const string& strOutTradingCode,
+	const CAlipayCallOptions& options,
+	CAlipayResps& alipayResps,
+	boost::optional<CAlipayError>& error
+)
+{
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	auto fetch = [this, &strOutTradingCode, &options](CAlipayResps& resps, boost::optional<CAlipayError>& err)
 	{
-		throw CAlipayError(ALIPAY_RET_PARSE_ERROR, strReq, strResps);
+		return fetchPayStatus(strOutTradingCode, options, resps, err);
+	};
+	bool bRet = false;
+	if (m_pOrderCache)
+		bRet = m_pOrderCache->getOrLoad(CAlipayOrderCache::makeKey(m_strAppId, strOutTradingCode), alipayResps, error, fetch);
+	else
+	{
+		//concurrent queries of the same order share one signed request
+		bRet = CAlipayFlight::shared().call(CAlipayFlight::makeKey(m_strAppId, ALIPAY_METHOD_QUERY, strOutTradingCode), alipayResps, error, fetch);
 	}
 
-	alipayResps.strBuyerLogonId = respsContent[ALIPAY_RESPS_BUYER_LOGON_ID].GetString();
-	alipayResps.strBuyerUserId = respsContent[ALIPAY_RESPS_BUYER_USER_ID].GetString();
-	alipayResps.strOutTradeNo = respsContent[ALIPAY_RESPS_OUT_TRADE_NO].GetString();
-	alipayResps.strTradeNo = respsContent[ALIPAY_RESPS_TRADE_NO].GetString();
-	alipayResps.strTotalAmount = respsContent[ALIPAY_RESPS_TOTAL_AMOUNT].GetString();
-
-	string strTradeStatus = respsContent[ALIPAY_RESPS_TRADE_STATUS].GetString();
-	if (strTradeStatus == ALIPAY_TRADE_STATUS_SUCCESS_STR)
-		alipayResps.iTradeStatus = ALIPAY_TRADE_STATUS_SUCCESS;
-	else if (strTradeStatus == ALIPAY_TRADE_STATUS_CLOSED_STR)
-		alipayResps.iTradeStatus = ALIPAY_TRADE_STATUS_CLOSED;
-	else if (strTradeStatus == ALIPAY_TRADE_STATUS_FINISHED_STR)
-		alipayResps.iTradeStatus = ALIPAY_TRADE_STATUS_FINISHED;
-	else if (strTradeStatus == ALIPAY_TRADE_STATUS_WAIT_BUYER_PAY_STR)
-		alipayResps.iTradeStatus = ALIPAY_TRADE_STATUS_WAIT_BUYER_PAY;
-	else
-		alipayResps.iTradeStatus = ALIPAY_TRADE_STATUS_UNKONW;
+	//refunds of a paid order are checked against its total from now on
+	long long llCaptured = 0;
+	if (bRet && m_pRefundLedger &&
+		(alipayResps.iTradeStatus == ALIPAY_TRADE_STATUS_SUCCESS || alipayResps.iTradeStatus == ALIPAY_TRADE_STATUS_FINISHED) &&
+		CPayBillReconciler::parseFen(alipayResps.strTotalAmount.data(), alipayResps.strTotalAmount.size(), llCaptured))
+	{
+		m_pRefundLedger->setCaptured(CPayRefundLedger::makeKey(m_strAppId, strOutTradingCode), llCaptured);
+	}
+	return bRet;
+}
+
+bool CAlipay::fetchPayStatus(
+	const string& strOutTradingCode,
+	const CAlipayCallOptions& options,
+	CAlipayResps& alipayResps,
+	boost::optional<CAlipayError>& error
+)
+{
+	CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_QUERY);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	pContext->iTimeOut = options.iTimeOut;
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendQueryStatusContent(pContext->strReq, strOutTradingCode);
+	}
+	return CAlipayGateway::call<CAlipayQueryOp>(*this, pContext, alipayResps, error);
+}
+
+enum CQueryRespsField
+{
+	QUERY_FIELD_BUYER_LOGON_ID,
+	QUERY_FIELD_BUYER_USER_ID,
+	QUERY_FIELD_OUT_TRADE_NO,
+	QUERY_FIELD_TRADE_NO,
+	QUERY_FIELD_TRADE_STATUS,
+	QUERY_FIELD_TOTAL_AMOUNT,
+	QUERY_FIELD_COUNT
+};
+
+static constexpr CPayField<CQueryRespsField> s_queryFields[] = {
+	{ ALIPAY_RESPS_BUYER_LOGON_ID, QUERY_FIELD_BUYER_LOGON_ID },
+	{ ALIPAY_RESPS_BUYER_USER_ID, QUERY_FIELD_BUYER_USER_ID },
+	{ ALIPAY_RESPS_OUT_TRADE_NO, QUERY_FIELD_OUT_TRADE_NO },
+	{ ALIPAY_RESPS_TRADE_NO, QUERY_FIELD_TRADE_NO },
+	{ ALIPAY_RESPS_TRADE_STATUS, QUERY_FIELD_TRADE_STATUS },
+	{ ALIPAY_RESPS_TOTAL_AMOUNT, QUERY_FIELD_TOTAL_AMOUNT }
+};
+static constexpr auto s_queryRespsFields = makePayFieldTable<4>(s_queryFields, 0x811c9dc8u);
+static_assert(s_queryRespsFields.isPerfect(), "query resps fields collide, pick another seed");
+
+static constexpr CPayField<CAlipayTradeStatus> s_tradeStatusFields[] = {
+	{ ALIPAY_TRADE_STATUS_SUCCESS_STR, ALIPAY_TRADE_STATUS_SUCCESS },
+	{ ALIPAY_TRADE_STATUS_CLOSED_STR, ALIPAY_TRADE_STATUS_CLOSED },
+	{ ALIPAY_TRADE_STATUS_FINISHED_STR, ALIPAY_TRADE_STATUS_FINISHED },
+	{ ALIPAY_TRADE_STATUS_WAIT_BUYER_PAY_STR, ALIPAY_TRADE_STATUS_WAIT_BUYER_PAY }
+};
+static constexpr auto s_tradeStatuses = makePayFieldTable<3>(s_tradeStatusFields);
+static_assert(s_tradeStatuses.isPerfect(), "trade_status values collide, pick another seed");
+
+bool CAlipayQueryOp::parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps)
+{
+	//one pass over the members instead of a linear HasMember and operator[] per field
+	const rapidjson::Value* fields[QUERY_FIELD_COUNT] = {};
+	CQueryRespsField iField;
+	for (auto itr = respsContent.MemberBegin(); itr != respsContent.MemberEnd(); ++itr)
+	{
+		if (s_queryRespsFields.find(boost::string_view(itr->name.GetString(), itr->name.GetStringLength()), iField) &&
+			itr->value.IsString())
+		{
+			fields[iField] = &itr->value;
+		}
+	}
+	for (int i = 0; i < QUERY_FIELD_COUNT; ++i)
+	{
+		if (!fields[i])
+			return false;
+	}
+
+	alipayResps.strBuyerLogonId = fields[QUERY_FIELD_BUYER_LOGON_ID]->GetString();
+	alipayResps.strBuyerUserId = fields[QUERY_FIELD_BUYER_USER_ID]->GetString();
+	alipayResps.strOutTradeNo = fields[QUERY_FIELD_OUT_TRADE_NO]->GetString();
+	alipayResps.strTradeNo = fields[QUERY_FIELD_TRADE_NO]->GetString();
+	alipayResps.strTotalAmount = fields[QUERY_FIELD_TOTAL_AMOUNT]->GetString();
+
+	alipayResps.iTradeStatus = s_tradeStatuses.find(fields[QUERY_FIELD_TRADE_STATUS]->GetString(), ALIPAY_TRADE_STATUS_UNKONW);
+	return true;
+}
+
+CAlipayTradeStatus CAlipay::parseTradeStatus(const string& strTradeStatus)
+{
+	return s_tradeStatuses.find(strTradeStatus, ALIPAY_TRADE_STATUS_UNKONW);
 }
 
 void CAlipay::queryRefund(
 	const std::string& strOutTradingCode, 
 	const std::string& strRefundTradingCode, 
-	CAlipayResps& alipayResps
+	CAlipayResps& alipayResps,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
+)
+{
+	boost::optional<CAlipayError> error;
+	if (!doQueryRefund(strOutTradingCode, strRefundTradingCode, options, alipayResps, error))
+		throw *error;
+}
+
+CAlipayResult CAlipay::tryQueryRefund(
+	const string& strOutTradingCode,
+	const string& strRefundTradingCode,
+	const CAlipayCallOptions& options /*= CAlipayCallOptions()*/
 )
 {
-	string strReq;
-	appendQueryRefundContent(strReq, strOutTradingCode, strRefundTradingCode);
-	sendReqAndParseResps(strReq, ALIPAY_RESPS_QUERY_REFUND, bind(&CAlipay::parseQueryRefundResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &alipayResps));
+	CAlipayResps alipayResps;
+	boost::optional<CAlipayError> error;
+	doQueryRefund(strOutTradingCode, strRefundTradingCode, options, alipayResps, error);
+	return CAlipayResult(std::move(alipayResps), std::move(error));
 }
 
-void CAlipay::parseQueryRefundResps(const string& strReq, const string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps)
+bool CAlipay::doQueryRefund(
+	const string& strOutTradingCode,
+	const string& strRefundTradingCode,
+	const CAlipayCallOptions& options,
+	CAlipayResps& alipayResps,
+	boost::optional<CAlipayError>& error
+)
+{
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	auto fetch = [this, &strOutTradingCode, &strRefundTradingCode, &options](CAlipayResps& resps, boost::optional<CAlipayError>& err)
+	{
+		CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_QUERY_REFUND);
+		CPayContextPtr pContext = std::make_shared<CPayContext>();
+		pContext->iTimeOut = options.iTimeOut;
+		{
+			CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+			appendQueryRefundContent(pContext->strReq, strOutTradingCode, strRefundTradingCode);
+		}
+		return CAlipayGateway::call<CAlipayQueryRefundOp>(*this, pContext, resps, err);
+	};
+	bool bRet = CAlipayFlight::shared().call(CAlipayFlight::makeKey(m_strAppId, ALIPAY_METHOD_QUERY_REFUND, strOutTradingCode + "|" + strRefundTradingCode), alipayResps, error, fetch);
+
+	//refund_amount is only returned once the refund succeeded
+	long long llRefundAmount = 0;
+	if (bRet && m_pRefundLedger &&
+		CPayBillReconciler::parseFen(alipayResps.strRefundAmount.data(), alipayResps.strRefundAmount.size(), llRefundAmount))
+	{
+		m_pRefundLedger->commit(CPayRefundLedger::makeKey(m_strAppId, strOutTradingCode), strRefundTradingCode, llRefundAmount);
+	}
+	return bRet;
+}
+
+bool CAlipayQueryRefundOp::parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps)
 {
-	CAlipayResps& alipayResps = *pAlipayResps;
 	if (respsContent.HasMember(ALIPAY_RESPS_OUT_REQ_NO) &&
 		respsContent[ALIPAY_RESPS_OUT_REQ_NO].IsString())
 	{
@@ -309,6 +792,100 @@ void CAlipay::parseQueryRefundResps(const string& strReq, const string& strResps
 	{
 		alipayResps.strRefundAmount = respsContent[ALIPAY_RESPS_REFUND_AMOUNT].GetString();
 	}
+	return true;
+}
+
+void CAlipay::downloadBill(
+	const string& strBillType,
+	const string& strBillDate,
+	const CPayBillRowFunc& onRow,
+	CAlipayResps& alipayResps
+)
+{
+	boost::optional<CAlipayError> error;
+	if (!doDownloadBill(strBillType, strBillDate, onRow, alipayResps, error))
+		throw *error;
+}
+
+CAlipayResult CAlipay::tryDownloadBill(const string& strBillType, const string& strBillDate, const CPayBillRowFunc& onRow)
+{
+	CAlipayResps alipayResps;
+	boost::optional<CAlipayError> error;
+	doDownloadBill(strBillType, strBillDate, onRow, alipayResps, error);
+	return CAlipayResult(std::move(alipayResps), std::move(error));
+}
+
+CPayBillColumns CAlipay::getBillColumns()
+{
+	//商户订单号, 订单金额（元）, 退款批次号/请求号, refunds are booked as negative order amounts
+	CPayBillColumns columns;
+	columns.iOutTradeNo = 1;
+	columns.iAmount = 11;
+	columns.iOutRefundNo = 21;
+	columns.iRefundAmount = 11;
+	return columns;
+}
+
+bool CAlipay::doDownloadBill(
+	const string& strBillType,
+	const string& strBillDate,
+	const CPayBillRowFunc& onRow,
+	CAlipayResps& alipayResps,
+	boost::optional<CAlipayError>& error
+)
+{
+	CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_DOWNLOAD_BILL);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendBillDownloadUrlContent(pContext->strReq, strBillType, strBillDate);
+	}
+	if (!CAlipayGateway::call<CAlipayBillDownloadUrlOp>(*this, pContext, alipayResps, error))
+		return false;
+
+	//the summary entry ("汇总" in gbk or utf-8) repeats the totals in another layout
+	CPayBillReader billReader(PAY_BILL_ZIP, onRow, [](const string& strName)
+	{
+		return strName.find("\xBB\xE3\xD7\xDC") == string::npos && strName.find("\xE6\xB1\x87\xE6\x80\xBB") == string::npos;
+	});
+
+	//the url is signed for a short while, rows may already be consumed, so no retry
+	CHttpTimings httpTimings;
+	bool bRecordTimings = CPayMetricsScope::current() != nullptr;
+	int iNetWorkRet = CHttpClient::download(alipayResps.strBillDownloadUrl, "", [&billReader](const char* pData, size_t iLen)
+	{
+		return billReader.write(pData, iLen);
+	}, HTTPCLIENT_DOWNLOAD_TIME_OUT, bRecordTimings ? &httpTimings : nullptr);
+	if (bRecordTimings)
+		CPayMetrics::recordHttpTimings(httpTimings);
+
+	if (billReader.isCorrupt())
+	{
+		return setAlipayError(error, CAlipayError(ALIPAY_RET_PARSE_ERROR, pContext));
+	}
+	if (billReader.isStopped())
+		return true;
+	if (iNetWorkRet != 0)
+	{
+		return setAlipayError(error, CAlipayError(ALIPAY_RET_NETWORK_ERROR, pContext, iNetWorkRet));
+	}
+	if (!billReader.finish() && billReader.isCorrupt())
+	{
+		return setAlipayError(error, CAlipayError(ALIPAY_RET_PARSE_ERROR, pContext));
+	}
+	return true;
+}
+
+bool CAlipayBillDownloadUrlOp::parse(rapidjson::Value& respsContent, CAlipayResps& alipayResps)
+{
+	if (!respsContent.HasMember(ALIPAY_RESPS_BILL_DOWNLOAD_URL) ||
+		!respsContent[ALIPAY_RESPS_BILL_DOWNLOAD_URL].IsString())
+	{
+		return false;
+	}
+
+	alipayResps.strBillDownloadUrl = respsContent[ALIPAY_RESPS_BILL_DOWNLOAD_URL].GetString();
+	return true;
 }
 
 
@@ -321,7 +898,34 @@ void CAlipay::appendContentAndSign(
 	const string& strCallBack /*= ""*/
 )
 {
-	string clearString;
+	//url encoding takes at most three bytes per byte, the fixed fields and the signature fit in 1k.
+	//the content to sign is only hashed, it lives in the call's arena
+	CPayArenaScope arenaScope;
+	CPayArenaString clearString(arenaScope.resource());
+	clearString.reserve(biz_content.size() + 512);
+	totalString.reserve(totalString.size() + biz_content.size() * 3 + 1024);
+	appendUnsignedContent(totalString, clearString, biz_content, strMethodName, strCharset, strCallBack);
+	string signContent;
+	{
+		CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+		if (m_pSigner)
+			signContent = m_pSigner->signInline(clearString);
+		else
+			signContent = CRSAUtils::rsa_sign_with_base64(clearString, m_pPrivKey.get());
+	}
+	CUtils::AppendContent(ALIPAY_REQ_SIGN, signContent, totalString);
+}
+
+template<typename TClear>
+void CAlipay::appendUnsignedContent(
+	string& totalString,
+	TClear& clearString,
+	const string& biz_content,
+	const string& strMethodName,
+	const string& strCharset,
+	const string& strCallBack
+)
+{
 	CUtils::AppendContent(ALIPAY_REQ_APP_ID, m_strAppId, totalString, clearString, false);
 	CUtils::AppendContent(ALIPAY_REQ_BIZ_CONTENT, biz_content, totalString, clearString);
 	CUtils::AppendContent(ALIPAY_REQ_CHARSET, strCharset, totalString, clearString);
@@ -331,8 +935,6 @@ void CAlipay::appendContentAndSign(
 	CUtils::AppendContent(ALIPAY_REQ_SIGN_TYPE, "RSA2", totalString, clearString);
 	CUtils::AppendContent(ALIPAY_REQ_TIMESTAMP, CUtils::getCurentTime(), totalString, clearString);
 	CUtils::AppendContent(ALIPAY_REQ_VERSION, "1.0", totalString, clearString);
-	string& signContent = CRSAUtils::rsa_sign_from_privKey_with_base64(clearString, m_strPrivKey);
-	CUtils::AppendContent(ALIPAY_REQ_SIGN, signContent, totalString);
 }
 
 void CAlipay::appendPayContent(
@@ -344,13 +946,51 @@ void CAlipay::appendPayContent(
 	const string& strTimeOut /*= string("30m")*/,
 	const string& strPassBackParams /*= string("")*/
 )
+{
+	CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_PREPAY);
+	CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+	appendContentAndSign(strContent, makePayBizContent(iAmount, strTradingCode, strSubject, strTimeOut, strPassBackParams), ALIPAY_METHOD_APP_PAY, "utf-8", strCallBack);
+}
+
+void CAlipay::appendPayContentBatch(vector<string>& vecContent, const vector<CAlipayPayReq>& vecReq)
+{
+	CPayMetricsScope metricsScope(PAY_PROVIDER_ALIPAY, PAY_OP_PREPAY);
+	CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+	vecContent.resize(vecReq.size());
+	vector<string> vecClear(vecReq.size());
+	for (size_t i = 0; i < vecReq.size(); ++i)
+	{
+		const CAlipayPayReq& req = vecReq[i];
+		vecContent[i].clear();
+		appendUnsignedContent(vecContent[i], vecClear[i], makePayBizContent(req.iAmount, req.strTradingCode, req.strSubject, req.strTimeOut, req.strPassBackParams), ALIPAY_METHOD_APP_PAY, "utf-8", req.strCallBackAddr);
+	}
+
+	CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+	if (m_pSigner)
+	{
+		vector<std::future<string>> vecSigns = m_pSigner->signBatch(vecClear);
+		for (size_t i = 0; i < vecSigns.size(); ++i)
+			CUtils::AppendContent(ALIPAY_REQ_SIGN, vecSigns[i].get(), vecContent[i]);
+		return;
+	}
+	for (size_t i = 0; i < vecClear.size(); ++i)
+		CUtils::AppendContent(ALIPAY_REQ_SIGN, CRSAUtils::rsa_sign_with_base64(vecClear[i], m_pPrivKey.get()), vecContent[i]);
+}
+
+string CAlipay::makePayBizContent(
+	int iAmount,
+	const string& strTradingCode,
+	const string& strSubject,
+	const string& strTimeOut,
+	const string& strPassBackParams
+)
 {
 #ifdef CHECK_INPUT_STRING_TYPE
-	const string& u8Subject = ch_trans::is_utf8(strSubject.c_str()) ? strSubject : ch_trans::ascii_to_utf8(strSubject);
+	const string& u8Subject = ch_trans::is_utf8(strSubject) ? strSubject : ch_trans::ascii_to_utf8(strSubject);
 
 	string u8PassBackParams("");
 	if (!strPassBackParams.empty())
-		u8PassBackParams = ch_trans::is_utf8(strPassBackParams.c_str()) ? strPassBackParams : ch_trans::ascii_to_utf8(strPassBackParams);
+		u8PassBackParams = ch_trans::is_utf8(strPassBackParams) ? strPassBackParams : ch_trans::ascii_to_utf8(strPassBackParams);
 #else
 	const string& u8Subject = strSubject;
 
@@ -367,9 +1007,7 @@ void CAlipay::appendPayContent(
 	}
 	else
 		f % "";
-	string& biz_content = f.str();
-
-	appendContentAndSign(strContent, biz_content, "alipay.trade.app.pay", "utf-8", strCallBack);
+	return f.str();
 }
 
 void CAlipay::appendTransferContent(
@@ -382,9 +1020,9 @@ void CAlipay::appendTransferContent(
 )
 {
 #ifdef CHECK_INPUT_STRING_TYPE
-	const string& asciiTrueName = ch_trans::is_utf8(strTrueName.c_str()) ? ch_trans::utf8_to_ascii(strTrueName) : strTrueName;
+	const string& asciiTrueName = ch_trans::is_utf8(strTrueName) ? ch_trans::utf8_to_ascii(strTrueName) : strTrueName;
 
-	const string& asciiRemarks = ch_trans::is_utf8(strRemarks.c_str()) ? ch_trans::utf8_to_ascii(strRemarks) : strRemarks;
+	const string& asciiRemarks = ch_trans::is_utf8(strRemarks) ? ch_trans::utf8_to_ascii(strRemarks) : strRemarks;
 #else
 	const string& asciiTrueName = strTrueName;
 
@@ -395,7 +1033,7 @@ void CAlipay::appendTransferContent(
 	f % strTradingCode.c_str() % strAlipayAccount.c_str() % (((float)iAmount) / 100.0) % asciiTrueName.c_str() % asciiRemarks.c_str();
 	string& biz_content = f.str();
 
-	appendContentAndSign(strReq, biz_content, "alipay.fund.trans.toaccount.transfer", "gb2312");
+	appendContentAndSign(strReq, biz_content, ALIPAY_METHOD_TRANSFER, "gb2312");
 }
 
 void CAlipay::appendRefundContent(
@@ -409,7 +1047,7 @@ void CAlipay::appendRefundContent(
 	f % strOutTradingCode.c_str() % (((float)iAmount) / 100.0) % strTradingCode.c_str();
 	string& biz_content = f.str();
 
-	appendContentAndSign(strReq, biz_content, "alipay.trade.refund");
+	appendContentAndSign(strReq, biz_content, ALIPAY_METHOD_REFUND);
 }
 
 void CAlipay::appendQueryStatusContent(string& strReq, const string& strOutTradingCode)
@@ -418,7 +1056,7 @@ void CAlipay::appendQueryStatusContent(string& strReq, const string& strOutTradi
 	f % strOutTradingCode.c_str();
 	string& biz_content = f.str();
 
-	appendContentAndSign(strReq, biz_content, "alipay.trade.query");
+	appendContentAndSign(strReq, biz_content, ALIPAY_METHOD_QUERY);
 }
 
 void CAlipay::appendQueryRefundContent(string& strReq, const string& strOutTradingCode, const string& strRefundTradingCode)
@@ -427,5 +1065,14 @@ void CAlipay::appendQueryRefundContent(string& strReq, const string& strOutTradi
 	f % strOutTradingCode.c_str() % strRefundTradingCode.c_str();
 	string& biz_content = f.str();
 
-	appendContentAndSign(strReq, biz_content, "alipay.trade.fastpay.refund.query");
-}
\ No newline at end of file
+	appendContentAndSign(strReq, biz_content, ALIPAY_METHOD_QUERY_REFUND);
+}
+
+void CAlipay::appendBillDownloadUrlContent(string& strReq, const string& strBillType, const string& strBillDate)
+{
+	format f("{\"bill_type\":\"%s\",\"bill_date\":\"%s\"}");
+	f % strBillType.c_str() % strBillDate.c_str();
+	string& biz_content = f.str();
+
+	appendContentAndSign(strReq, biz_content, ALIPAY_METHOD_BILL_DOWNLOAD_URL);
+}
@@ -1,13 +1,27 @@
 #pragma once
 
 #include <map>
+#include <set>
+#include <memory>
 #include <vector>
 #include <functional>
 #include "rapidjson/document.h"
 #include "Pay/PayError.h"
+#include "PayUtils/PayResilience.h"
+#include "PayUtils/PayRateLimiter.h"
+#include "PayUtils/PayOrderCache.h"
+#include "PayUtils/PayBill.h"
+
+struct rsa_st;
 
 namespace SAPay{
 
+class CPayJournal;
+class CPayRefundLedger;
+class CPaySigner;
+class CPayMemoryResource;
+struct CAlipayCodec;
+
 enum CAlipayRet
 {
 	//δ֪
@@ -23,7 +37,16 @@ enum CAlipayRet
 	ALIPAY_RET_PARSE_ERROR,
 
 	//ǩ
-	ALIPAY_RET_VERIFY_ERROR
+	ALIPAY_RET_VERIFY_ERROR,
+
+	//۶,δ
+	ALIPAY_RET_CIRCUIT_OPEN,
+
+	//,δ
+	ALIPAY_RET_RATE_LIMITED,
+
+	//˽,δ
+	ALIPAY_RET_REFUND_EXCEEDED
 };
 
 using CAlipayError = CPayError<CAlipayRet>;
@@ -67,12 +90,67 @@ struct CAlipayResps
 	//query refund
 	std::string strOutRequestNo;
 	std::string strRefundAmount;
+
+	//download bill
+	std::string strBillDownloadUrl;
 };
 
+using CAlipayResult = CPayExpected<CAlipayResps, CAlipayError>;
+
+template<>
+struct CPayOrderTraits<CAlipayResps>
+{
+	//׳ɹرպ״̬Ҹı
+	static bool isFinal(const CAlipayResps& alipayResps)
+	{
+		return alipayResps.iTradeStatus == ALIPAY_TRADE_STATUS_SUCCESS ||
+			alipayResps.iTradeStatus == ALIPAY_TRADE_STATUS_FINISHED ||
+			alipayResps.iTradeStatus == ALIPAY_TRADE_STATUS_CLOSED;
+	}
+};
 
+using CAlipayOrderCache = CPayOrderCache<CAlipayResps, CAlipayError>;
+
+//εõѡ,δõֶʹÿͻ˵Ĭֵ
+struct CAlipayCallOptions
+{
+	CAlipayCallOptions(int iSeconds = 0) :
+		iTimeOut(iSeconds),
+		pMemoryResource(nullptr) {}
+
+	//httpĳʱ,λΪ, 0-HTTPCLIENT_DEFAULT_TOME_OUT
+	int iTimeOut;
+
+	//εõʱڴ(ǩݡӦֶε)Ӵ˷,÷غ󼴿,nullptrʱ߳Դarena;
+	//ֻڷõ߳ʹ,̰߳ȫ,첽ӿںԴ
+	CPayMemoryResource* pMemoryResource;
+};
+
+//appendPayContentBatchĲ,ֶκͬappendPayContent
+struct CAlipayPayReq
+{
+	CAlipayPayReq() :
+		iAmount(0),
+		strTimeOut("30m") {}
+
+	int iAmount;
+	std::string strTradingCode;
+	std::string strSubject;
+	std::string strCallBackAddr;
+	std::string strTimeOut;
+	std::string strPassBackParams;
+};
 
 
 
+
+
+/**
+* @name CAlipay
+*
+* @brief								set*ֻڹ󡢽֮߳ǰ,֮ͻֻ,
+*										ͬһapp idһʵɱй̲߳,·ϲ
+*/
 class CAlipay
 {
 public:
@@ -115,6 +193,69 @@ public:
 	);
 	virtual ~CAlipay() {}
 
+	/**
+	* @name setRetryPolicy
+	*
+	* @brief								Բ,ѯ˿(ͬһout_request_no)ɰȫԲѯԳ,
+	*										ת˽δ(dns/ʧ)ʱ
+	*/
+	void setRetryPolicy(const CPayRetryPolicy& retryPolicy) { m_retryPolicy = retryPolicy; }
+
+	//۶,ͬһع
+	CPayCircuitBreaker* getCircuitBreaker() const { return m_pCircuitBreaker; }
+
+	/**
+	* @name setRateLimit
+	*
+	* @brief								,app idӿڷ( ALIPAY_METHOD_REFUND)ڽڹ,
+	*										Ĭϲ
+	*/
+	void setRateLimit(const std::string& strMethod, const CPayRateLimit& rateLimit);
+
+	//ٵsub_code,Ĭ isv.app-call-limited, aop.api-call-limited
+	void setThrottleCodes(const std::vector<std::string>& vecSubCodes);
+
+	/**
+	* @name setJournal
+	*
+	* @brief								˿ת˷ǰдͼ,յȷд,
+	*										δպϵĲȲѯپǷط,ɶͻ˹
+	*/
+	void setJournal(const std::shared_ptr<CPayJournal>& pJournal) { m_pJournal = pJournal; }
+
+	/**
+	* @name setOrderCache
+	*
+	* @brief								queryPayStatusȲ鶩״̬,ͬһĲѯֻһ,
+	*										ɲѯverifyAndApplyNotify,ɶͻ˹
+	*/
+	void setOrderCache(const std::shared_ptr<CAlipayOrderCache>& pOrderCache) { m_pOrderCache = pOrderCache; }
+
+	/**
+	* @name setRefundLedger
+	*
+	* @brief								˿ǰ˱˽,ʱֱӷ ALIPAY_RET_REFUND_EXCEEDED,
+	*										˱ɲѯ˿,δѯĶ,ɶͻ˹
+	*/
+	void setRefundLedger(const std::shared_ptr<CPayRefundLedger>& pRefundLedger) { m_pRefundLedger = pRefundLedger; }
+
+	/**
+	* @name setSigner
+	*
+	* @brief								ǩǩĹ̲߳,ڵ߳ǩ,
+	*										ǩԱ̻˽Կ,ɶͻ˹
+	*/
+	void setSigner(const std::shared_ptr<CPaySigner>& pSigner) { m_pSigner = pSigner; }
+
+	/**
+	* @name verifyAndApplyNotify
+	*
+	* @brief								ñ̻Կ֪ͨǩ,ɹ֪ͨеĽ״̬¶״̬
+	*
+	* @return								0-sucess other-failed
+	*/
+	int verifyAndApplyNotify(const std::map<std::string, std::string>& mapNotify);
+
 	
 
 	/**
@@ -139,6 +280,18 @@ public:
 		const std::string& strPassBackParams = std::string("")
 	);
 
+	/**
+	* @name appendPayContentBatch
+	*
+	* @brief								ɶ,ƴȫһύǩ,ǩʱǩ
+	*
+	* @param vecContent						vecReqһһӦ,ǩʧʱsignΪ
+	*/
+	void appendPayContentBatch(
+		std::vector<std::string>& vecContent,
+		const std::vector<CAlipayPayReq>& vecReq
+	);
+
 	/**
 	* @name refund
 	*
@@ -151,12 +304,14 @@ public:
 	* @param iAmount						˿
 	* @param strTradingCode					˿
 	* @param strOutTradingCode				Ҫ˿Ķ						
+	* @param options						ʱ
 	*/
 	void refund(
 		int iAmount,
 		const std::string& strTradingCode,
 		const std::string& strOutTradingCode,
-		CAlipayResps& alipayResps
+		CAlipayResps& alipayResps,
+		const CAlipayCallOptions& options = CAlipayCallOptions()
 	);
 
 	/**
@@ -172,6 +327,7 @@ public:
 	* @param strAlipayAccount				û֧˺
 	* @param strTrueName					ûʵ		
 	* @param strRemarks						ע
+	* @param options						ʱ
 	*/
 	void withdraw(
 		int iAmount,
@@ -179,7 +335,8 @@ public:
 		const std::string& strAlipayAccount,
 		const std::string& strTrueName,
 		CAlipayResps& alipayResps,
-		const std::string& strRemarks = std::string("")
+		const std::string& strRemarks = std::string(""),
+		const CAlipayCallOptions& options = CAlipayCallOptions()
 	);
 
 	/**
@@ -192,10 +349,12 @@ public:
 	*										strBuyerUserId, strTradeStatus, strTotalAmount
 	*
 	* @param strOutTradingCode				ҪѯĶ				
+	* @param options						ͬһĲѯһ,ʹ÷ߵĳʱ
 	*/
 	void queryPayStatus(
 		const std::string& strOutTradingCode,
-		CAlipayResps& alipayResps
+		CAlipayResps& alipayResps,
+		const CAlipayCallOptions& options = CAlipayCallOptions()
 	);
 
 	/**
@@ -207,12 +366,72 @@ public:
 	*
 	* @param strOutTradingCode				˿Ķ
 	* @param strRefundTradingCode			˿
+	* @param options						ͬqueryPayStatus
 	*/
 	void queryRefund(
 		const std::string& strOutTradingCode,
 		const std::string& strRefundTradingCode,
+		CAlipayResps& alipayResps,
+		const CAlipayCallOptions& options = CAlipayCallOptions()
+	);
+
+	/**
+	* @name tryRefund/tryWithdraw/tryQueryPayStatus/tryQueryRefund
+	*
+	* @brief								non-throwing variants for high-rate callers, errors are returned
+	*										in CAlipayResult and share the req/resps instead of copying them
+	*/
+	CAlipayResult tryRefund(
+		int iAmount,
+		const std::string& strTradingCode,
+		const std::string& strOutTradingCode,
+		const CAlipayCallOptions& options = CAlipayCallOptions()
+	);
+	CAlipayResult tryWithdraw(
+		int iAmount,
+		const std::string& strTradingCode,
+		const std::string& strAlipayAccount,
+		const std::string& strTrueName,
+		const std::string& strRemarks = std::string(""),
+		const CAlipayCallOptions& options = CAlipayCallOptions()
+	);
+	CAlipayResult tryQueryPayStatus(
+		const std::string& strOutTradingCode,
+		const CAlipayCallOptions& options = CAlipayCallOptions()
+	);
+	CAlipayResult tryQueryRefund(
+		const std::string& strOutTradingCode,
+		const std::string& strRefundTradingCode,
+		const CAlipayCallOptions& options = CAlipayCallOptions()
+	);
+
+	/**
+	* @name downloadBill
+	*
+	* @brief								ض˵,ر߽ѹлص,ڴռ˵С޹
+	*
+	* @note									see https://opendocs.alipay.com/apis/api_15/alipay.data.dataservice.bill.downloadurl.query
+	*										ֻصzipеϸļ,ļز,ʧǰѻص
+	*										ֶΰ strBillDownloadUrl
+	*
+	* @param strBillType					˵, ALIPAY_BILL_TYPE_TRADE  ALIPAY_BILL_TYPE_SIGNCUSTOMER
+	* @param strBillDate					˵, yyyy-MM-dd  yyyy-MM
+	* @param onRow							ÿлص,falseֹͣ
+	*/
+	void downloadBill(
+		const std::string& strBillType,
+		const std::string& strBillDate,
+		const CPayBillRowFunc& onRow,
 		CAlipayResps& alipayResps
 	);
+	CAlipayResult tryDownloadBill(
+		const std::string& strBillType,
+		const std::string& strBillDate,
+		const CPayBillRowFunc& onRow
+	);
+
+	//˵ϸ,CPayBillReconcilerʹ
+	static CPayBillColumns getBillColumns();
 
 protected:
 	//token
@@ -221,22 +440,85 @@ protected:
 	std::string m_strPubKey;
 	std::string m_strPrivKey;
 
+	//Կ,ͬpemڽڹ
+	std::shared_ptr<rsa_st> m_pPubKey;
+	std::shared_ptr<rsa_st> m_pPrivKey;
+
+	CPayRetryPolicy m_retryPolicy;
+	CPayCircuitBreaker* m_pCircuitBreaker;
+
+	//ÿӿڷһ,ʱȡ,ֻ֮
+	std::map<std::string, CPayRateLimiter*> m_mapRateLimiters;
+	std::set<std::string> m_setThrottleCodes;
+
+	std::shared_ptr<CPayJournal> m_pJournal;
+	std::shared_ptr<CAlipayOrderCache> m_pOrderCache;
+	std::shared_ptr<CPayRefundLedger> m_pRefundLedger;
+	std::shared_ptr<CPaySigner> m_pSigner;
+
 protected:
-	using ParseFunc = std::function<void(const std::string&, const std::string&, rapidjson::Value&)>;
+	//͡ǩ뷵ϢCPayGateway<CAlipayCodec>,ÿӿһ(Alipay.cpp)
+	friend struct CAlipayCodec;
 
-	//Ϣ
-	virtual void parseTransferResps(const std::string& strReq, const std::string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps);
+	CPayRateLimiter* getRateLimiter(const std::string& strMethod) const;
 
-	virtual void parseRefundResps(const std::string& strReq, const std::string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps);
+	//throttling sub_code slows the limiter down, returns szSubCode
+	const char* checkThrottled(CPayRateLimiter* pRateLimiter, const char* szSubCode) const;
 
-	virtual void parseQueryStatusResps(const std::string& strReq, const std::string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps);
+	bool doRefund(
+		int iAmount,
+		const std::string& strTradingCode,
+		const std::string& strOutTradingCode,
+		const CAlipayCallOptions& options,
+		CAlipayResps& alipayResps,
+		boost::optional<CAlipayError>& error
+	);
+	bool doWithdraw(
+		int iAmount,
+		const std::string& strTradingCode,
+		const std::string& strAlipayAccount,
+		const std::string& strTrueName,
+		const std::string& strRemarks,
+		const CAlipayCallOptions& options,
+		CAlipayResps& alipayResps,
+		boost::optional<CAlipayError>& error
+	);
+	bool doQueryPayStatus(
+		const std::string& strOutTradingCode,
+		const CAlipayCallOptions& options,
+		CAlipayResps& alipayResps,
+		boost::optional<CAlipayError>& error
+	);
 
-	virtual void parseQueryRefundResps(const std::string& strReq, const std::string& strResps, rapidjson::Value& respsContent, CAlipayResps* pAlipayResps);
-	
-	void sendReqAndParseResps(
-		const std::string& strReq,
-		const std::string& strRespsName,
-		ParseFunc func
+	//always asks the gateway
+	bool fetchPayStatus(
+		const std::string& strOutTradingCode,
+		const CAlipayCallOptions& options,
+		CAlipayResps& alipayResps,
+		boost::optional<CAlipayError>& error
+	);
+
+	static CAlipayTradeStatus parseTradeStatus(const std::string& strTradeStatus);
+
+	//ǩǩ
+	static void makeNotifySignContent(
+		const std::map<std::string, std::string>& mapNotify,
+		std::string& strContent,
+		std::string& strSign
+	);
+	bool doQueryRefund(
+		const std::string& strOutTradingCode,
+		const std::string& strRefundTradingCode,
+		const CAlipayCallOptions& options,
+		CAlipayResps& alipayResps,
+		boost::optional<CAlipayError>& error
+	);
+	bool doDownloadBill(
+		const std::string& strBillType,
+		const std::string& strBillDate,
+		const CPayBillRowFunc& onRow,
+		CAlipayResps& alipayResps,
+		boost::optional<CAlipayError>& error
 	);
 
 	//ƴ
@@ -248,6 +530,25 @@ protected:
 		const std::string& strCallBack = ""
 	);
 
+	//ƴӳsign,clearStringΪǩ
+	template<typename TClear>
+	void appendUnsignedContent(
+		std::string& totalString,
+		TClear& clearString,
+		const std::string& biz_content,
+		const std::string& strMethodName,
+		const std::string& strCharset,
+		const std::string& strCallBack
+	);
+
+	static std::string makePayBizContent(
+		int iAmount,
+		const std::string& strTradingCode,
+		const std::string& strSubject,
+		const std::string& strTimeOut,
+		const std::string& strPassBackParams
+	);
+
 	void appendTransferContent(
 		std::string& strReq,
 		int iAmount,
@@ -271,6 +572,11 @@ protected:
 		const std::string& strOutTradingCode,
 		const std::string& strRefundTradingCode
 	);
+	void appendBillDownloadUrlContent(
+		std::string& strReq,
+		const std::string& strBillType,
+		const std::string& strBillDate
+	);
 };
 
 }
\ No newline at end of file
@@ -1,45 +1,135 @@
 #pragma once
 #include <string>
+#include <memory>
+#include <utility>
+#include <boost/optional.hpp>
+#include "PayUtils/PayBufferPool.h"
 
 namespace SAPay {
 
+//request and response of one gateway call, errors share it instead of copying the bodies
+struct CPayContext
+{
+	//the resps is received into a pooled buffer, handed back once no error holds the context
+	CPayContext() :iTimeOut(0) { CPayBufferPool::acquire(strResps); }
+	~CPayContext() { CPayBufferPool::release(strResps); }
+
+	std::string strReq;
+	std::string strResps;
+
+	//per call http timeout in seconds, 0 for the client default
+	int iTimeOut;
+};
+
+using CPayContextPtr = std::shared_ptr<CPayContext>;
+
 template<typename T>
 class CPayError
 {
 public:
 	CPayError(T ret) :m_ret(ret), m_iLastNetWorkCode(0) {}
 
+	CPayError(T ret, const CPayContextPtr& pContext) :
+		m_ret(ret),
+		m_iLastNetWorkCode(0),
+		m_pContext(pContext) {}
+
+	CPayError(T ret, const CPayContextPtr& pContext, int iNetWorkCode) :
+		m_ret(ret),
+		m_iLastNetWorkCode(iNetWorkCode),
+		m_pContext(pContext) {}
+
+	CPayError(T ret, const CPayContextPtr& pContext, const std::string& strErrorInfo) :
+		m_ret(ret),
+		m_iLastNetWorkCode(0),
+		m_pContext(pContext),
+		m_strErrInfo(strErrorInfo) {}
+
 	CPayError(T ret, const std::string& strLastReq, const std::string& strLastResps) :
 		m_ret(ret),
 		m_iLastNetWorkCode(0),
-		m_strLastReq(strLastReq),
-		m_strLastResps(strLastResps) {}
+		m_pContext(makeContext(strLastReq, strLastResps)) {}
 
 	CPayError(T ret, const std::string& strLastReq, const std::string& strLastResps, int iNetWorkCode) :
 		m_ret(ret),
 		m_iLastNetWorkCode(iNetWorkCode),
-		m_strLastReq(strLastReq),
-		m_strLastResps(strLastResps) {}
+		m_pContext(makeContext(strLastReq, strLastResps)) {}
 
 	CPayError(T ret, const std::string& strLastReq, const std::string& strLastResps, const std::string& strErrorInfo) :
 		m_ret(ret),
 		m_iLastNetWorkCode(0),
-		m_strLastReq(strLastReq),
-		m_strLastResps(strLastResps),
+		m_pContext(makeContext(strLastReq, strLastResps)),
 		m_strErrInfo(strErrorInfo) {}
 
 	T getErrorCode() const { return m_ret; }
 	int getNetWorkCode() const { return m_iLastNetWorkCode; }
-	const std::string& getLastReq() const { return m_strLastReq; }
-	const std::string& getLastResps() const { return m_strLastResps; }
+	const std::string& getLastReq() const { return m_pContext ? m_pContext->strReq : emptyString(); }
+	const std::string& getLastResps() const { return m_pContext ? m_pContext->strResps : emptyString(); }
 	const std::string& getErrInfo() const { return m_strErrInfo; }
+	std::shared_ptr<const CPayContext> getContext() const { return m_pContext; }
 
 private:
+	static const std::string& emptyString()
+	{
+		static const std::string strEmpty;
+		return strEmpty;
+	}
+
+	static std::shared_ptr<const CPayContext> makeContext(const std::string& strLastReq, const std::string& strLastResps)
+	{
+		CPayContextPtr pContext = std::make_shared<CPayContext>();
+		pContext->strReq = strLastReq;
+		pContext->strResps = strLastResps;
+		return pContext;
+	}
+
 	T m_ret;
 	int m_iLastNetWorkCode;
-	std::string m_strLastReq;
-	std::string m_strLastResps;
+	std::shared_ptr<const CPayContext> m_pContext;
 	std::string m_strErrInfo;
 };
 
-}
\ No newline at end of file
+/**
+* @name CPayExpected
+*
+* @brief								result of the non-throwing try* api, holds the resps or the error.
+*										value() rethrows the error if there is one
+*/
+template<typename T, typename E>
+class CPayExpected
+{
+public:
+	CPayExpected(T&& value, boost::optional<E>&& error) :
+		m_value(std::move(value)),
+		m_error(std::move(error)) {}
+
+	bool hasValue() const { return !m_error; }
+	explicit operator bool() const { return hasValue(); }
+
+	T& value()
+	{
+		if (m_error)
+			throw *m_error;
+		return m_value;
+	}
+	const T& value() const
+	{
+		if (m_error)
+			throw *m_error;
+		return m_value;
+	}
+
+	T& operator*() { return m_value; }
+	const T& operator*() const { return m_value; }
+	T* operator->() { return &m_value; }
+	const T* operator->() const { return &m_value; }
+
+	//only valid if hasValue() is false
+	const E& error() const { return *m_error; }
+
+private:
+	T m_value;
+	boost::optional<E> m_error;
+};
+
+}
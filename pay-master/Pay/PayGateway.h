@@ -0,0 +1,86 @@
+#pragma once
+#include <string>
+#include <boost/optional.hpp>
+#include "Pay/PayError.h"
+#include "PayUtils/HttpClient.h"
+#include "PayUtils/PayMetrics.h"
+#include "PayUtils/PayResilience.h"
+#include "PayUtils/PayRateLimiter.h"
+
+namespace SAPay {
+
+/**
+* @name CPayGateway
+*
+* @brief								send, decode, verify and parse skeleton shared by every provider, specialized
+*										at compile time so each api is one straight-line call with no std::function
+*										or virtual dispatch for the parse step.
+*
+*										TCodec, one per provider (friend of its client):
+*										  CClient, CError, CMessage and the RET_* codes used below
+*										  fail(error, CError&&)										count and store the error
+*										  makeAttempt<TOp>(client, pContext, iTimeOut, attempt, error)	false if it cannot be sent
+*										  getRetryPolicy(client), getCircuitBreaker<TOp>(client), getRateLimiter<TOp>(client)
+*										  decode<TOp>(client, pContext, pRateLimiter, message, error)	parse, status codes and sign
+*										  content(message)											what TOp::parse reads
+*
+*										TOp, one per api:
+*										  idempotency()
+*										  parse(content, TResps&)									false if a field is missing
+*/
+template<typename TCodec>
+class CPayGateway
+{
+public:
+	using CClient = typename TCodec::CClient;
+	using CError = typename TCodec::CError;
+
+	//never throws, fills error and returns false on failure
+	template<typename TOp, typename TResps>
+	static bool call(
+		const CClient& client,
+		const CPayContextPtr& pContext,
+		TResps& resps,
+		boost::optional<CError>& error
+	)
+	{
+		int iTimeOut = pContext->iTimeOut > 0 ? pContext->iTimeOut : HTTPCLIENT_DEFAULT_TOME_OUT;
+		CPayHttpAttempt attempt;
+		if (!TCodec::template makeAttempt<TOp>(client, pContext, iTimeOut, attempt, error))
+			return false;
+
+		CPayRateLimiter* pRateLimiter = TCodec::template getRateLimiter<TOp>(client);
+		if (pRateLimiter && !pRateLimiter->acquire())
+		{
+			return TCodec::fail(error, CError(TCodec::RET_RATE_LIMITED, pContext));
+		}
+
+		CHttpTimings httpTimings;
+		bool bRecordTimings = CPayMetricsScope::current() != nullptr;
+		int iNetWorkRet = 0;
+		CPayCallRet iCallRet = CPayResilience::execute(TCodec::getRetryPolicy(client), TCodec::template getCircuitBreaker<TOp>(client),
+			TOp::idempotency(), attempt, pContext->strResps, bRecordTimings ? &httpTimings : nullptr, iNetWorkRet);
+		if (iCallRet == PAY_CALL_CIRCUIT_OPEN)
+		{
+			return TCodec::fail(error, CError(TCodec::RET_CIRCUIT_OPEN, pContext));
+		}
+		if (bRecordTimings)
+			CPayMetrics::recordHttpTimings(httpTimings);
+		if (iCallRet != PAY_CALL_SUCCESS)
+		{
+			return TCodec::fail(error, CError(TCodec::RET_NETWORK_ERROR, pContext, iNetWorkRet));
+		}
+
+		typename TCodec::CMessage message;
+		if (!TCodec::template decode<TOp>(client, pContext, pRateLimiter, message, error))
+			return false;
+
+		if (!TOp::parse(TCodec::content(message), resps))
+		{
+			return TCodec::fail(error, CError(TCodec::RET_PARSE_ERROR, pContext));
+		}
+		return true;
+	}
+};
+
+}
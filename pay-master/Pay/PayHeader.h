@@ -4,6 +4,23 @@
 #define ALIPAY_HREF_DEV										"https://openapi.alipaydev.com/gateway.do"
 #define ALIPAY_HREF											"https://openapi.alipay.com/gateway.do"
 
+//alipay method name
+#define ALIPAY_METHOD_APP_PAY								"alipay.trade.app.pay"
+#define ALIPAY_METHOD_TRANSFER								"alipay.fund.trans.toaccount.transfer"
+#define ALIPAY_METHOD_REFUND								"alipay.trade.refund"
+#define ALIPAY_METHOD_QUERY									"alipay.trade.query"
+#define ALIPAY_METHOD_QUERY_REFUND							"alipay.trade.fastpay.refund.query"
+#define ALIPAY_METHOD_BILL_DOWNLOAD_URL						"alipay.data.dataservice.bill.downloadurl.query"
+
+//alipay throttling sub_code
+#define ALIPAY_SUB_CODE_APP_CALL_LIMITED					"isv.app-call-limited"
+#define ALIPAY_SUB_CODE_API_CALL_LIMITED					"aop.api-call-limited"
+
+//alipay sub_code leaving the result unknown, query before resending
+//trade apis (acquiring) and fund transfer name it differently
+#define ALIPAY_SUB_CODE_SYSTEM_ERROR						"ACQ.SYSTEM_ERROR"
+#define ALIPAY_TRANSFER_SUB_CODE_SYSTEM_ERROR				"SYSTEM_ERROR"
+
 //alipay key name
 #define ALIPAY_REQ_APP_ID									"app_id"
 #define ALIPAY_REQ_BIZ_CONTENT								"biz_content"
@@ -19,6 +36,8 @@
 #define ALIPAY_RESPS_RFND									"alipay_trade_refund_response"
 #define ALIPAY_RESPS_QUERY									"alipay_trade_query_response"
 #define ALIPAY_RESPS_QUERY_REFUND							"alipay_trade_fastpay_refund_query_response"
+#define ALIPAY_RESPS_BILL_DOWNLOAD_URL_QUERY				"alipay_data_dataservice_bill_downloadurl_query_response"
+#define ALIPAY_RESPS_BILL_DOWNLOAD_URL						"bill_download_url"
 #define ALIPAY_RESPS_SIGN									"sign"
 #define ALIPAY_RESPS_CODE									"code"
 #define ALIPAY_RESPS_SUB_CODE								"sub_code"
@@ -45,6 +64,10 @@
 #define ALIPAY_TRADE_STATUS_FINISHED_STR					"TRADE_FINISHED"
 #define ALIPAY_TRADE_STATUS_WAIT_BUYER_PAY_STR				"WAIT_BUYER_PAY"
 
+//alipay bill type
+#define ALIPAY_BILL_TYPE_TRADE								"trade"
+#define ALIPAY_BILL_TYPE_SIGNCUSTOMER						"signcustomer"
+
 //alipay notify key name
 #define ALIPAY_NOTIFY_GMT_CREATE							"gmt_create";
 #define ALIPAY_NOTIFY_CHARSET								"charset";
@@ -80,6 +103,20 @@
 #define WECHAT_HREF_PREPAY									"https://api.mch.weixin.qq.com/pay/unifiedorder"
 #define WECHAT_HREF_REFUND									"https://api.mch.weixin.qq.com/secapi/pay/refund"
 #define WECHAT_HREF_QUERY									"https://api.mch.weixin.qq.com/pay/orderquery"
+#define WECHAT_HREF_DOWNLOAD_BILL							"https://api.mch.weixin.qq.com/pay/downloadbill"
+
+//wechat method name, rate limiter key
+#define WECHAT_METHOD_SMALL_PROGRAM_LOGIN					"sns/jscode2session"
+#define WECHAT_METHOD_PREPAY								"pay/unifiedorder"
+#define WECHAT_METHOD_REFUND								"secapi/pay/refund"
+#define WECHAT_METHOD_QUERY									"pay/orderquery"
+#define WECHAT_METHOD_DOWNLOAD_BILL							"pay/downloadbill"
+
+//wechat throttling err_code
+#define WECHAT_ERR_CODE_FREQUENCY_LIMITED					"FREQUENCY_LIMITED"
+
+//wechat err_code leaving the result unknown, query before resending
+#define WECHAT_ERR_CODE_SYSTEM_ERROR						"SYSTEMERROR"
 
 //wechat key name
 #define WECHAT_XML_ROOT										"xml"
@@ -105,6 +142,9 @@
 #define WECHAT_REQ_TRANSACTION_ID							"transaction_id"
 #define WECHAT_REQ_OUT_REFUND_NO							"out_refund_no"
 #define WECHAT_REQ_REFUND_DESC								"refund_desc"
+#define WECHAT_REQ_BILL_DATE								"bill_date"
+#define WECHAT_REQ_BILL_TYPE								"bill_type"
+#define WECHAT_REQ_TAR_TYPE									"tar_type"
 
 #define WECHAT_RESPS_SESSION_KEY							"session_key"
 #define WECHAT_RESPS_RETURN_CODE							"return_code"
@@ -138,6 +178,19 @@
 #define WECHAT_TRADE_STATE_USERPAYING_STR					"USERPAYING"
 #define WECHAT_TRADE_STATE_PAYERROR_STR						"PAYERROR"
 
+//wechat refund notify refund status
+#define WECHAT_REFUND_STATUS_SUCCESS_STR					"SUCCESS"
+#define WECHAT_REFUND_STATUS_CHANGE_STR						"CHANGE"
+#define WECHAT_REFUND_STATUS_REFUNDCLOSE_STR				"REFUNDCLOSE"
+
+//error replies of pay/downloadbill are plain xml, anything longer is not one
+#define WECHAT_BILL_MAX_ERROR_SIZE							4096
+
+//wechat bill type
+#define WECHAT_BILL_TYPE_ALL								"ALL"
+#define WECHAT_BILL_TYPE_SUCCESS							"SUCCESS"
+#define WECHAT_BILL_TYPE_REFUND								"REFUND"
+
 //wechat notify key name
 #define WECHAT_NOTIFY_APP_ID								"appid"
 #define WECHAT_NOTIFY_ATTACH								"attach"
@@ -156,6 +209,22 @@
 #define WECHAT_NOTIFY_TOTAL_FEE								"total_fee"
 #define WECHAT_NOTIFY_TRADE_TYPE							"trade_type"
 #define WECHAT_NOTIFY_TRANSACTION_ID						"transaction_id"
+#define WECHAT_NOTIFY_REQ_INFO								"req_info"
+
+//wechat refund notify req_info key name
+#define WECHAT_REFUND_NOTIFY_TRANSACTION_ID					"transaction_id"
+#define WECHAT_REFUND_NOTIFY_OUT_TRADE_NO					"out_trade_no"
+#define WECHAT_REFUND_NOTIFY_REFUND_ID						"refund_id"
+#define WECHAT_REFUND_NOTIFY_OUT_REFUND_NO					"out_refund_no"
+#define WECHAT_REFUND_NOTIFY_TOTAL_FEE						"total_fee"
+#define WECHAT_REFUND_NOTIFY_SETTLEMENT_TOTAL_FEE			"settlement_total_fee"
+#define WECHAT_REFUND_NOTIFY_REFUND_FEE						"refund_fee"
+#define WECHAT_REFUND_NOTIFY_SETTLEMENT_REFUND_FEE			"settlement_refund_fee"
+#define WECHAT_REFUND_NOTIFY_REFUND_STATUS					"refund_status"
+#define WECHAT_REFUND_NOTIFY_SUCCESS_TIME					"success_time"
+#define WECHAT_REFUND_NOTIFY_REFUND_RECV_ACCOUT				"refund_recv_accout"
+#define WECHAT_REFUND_NOTIFY_REFUND_ACCOUNT					"refund_account"
+#define WECHAT_REFUND_NOTIFY_REFUND_REQUEST_SOURCE			"refund_request_source"
 
 //define CHECK_INPUT_STRING_TYPE if you want to check the type of input string 
 #define CHECK_INPUT_STRING_TYPE
\ No newline at end of file
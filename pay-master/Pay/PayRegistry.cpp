@@ -0,0 +1,120 @@
+#include "PayRegistry.h"
+
+using namespace std;
+using namespace SAPay;
+
+static atomic<unsigned long long> s_llNextRegistryId(1);
+
+//per thread copy of the last snapshot seen, keeps the shared snapshot refcount off the lookup path
+struct CPayRegistryCache
+{
+	CPayRegistryCache() :llId(0), llVersion(0) {}
+
+	unsigned long long llId;
+	unsigned long long llVersion;
+	shared_ptr<const void> pSnapshot;
+};
+
+static thread_local CPayRegistryCache t_registryCache;
+
+static bool operator==(const CAlipayMerchant& l, const CAlipayMerchant& r)
+{
+	return l.strAppId == r.strAppId &&
+		l.strPubKey == r.strPubKey &&
+		l.strPrivKey == r.strPrivKey &&
+		l.bIsDevMode == r.bIsDevMode;
+}
+
+static bool operator==(const CWeChatMerchant& l, const CWeChatMerchant& r)
+{
+	return l.strAppId == r.strAppId &&
+		l.strMchId == r.strMchId &&
+		l.strMchKey == r.strMchKey &&
+		l.strAppSecret == r.strAppSecret &&
+		l.strCertPath == r.strCertPath &&
+		l.strKeyPath == r.strKeyPath &&
+		l.bIsApp == r.bIsApp;
+}
+
+CPayRegistry::CPayRegistry() :
+	m_llId(s_llNextRegistryId.fetch_add(1)),
+	m_llVersion(0),
+	m_pSnapshot(make_shared<CSnapshot>())
+{
+}
+
+const CPayRegistry::CSnapshot* CPayRegistry::snapshot() const
+{
+	unsigned long long llVersion = m_llVersion.load(memory_order_acquire);
+	if (t_registryCache.llId != m_llId || t_registryCache.llVersion != llVersion)
+	{
+		t_registryCache.pSnapshot = atomic_load(&m_pSnapshot);
+		t_registryCache.llId = m_llId;
+		t_registryCache.llVersion = llVersion;
+	}
+	return static_cast<const CSnapshot*>(t_registryCache.pSnapshot.get());
+}
+
+void CPayRegistry::publish(const shared_ptr<const CSnapshot>& pSnapshot)
+{
+	atomic_store(&m_pSnapshot, pSnapshot);
+	m_llVersion.fetch_add(1, memory_order_release);
+}
+
+void CPayRegistry::reloadAlipay(const vector<CAlipayMerchant>& vecMerchants)
+{
+	lock_guard<mutex> lock(m_mutexReload);
+	shared_ptr<const CSnapshot> pOld = atomic_load(&m_pSnapshot);
+	shared_ptr<CSnapshot> pNew = make_shared<CSnapshot>();
+	pNew->mapWeChat = pOld->mapWeChat;
+	for (auto itr = vecMerchants.begin(); itr != vecMerchants.end(); ++itr)
+	{
+		CAlipayEntry& entry = pNew->mapAlipay[itr->strAppId];
+		auto itrOld = pOld->mapAlipay.find(itr->strAppId);
+		if (itrOld != pOld->mapAlipay.end() && itrOld->second.merchant == *itr)
+		{
+			entry = itrOld->second;
+			continue;
+		}
+		entry.merchant = *itr;
+		entry.pAlipay = make_shared<CAlipay>(itr->strAppId, itr->strPubKey, itr->strPrivKey, itr->bIsDevMode);
+	}
+	publish(pNew);
+}
+
+void CPayRegistry::reloadWeChat(const vector<CWeChatMerchant>& vecMerchants)
+{
+	lock_guard<mutex> lock(m_mutexReload);
+	shared_ptr<const CSnapshot> pOld = atomic_load(&m_pSnapshot);
+	shared_ptr<CSnapshot> pNew = make_shared<CSnapshot>();
+	pNew->mapAlipay = pOld->mapAlipay;
+	for (auto itr = vecMerchants.begin(); itr != vecMerchants.end(); ++itr)
+	{
+		CWeChatEntry& entry = pNew->mapWeChat[itr->strMchId];
+		auto itrOld = pOld->mapWeChat.find(itr->strMchId);
+		if (itrOld != pOld->mapWeChat.end() && itrOld->second.merchant == *itr)
+		{
+			entry = itrOld->second;
+			continue;
+		}
+		entry.merchant = *itr;
+		entry.pWeChat = make_shared<CWeChat>(itr->strAppId, itr->strMchId, itr->strMchKey,
+			itr->strAppSecret, itr->strCertPath, itr->strKeyPath);
+		entry.pWeChat->setIsApp(itr->bIsApp);
+	}
+	publish(pNew);
+}
+
+shared_ptr<CAlipay> CPayRegistry::getAlipay(const string& strAppId) const
+{
+	const CSnapshot* pSnapshot = snapshot();
+	auto itr = pSnapshot->mapAlipay.find(strAppId);
+	return itr != pSnapshot->mapAlipay.end() ? itr->second.pAlipay : nullptr;
+}
+
+shared_ptr<CWeChat> CPayRegistry::getWeChat(const string& strMchId) const
+{
+	const CSnapshot* pSnapshot = snapshot();
+	auto itr = pSnapshot->mapWeChat.find(strMchId);
+	return itr != pSnapshot->mapWeChat.end() ? itr->second.pWeChat : nullptr;
+}
@@ -0,0 +1,97 @@
+#pragma once
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include "Pay/Alipay.h"
+#include "Pay/WeChat.h"
+
+namespace SAPay {
+
+struct CAlipayMerchant
+{
+	CAlipayMerchant() :bIsDevMode(false) {}
+
+	std::string strAppId;
+	std::string strPubKey;
+	std::string strPrivKey;
+	bool bIsDevMode;
+};
+
+struct CWeChatMerchant
+{
+	CWeChatMerchant() :bIsApp(true) {}
+
+	std::string strAppId;
+	std::string strMchId;
+	std::string strMchKey;
+	std::string strAppSecret;
+	std::string strCertPath;
+	std::string strKeyPath;
+	bool bIsApp;
+};
+
+/**
+* @name CPayRegistry
+*
+* @brief								owns the clients of many merchants, one CAlipay per app_id and one CWeChat per mch_id.
+*										parsed RSA keys, circuit breakers, rate limiters and the curl connection cache
+*										are process wide and shared by every client.
+*										lookups read an immutable snapshot: a thread only touches the shared
+*										snapshot pointer after a reload, otherwise a lookup is one atomic load and a hash find.
+*										reload swaps the snapshot, in-flight calls keep the client they already hold
+*/
+class CPayRegistry
+{
+public:
+	CPayRegistry();
+
+	CPayRegistry(const CPayRegistry&) = delete;
+	CPayRegistry& operator=(const CPayRegistry&) = delete;
+
+	//replace every alipay merchant, clients of unchanged merchants are kept
+	void reloadAlipay(const std::vector<CAlipayMerchant>& vecMerchants);
+
+	//replace every wechat merchant, clients of unchanged merchants are kept
+	void reloadWeChat(const std::vector<CWeChatMerchant>& vecMerchants);
+
+	//nullptr if unknown
+	std::shared_ptr<CAlipay> getAlipay(const std::string& strAppId) const;
+	std::shared_ptr<CWeChat> getWeChat(const std::string& strMchId) const;
+
+private:
+	struct CAlipayEntry
+	{
+		CAlipayMerchant merchant;
+		std::shared_ptr<CAlipay> pAlipay;
+	};
+
+	struct CWeChatEntry
+	{
+		CWeChatMerchant merchant;
+		std::shared_ptr<CWeChat> pWeChat;
+	};
+
+	struct CSnapshot
+	{
+		std::unordered_map<std::string, CAlipayEntry> mapAlipay;
+		std::unordered_map<std::string, CWeChatEntry> mapWeChat;
+	};
+
+	//snapshot cached by the calling thread, refreshed when the version moves.
+	//valid until the next call on the same thread
+	const CSnapshot* snapshot() const;
+	void publish(const std::shared_ptr<const CSnapshot>& pSnapshot);
+
+	//unique per registry, pointers may be reused after a registry is destroyed
+	const unsigned long long m_llId;
+	std::atomic<unsigned long long> m_llVersion;
+	std::shared_ptr<const CSnapshot> m_pSnapshot;
+
+	//serializes reloads only, readers never take it
+	std::mutex m_mutexReload;
+};
+
+}
@@ -1,10 +1,22 @@
 #include "WeChat.h"
 #include "PayHeader.h"
-#include "Tinyxml/tinyxml.h"
+#include "PayGateway.h"
 #include "rapidjson/document.h"
 #include "PayUtils/Utils.h"
 #include "PayUtils/Md5Utils.h"
+#include "PayUtils/PayHex.h"
+#include "PayUtils/PayAes.h"
+#include "PayUtils/PayBase64.h"
+#include "PayUtils/PayFieldTable.h"
+#include "PayUtils/PayArena.h"
+#include "PayUtils/PayXml.h"
 #include "PayUtils/HttpClient.h"
+#include "PayUtils/PayMetrics.h"
+#include "PayUtils/PayJournal.h"
+#include "PayUtils/PayExecutor.h"
+#include "PayUtils/PaySessionStore.h"
+#include "PayUtils/PaySingleFlight.h"
+#include "PayUtils/PayRefundLedger.h"
 #include <boost/format.hpp>
 
 using namespace std;
@@ -16,22 +28,44 @@ void CWeChat::parseWechatRespsAndNotify(
 	map<string, string>& mapNameValue
 )
 {
-	TiXmlDocument document;
-	document.Parse(strNotify.c_str());
-	TiXmlNode* pRoot = document.FirstChild();
-	if (pRoot)
+	CPayArenaScope arenaScope;
+	CPayXmlFields fields(arenaScope.resource());
+	fields.parse(strNotify.data(), strNotify.size());
+	for (auto itr = fields.begin(); itr != fields.end(); ++itr)
+		mapNameValue[itr->first.to_string()] = itr->second.to_string();
+}
+
+//fields in dictionary order, from the map or straight from CPayXmlFields
+template<typename TItr>
+static int verifyMd5Sign(TItr begin, TItr end, const string& strMchKey)
+{
+	CPayArenaScope arenaScope;
+	CPayArenaString content(arenaScope.resource());
+	content.reserve(1024);
+	boost::string_view sign;
+	for (auto itr = begin; itr != end; ++itr)
 	{
-		for (TiXmlNode* pChild = pRoot->FirstChild(); pChild != nullptr; pChild = pChild->NextSibling())
+		if (itr->first == WECHAT_RESPS_SIGN)
 		{
-			TiXmlNode* pTextChild = pChild->FirstChild();
-			if (pChild->Type() == TiXmlNode::TINYXML_ELEMENT &&
-				pTextChild &&
-				pTextChild->Type() == TiXmlNode::TINYXML_TEXT)
-			{
-				mapNameValue[pChild->Value()] = pTextChild->ToText()->Value();
-			}
+			sign = itr->second;
+			continue;
 		}
+
+		if (!itr->second.empty())
+			CUtils::AppendPair(content, itr->first, itr->second, !content.empty());
 	}
+	CUtils::AppendPair(content, "key", strMchKey);
+	//compare raw digests instead of formatting ours as hex
+	unsigned char signDigest[16], resultDigest[16];
+	if (sign.size() != sizeof(signDigest) * 2 || !CPayHex::decode(sign.data(), sign.size(), signDigest))
+		return -1;
+
+	Md5Utils md5;
+	md5.encStr16(content.data(), (unsigned int)content.size(), resultDigest);
+	unsigned char iDiff = 0;
+	for (size_t i = 0; i < sizeof(resultDigest); ++i)
+		iDiff |= signDigest[i] ^ resultDigest[i];
+	return iDiff == 0 ? 1 : -1;
 }
 
 int CWeChat::verifyWechatRespsAndNotify(
@@ -39,37 +73,152 @@ int CWeChat::verifyWechatRespsAndNotify(
 	const string& strMchKey
 )
 {
-	string content(""), sign("");
-	vector<string>& vecDictionary = CUtils::createDictionaryWithMap(mapResps);
-	for (auto itr = vecDictionary.cbegin(); itr != vecDictionary.cend(); ++itr)
+	return verifyMd5Sign(mapResps.cbegin(), mapResps.cend(), strMchKey);
+}
+
+//total_fee/refund_fee are integer fen
+static bool parseFee(boost::string_view fee, long long& llFee)
+{
+	if (fee.empty() || fee.size() > 15)
+		return false;
+	llFee = 0;
+	for (auto itr = fee.begin(); itr != fee.end(); ++itr)
 	{
-		auto itrr = mapResps.find(*itr);
-		if (itrr != mapResps.end())
-		{
-			if (*itr == WECHAT_RESPS_SIGN)
-			{
-				sign = itrr->second;
-				continue;
-			}
+		if (*itr < '0' || *itr > '9')
+			return false;
+		llFee = llFee * 10 + (*itr - '0');
+	}
+	return true;
+}
 
-			if (!itrr->second.empty())
-				CUtils::AppendContentWithoutUrlEncode(*itr, itrr->second, content, !content.empty());
-		}
+int CWeChat::verifyAndApplyNotify(const map<string, string>& mapNotify)
+{
+	int iVerifyRet = verifyWechatRespsAndNotify(mapNotify, m_strMchKey);
+	if (iVerifyRet != 1)
+		return iVerifyRet;
+
+	auto itrMchId = mapNotify.find(WECHAT_NOTIFY_MCH_ID);
+	if (itrMchId != mapNotify.end() && itrMchId->second != m_strMchId)
+		return -1;
+
+	//only paid orders are notified, a failed result_code says nothing about the trade state
+	auto itrReturnCode = mapNotify.find(WECHAT_NOTIFY_RETURN_CODE);
+	auto itrResultCode = mapNotify.find(WECHAT_NOTIFY_RESULT_CODE);
+	auto itrOutTradeNo = mapNotify.find(WECHAT_NOTIFY_OUT_TRADE_NO);
+	if (itrReturnCode == mapNotify.end() ||
+		itrResultCode == mapNotify.end() ||
+		itrOutTradeNo == mapNotify.end() ||
+		itrReturnCode->second != "SUCCESS" ||
+		itrResultCode->second != "SUCCESS")
+	{
+		return iVerifyRet;
 	}
-	CUtils::AppendContentWithoutUrlEncode("key", strMchKey, content);
-	Md5Utils md5;
-	string signResult;
-	md5.encStr32(content.c_str(), signResult);
-	return signResult == sign ? 1 : -1;
+
+	//refunds of the paid order are checked against its total_fee from now on
+	auto itrTotalFee = mapNotify.find(WECHAT_NOTIFY_TOTAL_FEE);
+	long long llCaptured = 0;
+	if (m_pRefundLedger && itrTotalFee != mapNotify.end() && parseFee(itrTotalFee->second, llCaptured))
+		m_pRefundLedger->setCaptured(CPayRefundLedger::makeKey(m_strMchId, itrOutTradeNo->second), llCaptured);
+	if (!m_pOrderCache)
+		return iVerifyRet;
+
+	CWeChatResps wechatResps;
+	wechatResps.iTradeState = WECHAT_TRADE_STATE_SUCCESS;
+	wechatResps.strOutTradeNo = itrOutTradeNo->second;
+	auto itrOpenId = mapNotify.find(WECHAT_NOTIFY_OPEN_ID);
+	auto itrTradeType = mapNotify.find(WECHAT_NOTIFY_TRADE_TYPE);
+	auto itrBankType = mapNotify.find(WECHAT_NOTIFY_BANK_TYPE);
+	auto itrCashFee = mapNotify.find(WECHAT_NOTIFY_CASH_FEE);
+	auto itrTransactionId = mapNotify.find(WECHAT_NOTIFY_TRANSACTION_ID);
+	auto itrTimeEnd = mapNotify.find(WECHAT_NOTIFY_TIME_END);
+	if (itrOpenId != mapNotify.end())
+		wechatResps.strOpenId = itrOpenId->second;
+	if (itrTradeType != mapNotify.end())
+		wechatResps.strTradeType = itrTradeType->second;
+	if (itrBankType != mapNotify.end())
+		wechatResps.strBankType = itrBankType->second;
+	if (itrTotalFee != mapNotify.end())
+		wechatResps.strTotalFee = itrTotalFee->second;
+	if (itrCashFee != mapNotify.end())
+		wechatResps.strCashFee = itrCashFee->second;
+	if (itrTransactionId != mapNotify.end())
+		wechatResps.strTransactionId = itrTransactionId->second;
+	if (itrTimeEnd != mapNotify.end())
+		wechatResps.strTimeEnd = itrTimeEnd->second;
+	m_pOrderCache->put(CWeChatOrderCache::makeKey(m_strMchId, wechatResps.strOutTradeNo), wechatResps);
+	return iVerifyRet;
+}
+
+//request bodies are <xml> with one cdata element per field, written straight into the request
+//instead of through tinyxml nodes and a printer
+static void beginXml(string& strXml, size_t iReserve)
+{
+	strXml.clear();
+	strXml.reserve(iReserve);
+	strXml += "<" WECHAT_XML_ROOT ">";
+}
+
+static void addXmlChild(string& strXml, boost::string_view key, boost::string_view value)
+{
+	strXml += '<';
+	strXml.append(key.data(), key.size());
+	strXml += "><![CDATA[";
+	//a literal ]]> would close the section, split it across two
+	size_t iPos = 0;
+	for (size_t iEnd = value.find("]]>"); iEnd != boost::string_view::npos; iEnd = value.find("]]>", iPos))
+	{
+		strXml.append(value.data() + iPos, iEnd + 2 - iPos);
+		strXml += "]]><![CDATA[";
+		iPos = iEnd + 2;
+	}
+	strXml.append(value.data() + iPos, value.size() - iPos);
+	strXml += "]]></";
+	strXml.append(key.data(), key.size());
+	strXml += '>';
+}
+
+static void endXml(string& strXml)
+{
+	strXml += "</" WECHAT_XML_ROOT ">";
 }
 
-static void addXmlChild(TiXmlElement* pRoot, const string& key, const string& value)
+static void countWeChatError(const CWeChatError& e)
 {
-	TiXmlText* pValue = new TiXmlText(value.c_str());
-	pValue->SetCDATA(true);
-	TiXmlElement* pKey = new TiXmlElement(key.c_str());
-	pKey->LinkEndChild(pValue);
-	pRoot->LinkEndChild(pKey);
+	if (CPayMetricsScope::current() == nullptr)
+		return;
+
+	switch (e.getErrorCode())
+	{
+	case WECHAT_RET_NETWORK_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_NETWORK, CUtils::i2str(e.getNetWorkCode()));
+		break;
+	case WECHAT_RET_PARSE_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_PARSE, "");
+		break;
+	case WECHAT_RET_VERIFY_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_VERIFY, "");
+		break;
+	case WECHAT_RET_ERR_CODE_ERROR:
+	case WECHAT_RET_RET_MSG_ERROR:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_SUB_CODE, e.getErrInfo());
+		break;
+	case WECHAT_RET_MISSING_CERT_INFO:
+	case WECHAT_RET_MISSING_APP_SECRET:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_CONFIG, "");
+		break;
+	case WECHAT_RET_CIRCUIT_OPEN:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_CIRCUIT_OPEN, "");
+		break;
+	case WECHAT_RET_RATE_LIMITED:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_RATE_LIMITED, "");
+		break;
+	case WECHAT_RET_REFUND_EXCEEDED:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_REFUND_EXCEEDED, "");
+		break;
+	default:
+		CPayMetricsScope::countError(PAY_ERROR_CLASS_UNKNOW, "");
+		break;
+	}
 }
 
 CWeChat::CWeChat(
@@ -88,133 +237,503 @@ CWeChat::CWeChat(
 	m_strCertPath(strCertPath),
 	m_strKeyPath(strKeyPath)
 {
+	if (!m_strCertPath.empty() && !m_strKeyPath.empty())
+		m_pClientCert = CHttpClientCert::get(m_strCertPath, m_strKeyPath);
+
+	//the refund notify key is the lowercase hex md5 of the mch key
+	unsigned char keyDigest[16];
+	Md5Utils md5;
+	md5.encStr16(m_strMchKey.data(), (unsigned int)m_strMchKey.size(), keyDigest);
+	m_pRefundNotifyCipher = CPayAes256Ecb::get(CPayHex::encode(keyDigest, sizeof(keyDigest)));
+
+	const char* hrefs[] = { WECHAT_HREF_SMALL_PROGRAM_LOGIN, WECHAT_HREF_PREPAY, WECHAT_HREF_QUERY, WECHAT_HREF_REFUND };
+	for (const char* szHref : hrefs)
+		m_mapCircuitBreakers[szHref] = CPayCircuitBreaker::get(szHref);
+
+	//login is limited per app, pay apis per merchant
+	m_mapRateLimiters[WECHAT_METHOD_SMALL_PROGRAM_LOGIN] =
+		CPayRateLimiter::get(CPayRateLimiter::makeKey(m_strAppId, WECHAT_METHOD_SMALL_PROGRAM_LOGIN));
+	const char* methods[] = { WECHAT_METHOD_PREPAY, WECHAT_METHOD_QUERY, WECHAT_METHOD_REFUND, WECHAT_METHOD_DOWNLOAD_BILL };
+	for (const char* szMethod : methods)
+		m_mapRateLimiters[szMethod] = CPayRateLimiter::get(CPayRateLimiter::makeKey(m_strMchId, szMethod));
+
+	m_setThrottleCodes.insert(WECHAT_ERR_CODE_FREQUENCY_LIMITED);
+}
+
+void CWeChat::setRateLimit(const string& strMethod, const CPayRateLimit& rateLimit)
+{
+	CPayRateLimiter* pRateLimiter = getRateLimiter(strMethod);
+	if (pRateLimiter)
+		pRateLimiter->configure(rateLimit);
 }
 
-void CWeChat::sendReqAndParseResps(
-	const string& strReq,
-	const string& strHref,
-	ParseFunc func,
-	bool bPostWithCert /*= false*/
-)
+void CWeChat::setThrottleCodes(const vector<string>& vecErrCodes)
 {
-	string strResps("");
-	int iNetWorkRet = 0;
-	if (bPostWithCert)
+	m_setThrottleCodes = set<string>(vecErrCodes.begin(), vecErrCodes.end());
+}
+
+CPayRateLimiter* CWeChat::getRateLimiter(const string& strMethod) const
+{
+	auto itr = m_mapRateLimiters.find(strMethod);
+	return itr != m_mapRateLimiters.end() ? itr->second : nullptr;
+}
+
+CPayCircuitBreaker* CWeChat::getCircuitBreaker(const string& strHref) const
+{
+	auto itr = m_mapCircuitBreakers.find(strHref);
+	return itr != m_mapCircuitBreakers.end() ? itr->second : nullptr;
+}
+
+using CWeChatFlight = CPaySingleFlight<CWeChatResps, CWeChatError>;
+
+//only a definite answer of the gateway closes a journaled operation
+static CPayJournalOutcome journalOutcome(const boost::optional<CWeChatError>& error)
+{
+	if (!error)
+		return PAY_JOURNAL_SUCCEEDED;
+	switch (error->getErrorCode())
 	{
-		if (m_strCertPath.empty() || m_strKeyPath.empty())
-		{
-			throw CWeChatError(WECHAT_RET_MISSING_CERT_INFO);
-		}
-		iNetWorkRet = CHttpClient::postWithCert(strHref, strReq, m_strCertPath, m_strKeyPath, strResps);
+	case WECHAT_RET_ERR_CODE_ERROR:
+		//the gateway itself does not know yet
+		return error->getErrInfo() == WECHAT_ERR_CODE_SYSTEM_ERROR ? PAY_JOURNAL_UNKNOWN : PAY_JOURNAL_FAILED;
+	case WECHAT_RET_RET_MSG_ERROR:
+	case WECHAT_RET_MISSING_CERT_INFO:
+	case WECHAT_RET_CIRCUIT_OPEN:
+	case WECHAT_RET_RATE_LIMITED:
+		return PAY_JOURNAL_FAILED;
+	default:
+		return PAY_JOURNAL_UNKNOWN;
 	}
-	else
+}
+
+static bool setWeChatError(boost::optional<CWeChatError>& error, CWeChatError&& e)
+{
+	countWeChatError(e);
+	error = std::move(e);
+	return false;
+}
+
+//the xml + md5 side of CPayGateway. ops name the url, the rate limiter and whether the mch cert is needed
+struct SAPay::CWeChatCodec
+{
+	using CClient = CWeChat;
+	using CError = CWeChatError;
+
+	//fields are views into pContext->strResps, held in the call's arena
+	struct CMessage
+	{
+		CMessage() :fields(arenaScope.resource()) {}
+
+		CPayArenaScope arenaScope;
+		CPayXmlFields fields;
+	};
+
+	static const CWeChatRet RET_RATE_LIMITED = WECHAT_RET_RATE_LIMITED;
+	static const CWeChatRet RET_CIRCUIT_OPEN = WECHAT_RET_CIRCUIT_OPEN;
+	static const CWeChatRet RET_NETWORK_ERROR = WECHAT_RET_NETWORK_ERROR;
+	static const CWeChatRet RET_PARSE_ERROR = WECHAT_RET_PARSE_ERROR;
+
+	static bool fail(boost::optional<CWeChatError>& error, CWeChatError&& e)
 	{
-		iNetWorkRet = CHttpClient::post(strHref, strReq, strResps);;
+		return setWeChatError(error, std::move(e));
 	}
 
-	if (iNetWorkRet)
+	template<typename TOp>
+	static bool makeAttempt(
+		const CWeChat& wechat,
+		const CPayContextPtr& pContext,
+		int iTimeOut,
+		CPayHttpAttempt& attempt,
+		boost::optional<CWeChatError>& error
+	)
 	{
-		throw CWeChatError(WECHAT_RET_NETWORK_ERROR, strReq, strResps, iNetWorkRet);
+		string strHref = TOp::href();
+		if (!TOp::withCert())
+		{
+			attempt = [strHref, pContext, iTimeOut](string& strAttemptResps, CHttpTimings* pTimings, const CHttpHedge* pHedge)
+			{
+				return CHttpClient::post(strHref, pContext->strReq, strAttemptResps, nullptr,
+					iTimeOut, vector<string>(), pTimings, pHedge);
+			};
+			return true;
+		}
+
+		if (!wechat.m_pClientCert)
+		{
+			return fail(error, CWeChatError(WECHAT_RET_MISSING_CERT_INFO));
+		}
+		std::shared_ptr<CHttpClientCert> pClientCert = wechat.m_pClientCert;
+		string strCertPath = wechat.m_strCertPath, strKeyPath = wechat.m_strKeyPath;
+		attempt = [strHref, pClientCert, strCertPath, strKeyPath, pContext, iTimeOut](string& strAttemptResps, CHttpTimings* pTimings, const CHttpHedge* pHedge)
+		{
+			std::shared_ptr<const CHttpCertData> pCert = pClientCert->current();
+			if (!pCert)
+			{
+				//unreadable at load time, let curl report why
+				return CHttpClient::postWithCert(strHref, pContext->strReq, strCertPath, strKeyPath, strAttemptResps, nullptr,
+					iTimeOut, vector<string>(), pTimings, pHedge);
+			}
+			return CHttpClient::postWithCert(strHref, pContext->strReq, *pCert, strAttemptResps, nullptr,
+				iTimeOut, vector<string>(), pTimings, pHedge);
+		};
+		return true;
 	}
 
-	map<string, string> mapResps;
-	parseWechatRespsAndNotify(strResps, mapResps);
-	auto itrReturnCode = mapResps.find(WECHAT_RESPS_RETURN_CODE);
-	auto itrResultCode = mapResps.find(WECHAT_RESPS_RESULT_CODE);
-	if (itrReturnCode == mapResps.end() ||
-		itrResultCode == mapResps.end() ||
-		itrReturnCode->second != "SUCCESS" ||
-		itrResultCode->second != "SUCCESS")
+	static const CPayRetryPolicy& getRetryPolicy(const CWeChat& wechat) { return wechat.m_retryPolicy; }
+
+	template<typename TOp>
+	static CPayCircuitBreaker* getCircuitBreaker(const CWeChat& wechat) { return wechat.getCircuitBreaker(TOp::href()); }
+
+	template<typename TOp>
+	static CPayRateLimiter* getRateLimiter(const CWeChat& wechat) { return wechat.getRateLimiter(TOp::method()); }
+
+	//return_code, result_code, then the sign
+	template<typename TOp>
+	static bool decode(
+		const CWeChat& wechat,
+		const CPayContextPtr& pContext,
+		CPayRateLimiter* pRateLimiter,
+		CMessage& message,
+		boost::optional<CWeChatError>& error
+	)
 	{
-		auto itrErrCode = mapResps.find(WECHAT_RESPS_ERR_CODE);
-		auto itrReturnMsg = mapResps.find(WECHAT_RESPS_RETURN_MSG);
-		if (itrErrCode != mapResps.end())
+		CPayXmlFields& fields = message.fields;
+		{
+			CPayPhaseTimer parseTimer(PAY_PHASE_PARSE);
+			//read where it was received, the resps stays intact for the error context
+			fields.parse(pContext->strResps.data(), pContext->strResps.size());
+		}
+		boost::string_view returnCode, resultCode;
+		if (!fields.find(WECHAT_RESPS_RETURN_CODE, returnCode) ||
+			!fields.find(WECHAT_RESPS_RESULT_CODE, resultCode) ||
+			returnCode != "SUCCESS" ||
+			resultCode != "SUCCESS")
 		{
-			throw CWeChatError(WECHAT_RET_ERR_CODE_ERROR, strReq, strResps, itrErrCode->second);
+			boost::string_view errCode, returnMsg;
+			if (fields.find(WECHAT_RESPS_ERR_CODE, errCode))
+			{
+				string strErrCode = errCode.to_string();
+				if (pRateLimiter && wechat.m_setThrottleCodes.count(strErrCode))
+					pRateLimiter->onThrottled();
+				return fail(error, CWeChatError(WECHAT_RET_ERR_CODE_ERROR, pContext, strErrCode));
+			}
+			else if (fields.find(WECHAT_RESPS_RETURN_MSG, returnMsg))
+			{
+				return fail(error, CWeChatError(WECHAT_RET_RET_MSG_ERROR, pContext, returnMsg.to_string()));
+			}
+			else
+			{
+				return fail(error, CWeChatError(WECHAT_RET_UNKNOW_ERROR, pContext));
+			}
 		}
-		else if (itrReturnMsg != mapResps.end())
+
+		if (pRateLimiter)
+			pRateLimiter->onSuccess();
+
+		int iVerifyRet = 0;
 		{
-			throw CWeChatError(WECHAT_RET_RET_MSG_ERROR, strReq, strResps, itrReturnMsg->second);
+			CPayPhaseTimer verifyTimer(PAY_PHASE_VERIFY);
+			iVerifyRet = verifyMd5Sign(fields.begin(), fields.end(), wechat.m_strMchKey);
 		}
-		else
+		if (iVerifyRet < 0)
 		{
-			throw CWeChatError(WECHAT_RET_UNKNOW_ERROR, strReq, strResps);
+			return fail(error, CWeChatError(WECHAT_RET_VERIFY_ERROR, pContext));
 		}
+
+		return true;
 	}
 
-	if (verifyWechatRespsAndNotify(mapResps, m_strMchKey) < 0)
+	static const CPayXmlFields& content(const CMessage& message) { return message.fields; }
+};
+
+struct CWeChatQueryOp
+{
+	static const char* href() { return WECHAT_HREF_QUERY; }
+	static const char* method() { return WECHAT_METHOD_QUERY; }
+	static CPayIdempotency idempotency() { return PAY_CALL_READ_ONLY; }
+	static bool withCert() { return false; }
+	static bool parse(const CPayXmlFields& fields, CWeChatResps& wechatResps);
+};
+
+//the same out_refund_no is refunded once
+struct CWeChatRefundOp
+{
+	static const char* href() { return WECHAT_HREF_REFUND; }
+	static const char* method() { return WECHAT_METHOD_REFUND; }
+	static CPayIdempotency idempotency() { return PAY_CALL_IDEMPOTENT; }
+	static bool withCert() { return true; }
+	static bool parse(const CPayXmlFields& fields, CWeChatResps& wechatResps);
+};
+
+struct CWeChatPrepayOp
+{
+	static const char* href() { return WECHAT_HREF_PREPAY; }
+	static const char* method() { return WECHAT_METHOD_PREPAY; }
+	static CPayIdempotency idempotency() { return PAY_CALL_NON_IDEMPOTENT; }
+	static bool withCert() { return false; }
+	static bool parse(const CPayXmlFields& fields, CWeChatResps& wechatResps);
+};
+
+using CWeChatGateway = CPayGateway<CWeChatCodec>;
+
+void CWeChat::queryPayStatus(
+	const string& strOutTradingCode, 
+	CWeChatResps& wechatResps,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
+)
+{
+	boost::optional<CWeChatError> error;
+	if (!doQueryPayStatus(strOutTradingCode, options, wechatResps, error))
+		throw *error;
+}
+
+CWeChatResult CWeChat::tryQueryPayStatus(
+	const string& strOutTradingCode,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
+)
+{
+	CWeChatResps wechatResps;
+	boost::optional<CWeChatError> error;
+	doQueryPayStatus(strOutTradingCode, options, wechatResps, error);
+	return CWeChatResult(std::move(wechatResps), std::move(error));
+}
+
+bool CWeChat::doQueryPayStatus(
+	const string& strOutTradingCode,
+	const CWeChatCallOptions& options,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
+)
+{
+	//transient buffers of the whole call, from the caller's resource if it passed one
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	auto fetch = [this, &strOutTradingCode, &options](CWeChatResps& resps, boost::optional<CWeChatError>& err)
+	{
+		return fetchPayStatus(strOutTradingCode, options, resps, err);
+	};
+	bool bRet = false;
+	if (m_pOrderCache)
+		bRet = m_pOrderCache->getOrLoad(CWeChatOrderCache::makeKey(m_strMchId, strOutTradingCode), wechatResps, error, fetch);
+	else
 	{
-		throw CWeChatError(WECHAT_RET_VERIFY_ERROR, strReq, strResps);
+		//concurrent queries of the same order share one signed request
+		bRet = CWeChatFlight::shared().call(CWeChatFlight::makeKey(m_strMchId, WECHAT_METHOD_QUERY, strOutTradingCode), wechatResps, error, fetch);
 	}
 
-	func(strReq, strResps, mapResps);
+	//refunds of a paid order are checked against its total_fee from now on
+	long long llCaptured = 0;
+	if (bRet && m_pRefundLedger &&
+		(wechatResps.iTradeState == WECHAT_TRADE_STATE_SUCCESS || wechatResps.iTradeState == WECHAT_TRADE_STATE_REFUND) &&
+		parseFee(wechatResps.strTotalFee, llCaptured))
+	{
+		m_pRefundLedger->setCaptured(CPayRefundLedger::makeKey(m_strMchId, strOutTradingCode), llCaptured);
+	}
+	return bRet;
 }
 
-void CWeChat::queryPayStatus(
-	const string& strOutTradingCode, 
-	CWeChatResps& wechatResps
+bool CWeChat::fetchPayStatus(
+	const string& strOutTradingCode,
+	const CWeChatCallOptions& options,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
 )
 {
-	string strReq;
-	appendQueryStatusContent(strReq, strOutTradingCode);
-	sendReqAndParseResps(strReq, WECHAT_HREF_QUERY, bind(&CWeChat::parseQueryStatusResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &wechatResps));
+	CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_QUERY);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	pContext->iTimeOut = options.iTimeOut;
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendQueryStatusContent(pContext->strReq, strOutTradingCode);
+	}
+	return CWeChatGateway::call<CWeChatQueryOp>(*this, pContext, wechatResps, error);
+}
+
+static constexpr CPayField<CWeChatRespsTradeState> s_tradeStateFields[] = {
+	{ WECHAT_TRADE_STATE_SUCCESS_STR, WECHAT_TRADE_STATE_SUCCESS },
+	{ WECHAT_TRADE_STATE_REFUND_STR, WECHAT_TRADE_STATE_REFUND },
+	{ WECHAT_TRADE_STATE_NOTPAY_STR, WECHAT_TRADE_STATE_NOTPAY },
+	{ WECHAT_TRADE_STATE_CLOSED_STR, WECHAT_TRADE_STATE_CLOSED },
+	{ WECHAT_TRADE_STATE_REVOKED_STR, WECHAT_TRADE_STATE_REVOKED },
+	{ WECHAT_TRADE_STATE_USERPAYING_STR, WECHAT_TRADE_STATE_USERPAYING },
+	{ WECHAT_TRADE_STATE_PAYERROR_STR, WECHAT_TRADE_STATE_PAYERROR }
+};
+static constexpr auto s_tradeStates = makePayFieldTable<4>(s_tradeStateFields);
+static_assert(s_tradeStates.isPerfect(), "trade_state values collide, pick another seed");
+
+static constexpr CPayField<CWeChatRefundStatus> s_refundStatusFields[] = {
+	{ WECHAT_REFUND_STATUS_SUCCESS_STR, WECHAT_REFUND_STATUS_SUCCESS },
+	{ WECHAT_REFUND_STATUS_CHANGE_STR, WECHAT_REFUND_STATUS_CHANGE },
+	{ WECHAT_REFUND_STATUS_REFUNDCLOSE_STR, WECHAT_REFUND_STATUS_REFUNDCLOSE }
+};
+static constexpr auto s_refundStatuses = makePayFieldTable<3>(s_refundStatusFields);
+static_assert(s_refundStatuses.isPerfect(), "refund_status values collide, pick another seed");
+
+//query resps fields copied as they are, trade_state is parsed on its own
+static constexpr CPayField<string CWeChatResps::*> s_queryFields[] = {
+	{ WECHAT_RESPS_OPEN_ID, &CWeChatResps::strOpenId },
+	{ WECHAT_RESPS_TRADE_TYPE, &CWeChatResps::strTradeType },
+	{ WECHAT_RESPS_BANK_TYPE, &CWeChatResps::strBankType },
+	{ WECHAT_RESPS_TOTAL_FEE, &CWeChatResps::strTotalFee },
+	{ WECHAT_RESPS_CASH_FEE, &CWeChatResps::strCashFee },
+	{ WECHAT_RESPS_TRANSACTION_ID, &CWeChatResps::strTransactionId },
+	{ WECHAT_RESPS_OUT_TRADE_NO, &CWeChatResps::strOutTradeNo },
+	{ WECHAT_RESPS_TIME_END, &CWeChatResps::strTimeEnd },
+	{ WECHAT_RESPS_TRADE_STATE_DESC, &CWeChatResps::strTradeStateDesc }
+};
+static constexpr auto s_queryRespsFields = makePayFieldTable<4>(s_queryFields);
+static_assert(s_queryRespsFields.isPerfect(), "query resps fields collide, pick another seed");
+
+enum CRefundReqInfoField
+{
+	REFUND_FIELD_TRANSACTION_ID,
+	REFUND_FIELD_OUT_TRADE_NO,
+	REFUND_FIELD_REFUND_ID,
+	REFUND_FIELD_OUT_REFUND_NO,
+	REFUND_FIELD_TOTAL_FEE,
+	REFUND_FIELD_SETTLEMENT_TOTAL_FEE,
+	REFUND_FIELD_REFUND_FEE,
+	REFUND_FIELD_SETTLEMENT_REFUND_FEE,
+	REFUND_FIELD_REFUND_STATUS,
+	REFUND_FIELD_SUCCESS_TIME,
+	REFUND_FIELD_REFUND_RECV_ACCOUT,
+	REFUND_FIELD_REFUND_ACCOUNT,
+	REFUND_FIELD_REFUND_REQUEST_SOURCE
+};
+
+static constexpr CPayField<CRefundReqInfoField> s_refundReqInfoFields[] = {
+	{ WECHAT_REFUND_NOTIFY_TRANSACTION_ID, REFUND_FIELD_TRANSACTION_ID },
+	{ WECHAT_REFUND_NOTIFY_OUT_TRADE_NO, REFUND_FIELD_OUT_TRADE_NO },
+	{ WECHAT_REFUND_NOTIFY_REFUND_ID, REFUND_FIELD_REFUND_ID },
+	{ WECHAT_REFUND_NOTIFY_OUT_REFUND_NO, REFUND_FIELD_OUT_REFUND_NO },
+	{ WECHAT_REFUND_NOTIFY_TOTAL_FEE, REFUND_FIELD_TOTAL_FEE },
+	{ WECHAT_REFUND_NOTIFY_SETTLEMENT_TOTAL_FEE, REFUND_FIELD_SETTLEMENT_TOTAL_FEE },
+	{ WECHAT_REFUND_NOTIFY_REFUND_FEE, REFUND_FIELD_REFUND_FEE },
+	{ WECHAT_REFUND_NOTIFY_SETTLEMENT_REFUND_FEE, REFUND_FIELD_SETTLEMENT_REFUND_FEE },
+	{ WECHAT_REFUND_NOTIFY_REFUND_STATUS, REFUND_FIELD_REFUND_STATUS },
+	{ WECHAT_REFUND_NOTIFY_SUCCESS_TIME, REFUND_FIELD_SUCCESS_TIME },
+	{ WECHAT_REFUND_NOTIFY_REFUND_RECV_ACCOUT, REFUND_FIELD_REFUND_RECV_ACCOUT },
+	{ WECHAT_REFUND_NOTIFY_REFUND_ACCOUNT, REFUND_FIELD_REFUND_ACCOUNT },
+	{ WECHAT_REFUND_NOTIFY_REFUND_REQUEST_SOURCE, REFUND_FIELD_REFUND_REQUEST_SOURCE }
+};
+static constexpr auto s_refundReqInfo = makePayFieldTable<5>(s_refundReqInfoFields, 0x811c9dccu);
+static_assert(s_refundReqInfo.isPerfect(), "req_info fields collide, pick another seed");
+
+CWeChatRespsTradeState CWeChat::parseTradeState(const string& strTradeState)
+{
+	return s_tradeStates.find(strTradeState, WECHAT_TRADE_STATE_UNKNOW);
 }
 
-void CWeChat::parseQueryStatusResps(const string& strReq, const string& strResps, map<string, string>& mapResps, CWeChatResps* pWechatResps)
+//req_info is <root> with one element per field, values in cdata
+static bool parseRefundReqInfo(const string& strReqInfo, CWeChatRefundNotify& refundNotify)
 {
-	CWeChatResps& wechatResps = *pWechatResps;
-	auto itrTradeState = mapResps.find(WECHAT_RESPS_TRADE_STATE);
+	CPayArenaScope arenaScope;
+	CPayXmlFields fields(arenaScope.resource());
+	if (strReqInfo.empty() || !fields.parse(strReqInfo.data(), strReqInfo.size()))
+		return false;
 
-	if (itrTradeState == mapResps.end())
+	bool bHasRefundFee = false;
+	for (auto itr = fields.begin(); itr != fields.end(); ++itr)
 	{
-		throw CWeChatError(WECHAT_RET_PARSE_ERROR, strReq, strResps);
+		CRefundReqInfoField iField;
+		if (!s_refundReqInfo.find(itr->first, iField))
+			continue;
+
+		boost::string_view value = itr->second;
+		switch (iField)
+		{
+		case REFUND_FIELD_TRANSACTION_ID: refundNotify.strTransactionId = value.to_string(); break;
+		case REFUND_FIELD_OUT_TRADE_NO: refundNotify.strOutTradeNo = value.to_string(); break;
+		case REFUND_FIELD_REFUND_ID: refundNotify.strRefundId = value.to_string(); break;
+		case REFUND_FIELD_OUT_REFUND_NO: refundNotify.strOutRefundNo = value.to_string(); break;
+		case REFUND_FIELD_TOTAL_FEE: parseFee(value, refundNotify.llTotalFee); break;
+		case REFUND_FIELD_SETTLEMENT_TOTAL_FEE: parseFee(value, refundNotify.llSettlementTotalFee); break;
+		case REFUND_FIELD_REFUND_FEE: bHasRefundFee = parseFee(value, refundNotify.llRefundFee); break;
+		case REFUND_FIELD_SETTLEMENT_REFUND_FEE: parseFee(value, refundNotify.llSettlementRefundFee); break;
+		case REFUND_FIELD_REFUND_STATUS: refundNotify.iRefundStatus = s_refundStatuses.find(value, WECHAT_REFUND_STATUS_UNKNOW); break;
+		case REFUND_FIELD_SUCCESS_TIME: refundNotify.strSuccessTime = value.to_string(); break;
+		case REFUND_FIELD_REFUND_RECV_ACCOUT: refundNotify.strRefundRecvAccout = value.to_string(); break;
+		case REFUND_FIELD_REFUND_ACCOUNT: refundNotify.strRefundAccount = value.to_string(); break;
+		case REFUND_FIELD_REFUND_REQUEST_SOURCE: refundNotify.strRefundRequestSource = value.to_string(); break;
+		}
 	}
 
-	if (itrTradeState->second == WECHAT_TRADE_STATE_SUCCESS_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_SUCCESS;
-	else if (itrTradeState->second == WECHAT_TRADE_STATE_REFUND_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_REFUND;
-	else if (itrTradeState->second == WECHAT_TRADE_STATE_NOTPAY_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_NOTPAY;
-	else if (itrTradeState->second == WECHAT_TRADE_STATE_CLOSED_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_CLOSED;
-	else if (itrTradeState->second == WECHAT_TRADE_STATE_REVOKED_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_REVOKED;
-	else if (itrTradeState->second == WECHAT_TRADE_STATE_USERPAYING_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_USERPAYING;
-	else if (itrTradeState->second == WECHAT_TRADE_STATE_PAYERROR_STR)
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_PAYERROR;
-	else
-		wechatResps.iTradeState = WECHAT_TRADE_STATE_UNKNOW;
-
-	auto itrOpenId = mapResps.find(WECHAT_RESPS_OPEN_ID);
-	auto itrTradeType = mapResps.find(WECHAT_RESPS_TRADE_TYPE);
-	auto itrBankType = mapResps.find(WECHAT_RESPS_BANK_TYPE);
-	auto itrTotalFee = mapResps.find(WECHAT_RESPS_TOTAL_FEE);
-	auto itrCashFee = mapResps.find(WECHAT_RESPS_CASH_FEE);
-	auto itrTransactionId = mapResps.find(WECHAT_RESPS_TRANSACTION_ID);
-	auto itrOutTradeNo = mapResps.find(WECHAT_RESPS_OUT_TRADE_NO);
-	auto itrTimeEnd = mapResps.find(WECHAT_RESPS_TIME_END);
-	auto itrTradeStateDesc = mapResps.find(WECHAT_RESPS_TRADE_STATE_DESC);
-
-	if (itrOpenId != mapResps.end())
-		wechatResps.strOpenId = itrOpenId->second;
-	if (itrTradeType != mapResps.end())
-		wechatResps.strTradeType = itrTradeType->second;
-	if (itrBankType != mapResps.end())
-		wechatResps.strBankType = itrBankType->second;
-	if (itrTotalFee != mapResps.end())
-		wechatResps.strTotalFee = itrTotalFee->second;
-	if (itrCashFee != mapResps.end())
-		wechatResps.strCashFee = itrCashFee->second;
-	if (itrTransactionId != mapResps.end())
-		wechatResps.strTransactionId = itrTransactionId->second;
-	if (itrOutTradeNo != mapResps.end())
-		wechatResps.strOutTradeNo = itrOutTradeNo->second;
-	if (itrTimeEnd != mapResps.end())
-		wechatResps.strTimeEnd = itrTimeEnd->second;
-	if (itrTradeStateDesc != mapResps.end())
-		wechatResps.strTradeStateDesc = itrTradeStateDesc->second;
+	return bHasRefundFee &&
+		!refundNotify.strOutTradeNo.empty() &&
+		!refundNotify.strOutRefundNo.empty() &&
+		refundNotify.iRefundStatus != WECHAT_REFUND_STATUS_UNKNOW;
+}
+
+int CWeChat::decryptRefundNotify(const string& strNotify, CWeChatRefundNotify& refundNotify)
+{
+	map<string, string> mapNotify;
+	parseWechatRespsAndNotify(strNotify, mapNotify);
+
+	auto itrReturnCode = mapNotify.find(WECHAT_NOTIFY_RETURN_CODE);
+	auto itrMchId = mapNotify.find(WECHAT_NOTIFY_MCH_ID);
+	auto itrReqInfo = mapNotify.find(WECHAT_NOTIFY_REQ_INFO);
+	if (itrReturnCode == mapNotify.end() ||
+		itrReqInfo == mapNotify.end() ||
+		itrReturnCode->second != "SUCCESS")
+	{
+		return -1;
+	}
+	if (itrMchId != mapNotify.end() && itrMchId->second != m_strMchId)
+		return -1;
+
+	//base64 and aes both run over the one buffer
+	const string& strReqInfo = itrReqInfo->second;
+	size_t iEncryptedSize = CPayBase64::getDecodedSize(strReqInfo.data(), strReqInfo.size());
+	if (iEncryptedSize == 0)
+		return -1;
+	vector<unsigned char> vecEncrypted(iEncryptedSize);
+	string strPlain;
+	if (!CPayBase64::decode(strReqInfo.data(), strReqInfo.size(), vecEncrypted.data()) ||
+		!m_pRefundNotifyCipher->decrypt(vecEncrypted.data(), vecEncrypted.size(), strPlain) ||
+		!parseRefundReqInfo(strPlain, refundNotify))
+	{
+		return -1;
+	}
+
+	auto itrAppId = mapNotify.find(WECHAT_NOTIFY_APP_ID);
+	if (itrAppId != mapNotify.end())
+		refundNotify.strAppId = itrAppId->second;
+	refundNotify.strMchId = m_strMchId;
+
+	string strLedgerKey = CPayRefundLedger::makeKey(m_strMchId, refundNotify.strOutTradeNo);
+	if (refundNotify.iRefundStatus == WECHAT_REFUND_STATUS_SUCCESS)
+	{
+		if (m_pRefundLedger && refundNotify.llTotalFee > 0)
+			m_pRefundLedger->setCaptured(strLedgerKey, refundNotify.llTotalFee);
+		if (m_pRefundLedger)
+			m_pRefundLedger->commit(strLedgerKey, refundNotify.strOutRefundNo, refundNotify.llRefundFee);
+		if (m_pOrderCache)
+			m_pOrderCache->erase(CWeChatOrderCache::makeKey(m_strMchId, refundNotify.strOutTradeNo));
+	}
+	else if (refundNotify.iRefundStatus == WECHAT_REFUND_STATUS_REFUNDCLOSE && m_pRefundLedger)
+	{
+		m_pRefundLedger->release(strLedgerKey, refundNotify.strOutRefundNo);
+	}
+	return 1;
+}
+
+bool CWeChatQueryOp::parse(const CPayXmlFields& fields, CWeChatResps& wechatResps)
+{
+	boost::string_view tradeState;
+	if (!fields.find(WECHAT_RESPS_TRADE_STATE, tradeState))
+	{
+		return false;
+	}
+
+	wechatResps.iTradeState = s_tradeStates.find(tradeState, WECHAT_TRADE_STATE_UNKNOW);
+
+	//one pass over the resps, each name finds its member in one probe
+	string CWeChatResps::* pField = nullptr;
+	for (auto itr = fields.begin(); itr != fields.end(); ++itr)
+	{
+		if (s_queryRespsFields.find(itr->first, pField))
+			(wechatResps.*pField).assign(itr->second.data(), itr->second.size());
+	}
+	return true;
 }
 
 void CWeChat::refund(
@@ -224,26 +743,207 @@ void CWeChat::refund(
 	const string& strOutRefundNo,
 	CWeChatResps& wechatResps,
 	const string& strRemarks /*= ""*/,
-	const string& strCallBackAddr /*= ""*/
+	const string& strCallBackAddr /*= ""*/,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
+)
+{
+	boost::optional<CWeChatError> error;
+	if (!doRefund(iTotalAmount, iRefundAmount, strOutTradeNo, strOutRefundNo, strRemarks, strCallBackAddr, options, wechatResps, error))
+		throw *error;
+}
+
+CWeChatResult CWeChat::tryRefund(
+	int iTotalAmount,
+	int iRefundAmount,
+	const string& strOutTradeNo,
+	const string& strOutRefundNo,
+	const string& strRemarks /*= ""*/,
+	const string& strCallBackAddr /*= ""*/,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
 )
 {
-	string strReq;
-	appendRefundContent(strReq, iTotalAmount, iRefundAmount, strOutTradeNo, strOutRefundNo, strRemarks, strCallBackAddr);
-	sendReqAndParseResps(strReq, WECHAT_HREF_REFUND, bind(&CWeChat::parseRefundResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &wechatResps), true);
+	CWeChatResps wechatResps;
+	boost::optional<CWeChatError> error;
+	doRefund(iTotalAmount, iRefundAmount, strOutTradeNo, strOutRefundNo, strRemarks, strCallBackAddr, options, wechatResps, error);
+	return CWeChatResult(std::move(wechatResps), std::move(error));
 }
 
-void CWeChat::parseRefundResps(const string& strReq, const string& strResps, map<string, string>& mapResps, CWeChatResps* pWechatResps)
+bool CWeChat::doRefund(
+	int iTotalAmount,
+	int iRefundAmount,
+	const string& strOutTradeNo,
+	const string& strOutRefundNo,
+	const string& strRemarks,
+	const string& strCallBackAddr,
+	const CWeChatCallOptions& options,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
+)
 {
-	CWeChatResps& wechatResps = *pWechatResps;
-	auto itrRefundId = mapResps.find(WECHAT_RESPS_REFUND_ID);
-	auto itrRefundFee = mapResps.find(WECHAT_RESPS_REFUND_FEE);
-	if (itrRefundId == mapResps.end() || itrRefundFee == mapResps.end())
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_REFUND);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	pContext->iTimeOut = options.iTimeOut;
+	string strLedgerKey = CPayRefundLedger::makeKey(m_strMchId, strOutTradeNo);
+	//the caller's total_fee is not trusted as the captured amount, an untracked order goes to the gateway unchecked
+	if (m_pRefundLedger && m_pRefundLedger->reserve(strLedgerKey, strOutRefundNo, iRefundAmount) == PAY_REFUND_EXCEEDED)
+		return setWeChatError(error, CWeChatError(WECHAT_RET_REFUND_EXCEEDED, pContext));
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendRefundContent(pContext->strReq, iTotalAmount, iRefundAmount, strOutTradeNo, strOutRefundNo, strRemarks, strCallBackAddr);
+	}
+	unsigned long long llJournalId = m_pJournal ? m_pJournal->begin(PAY_PROVIDER_WECHAT, PAY_OP_REFUND, m_strMchId, strOutTradeNo, strOutRefundNo) : 0;
+	bool bRet = CWeChatGateway::call<CWeChatRefundOp>(*this, pContext, wechatResps, error);
+	CPayJournalOutcome iOutcome = journalOutcome(error);
+	if (m_pJournal)
+		m_pJournal->end(llJournalId, iOutcome);
+
+	//an unknown outcome keeps the reservation until a retry with the same out_refund_no settles it
+	long long llCaptured = 0;
+	if (m_pRefundLedger && iOutcome == PAY_JOURNAL_SUCCEEDED)
+	{
+		//total_fee in the answer is the gateway's, unlike the one sent
+		if (parseFee(wechatResps.strTotalFee, llCaptured))
+			m_pRefundLedger->setCaptured(strLedgerKey, llCaptured);
+		m_pRefundLedger->commit(strLedgerKey, strOutRefundNo, iRefundAmount);
+	}
+	else if (m_pRefundLedger && iOutcome == PAY_JOURNAL_FAILED)
+	{
+		//a gateway answer settles earlier in doubt sends of the number too, a send that never left drops only its own hold
+		if (error->getErrorCode() == WECHAT_RET_ERR_CODE_ERROR || error->getErrorCode() == WECHAT_RET_RET_MSG_ERROR)
+			m_pRefundLedger->release(strLedgerKey, strOutRefundNo);
+		else
+			m_pRefundLedger->cancel(strLedgerKey, strOutRefundNo);
+	}
+
+	//the trade moves to REFUND
+	if (bRet && m_pOrderCache)
+		m_pOrderCache->erase(CWeChatOrderCache::makeKey(m_strMchId, strOutTradeNo));
+	return bRet;
+}
+
+bool CWeChatRefundOp::parse(const CPayXmlFields& fields, CWeChatResps& wechatResps)
+{
+	boost::string_view refundId, refundFee, totalFee;
+	if (!fields.find(WECHAT_RESPS_REFUND_ID, refundId) || !fields.find(WECHAT_RESPS_REFUND_FEE, refundFee))
+	{
+		return false;
+	}
+
+	wechatResps.strRefundFee.assign(refundFee.data(), refundFee.size());
+	wechatResps.strRefundId.assign(refundId.data(), refundId.size());
+	if (fields.find(WECHAT_RESPS_TOTAL_FEE, totalFee))
+		wechatResps.strTotalFee.assign(totalFee.data(), totalFee.size());
+	return true;
+}
+
+void CWeChat::downloadBill(
+	const string& strBillDate,
+	const string& strBillType,
+	const CPayBillRowFunc& onRow
+)
+{
+	boost::optional<CWeChatError> error;
+	if (!doDownloadBill(strBillDate, strBillType, onRow, error))
+		throw *error;
+}
+
+CWeChatResult CWeChat::tryDownloadBill(const string& strBillDate, const string& strBillType, const CPayBillRowFunc& onRow)
+{
+	CWeChatResps wechatResps;
+	boost::optional<CWeChatError> error;
+	doDownloadBill(strBillDate, strBillType, onRow, error);
+	return CWeChatResult(std::move(wechatResps), std::move(error));
+}
+
+CPayBillColumns CWeChat::getBillColumns()
+{
+	//商户订单号, 订单金额, 商户退款单号, 申请退款金额
+	CPayBillColumns columns;
+	columns.iOutTradeNo = 6;
+	columns.iAmount = 24;
+	columns.iOutRefundNo = 15;
+	columns.iRefundAmount = 25;
+	return columns;
+}
+
+bool CWeChat::doDownloadBill(
+	const string& strBillDate,
+	const string& strBillType,
+	const CPayBillRowFunc& onRow,
+	boost::optional<CWeChatError>& error
+)
+{
+	CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_DOWNLOAD_BILL);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	{
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendDownloadBillContent(pContext->strReq, strBillDate, strBillType);
+	}
+
+	CPayRateLimiter* pRateLimiter = getRateLimiter(WECHAT_METHOD_DOWNLOAD_BILL);
+	if (pRateLimiter && !pRateLimiter->acquire())
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_RATE_LIMITED, pContext));
+	}
+
+	//a bill comes back as gzip, an error as a small plain xml kept in the context
+	CPayBillReader billReader(PAY_BILL_GZIP, onRow);
+	string& strResps = pContext->strResps;
+	bool bFirstChunk = true;
+	bool bPlain = false;
+	CHttpDataFunc onData = [&](const char* pData, size_t iLen)
 	{
-		throw CWeChatError(WECHAT_RET_MISSING_APP_SECRET, strReq, strResps);
+		if (bFirstChunk)
+		{
+			bFirstChunk = false;
+			bPlain = (unsigned char)pData[0] != 0x1f;
+		}
+		if (!bPlain)
+			return billReader.write(pData, iLen);
+		if (strResps.size() + iLen > WECHAT_BILL_MAX_ERROR_SIZE)
+			return false;
+		strResps.append(pData, iLen);
+		return true;
+	};
+
+	//rows may already be consumed, so no retry
+	CHttpTimings httpTimings;
+	bool bRecordTimings = CPayMetricsScope::current() != nullptr;
+	int iNetWorkRet = CHttpClient::download(WECHAT_HREF_DOWNLOAD_BILL, pContext->strReq, onData,
+		HTTPCLIENT_DOWNLOAD_TIME_OUT, bRecordTimings ? &httpTimings : nullptr);
+	if (bRecordTimings)
+		CPayMetrics::recordHttpTimings(httpTimings);
+
+	if (bPlain)
+	{
+		map<string, string> mapResps;
+		parseWechatRespsAndNotify(strResps, mapResps);
+		auto itrReturnMsg = mapResps.find(WECHAT_RESPS_RETURN_MSG);
+		if (itrReturnMsg != mapResps.end())
+		{
+			return setWeChatError(error, CWeChatError(WECHAT_RET_RET_MSG_ERROR, pContext, itrReturnMsg->second));
+		}
+		return setWeChatError(error, CWeChatError(WECHAT_RET_PARSE_ERROR, pContext));
+	}
+	if (billReader.isCorrupt())
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_PARSE_ERROR, pContext));
+	}
+	if (billReader.isStopped())
+		return true;
+	if (iNetWorkRet != 0)
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_NETWORK_ERROR, pContext, iNetWorkRet));
+	}
+	if (!billReader.finish() && billReader.isCorrupt())
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_PARSE_ERROR, pContext));
 	}
 
-	wechatResps.strRefundFee = itrRefundFee->second;
-	wechatResps.strRefundId = itrRefundId->second;
+	if (pRateLimiter)
+		pRateLimiter->onSuccess();
+	return true;
 }
 
 void CWeChat::smallProgramLogin(
@@ -251,33 +951,121 @@ void CWeChat::smallProgramLogin(
 	CWeChatResps& wechatResps
 )
 {
+	boost::optional<CWeChatError> error;
+	if (!doSmallProgramLogin(strJsCode, wechatResps, error))
+		throw *error;
+}
+
+CWeChatResult CWeChat::trySmallProgramLogin(const string& strJsCode)
+{
+	CWeChatResps wechatResps;
+	boost::optional<CWeChatError> error;
+	doSmallProgramLogin(strJsCode, wechatResps, error);
+	return CWeChatResult(std::move(wechatResps), std::move(error));
+}
+
+future<CWeChatResult> CWeChat::smallProgramLoginAsync(const string& strJsCode)
+{
+	//the task owns the client, a registry reload may drop every other owner first
+	std::shared_ptr<CWeChat> pSelf = shared_from_this();
+	return CPayExecutor::io().submit([pSelf, strJsCode]()
+	{
+		return pSelf->trySmallProgramLogin(strJsCode);
+	});
+}
+
+bool CWeChat::doSmallProgramLogin(
+	const string& strJsCode,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
+)
+{
+	//a resent js_code is rejected by the gateway, duplicates wait for the first login instead
+	return CWeChatFlight::shared().call(CWeChatFlight::makeKey(m_strAppId, WECHAT_METHOD_SMALL_PROGRAM_LOGIN, strJsCode), wechatResps, error,
+		[this, &strJsCode](CWeChatResps& resps, boost::optional<CWeChatError>& err)
+	{
+		if (!fetchSmallProgramLogin(strJsCode, resps, err))
+			return false;
+
+		if (m_pSessionStore)
+		{
+			CPaySession session;
+			session.strOpenId = resps.strOpenId;
+			session.strSessionKey = resps.strSessionKey;
+			m_pSessionStore->put(session);
+		}
+		return true;
+	});
+}
+
+bool CWeChat::fetchSmallProgramLogin(
+	const string& strJsCode,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
+)
+{
+	CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_LOGIN);
 	if (m_strAppSecret.empty())
 	{
-		throw CWeChatError(WECHAT_RET_MISSING_APP_SECRET);
+		return setWeChatError(error, CWeChatError(WECHAT_RET_MISSING_APP_SECRET));
 	}
 
-	string strReq;
-	appendSmallProgramLoginContent(strReq, strJsCode);
-	string strResps("");
-	int iNetWorkRet = CHttpClient::get(WECHAT_HREF_SMALL_PROGRAM_LOGIN + strReq, strResps);
-	if (iNetWorkRet)
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	string& strResps = pContext->strResps;
 	{
-		throw CWeChatError(WECHAT_RET_NETWORK_ERROR, strReq, strResps, iNetWorkRet);
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendSmallProgramLoginContent(pContext->strReq, strJsCode);
 	}
 
+	CPayRateLimiter* pRateLimiter = getRateLimiter(WECHAT_METHOD_SMALL_PROGRAM_LOGIN);
+	if (pRateLimiter && !pRateLimiter->acquire())
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_RATE_LIMITED, pContext));
+	}
+
+	//js_code is single use, never hedged and only resent when the request never left
+	CPayHttpAttempt attempt = [pContext](string& strAttemptResps, CHttpTimings* pTimings, const CHttpHedge* pHedge)
+	{
+		return CHttpClient::get(WECHAT_HREF_SMALL_PROGRAM_LOGIN + pContext->strReq, strAttemptResps,
+			HTTPCLIENT_DEFAULT_TOME_OUT, pTimings, pHedge);
+	};
+	CHttpTimings httpTimings;
+	bool bRecordTimings = CPayMetricsScope::current() != nullptr;
+	int iNetWorkRet = 0;
+	CPayCallRet iCallRet = CPayResilience::execute(m_retryPolicy, getCircuitBreaker(WECHAT_HREF_SMALL_PROGRAM_LOGIN), PAY_CALL_NON_IDEMPOTENT,
+		attempt, strResps, bRecordTimings ? &httpTimings : nullptr, iNetWorkRet);
+	if (iCallRet == PAY_CALL_CIRCUIT_OPEN)
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_CIRCUIT_OPEN, pContext));
+	}
+	if (bRecordTimings)
+		CPayMetrics::recordHttpTimings(httpTimings);
+	if (iCallRet != PAY_CALL_SUCCESS)
+	{
+		return setWeChatError(error, CWeChatError(WECHAT_RET_NETWORK_ERROR, pContext, iNetWorkRet));
+	}
+
+	//not in place, the resps stays intact for the error context
 	rapidjson::Document respsDocument;
-	respsDocument.Parse(strResps.c_str(), strResps.length());
+	{
+		CPayPhaseTimer parseTimer(PAY_PHASE_PARSE);
+		respsDocument.Parse(strResps.data(), strResps.size());
+	}
 	if (!respsDocument.IsObject() ||
 		!respsDocument.HasMember(WECHAT_RESPS_SESSION_KEY) ||
 		!respsDocument.HasMember(WECHAT_RESPS_OPEN_ID) ||
 		!respsDocument[WECHAT_RESPS_SESSION_KEY].IsString() ||
 		!respsDocument[WECHAT_RESPS_OPEN_ID].IsString())
 	{
-		throw CWeChatError(WECHAT_RET_PARSE_ERROR, strReq, strResps);
+		return setWeChatError(error, CWeChatError(WECHAT_RET_PARSE_ERROR, pContext));
 	}
 
+	if (pRateLimiter)
+		pRateLimiter->onSuccess();
+
 	wechatResps.strSessionKey = respsDocument[WECHAT_RESPS_SESSION_KEY].GetString();
 	wechatResps.strOpenId = respsDocument[WECHAT_RESPS_OPEN_ID].GetString();
+	return true;
 }
 
 void CWeChat::prepay(
@@ -289,27 +1077,84 @@ void CWeChat::prepay(
 	const string& strCallBackAddr,
 	CWeChatResps& wechatResps,
 	const string& strAttach /*= string("")*/,
-	const string& strOpenId /*= string("")*/
+	const string& strOpenId /*= string("")*/,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
 )
 {
-	string strReq;
-	appendPrepayContent(strReq, iAmount, llValidTime, strTradingCode, strRemoteIP, strBody, strCallBackAddr, strAttach, strOpenId);
-	sendReqAndParseResps(strReq, WECHAT_HREF_PREPAY, bind(&CWeChat::parsePrepayResps, this, placeholders::_1, placeholders::_2, placeholders::_3, &wechatResps));
+	boost::optional<CWeChatError> error;
+	if (!doPrepay(iAmount, llValidTime, strTradingCode, strRemoteIP, strBody, strCallBackAddr, strAttach, strOpenId, options, wechatResps, error))
+		throw *error;
 }
 
-void CWeChat::parsePrepayResps(const string& strReq, const string& strResps, map<string, string>& mapResps, CWeChatResps* pWechatResps)
+CWeChatResult CWeChat::tryPrepay(
+	int iAmount,
+	long long llValidTime,
+	const string& strTradingCode,
+	const string& strRemoteIP,
+	const string& strBody,
+	const string& strCallBackAddr,
+	const string& strAttach /*= string("")*/,
+	const string& strOpenId /*= string("")*/,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
+)
 {
-	CWeChatResps& wechatResps = *pWechatResps;
-	auto itrTradeType = mapResps.find(WECHAT_RESPS_TRADE_TYPE);
-	auto itrPrepayId = mapResps.find(WECHAT_RESPS_PREPAY_ID);
-	if (itrTradeType == mapResps.end() ||
-		itrPrepayId == mapResps.end())
+	CWeChatResps wechatResps;
+	boost::optional<CWeChatError> error;
+	doPrepay(iAmount, llValidTime, strTradingCode, strRemoteIP, strBody, strCallBackAddr, strAttach, strOpenId, options, wechatResps, error);
+	return CWeChatResult(std::move(wechatResps), std::move(error));
+}
+
+bool CWeChat::doPrepay(
+	int iAmount,
+	long long llValidTime,
+	const string& strTradingCode,
+	const string& strRemoteIP,
+	const string& strBody,
+	const string& strCallBackAddr,
+	const string& strAttach,
+	const string& strOpenId,
+	const CWeChatCallOptions& options,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
+)
+{
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_PREPAY);
+	CPayContextPtr pContext = std::make_shared<CPayContext>();
+	pContext->iTimeOut = options.iTimeOut;
 	{
-		throw CWeChatError(WECHAT_RET_PARSE_ERROR, strReq, strResps);
+		CPayPhaseTimer buildTimer(PAY_PHASE_BUILD);
+		appendPrepayContent(pContext->strReq, isApp(options), iAmount, llValidTime, strTradingCode, strRemoteIP, strBody, strCallBackAddr, strAttach, strOpenId);
 	}
+	return sendPrepay(pContext, strTradingCode, wechatResps, error);
+}
 
-	wechatResps.strTradeType = itrTradeType->second;
-	wechatResps.strPrepayId = itrPrepayId->second;
+bool CWeChat::sendPrepay(
+	const CPayContextPtr& pContext,
+	const string& strTradingCode,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
+)
+{
+	unsigned long long llJournalId = m_pJournal ? m_pJournal->begin(PAY_PROVIDER_WECHAT, PAY_OP_PREPAY, m_strMchId, strTradingCode) : 0;
+	bool bRet = CWeChatGateway::call<CWeChatPrepayOp>(*this, pContext, wechatResps, error);
+	if (m_pJournal)
+		m_pJournal->end(llJournalId, journalOutcome(error));
+	return bRet;
+}
+
+bool CWeChatPrepayOp::parse(const CPayXmlFields& fields, CWeChatResps& wechatResps)
+{
+	boost::string_view tradeType, prepayId;
+	if (!fields.find(WECHAT_RESPS_TRADE_TYPE, tradeType) ||
+		!fields.find(WECHAT_RESPS_PREPAY_ID, prepayId))
+	{
+		return false;
+	}
+
+	wechatResps.strTradeType.assign(tradeType.data(), tradeType.size());
+	wechatResps.strPrepayId.assign(prepayId.data(), prepayId.size());
+	return true;
 }
 
 void CWeChat::prepayWithSign(
@@ -321,52 +1166,154 @@ void CWeChat::prepayWithSign(
 	const string& strCallBackAddr,
 	CWeChatResps& wechatResps,
 	const string& strAttach /*= string("")*/,
-	const string& strOpenId /*= string("")*/
+	const string& strOpenId /*= string("")*/,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
+)
+{
+	boost::optional<CWeChatError> error;
+	if (!doPrepayWithSign(iAmount, llValidTime, strTradingCode, strRemoteIP, strBody, strCallBackAddr, strAttach, strOpenId, options, wechatResps, error))
+		throw *error;
+}
+
+CWeChatResult CWeChat::tryPrepayWithSign(
+	int iAmount,
+	long long llValidTime,
+	const string& strTradingCode,
+	const string& strRemoteIP,
+	const string& strBody,
+	const string& strCallBackAddr,
+	const string& strAttach /*= string("")*/,
+	const string& strOpenId /*= string("")*/,
+	const CWeChatCallOptions& options /*= CWeChatCallOptions()*/
+)
+{
+	CWeChatResps wechatResps;
+	boost::optional<CWeChatError> error;
+	doPrepayWithSign(iAmount, llValidTime, strTradingCode, strRemoteIP, strBody, strCallBackAddr, strAttach, strOpenId, options, wechatResps, error);
+	return CWeChatResult(std::move(wechatResps), std::move(error));
+}
+
+bool CWeChat::doPrepayWithSign(
+	int iAmount,
+	long long llValidTime,
+	const string& strTradingCode,
+	const string& strRemoteIP,
+	const string& strBody,
+	const string& strCallBackAddr,
+	const string& strAttach,
+	const string& strOpenId,
+	const CWeChatCallOptions& options,
+	CWeChatResps& wechatResps,
+	boost::optional<CWeChatError>& error
 )
 {
-	prepay(iAmount, llValidTime, strTradingCode, strRemoteIP,
-		strBody, strCallBackAddr, wechatResps, strAttach, strOpenId);
-	
+	CPayArenaScope arenaScope(options.pMemoryResource);
+	CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_PREPAY);
+	if (!doPrepay(iAmount, llValidTime, strTradingCode, strRemoteIP,
+		strBody, strCallBackAddr, strAttach, strOpenId, options, wechatResps, error))
+		return false;
+
+	appendPrepaySignedContent(wechatResps, isApp(options));
+	return true;
+}
+
+void CWeChat::appendPrepaySignedContent(CWeChatResps& wechatResps, bool bIsApp)
+{
 	string& strNonceStr = CUtils::generate_unique_string(32);
 	string& strTimeStamp = CUtils::getCurentTimeStampStr();
 	string strSignResult;
-	signPrepay(strSignResult, strNonceStr, strTimeStamp, wechatResps.strPrepayId);
-	m_bIsApp ?
-		appendAppPrepayInfo(strNonceStr, strTimeStamp, wechatResps.strPrepayId, strSignResult, wechatResps.strPrepaySignedContent) :
+	{
+		CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+		signPrepay(strSignResult, bIsApp, strNonceStr, strTimeStamp, wechatResps.strPrepayId);
+	}
+	if (bIsApp)
+		appendAppPrepayInfo(strNonceStr, strTimeStamp, wechatResps.strPrepayId, strSignResult, wechatResps.strPrepaySignedContent);
+	else
 		appendSmallProgramPrepayInfo(strNonceStr, strTimeStamp, wechatResps.strPrepayId, strSignResult, wechatResps.strPrepaySignedContent);
 }
 
+future<CWeChatResult> CWeChat::prepayWithSignAsync(const CWeChatPrepayReq& prepayReq)
+{
+	//a stage that throws drops the last promise copy, the caller sees broken_promise
+	std::shared_ptr<promise<CWeChatResult>> pPromise = std::make_shared<promise<CWeChatResult>>();
+	future<CWeChatResult> result = pPromise->get_future();
+
+	//a registry reload may drop the last other owner while stages are queued
+	std::shared_ptr<CWeChat> pSelf = shared_from_this();
+	CPayExecutor::cpu().post([pSelf, prepayReq, pPromise]()
+	{
+		CPayContextPtr pContext = std::make_shared<CPayContext>();
+		pContext->iTimeOut = prepayReq.options.iTimeOut;
+		pSelf->appendPrepayContent(pContext->strReq, pSelf->isApp(prepayReq.options), prepayReq.iAmount, prepayReq.llValidTime, prepayReq.strTradingCode, prepayReq.strRemoteIP,
+			prepayReq.strBody, prepayReq.strCallBackAddr, prepayReq.strAttach, prepayReq.strOpenId);
+
+		CPayExecutor::io().post([pSelf, pContext, prepayReq, pPromise]()
+		{
+			std::shared_ptr<CWeChatResps> pWechatResps = std::make_shared<CWeChatResps>();
+			boost::optional<CWeChatError> error;
+			bool bRet = false;
+			{
+				CPayMetricsScope metricsScope(PAY_PROVIDER_WECHAT, PAY_OP_PREPAY);
+				bRet = pSelf->sendPrepay(pContext, prepayReq.strTradingCode, *pWechatResps, error);
+			}
+			if (!bRet)
+			{
+				pPromise->set_value(CWeChatResult(std::move(*pWechatResps), std::move(error)));
+				return;
+			}
+
+			CPayExecutor::cpu().post([pSelf, pWechatResps, prepayReq, pPromise]()
+			{
+				pSelf->appendPrepaySignedContent(*pWechatResps, pSelf->isApp(prepayReq.options));
+				pPromise->set_value(CWeChatResult(std::move(*pWechatResps), boost::optional<CWeChatError>()));
+			});
+		});
+	});
+	return result;
+}
+
+vector<future<CWeChatResult>> CWeChat::prepayWithSignBatch(const vector<CWeChatPrepayReq>& vecPrepayReqs)
+{
+	vector<future<CWeChatResult>> vecResults;
+	vecResults.reserve(vecPrepayReqs.size());
+	for (auto itr = vecPrepayReqs.begin(); itr != vecPrepayReqs.end(); ++itr)
+		vecResults.push_back(prepayWithSignAsync(*itr));
+	return vecResults;
+}
+
 void CWeChat::signPrepay(
 	string& strSign,
+	bool bIsApp,
 	const string& strNonceStr,
 	const string& strTimeStamp,
 	const string& strPrepayId
 )
 {
-	string signContent("");
-	if (m_bIsApp)
+	CPayArenaScope arenaScope;
+	CPayArenaString signContent(arenaScope.resource());
+	signContent.reserve(512);
+	if (bIsApp)
 	{
-		CUtils::AppendContentWithoutUrlEncode("appid", m_strAppId, signContent, false);
-		CUtils::AppendContentWithoutUrlEncode("noncestr", strNonceStr, signContent);
-		CUtils::AppendContentWithoutUrlEncode("package", "Sign=WXPay", signContent);
-		CUtils::AppendContentWithoutUrlEncode("partnerid", m_strMchId, signContent);
-		CUtils::AppendContentWithoutUrlEncode("prepayid", strPrepayId, signContent);
-		CUtils::AppendContentWithoutUrlEncode("timestamp", strTimeStamp, signContent);
-		CUtils::AppendContentWithoutUrlEncode("key", m_strMchKey, signContent);
+		CUtils::AppendPair(signContent, "appid", m_strAppId, false);
+		CUtils::AppendPair(signContent, "noncestr", strNonceStr);
+		CUtils::AppendPair(signContent, "package", "Sign=WXPay");
+		CUtils::AppendPair(signContent, "partnerid", m_strMchId);
+		CUtils::AppendPair(signContent, "prepayid", strPrepayId);
+		CUtils::AppendPair(signContent, "timestamp", strTimeStamp);
+		CUtils::AppendPair(signContent, "key", m_strMchKey);
 	}
 	else
 	{
 		string packageContent = "prepay_id=" + strPrepayId;
-		CUtils::AppendContentWithoutUrlEncode("appId", m_strAppId, signContent, false);
-		CUtils::AppendContentWithoutUrlEncode("nonceStr", strNonceStr, signContent);
-		CUtils::AppendContentWithoutUrlEncode("package", packageContent, signContent);
-		CUtils::AppendContentWithoutUrlEncode("signType", "MD5", signContent);
-		CUtils::AppendContentWithoutUrlEncode("timeStamp", strTimeStamp, signContent);
-		CUtils::AppendContentWithoutUrlEncode("key", m_strMchKey, signContent);
+		CUtils::AppendPair(signContent, "appId", m_strAppId, false);
+		CUtils::AppendPair(signContent, "nonceStr", strNonceStr);
+		CUtils::AppendPair(signContent, "package", packageContent);
+		CUtils::AppendPair(signContent, "signType", "MD5");
+		CUtils::AppendPair(signContent, "timeStamp", strTimeStamp);
+		CUtils::AppendPair(signContent, "key", m_strMchKey);
 	}
-	string signResult("");
 	Md5Utils m5;
-	m5.encStr32(signContent.c_str(), strSign);
+	m5.encStr32(signContent.data(), (unsigned int)signContent.size(), strSign);
 }
 
 void CWeChat::appendAppPrepayInfo(
@@ -408,32 +1355,34 @@ void CWeChat::appendSmallProgramLoginContent(string& strReq, const string& strJs
 void CWeChat::appendQueryStatusContent(string& strReq, const string& strOutTradingCode)
 {
 	string& strNonceStr = CUtils::generate_unique_string(32);
-	string signContent("");
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_APP_ID, m_strAppId, signContent, false);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_MCH_ID, m_strMchId, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_NONCE_STR, strNonceStr, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_OUT_TRADE_NO, strOutTradingCode, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_MCH_KEY, m_strMchKey, signContent);
+	CPayArenaScope arenaScope;
+	CPayArenaString signContent(arenaScope.resource());
+	signContent.reserve(512);
+	CUtils::AppendPair(signContent, WECHAT_REQ_APP_ID, m_strAppId, false);
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_ID, m_strMchId);
+	CUtils::AppendPair(signContent, WECHAT_REQ_NONCE_STR, strNonceStr);
+	CUtils::AppendPair(signContent, WECHAT_REQ_OUT_TRADE_NO, strOutTradingCode);
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_KEY, m_strMchKey);
 	string strSignResult("");
-	Md5Utils m5;
-	m5.encStr32(signContent.c_str(), strSignResult);
+	{
+		CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+		Md5Utils m5;
+		m5.encStr32(signContent.data(), (unsigned int)signContent.size(), strSignResult);
+	}
 
-	TiXmlElement* root = new TiXmlElement(WECHAT_XML_ROOT);
-	addXmlChild(root, WECHAT_REQ_APP_ID, m_strAppId);
-	addXmlChild(root, WECHAT_REQ_MCH_ID, m_strMchId);
-	addXmlChild(root, WECHAT_REQ_NONCE_STR, strNonceStr);
-	addXmlChild(root, WECHAT_REQ_OUT_TRADE_NO, strOutTradingCode);
-	addXmlChild(root, WECHAT_REQ_SIGN, strSignResult);
+	beginXml(strReq, signContent.size() * 2);
+	addXmlChild(strReq, WECHAT_REQ_APP_ID, m_strAppId);
+	addXmlChild(strReq, WECHAT_REQ_MCH_ID, m_strMchId);
+	addXmlChild(strReq, WECHAT_REQ_NONCE_STR, strNonceStr);
+	addXmlChild(strReq, WECHAT_REQ_OUT_TRADE_NO, strOutTradingCode);
+	addXmlChild(strReq, WECHAT_REQ_SIGN, strSignResult);
 
-	TiXmlDocument document;
-	document.LinkEndChild(root);
-	TiXmlPrinter printer;
-	document.Accept(&printer);
-	strReq = printer.CStr();
+	endXml(strReq);
 }
 
 void CWeChat::appendPrepayContent(
 	string& strReq,
+	bool bIsApp,
 	int iAmount,
 	long long llValidTime,
 	const string& strTradingCode,
@@ -447,65 +1396,66 @@ void CWeChat::appendPrepayContent(
 	string& strNonceStr = CUtils::generate_unique_string(32);
 	string& strTimeExpire = CUtils::getDelayTime(llValidTime, false);
 #ifdef CHECK_INPUT_STRING_TYPE
-	const string& u8Body = ch_trans::is_utf8(strBody.c_str()) ? strBody : ch_trans::ascii_to_utf8(strBody);
+	const string& u8Body = ch_trans::is_utf8(strBody) ? strBody : ch_trans::ascii_to_utf8(strBody);
 
 	string u8Attach("");
 	if (!strAttach.empty())
-		u8Attach = ch_trans::is_utf8(strAttach.c_str()) ? strAttach : ch_trans::ascii_to_utf8(strAttach);
+		u8Attach = ch_trans::is_utf8(strAttach) ? strAttach : ch_trans::ascii_to_utf8(strAttach);
 #else
 	const string& u8Body = strBody;
 
 	const string& u8Attach = strAttach;
 #endif
 
-	const string& strTradeType = m_bIsApp ? "APP" : "JSAPI";
+	const char* szTradeType = bIsApp ? "APP" : "JSAPI";
 
-	string signContent("");
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_APP_ID, m_strAppId, signContent, false);
+	CPayArenaScope arenaScope;
+	CPayArenaString signContent(arenaScope.resource());
+	signContent.reserve(512);
+	CUtils::AppendPair(signContent, WECHAT_REQ_APP_ID, m_strAppId, false);
 	//add attach id if exist
 	if (!u8Attach.empty())
-		CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_ATTACH, u8Attach, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_BODY, u8Body, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_MCH_ID, m_strMchId, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_NONCE_STR, strNonceStr, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_NOTIFY_URL, strCallBackAddr, signContent);
+		CUtils::AppendPair(signContent, WECHAT_REQ_ATTACH, u8Attach);
+	CUtils::AppendPair(signContent, WECHAT_REQ_BODY, u8Body);
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_ID, m_strMchId);
+	CUtils::AppendPair(signContent, WECHAT_REQ_NONCE_STR, strNonceStr);
+	CUtils::AppendPair(signContent, WECHAT_REQ_NOTIFY_URL, strCallBackAddr);
 	//add open id if exist
 	if (!strOpenId.empty())
-		CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_OPEN_ID, strOpenId, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_OUT_TRADE_NO, strTradingCode, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_SPBILL_CREATE_IP, strRemoteIP, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_TIME_EXPIRE, strTimeExpire, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iAmount), signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_TRADE_TYPE, strTradeType, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_MCH_KEY, m_strMchKey, signContent);
+		CUtils::AppendPair(signContent, WECHAT_REQ_OPEN_ID, strOpenId);
+	CUtils::AppendPair(signContent, WECHAT_REQ_OUT_TRADE_NO, strTradingCode);
+	CUtils::AppendPair(signContent, WECHAT_REQ_SPBILL_CREATE_IP, strRemoteIP);
+	CUtils::AppendPair(signContent, WECHAT_REQ_TIME_EXPIRE, strTimeExpire);
+	CUtils::AppendPair(signContent, WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iAmount));
+	CUtils::AppendPair(signContent, WECHAT_REQ_TRADE_TYPE, szTradeType);
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_KEY, m_strMchKey);
 	string signResult("");
-	Md5Utils m5;
-	m5.encStr32(signContent.c_str(), signResult);
-
-	TiXmlElement* root = new TiXmlElement(WECHAT_XML_ROOT);
-	addXmlChild(root, WECHAT_REQ_APP_ID, m_strAppId);
-	addXmlChild(root, WECHAT_REQ_MCH_ID, m_strMchId);
-	addXmlChild(root, WECHAT_REQ_NONCE_STR, strNonceStr);
-	addXmlChild(root, WECHAT_REQ_BODY, u8Body);
-	addXmlChild(root, WECHAT_REQ_OUT_TRADE_NO, strTradingCode);
-	addXmlChild(root, WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iAmount));
-	addXmlChild(root, WECHAT_REQ_SPBILL_CREATE_IP, strRemoteIP);
-	addXmlChild(root, WECHAT_REQ_TIME_EXPIRE, strTimeExpire);
-	addXmlChild(root, WECHAT_REQ_NOTIFY_URL, strCallBackAddr);
-	addXmlChild(root, WECHAT_REQ_TRADE_TYPE, strTradeType);
-	addXmlChild(root, WECHAT_REQ_SIGN, signResult);
+	{
+		CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+		Md5Utils m5;
+		m5.encStr32(signContent.data(), (unsigned int)signContent.size(), signResult);
+	}
+
+	beginXml(strReq, signContent.size() * 2);
+	addXmlChild(strReq, WECHAT_REQ_APP_ID, m_strAppId);
+	addXmlChild(strReq, WECHAT_REQ_MCH_ID, m_strMchId);
+	addXmlChild(strReq, WECHAT_REQ_NONCE_STR, strNonceStr);
+	addXmlChild(strReq, WECHAT_REQ_BODY, u8Body);
+	addXmlChild(strReq, WECHAT_REQ_OUT_TRADE_NO, strTradingCode);
+	addXmlChild(strReq, WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iAmount));
+	addXmlChild(strReq, WECHAT_REQ_SPBILL_CREATE_IP, strRemoteIP);
+	addXmlChild(strReq, WECHAT_REQ_TIME_EXPIRE, strTimeExpire);
+	addXmlChild(strReq, WECHAT_REQ_NOTIFY_URL, strCallBackAddr);
+	addXmlChild(strReq, WECHAT_REQ_TRADE_TYPE, szTradeType);
+	addXmlChild(strReq, WECHAT_REQ_SIGN, signResult);
 	//add attach id if exist
 	if (!u8Attach.empty())
-		addXmlChild(root, WECHAT_REQ_ATTACH, u8Attach);
+		addXmlChild(strReq, WECHAT_REQ_ATTACH, u8Attach);
 	//add open id if exist
 	if (!strOpenId.empty())
-		addXmlChild(root, WECHAT_REQ_OPEN_ID, strOpenId);
+		addXmlChild(strReq, WECHAT_REQ_OPEN_ID, strOpenId);
 
-	TiXmlDocument document;
-	document.LinkEndChild(root);
-	TiXmlPrinter printer;
-	document.Accept(&printer);
-	strReq = printer.CStr();
+	endXml(strReq);
 }
 
 void CWeChat::appendRefundContent(
@@ -520,45 +1470,78 @@ void CWeChat::appendRefundContent(
 {
 	string& strNonceStr = CUtils::generate_unique_string(32);
 #ifdef CHECK_INPUT_STRING_TYPE
-	const string& u8Remarks = ch_trans::is_utf8(strRemarks.c_str()) ? strRemarks : ch_trans::ascii_to_utf8(strRemarks);
+	const string& u8Remarks = ch_trans::is_utf8(strRemarks) ? strRemarks : ch_trans::ascii_to_utf8(strRemarks);
 #else
 	const string& u8Remarks = strRemarks;
 #endif
 
-	string signContent("");
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_APP_ID, m_strAppId, signContent, false);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_MCH_ID, m_strMchId, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_NONCE_STR, strNonceStr, signContent);
+	CPayArenaScope arenaScope;
+	CPayArenaString signContent(arenaScope.resource());
+	signContent.reserve(512);
+	CUtils::AppendPair(signContent, WECHAT_REQ_APP_ID, m_strAppId, false);
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_ID, m_strMchId);
+	CUtils::AppendPair(signContent, WECHAT_REQ_NONCE_STR, strNonceStr);
 	if (!strCallBackAddr.empty())
-		CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_NOTIFY_URL, strCallBackAddr, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_OUT_REFUND_NO, strOutRefundNo, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_OUT_TRADE_NO, strOutTradeNo, signContent);
+		CUtils::AppendPair(signContent, WECHAT_REQ_NOTIFY_URL, strCallBackAddr);
+	CUtils::AppendPair(signContent, WECHAT_REQ_OUT_REFUND_NO, strOutRefundNo);
+	CUtils::AppendPair(signContent, WECHAT_REQ_OUT_TRADE_NO, strOutTradeNo);
 	if (!u8Remarks.empty())
-		CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_REFUND_DESC, u8Remarks, signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_REFUND_FEE, CUtils::i2str(iRefundAmount), signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iTotalAmount), signContent);
-	CUtils::AppendContentWithoutUrlEncode(WECHAT_REQ_MCH_KEY, m_strMchKey, signContent);
+		CUtils::AppendPair(signContent, WECHAT_REQ_REFUND_DESC, u8Remarks);
+	CUtils::AppendPair(signContent, WECHAT_REQ_REFUND_FEE, CUtils::i2str(iRefundAmount));
+	CUtils::AppendPair(signContent, WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iTotalAmount));
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_KEY, m_strMchKey);
 	string signResult("");
-	Md5Utils m5;
-	m5.encStr32(signContent.c_str(), signResult);
+	{
+		CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+		Md5Utils m5;
+		m5.encStr32(signContent.data(), (unsigned int)signContent.size(), signResult);
+	}
 
-	TiXmlElement* root = new TiXmlElement(WECHAT_XML_ROOT);
-	addXmlChild(root, WECHAT_REQ_APP_ID, m_strAppId);
-	addXmlChild(root, WECHAT_REQ_MCH_ID, m_strMchId);
-	addXmlChild(root, WECHAT_REQ_NONCE_STR, strNonceStr);
+	beginXml(strReq, signContent.size() * 2);
+	addXmlChild(strReq, WECHAT_REQ_APP_ID, m_strAppId);
+	addXmlChild(strReq, WECHAT_REQ_MCH_ID, m_strMchId);
+	addXmlChild(strReq, WECHAT_REQ_NONCE_STR, strNonceStr);
 	if (!strCallBackAddr.empty())
-		addXmlChild(root, WECHAT_REQ_NOTIFY_URL, strCallBackAddr);
-	addXmlChild(root, WECHAT_REQ_OUT_TRADE_NO, strOutTradeNo);
-	addXmlChild(root, WECHAT_REQ_OUT_REFUND_NO, strOutRefundNo);
-	addXmlChild(root, WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iTotalAmount));
-	addXmlChild(root, WECHAT_REQ_REFUND_FEE, CUtils::i2str(iRefundAmount));
+		addXmlChild(strReq, WECHAT_REQ_NOTIFY_URL, strCallBackAddr);
+	addXmlChild(strReq, WECHAT_REQ_OUT_TRADE_NO, strOutTradeNo);
+	addXmlChild(strReq, WECHAT_REQ_OUT_REFUND_NO, strOutRefundNo);
+	addXmlChild(strReq, WECHAT_REQ_TOTAL_FEE, CUtils::i2str(iTotalAmount));
+	addXmlChild(strReq, WECHAT_REQ_REFUND_FEE, CUtils::i2str(iRefundAmount));
 	if (!u8Remarks.empty())
-		addXmlChild(root, WECHAT_REQ_REFUND_DESC, u8Remarks);
-	addXmlChild(root, WECHAT_REQ_SIGN, signResult);
-
-	TiXmlDocument document;
-	document.LinkEndChild(root);
-	TiXmlPrinter printer;
-	document.Accept(&printer);
-	strReq = printer.CStr();
-}
\ No newline at end of file
+		addXmlChild(strReq, WECHAT_REQ_REFUND_DESC, u8Remarks);
+	addXmlChild(strReq, WECHAT_REQ_SIGN, signResult);
+
+	endXml(strReq);
+}
+
+void CWeChat::appendDownloadBillContent(string& strReq, const string& strBillDate, const string& strBillType)
+{
+	string& strNonceStr = CUtils::generate_unique_string(32);
+	CPayArenaScope arenaScope;
+	CPayArenaString signContent(arenaScope.resource());
+	signContent.reserve(512);
+	CUtils::AppendPair(signContent, WECHAT_REQ_APP_ID, m_strAppId, false);
+	CUtils::AppendPair(signContent, WECHAT_REQ_BILL_DATE, strBillDate);
+	CUtils::AppendPair(signContent, WECHAT_REQ_BILL_TYPE, strBillType);
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_ID, m_strMchId);
+	CUtils::AppendPair(signContent, WECHAT_REQ_NONCE_STR, strNonceStr);
+	CUtils::AppendPair(signContent, WECHAT_REQ_TAR_TYPE, "GZIP");
+	CUtils::AppendPair(signContent, WECHAT_REQ_MCH_KEY, m_strMchKey);
+	string strSignResult("");
+	{
+		CPayPhaseTimer signTimer(PAY_PHASE_SIGN);
+		Md5Utils m5;
+		m5.encStr32(signContent.data(), (unsigned int)signContent.size(), strSignResult);
+	}
+
+	beginXml(strReq, signContent.size() * 2);
+	addXmlChild(strReq, WECHAT_REQ_APP_ID, m_strAppId);
+	addXmlChild(strReq, WECHAT_REQ_BILL_DATE, strBillDate);
+	addXmlChild(strReq, WECHAT_REQ_BILL_TYPE, strBillType);
+	addXmlChild(strReq, WECHAT_REQ_MCH_ID, m_strMchId);
+	addXmlChild(strReq, WECHAT_REQ_NONCE_STR, strNonceStr);
+	addXmlChild(strReq, WECHAT_REQ_TAR_TYPE, "GZIP");
+	addXmlChild(strReq, WECHAT_REQ_SIGN, strSignResult);
+
+	endXml(strReq);
+}
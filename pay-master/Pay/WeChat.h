@@ -1,11 +1,26 @@
 #pragma once
 #include <map>
+#include <set>
+#include <future>
+#include <memory>
 #include <vector>
 #include <functional>
 #include "Pay/PayError.h"
+#include "PayUtils/PayResilience.h"
+#include "PayUtils/PayRateLimiter.h"
+#include "PayUtils/PayOrderCache.h"
+#include "PayUtils/PayBill.h"
 
 namespace SAPay{
 
+class CHttpClientCert;
+class CPayJournal;
+class CPaySessionStore;
+class CPayRefundLedger;
+class CPayAes256Ecb;
+class CPayMemoryResource;
+struct CWeChatCodec;
+
 enum CWeChatRet
 {
 	//δ֪
@@ -30,7 +45,16 @@ enum CWeChatRet
 	WECHAT_RET_MISSING_CERT_INFO,
 
 	//app secretϢ
-	WECHAT_RET_MISSING_APP_SECRET
+	WECHAT_RET_MISSING_APP_SECRET,
+
+	//۶,δ
+	WECHAT_RET_CIRCUIT_OPEN,
+
+	//,δ
+	WECHAT_RET_RATE_LIMITED,
+
+	//˽,δ
+	WECHAT_RET_REFUND_EXCEEDED
 };
 
 using CWeChatError = CPayError<CWeChatRet>;
@@ -78,11 +102,117 @@ struct CWeChatResps
 	std::string strRefundId;
 };
 
+using CWeChatResult = CPayExpected<CWeChatResps, CWeChatError>;
+
+template<>
+struct CPayOrderTraits<CWeChatResps>
+{
+	//֧ɹת˿ѹرաѳ״̬ûı
+	static bool isFinal(const CWeChatResps& wechatResps)
+	{
+		return wechatResps.iTradeState == WECHAT_TRADE_STATE_SUCCESS ||
+			wechatResps.iTradeState == WECHAT_TRADE_STATE_REFUND ||
+			wechatResps.iTradeState == WECHAT_TRADE_STATE_CLOSED ||
+			wechatResps.iTradeState == WECHAT_TRADE_STATE_REVOKED;
+	}
+};
+
+using CWeChatOrderCache = CPayOrderCache<CWeChatResps, CWeChatError>;
+
+enum CWeChatTradeType
+{
+	//ʹsetIsAppõĬֵ
+	WECHAT_TRADE_TYPE_DEFAULT,
+	WECHAT_TRADE_TYPE_APP,
+	WECHAT_TRADE_TYPE_JSAPI
+};
+
+//εõѡ,δõֶʹÿͻ˵ĬֵصַÿεõĲ
+struct CWeChatCallOptions
+{
+	CWeChatCallOptions(CWeChatTradeType iType = WECHAT_TRADE_TYPE_DEFAULT, int iSeconds = 0) :
+		iTradeType(iType),
+		iTimeOut(iSeconds),
+		pMemoryResource(nullptr) {}
+
+	CWeChatTradeType iTradeType;
+
+	//httpĳʱ,λΪ, 0-HTTPCLIENT_DEFAULT_TOME_OUT
+	int iTimeOut;
+
+	//εõʱڴ(ǩݡӦֶε)Ӵ˷,÷غ󼴿,nullptrʱ߳Դarena;
+	//ֻڷõ߳ʹ,̰߳ȫ,첽ӿںԴ
+	CPayMemoryResource* pMemoryResource;
+};
+
+//prepayWithSignAsyncĲ,ֶκͬprepayWithSign
+struct CWeChatPrepayReq
+{
+	CWeChatPrepayReq() :
+		iAmount(0),
+		llValidTime(0) {}
+
+	int iAmount;
+	long long llValidTime;
+	std::string strTradingCode;
+	std::string strRemoteIP;
+	std::string strBody;
+	std::string strCallBackAddr;
+	std::string strAttach;
+	std::string strOpenId;
+	CWeChatCallOptions options;
+};
+
+enum CWeChatRefundStatus
+{
+	WECHAT_REFUND_STATUS_SUCCESS,
+	WECHAT_REFUND_STATUS_CHANGE,
+	WECHAT_REFUND_STATUS_REFUNDCLOSE,
+	WECHAT_REFUND_STATUS_UNKNOW
+};
+
+//˿֪ͨ,ɽܺreq_info,λΪ
+struct CWeChatRefundNotify
+{
+	CWeChatRefundNotify() :
+		iRefundStatus(WECHAT_REFUND_STATUS_UNKNOW),
+		llTotalFee(0),
+		llSettlementTotalFee(0),
+		llRefundFee(0),
+		llSettlementRefundFee(0) {}
+
+	//outer message
+	std::string strAppId;
+	std::string strMchId;
+
+	//req_info
+	CWeChatRefundStatus iRefundStatus;
+	std::string strTransactionId;
+	std::string strOutTradeNo;
+	std::string strRefundId;
+	std::string strOutRefundNo;
+	long long llTotalFee;
+	long long llSettlementTotalFee;
+	long long llRefundFee;
+	long long llSettlementRefundFee;
+	std::string strSuccessTime;
+	std::string strRefundRecvAccout;
+	std::string strRefundAccount;
+	std::string strRefundRequestSource;
+};
+
 
 
 
 
-class CWeChat
+/**
+* @name CWeChat
+*
+* @brief								set*ֻڹ󡢽֮߳ǰ,֮ͻֻ,
+*										ͬһ̻һʵɱй̲߳,·ϲ
+*										APPСĲͨCWeChatCallOptionsָ
+*/
+class CWeChat : public std::enable_shared_from_this<CWeChat>
 {
 public:
 	//xmlΪmap
@@ -121,9 +251,83 @@ public:
 
 	virtual ~CWeChat() {}
 
-	/*@param bIsApp							true-APP false-small program*/
+	/*@param bIsApp							WECHAT_TRADE_TYPE_DEFAULTĺ, true-APP false-small program*/
 	void setIsApp(bool bIsApp) { m_bIsApp = bIsApp; }
 
+	/**
+	* @name setRetryPolicy
+	*
+	* @brief								Բ,ѯ˿(ͬһout_refund_no)ɰȫԲѯԳ,
+	*										ͳһµС¼δ(dns/ʧ)ʱ
+	*/
+	void setRetryPolicy(const CPayRetryPolicy& retryPolicy) { m_retryPolicy = retryPolicy; }
+
+	/**
+	* @name setRateLimit
+	*
+	* @brief								,mch id(С¼app id)ӿڷ( WECHAT_METHOD_QUERY)
+	*										ڽڹ,Ĭϲ
+	*/
+	void setRateLimit(const std::string& strMethod, const CPayRateLimit& rateLimit);
+
+	//ٵerr_code,Ĭ FREQUENCY_LIMITED
+	void setThrottleCodes(const std::vector<std::string>& vecErrCodes);
+
+	/**
+	* @name setJournal
+	*
+	* @brief								ͳһµ˿ǰдͼ,յȷд,
+	*										δպϵĲȲѯپǷط,ɶͻ˹
+	*/
+	void setJournal(const std::shared_ptr<CPayJournal>& pJournal) { m_pJournal = pJournal; }
+
+	/**
+	* @name setOrderCache
+	*
+	* @brief								queryPayStatusȲ鶩״̬,ͬһĲѯֻһ,
+	*										ɲѯverifyAndApplyNotify,ɶͻ˹
+	*/
+	void setOrderCache(const std::shared_ptr<CWeChatOrderCache>& pOrderCache) { m_pOrderCache = pOrderCache; }
+
+	/**
+	* @name setSessionStore
+	*
+	* @brief								С¼ɹopenidдỰ,ҵֱӴCPaySessionStoreȡsession_key,
+	*										ɶͻ˹
+	*/
+	void setSessionStore(const std::shared_ptr<CPaySessionStore>& pSessionStore) { m_pSessionStore = pSessionStore; }
+
+	/**
+	* @name setRefundLedger
+	*
+	* @brief								˿ǰ˱˽,ʱֱӷ WECHAT_RET_REFUND_EXCEEDED,
+	*										˱ɲѯ˿,δѯĶ˿еĶܽ,ɶͻ˹
+	*/
+	void setRefundLedger(const std::shared_ptr<CPayRefundLedger>& pRefundLedger) { m_pRefundLedger = pRefundLedger; }
+
+	/**
+	* @name verifyAndApplyNotify
+	*
+	* @brief								ñ̻key֧֪ͨǩ,ɹ󽫶Ϊ֧ɹд붩״̬
+	*
+	* @return								ͬverifyWechatRespsAndNotify, 1-sucess other-failed
+	*/
+	int verifyAndApplyNotify(const std::map<std::string, std::string>& mapNotify);
+
+	/**
+	* @name decryptRefundNotify
+	*
+	* @brief								˿֪ͨreq_info(AES-256-ECB,ԿΪ̻keymd5Сд),ΪCWeChatRefundNotify
+	*										Կ̻ڽڻ档˿ɹʱύ˿˱״̬,˿رʱͷԤ
+	*
+	* @note									see https://pay.weixin.qq.com/wiki/doc/api/app/app.php?chapter=9_16&index=11
+	*
+	* @param strNotify						֪ͨԭ(xml)
+	*
+	* @return								1-sucess other-failed
+	*/
+	int decryptRefundNotify(const std::string& strNotify, CWeChatRefundNotify& refundNotify);
+
 	/**
 	* @name queryPayStatus
 	*
@@ -134,8 +338,13 @@ public:
 	*										strCashFee,strTransactionId, strOutTradeNo,strTimeEnd, strTradeStateDesc
 	*
 	* @param strOutTradingCode				ҪѯĶ			
+	* @param options						ͬһĲѯһ,ʹ÷ߵĳʱ
 	*/
-	void queryPayStatus(const std::string& strOutTradingCode, CWeChatResps& wechatResps);
+	void queryPayStatus(
+		const std::string& strOutTradingCode,
+		CWeChatResps& wechatResps,
+		const CWeChatCallOptions& options = CWeChatCallOptions()
+	);
 
 	/**
 	* @name smallProgramLogin
@@ -149,6 +358,15 @@ public:
 	*/
 	void smallProgramLogin(const std::string& strJsCode, CWeChatResps& wechatResps);
 
+	/**
+	* @name smallProgramLoginAsync
+	*
+	* @brief								CPayExecutor::io()ִtrySmallProgramLoginjs_codeֻʹһ,
+	*										ͬһjs_codeĲ¼(ͬ첽)ֻһjscode2session
+	*										CWeChatstd::shared_ptr,Ŷеֱ
+	*/
+	std::future<CWeChatResult> smallProgramLoginAsync(const std::string& strJsCode);
+
 	/**
 	* @name prepay
 	*
@@ -165,6 +383,7 @@ public:
 	* @param strCallBackAddr				صַ
 	* @param strAttach						ԶϢ
 	* @param strOpenId						openId(С,شֶ)
+	* @param options						볬ʱ
 	*										
 	*/
 	void prepay(
@@ -176,7 +395,8 @@ public:
 		const std::string& strCallBackAddr,
 		CWeChatResps& wechatResps,
 		const std::string& strAttach = std::string(""),
-		const std::string& strOpenId = std::string("")
+		const std::string& strOpenId = std::string(""),
+		const CWeChatCallOptions& options = CWeChatCallOptions()
 	);
 
 	/**
@@ -198,6 +418,7 @@ public:
 	* @param strCallBackAddr				صַ
 	* @param strAttach						ԶϢ
 	* @param strOpenId						openId(С,شֶ)
+	* @param options						(ǩĸʽ)볬ʱ
 	*
 	*/
 	void prepayWithSign(
@@ -209,7 +430,8 @@ public:
 		const std::string& strCallBackAddr,
 		CWeChatResps& wechatResps,
 		const std::string& strAttach = std::string(""),
-		const std::string& strOpenId = std::string("")
+		const std::string& strOpenId = std::string(""),
+		const CWeChatCallOptions& options = CWeChatCallOptions()
 	);
 
 	/*
@@ -223,6 +445,7 @@ public:
 	* @param strOutRefundNo					˿					
 	* @param strRemarks						ע
 	* @param strCallBackAddr				صַ
+	* @param options						ʱ
 	*
 	*/
 	void refund(
@@ -232,12 +455,96 @@ public:
 		const std::string& strOutRefundNo,
 		CWeChatResps& wechatResps,
 		const std::string& strRemarks = "",
-		const std::string& strCallBackAddr = ""
+		const std::string& strCallBackAddr = "",
+		const CWeChatCallOptions& options = CWeChatCallOptions()
 	);
 
+	/**
+	* @name tryQueryPayStatus/trySmallProgramLogin/tryPrepay/tryPrepayWithSign/tryRefund
+	*
+	* @brief								non-throwing variants for high-rate callers, errors are returned
+	*										in CWeChatResult and share the req/resps instead of copying them
+	*/
+	CWeChatResult tryQueryPayStatus(
+		const std::string& strOutTradingCode,
+		const CWeChatCallOptions& options = CWeChatCallOptions()
+	);
+	CWeChatResult trySmallProgramLogin(const std::string& strJsCode);
+	CWeChatResult tryPrepay(
+		int iAmount,
+		long long llValidTime,
+		const std::string& strTradingCode,
+		const std::string& strRemoteIP,
+		const std::string& strBody,
+		const std::string& strCallBackAddr,
+		const std::string& strAttach = std::string(""),
+		const std::string& strOpenId = std::string(""),
+		const CWeChatCallOptions& options = CWeChatCallOptions()
+	);
+	CWeChatResult tryPrepayWithSign(
+		int iAmount,
+		long long llValidTime,
+		const std::string& strTradingCode,
+		const std::string& strRemoteIP,
+		const std::string& strBody,
+		const std::string& strCallBackAddr,
+		const std::string& strAttach = std::string(""),
+		const std::string& strOpenId = std::string(""),
+		const CWeChatCallOptions& options = CWeChatCallOptions()
+	);
+	CWeChatResult tryRefund(
+		int iTotalAmount,
+		int iRefundAmount,
+		const std::string& strOutTradeNo,
+		const std::string& strOutRefundNo,
+		const std::string& strRemarks = "",
+		const std::string& strCallBackAddr = "",
+		const CWeChatCallOptions& options = CWeChatCallOptions()
+	);
+
+	/**
+	* @name downloadBill
+	*
+	* @brief								gzipѹĶ˵,ر߽ѹлص,ڴռ˵С޹
+	*
+	* @note									see https://pay.weixin.qq.com/wiki/doc/api/app/app.php?chapter=9_6&index=8
+	*										˵ʱ WECHAT_RET_RET_MSG_ERRORز,ʧǰѻص
+	*
+	* @param strBillDate					˵, yyyyMMdd
+	* @param strBillType					WECHAT_BILL_TYPE_ALL/WECHAT_BILL_TYPE_SUCCESS/WECHAT_BILL_TYPE_REFUND
+	* @param onRow							ÿлص,falseֹͣ
+	*/
+	void downloadBill(
+		const std::string& strBillDate,
+		const std::string& strBillType,
+		const CPayBillRowFunc& onRow
+	);
+	CWeChatResult tryDownloadBill(
+		const std::string& strBillDate,
+		const std::string& strBillType,
+		const CPayBillRowFunc& onRow
+	);
+
+	//WECHAT_BILL_TYPE_ALL˵,CPayBillReconcilerʹ
+	static CPayBillColumns getBillColumns();
+
+	/**
+	* @name prepayWithSignAsync
+	*
+	* @brief								ֽ׶εtryPrepayWithSign: ƴͳһµCPayExecutor::cpu()ִ,
+	*										CPayExecutor::io(),ǩΪ׶λصcpu()ִ,
+	*										ֻ߳ȴصfutureCWeChatstd::shared_ptr(CPayRegistryʵ),
+	*										Ŷеĸ׶γֱ
+	*/
+	std::future<CWeChatResult> prepayWithSignAsync(const CWeChatPrepayReq& prepayReq);
+
+	//ύ(ɱ),˳vecPrepayReqsһ
+	std::vector<std::future<CWeChatResult>> prepayWithSignBatch(const std::vector<CWeChatPrepayReq>& vecPrepayReqs);
+
 protected:
 
 	//token
+	//WECHAT_TRADE_TYPE_DEFAULT˴
 	bool m_bIsApp;
 	std::string m_strAppId;
 	std::string m_strMchId;
@@ -246,15 +553,29 @@ protected:
 	std::string m_strCertPath;
 	std::string m_strKeyPath;
 
-protected:
-	using ParseFunc = std::function<void(const std::string& strReq, const std::string& strResps, std::map<std::string, std::string>&)>;
+	//ͻ֤,ʱڴ,ļԶ¼
+	std::shared_ptr<CHttpClientCert> m_pClientCert;
+
+	CPayRetryPolicy m_retryPolicy;
+
+	//ÿӿڵַһ۶,ʱȡ,ֻ֮
+	std::map<std::string, CPayCircuitBreaker*> m_mapCircuitBreakers;
 
-	//Ϣ
-	virtual void parseQueryStatusResps(const std::string& strReq, const std::string& strResps, std::map<std::string, std::string>& mapResps, CWeChatResps* pWechatResps);
+	//ÿӿڷһ,ʱȡ,ֻ֮
+	std::map<std::string, CPayRateLimiter*> m_mapRateLimiters;
+	std::set<std::string> m_setThrottleCodes;
 
-	virtual void parsePrepayResps(const std::string& strReq, const std::string& strResps, std::map<std::string, std::string>& mapResps, CWeChatResps* pWechatResps);
+	std::shared_ptr<CPayJournal> m_pJournal;
+	std::shared_ptr<CWeChatOrderCache> m_pOrderCache;
+	std::shared_ptr<CPaySessionStore> m_pSessionStore;
+	std::shared_ptr<CPayRefundLedger> m_pRefundLedger;
 
-	virtual void parseRefundResps(const std::string& strReq, const std::string& strResps, std::map<std::string, std::string>& mapResps, CWeChatResps* pWechatResps);
+	//˿֪ͨ,ʱ̻key
+	std::shared_ptr<CPayAes256Ecb> m_pRefundNotifyCipher;
+
+protected:
+	//͡ǩ뷵ϢCPayGateway<CWeChatCodec>,ÿӿһ(WeChat.cpp)
+	friend struct CWeChatCodec;
 
 	/**
 	* @name signSmallProgramPrepayInfo
@@ -294,21 +615,109 @@ protected:
 
 
 
+	//optionsеĽ,δʱȡm_bIsApp
+	bool isApp(const CWeChatCallOptions& options) const
+	{
+		return options.iTradeType == WECHAT_TRADE_TYPE_DEFAULT ? m_bIsApp : options.iTradeType == WECHAT_TRADE_TYPE_APP;
+	}
+
 	//ǩ
 	void signPrepay(
 		std::string& strSign,
+		bool bIsApp,
 		const std::string& strNonceStr,
 		const std::string& strTimeStamp,
 		const std::string& strPrepayId
 	);
 
-	void sendReqAndParseResps(
-		const std::string& strReq,
-		const std::string& strHref,
-		ParseFunc func,
-		bool bPostWithCert = false
+	bool doQueryPayStatus(
+		const std::string& strOutTradingCode,
+		const CWeChatCallOptions& options,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+
+	//always asks the gateway
+	bool fetchPayStatus(
+		const std::string& strOutTradingCode,
+		const CWeChatCallOptions& options,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+
+	static CWeChatRespsTradeState parseTradeState(const std::string& strTradeState);
+	bool doSmallProgramLogin(
+		const std::string& strJsCode,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
 	);
 
+	//always asks jscode2session
+	bool fetchSmallProgramLogin(
+		const std::string& strJsCode,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+	bool doPrepay(
+		int iAmount,
+		long long llValidTime,
+		const std::string& strTradingCode,
+		const std::string& strRemoteIP,
+		const std::string& strBody,
+		const std::string& strCallBackAddr,
+		const std::string& strAttach,
+		const std::string& strOpenId,
+		const CWeChatCallOptions& options,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+	bool doPrepayWithSign(
+		int iAmount,
+		long long llValidTime,
+		const std::string& strTradingCode,
+		const std::string& strRemoteIP,
+		const std::string& strBody,
+		const std::string& strCallBackAddr,
+		const std::string& strAttach,
+		const std::string& strOpenId,
+		const CWeChatCallOptions& options,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+	//doPrepay׶,pContext->strReqƴӺ,CPayMetricsScopeڵ
+	bool sendPrepay(
+		const CPayContextPtr& pContext,
+		const std::string& strTradingCode,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+
+	//ͻǩ,strPrepaySignedContent
+	void appendPrepaySignedContent(CWeChatResps& wechatResps, bool bIsApp);
+
+	bool doDownloadBill(
+		const std::string& strBillDate,
+		const std::string& strBillType,
+		const CPayBillRowFunc& onRow,
+		boost::optional<CWeChatError>& error
+	);
+
+	bool doRefund(
+		int iTotalAmount,
+		int iRefundAmount,
+		const std::string& strOutTradeNo,
+		const std::string& strOutRefundNo,
+		const std::string& strRemarks,
+		const std::string& strCallBackAddr,
+		const CWeChatCallOptions& options,
+		CWeChatResps& wechatResps,
+		boost::optional<CWeChatError>& error
+	);
+
+	CPayCircuitBreaker* getCircuitBreaker(const std::string& strHref) const;
+
+	CPayRateLimiter* getRateLimiter(const std::string& strMethod) const;
+
 	//ƴ
 	void appendSmallProgramLoginContent(std::string& strReq, const std::string& strJsCode);
 
@@ -316,6 +725,7 @@ protected:
 
 	void appendPrepayContent(
 		std::string& strReq,
+		bool bIsApp,
 		int iAmount,
 		long long llValidTime,
 		const std::string& strTradingCode,
@@ -335,6 +745,8 @@ protected:
 		const std::string& strRemarks = "",
 		const std::string& strCallBackAddr = ""
 	);
+
+	void appendDownloadBillContent(std::string& strReq, const std::string& strBillDate, const std::string& strBillType);
 };
 
 }
\ No newline at end of file
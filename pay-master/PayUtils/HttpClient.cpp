@@ -1,9 +1,19 @@
 #pragma once
 #include "HttpClient.h"
+#include "PayBufferPool.h"
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <sys/stat.h>
 #include <curl/curl.h>
 
 #define UNKNOW_ERROR -65535
 
+//idle easy handles kept for reuse
+#define HTTPCLIENT_MAX_IDLE_HANDLES 64
+
 using namespace SAPay;
 using namespace std;
 
@@ -18,29 +28,384 @@ vector<string> CHttpClient::makeHeaderWithMap(const map<string, string>& mapHead
 	return vecHeader;
 }
 
+//connection cache, dns cache, tls sessions and idle easy handles of one client identity.
+//requests without a client certificate share one for the whole process, so merchants talking to the
+//same gateway reuse the same connections. each client certificate has its own, a connection or tls
+//session authenticated as one merchant is never picked up by another
+class CHttpShare
+{
+public:
+	//keyed by cert and key path, never freed
+	static CHttpShare& get(const string& strIdentity)
+	{
+		static bool s_bInit = (curl_global_init(CURL_GLOBAL_ALL), true);
+		(void)s_bInit;
+		static mutex s_mutex;
+		static map<string, unique_ptr<CHttpShare>> s_mapShares;
+
+		lock_guard<mutex> lock(s_mutex);
+		unique_ptr<CHttpShare>& pShare = s_mapShares[strIdentity];
+		if (!pShare)
+			pShare.reset(new CHttpShare());
+		return *pShare;
+	}
+
+	//requests without a client certificate
+	static CHttpShare& plain()
+	{
+		static CHttpShare& s_share = get("");
+		return s_share;
+	}
+
+	//pooled easy handle, keeps its own connection cache when libcurl cannot share connections
+	CURL* acquireHandle()
+	{
+		CURL* curl = NULL;
+		{
+			lock_guard<mutex> lock(m_mutexIdleHandles);
+			if (!m_vecIdleHandles.empty())
+			{
+				curl = m_vecIdleHandles.back();
+				m_vecIdleHandles.pop_back();
+			}
+		}
+		if (curl == NULL)
+			curl = curl_easy_init();
+		if (curl)
+		{
+			if (m_pShare)
+				curl_easy_setopt(curl, CURLOPT_SHARE, m_pShare);
+			curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+		}
+		return curl;
+	}
+
+	void releaseHandle(CURL* curl)
+	{
+		curl_easy_reset(curl);
+		{
+			lock_guard<mutex> lock(m_mutexIdleHandles);
+			if (m_vecIdleHandles.size() < HTTPCLIENT_MAX_IDLE_HANDLES)
+			{
+				m_vecIdleHandles.push_back(curl);
+				return;
+			}
+		}
+		curl_easy_cleanup(curl);
+	}
+
+private:
+	CHttpShare()
+	{
+		m_pShare = curl_share_init();
+		if (m_pShare)
+		{
+			curl_share_setopt(m_pShare, CURLSHOPT_LOCKFUNC, lock);
+			curl_share_setopt(m_pShare, CURLSHOPT_UNLOCKFUNC, unlock);
+			curl_share_setopt(m_pShare, CURLSHOPT_USERDATA, this);
+			curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+			curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+			curl_share_setopt(m_pShare, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+		}
+	}
+
+	static void lock(CURL*, curl_lock_data data, curl_lock_access, void* pUser)
+	{
+		((CHttpShare*)pUser)->m_mutexes[data].lock();
+	}
+
+	static void unlock(CURL*, curl_lock_data data, void* pUser)
+	{
+		((CHttpShare*)pUser)->m_mutexes[data].unlock();
+	}
+
+	CURLSH* m_pShare;
+	mutex m_mutexes[CURL_LOCK_DATA_LAST];
+	mutex m_mutexIdleHandles;
+	vector<CURL*> m_vecIdleHandles;
+};
+
+static long long steadyNowMs()
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//0 if missing
+static time_t fileMTime(const string& strPath)
+{
+	struct stat info;
+	if (stat(strPath.c_str(), &info) != 0)
+		return 0;
+	return info.st_mtime;
+}
+
+static bool readFile(const string& strPath, string& strContent)
+{
+	ifstream file(strPath, ios::in | ios::binary);
+	if (!file)
+		return false;
+	ostringstream stream;
+	stream << file.rdbuf();
+	strContent = stream.str();
+	return !strContent.empty();
+}
+
+shared_ptr<CHttpClientCert> CHttpClientCert::get(const string& strCertPath, const string& strKeyPath)
+{
+	static mutex s_mutex;
+	static map<pair<string, string>, weak_ptr<CHttpClientCert>> s_mapCerts;
+
+	lock_guard<mutex> lock(s_mutex);
+	weak_ptr<CHttpClientCert>& pWeakCert = s_mapCerts[make_pair(strCertPath, strKeyPath)];
+	shared_ptr<CHttpClientCert> pCert = pWeakCert.lock();
+	if (!pCert)
+	{
+		pCert = std::make_shared<CHttpClientCert>(strCertPath, strKeyPath);
+		pWeakCert = pCert;
+	}
+	return pCert;
+}
+
+CHttpClientCert::CHttpClientCert(const string& strCertPath, const string& strKeyPath) :
+	m_strCertPath(strCertPath),
+	m_strKeyPath(strKeyPath),
+	m_llNextCheckMs(0)
+{
+	reloadIfChanged();
+}
+
+shared_ptr<const CHttpCertData> CHttpClientCert::current()
+{
+	if (steadyNowMs() >= m_llNextCheckMs.load(memory_order_relaxed))
+		reloadIfChanged();
+	return atomic_load(&m_pData);
+}
+
+void CHttpClientCert::reloadIfChanged()
+{
+	//a single thread stats the files, the others keep using the current pem
+	unique_lock<mutex> lock(m_mutexReload, try_to_lock);
+	if (!lock.owns_lock())
+		return;
+	long long llNow = steadyNowMs();
+	if (llNow < m_llNextCheckMs.load(memory_order_relaxed))
+		return;
+	m_llNextCheckMs.store(llNow + HTTPCLIENT_CERT_CHECK_INTERVAL * 1000LL, memory_order_relaxed);
+
+	time_t llCertMTime = fileMTime(m_strCertPath);
+	time_t llKeyMTime = fileMTime(m_strKeyPath);
+	shared_ptr<const CHttpCertData> pData = atomic_load(&m_pData);
+	if (pData && pData->llCertMTime == llCertMTime && pData->llKeyMTime == llKeyMTime)
+		return;
+
+	//a half written file is picked up again on the next check, the old pem stays in use meanwhile
+	shared_ptr<CHttpCertData> pNewData = std::make_shared<CHttpCertData>();
+	pNewData->strCertPath = m_strCertPath;
+	pNewData->strKeyPath = m_strKeyPath;
+	pNewData->llCertMTime = llCertMTime;
+	pNewData->llKeyMTime = llKeyMTime;
+	if (!readFile(m_strCertPath, pNewData->strCert) || !readFile(m_strKeyPath, pNewData->strKey))
+		return;
+	atomic_store(&m_pData, shared_ptr<const CHttpCertData>(pNewData));
+}
+
+//body target of on_write_data
+struct CHttpWriteTarget
+{
+	CHttpWriteTarget(CURL* pCurl, string* pString) :curl(pCurl), pBuffer(pString), bSized(false) {}
+
+	CURL* curl;
+	string* pBuffer;
+	bool bSized;
+};
+
+//headers are in by the first body chunk, so Content-Length is known there
+static void reserveContentLength(CHttpWriteTarget* pTarget)
+{
+	pTarget->bSized = true;
+#if LIBCURL_VERSION_NUM >= 0x073700
+	curl_off_t llLength = -1;
+	if (curl_easy_getinfo(pTarget->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &llLength) != CURLE_OK)
+		return;
+#else
+	double dLength = -1;
+	if (curl_easy_getinfo(pTarget->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &dLength) != CURLE_OK)
+		return;
+	long long llLength = (long long)dLength;
+#endif
+	//-1 when chunked or unknown
+	if (llLength > 0 && llLength <= HTTPCLIENT_MAX_RESERVE)
+		pTarget->pBuffer->reserve(pTarget->pBuffer->size() + (size_t)llLength);
+}
+
 static size_t on_write_data(const char* ptr, size_t size, size_t nmemb, void* data)
 {
-	string *buffer = (string *)data;
-	if (buffer != NULL) 
+	CHttpWriteTarget* pTarget = (CHttpWriteTarget*)data;
+	size_t read_data_size = size * nmemb;
+	if (!pTarget->bSized)
+		reserveContentLength(pTarget);
+	pTarget->pBuffer->append(ptr, read_data_size);
+	return read_data_size;
+}
+
+static size_t on_write_header(const char* ptr, size_t size, size_t nmemb, void* data)
+{
+	string* pHeader = (string*)data;
+	size_t read_data_size = size * nmemb;
+	pHeader->append(ptr, read_data_size);
+	return read_data_size;
+}
+
+static long long secondsToMicros(double dSeconds)
+{
+	return (long long)(dSeconds * 1000000.0);
+}
+
+static void getTimings(CURL* curl, CHttpTimings* pTimings)
+{
+	if (pTimings == NULL)
+		return;
+
+	double dNameLookup = 0, dConnect = 0, dAppConnect = 0, dPreTransfer = 0, dStartTransfer = 0, dTotal = 0;
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME, &dNameLookup);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME, &dConnect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME, &dAppConnect);
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME, &dPreTransfer);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME, &dStartTransfer);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME, &dTotal);
+	pTimings->llNameLookup = secondsToMicros(dNameLookup);
+	pTimings->llConnect = secondsToMicros(dConnect);
+	pTimings->llAppConnect = secondsToMicros(dAppConnect);
+	pTimings->llPreTransfer = secondsToMicros(dPreTransfer);
+	pTimings->llStartTransfer = secondsToMicros(dStartTransfer);
+	pTimings->llTotal = secondsToMicros(dTotal);
+}
+
+#if LIBCURL_VERSION_NUM >= 0x071c00
+static long long elapsedMs(chrono::steady_clock::time_point start)
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+}
+
+//primary and hedge in one multi handle on the calling thread, the winner's body ends up in target
+static int performHedged(CURL* curl, CHttpWriteTarget& target, const CHttpHedge& hedge, CHttpTimings* pTimings)
+{
+	CURLM* multi = curl_multi_init();
+	if (multi == NULL)
 	{
-		size_t read_data_size = size * nmemb;
-		buffer->append((const char *)ptr, read_data_size);
-		return read_data_size;
+		int ret = curl_easy_perform(curl);
+		getTimings(curl, pTimings);
+		return ret;
+	}
+
+	string strHedgeResps;
+	CPayBufferPool::acquire(strHedgeResps);
+	CHttpWriteTarget hedgeTarget(NULL, &strHedgeResps);
+	CURL* hedgeCurl = NULL;
+	bool bHedgeAsked = false;
+	int iActive = 1;
+	int ret = UNKNOW_ERROR;
+	CURL* winner = NULL;
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+	curl_multi_add_handle(multi, curl);
+	while (winner == NULL && iActive > 0)
+	{
+		int iRunning = 0;
+		curl_multi_perform(multi, &iRunning);
+		int iLeft = 0;
+		for (CURLMsg* pMsg = curl_multi_info_read(multi, &iLeft); pMsg != NULL; pMsg = curl_multi_info_read(multi, &iLeft))
+		{
+			if (pMsg->msg != CURLMSG_DONE)
+				continue;
+			CURL* done = pMsg->easy_handle;
+			ret = pMsg->data.result;
+			curl_multi_remove_handle(multi, done);
+			--iActive;
+			//a failure waits for the other transfer, the last code is returned if both fail
+			if (ret == CURLE_OK || iActive == 0)
+			{
+				winner = done;
+				break;
+			}
+		}
+		if (winner != NULL || iActive == 0)
+			break;
+
+		long long llWaitMs = 1000;
+		if (!bHedgeAsked)
+		{
+			long long llLeftMs = hedge.iDelayMs - elapsedMs(start);
+			if (llLeftMs <= 0)
+			{
+				bHedgeAsked = true;
+				if (!hedge.allow || hedge.allow())
+				{
+					hedgeCurl = curl_easy_duphandle(curl);
+					if (hedgeCurl != NULL)
+					{
+						hedgeTarget.curl = hedgeCurl;
+						curl_easy_setopt(hedgeCurl, CURLOPT_WRITEDATA, &hedgeTarget);
+						curl_multi_add_handle(multi, hedgeCurl);
+						++iActive;
+					}
+				}
+				llWaitMs = 0;
+			}
+			else
+			{
+				llWaitMs = min(llWaitMs, llLeftMs);
+			}
+		}
+		curl_multi_wait(multi, NULL, 0, (int)llWaitMs, NULL);
+	}
+
+	if (winner == NULL)
+		winner = curl;
+	getTimings(winner, pTimings);
+	if (winner == hedgeCurl && ret == CURLE_OK)
+		target.pBuffer->swap(strHedgeResps);
+
+	//the loser is dropped mid transfer, only read only calls are hedged
+	curl_multi_remove_handle(multi, curl);
+	if (hedgeCurl != NULL)
+	{
+		curl_multi_remove_handle(multi, hedgeCurl);
+		curl_easy_cleanup(hedgeCurl);
 	}
-	return -1;
+	curl_multi_cleanup(multi);
+	CPayBufferPool::release(strHedgeResps);
+	return ret;
+}
+#endif
+
+static int perform(CURL* curl, CHttpWriteTarget& target, const CHttpHedge* pHedge, CHttpTimings* pTimings)
+{
+#if LIBCURL_VERSION_NUM >= 0x071c00
+	if (pHedge != NULL)
+		return performHedged(curl, target, *pHedge, pTimings);
+#endif
+
+	int ret = curl_easy_perform(curl);
+	getTimings(curl, pTimings);
+	return ret;
 }
 
 int CHttpClient::post(
 	const string& strHref,
 	const string& strData,
 	string& strRespsContent,
-	string& strRespsHeader /*= string("")*/,
+	string* pRespsHeader /*= nullptr*/,
 	int iTimeOut /*= HTTPCLIENT_DEFAULT_TOME_OUT*/,
-	const vector<string>& vecHeader /*= vector<string>()*/
+	const vector<string>& vecHeader /*= vector<string>()*/,
+	CHttpTimings* pTimings /*= nullptr*/,
+	const CHttpHedge* pHedge /*= nullptr*/
 ) 
 {
 	int ret = UNKNOW_ERROR;
-	CURL *curl = curl_easy_init();
+	CHttpShare& share = CHttpShare::plain();
+	CURL* curl = share.acquireHandle();
 	if (curl) 
 	{
 		struct curl_slist* headers = NULL;
@@ -56,14 +421,18 @@ int CHttpClient::post(
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, strData.c_str());
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strData.size());
+		CHttpWriteTarget target(curl, &strRespsContent);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_write_data);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &strRespsContent);
-		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, on_write_data);
-		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &strRespsHeader);
-		ret = curl_easy_perform(curl);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+		if (pRespsHeader != NULL)
+		{
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, on_write_header);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, pRespsHeader);
+		}
+		ret = perform(curl, target, pRespsHeader == NULL ? pHedge : NULL, pTimings);
 		if (headers != NULL)
 			curl_slist_free_all(headers);
-		curl_easy_cleanup(curl);
+		share.releaseHandle(curl);
 	}
 	return ret;
 }
@@ -71,11 +440,14 @@ int CHttpClient::post(
 int CHttpClient::get(
 	const string &strHref,
 	string& strRespsContent,
-	int iTimeOut /*= HTTPCLIENT_DEFAULT_TOME_OUT*/
+	int iTimeOut /*= HTTPCLIENT_DEFAULT_TOME_OUT*/,
+	CHttpTimings* pTimings /*= nullptr*/,
+	const CHttpHedge* pHedge /*= nullptr*/
 )
 {
 	int ret = UNKNOW_ERROR;
-	CURL* curl = curl_easy_init();
+	CHttpShare& share = CHttpShare::plain();
+	CURL* curl = share.acquireHandle();
 	if (curl)
 	{
 		curl_easy_setopt(curl, CURLOPT_URL, strHref.c_str());
@@ -84,10 +456,55 @@ int CHttpClient::get(
 		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5);
 		curl_easy_setopt(curl, CURLOPT_TIMEOUT, iTimeOut);
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
+		CHttpWriteTarget target(curl, &strRespsContent);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_write_data);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &strRespsContent);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+		ret = perform(curl, target, pHedge, pTimings);
+		share.releaseHandle(curl);
+	}
+	return ret;
+}
+
+static size_t on_download_data(const char* ptr, size_t size, size_t nmemb, void* data)
+{
+	const CHttpDataFunc* pOnData = (const CHttpDataFunc*)data;
+	size_t read_data_size = size * nmemb;
+	if (read_data_size == 0 || (*pOnData)(ptr, read_data_size))
+		return read_data_size;
+	return 0;
+}
+
+int CHttpClient::download(
+	const string& strHref,
+	const string& strData,
+	const CHttpDataFunc& onData,
+	int iTimeOut /*= HTTPCLIENT_DOWNLOAD_TIME_OUT*/,
+	CHttpTimings* pTimings /*= nullptr*/
+)
+{
+	int ret = UNKNOW_ERROR;
+	CHttpShare& share = CHttpShare::plain();
+	CURL* curl = share.acquireHandle();
+	if (curl)
+	{
+		curl_easy_setopt(curl, CURLOPT_URL, strHref.c_str());
+		if (!strData.empty())
+		{
+			curl_easy_setopt(curl, CURLOPT_POST, true);
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, strData.c_str());
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strData.size());
+		}
+		curl_easy_setopt(curl, CURLOPT_READFUNCTION, NULL);
+		curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5);
+		curl_easy_setopt(curl, CURLOPT_TIMEOUT, iTimeOut);
+		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
+		curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_download_data);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &onData);
 		ret = curl_easy_perform(curl);
-		curl_easy_cleanup(curl);
+		getTimings(curl, pTimings);
+		share.releaseHandle(curl);
 	}
 	return ret;
 }
@@ -98,13 +515,36 @@ int CHttpClient::postWithCert(
 	const string& strCertPath,
 	const string& strKeyPath,
 	string& strRespsContent,
-	string& strRespsHeader /*= string("")*/,
+	string* pRespsHeader /*= nullptr*/,
 	int iTimeOut /*= HTTPCLIENT_DEFAULT_TOME_OUT*/,
-	const vector<string>& vecHeader /*= vector<string>()*/
+	const vector<string>& vecHeader /*= vector<string>()*/,
+	CHttpTimings* pTimings /*= nullptr*/,
+	const CHttpHedge* pHedge /*= nullptr*/
+)
+{
+	CHttpCertData cert;
+	cert.strCertPath = strCertPath;
+	cert.strKeyPath = strKeyPath;
+	cert.llCertMTime = 0;
+	cert.llKeyMTime = 0;
+	return postWithCert(strHref, strData, cert, strRespsContent, pRespsHeader, iTimeOut, vecHeader, pTimings, pHedge);
+}
+
+int CHttpClient::postWithCert(
+	const string& strHref,
+	const string& strData,
+	const CHttpCertData& cert,
+	string& strRespsContent,
+	string* pRespsHeader /*= nullptr*/,
+	int iTimeOut /*= HTTPCLIENT_DEFAULT_TOME_OUT*/,
+	const vector<string>& vecHeader /*= vector<string>()*/,
+	CHttpTimings* pTimings /*= nullptr*/,
+	const CHttpHedge* pHedge /*= nullptr*/
 )
 {
 	int ret = UNKNOW_ERROR;
-	CURL *curl = curl_easy_init();
+	CHttpShare& share = CHttpShare::get(cert.strCertPath + '\n' + cert.strKeyPath);
+	CURL* curl = share.acquireHandle();
 	if (curl)
 	{
 		struct curl_slist* headers = NULL;
@@ -118,20 +558,37 @@ int CHttpClient::postWithCert(
 		curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 5);
 		curl_easy_setopt(curl, CURLOPT_TIMEOUT, iTimeOut);
 		curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, false);
-		curl_easy_setopt(curl, CURLOPT_SSLCERT, strCertPath.c_str());
+#if LIBCURL_VERSION_NUM >= 0x074700
+		//cert outlives the perform, curl does not need its own copy
+		struct curl_blob certBlob = { (void*)cert.strCert.data(), cert.strCert.size(), CURL_BLOB_NOCOPY };
+		struct curl_blob keyBlob = { (void*)cert.strKey.data(), cert.strKey.size(), CURL_BLOB_NOCOPY };
+		if (!cert.strCert.empty() && !cert.strKey.empty())
+		{
+			curl_easy_setopt(curl, CURLOPT_SSLCERT_BLOB, &certBlob);
+			curl_easy_setopt(curl, CURLOPT_SSLKEY_BLOB, &keyBlob);
+		}
+		else
+#endif
+		{
+			curl_easy_setopt(curl, CURLOPT_SSLCERT, cert.strCertPath.c_str());
+			curl_easy_setopt(curl, CURLOPT_SSLKEY, cert.strKeyPath.c_str());
+		}
 		curl_easy_setopt(curl, CURLOPT_SSLCERTTYPE, "PEM");
-		curl_easy_setopt(curl, CURLOPT_SSLKEY, strKeyPath.c_str());
 		curl_easy_setopt(curl, CURLOPT_SSLKEYTYPE, "PEM");
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDS, strData.c_str());
 		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, strData.size());
+		CHttpWriteTarget target(curl, &strRespsContent);
 		curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, on_write_data);
-		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &strRespsContent);
-		curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, on_write_data);
-		curl_easy_setopt(curl, CURLOPT_HEADERDATA, &strRespsHeader);
-		ret = curl_easy_perform(curl);
+		curl_easy_setopt(curl, CURLOPT_WRITEDATA, &target);
+		if (pRespsHeader != NULL)
+		{
+			curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, on_write_header);
+			curl_easy_setopt(curl, CURLOPT_HEADERDATA, pRespsHeader);
+		}
+		ret = perform(curl, target, pRespsHeader == NULL ? pHedge : NULL, pTimings);
 		if (headers != NULL)
 			curl_slist_free_all(headers);
-		curl_easy_cleanup(curl);
+		share.releaseHandle(curl);
 	}
 	return ret;
 }
\ No newline at end of file
@@ -1,12 +1,105 @@
 #pragma once
 #include <map>
+#include <mutex>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <string>
+#include <ctime>
+#include <functional>
 
 #define HTTPCLIENT_DEFAULT_TOME_OUT 30
 
+//bills run to hundreds of MB
+#define HTTPCLIENT_DOWNLOAD_TIME_OUT 1800
+
+//largest Content-Length reserved up front, a bogus header cannot make us allocate more
+#define HTTPCLIENT_MAX_RESERVE (16 * 1024 * 1024)
+
+//seconds between two mtime checks of a client certificate
+#define HTTPCLIENT_CERT_CHECK_INTERVAL 5
+
 namespace SAPay{
 
+//curl CURLINFO_*_TIME in microseconds, every value is an offset from the start of the transfer
+struct CHttpTimings
+{
+	CHttpTimings() :
+		llNameLookup(0),
+		llConnect(0),
+		llAppConnect(0),
+		llPreTransfer(0),
+		llStartTransfer(0),
+		llTotal(0) {}
+
+	long long llNameLookup;
+	long long llConnect;
+	long long llAppConnect;
+	long long llPreTransfer;
+	long long llStartTransfer;
+	long long llTotal;
+};
+
+//pem contents of a client certificate and its key
+struct CHttpCertData
+{
+	std::string strCertPath;
+	std::string strKeyPath;
+	std::string strCert;
+	std::string strKey;
+	time_t llCertMTime;
+	time_t llKeyMTime;
+};
+
+/**
+* @name CHttpClientCert
+*
+* @brief								client certificate loaded once into memory and handed to curl as a blob,
+*										no disk read nor file open on the request path.
+*										the files are stat'ed at most every HTTPCLIENT_CERT_CHECK_INTERVAL seconds
+*										and reloaded when their mtime changes, in-flight requests keep the old pem
+*/
+class CHttpClientCert
+{
+public:
+	//one per cert/key pair for the whole process
+	static std::shared_ptr<CHttpClientCert> get(const std::string& strCertPath, const std::string& strKeyPath);
+
+	CHttpClientCert(const std::string& strCertPath, const std::string& strKeyPath);
+
+	CHttpClientCert(const CHttpClientCert&) = delete;
+	CHttpClientCert& operator=(const CHttpClientCert&) = delete;
+
+	//nullptr if the files could never be read
+	std::shared_ptr<const CHttpCertData> current();
+
+private:
+	void reloadIfChanged();
+
+	std::string m_strCertPath;
+	std::string m_strKeyPath;
+	std::shared_ptr<const CHttpCertData> m_pData;
+	std::atomic<long long> m_llNextCheckMs;
+	std::mutex m_mutexReload;
+};
+
+//a second copy of a slow transfer, sent from the same thread through curl multi. the first success wins
+//and the other transfer is dropped. ignored when response headers are asked for
+struct CHttpHedge
+{
+	CHttpHedge() :iDelayMs(0) {}
+
+	int iDelayMs;
+
+	//asked once when the delay is over, false keeps the single transfer
+	std::function<bool()> allow;
+};
+
+//false aborts the transfer
+using CHttpDataFunc = std::function<bool(const char*, size_t)>;
+
+//the body is appended to strRespsContent, reserved from Content-Length when the server sends one.
+//headers are only collected when pRespsHeader is given
 class CHttpClient
 {
 public:
@@ -16,7 +109,9 @@ public:
 	static int get(
 		const std::string &strHref,
 		std::string& strRespsContent,
-		int iTimeOut = HTTPCLIENT_DEFAULT_TOME_OUT
+		int iTimeOut = HTTPCLIENT_DEFAULT_TOME_OUT,
+		CHttpTimings* pTimings = nullptr,
+		const CHttpHedge* pHedge = nullptr
 	);
 
 
@@ -24,9 +119,11 @@ public:
 		const std::string& strHref,
 		const std::string& strData,
 		std::string& strRespsContent,
-		std::string& strRespsHeader = std::string(""),
+		std::string* pRespsHeader = nullptr,
 		int iTimeOut = HTTPCLIENT_DEFAULT_TOME_OUT,
-		const std::vector<std::string>& vecHeader = std::vector<std::string>()
+		const std::vector<std::string>& vecHeader = std::vector<std::string>(),
+		CHttpTimings* pTimings = nullptr,
+		const CHttpHedge* pHedge = nullptr
 	);
 
 
@@ -36,9 +133,34 @@ public:
 		const std::string& strCertPath,
 		const std::string& strKeyPath,
 		std::string& strRespsContent,
-		std::string& strRespsHeader = std::string(""),
+		std::string* pRespsHeader = nullptr,
+		int iTimeOut = HTTPCLIENT_DEFAULT_TOME_OUT,
+		const std::vector<std::string>& vecHeader = std::vector<std::string>(),
+		CHttpTimings* pTimings = nullptr,
+		const CHttpHedge* pHedge = nullptr
+	);
+
+	//body handed to onData as it arrives instead of being buffered, POST if strData is not empty.
+	//http errors (4xx/5xx) fail the transfer
+	static int download(
+		const std::string& strHref,
+		const std::string& strData,
+		const CHttpDataFunc& onData,
+		int iTimeOut = HTTPCLIENT_DOWNLOAD_TIME_OUT,
+		CHttpTimings* pTimings = nullptr
+	);
+
+	//cert and key from memory, needs libcurl 7.71, older versions fall back to the file paths
+	static int postWithCert(
+		const std::string& strHref,
+		const std::string& strData,
+		const CHttpCertData& cert,
+		std::string& strRespsContent,
+		std::string* pRespsHeader = nullptr,
 		int iTimeOut = HTTPCLIENT_DEFAULT_TOME_OUT,
-		const std::vector<std::string>& vecHeader = std::vector<std::string>()
+		const std::vector<std::string>& vecHeader = std::vector<std::string>(),
+		CHttpTimings* pTimings = nullptr,
+		const CHttpHedge* pHedge = nullptr
 	);
 };
 
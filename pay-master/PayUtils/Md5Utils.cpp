@@ -2,6 +2,8 @@
 //
 //////////////////////////////////////////////////////////////////////
 #include "Md5Utils.h"
+#include "PayHex.h"
+#include <cstring>
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
 //////////////////////////////////////////////////////////////////////
@@ -302,15 +304,9 @@ void Md5Utils::encStr32(const char* pcData, std::string& dest)
 void Md5Utils::encStr32(const char* pcData,unsigned int ilen, std::string& dest)
 {
 	unsigned char digest[16];//ɢн
-	char buffer[33] = "\0";         //ɢн16ʽ
 	MD5Update((unsigned char*)pcData, ilen);
 	MD5Final(digest);
-	for(int i = 0;i < 16; i ++){
-	
-		sprintf(&buffer[i*2], "%02X", digest[i]);
-	}
-
-	dest = buffer;
+	dest = CPayHex::encode(digest, sizeof(digest), true);
 }
 
 void Md5Utils::encStr16(const char* pcData, unsigned int ilen, unsigned char* encryptedData)
@@ -340,9 +336,8 @@ bool Md5Utils::encFile32(const char *path, char *hex32)
 
 	MD5Final(digest);
 
-	for (int i = 0; i < 16; i++) {
-		sprintf(&hex32[i * 2], "%02x", digest[i]);
-	}
+	CPayHex::encode(digest, sizeof(digest), hex32);
+	hex32[32] = 0;
 
 	return true;
 }
@@ -0,0 +1,84 @@
+#include "PayAes.h"
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <map>
+#include <mutex>
+#include <climits>
+
+#define PAY_AES_KEY_SIZE 32
+#define PAY_AES_BLOCK_SIZE 16
+
+using namespace SAPay;
+using namespace std;
+
+shared_ptr<CPayAes256Ecb> CPayAes256Ecb::get(const string& strKey)
+{
+	//keyed by the sha256 of the key so the raw key is only held inside the cipher context
+	static mutex s_mutex;
+	static map<string, weak_ptr<CPayAes256Ecb>> s_mapCiphers;
+
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256((const unsigned char*)strKey.data(), strKey.size(), digest);
+	string strCacheKey((const char*)digest, sizeof(digest));
+
+	lock_guard<mutex> lock(s_mutex);
+	weak_ptr<CPayAes256Ecb>& pWeakCipher = s_mapCiphers[strCacheKey];
+	shared_ptr<CPayAes256Ecb> pCipher = pWeakCipher.lock();
+	if (!pCipher)
+	{
+		pCipher = std::make_shared<CPayAes256Ecb>(strKey);
+		pWeakCipher = pCipher;
+
+		//rotated keys do not keep their slot
+		for (auto itr = s_mapCiphers.begin(); itr != s_mapCiphers.end();)
+		{
+			if (itr->second.expired())
+				itr = s_mapCiphers.erase(itr);
+			else
+				++itr;
+		}
+	}
+	return pCipher;
+}
+
+CPayAes256Ecb::CPayAes256Ecb(const string& strKey) :
+	m_pCtx(nullptr)
+{
+	if (strKey.size() != PAY_AES_KEY_SIZE)
+		return;
+
+	m_pCtx = EVP_CIPHER_CTX_new();
+	if (m_pCtx && EVP_DecryptInit_ex(m_pCtx, EVP_aes_256_ecb(), nullptr, (const unsigned char*)strKey.data(), nullptr) != 1)
+	{
+		EVP_CIPHER_CTX_free(m_pCtx);
+		m_pCtx = nullptr;
+	}
+}
+
+CPayAes256Ecb::~CPayAes256Ecb()
+{
+	if (m_pCtx)
+		EVP_CIPHER_CTX_free(m_pCtx);
+}
+
+bool CPayAes256Ecb::decrypt(const unsigned char* pData, size_t iLen, string& strOut) const
+{
+	if (!m_pCtx || iLen == 0 || iLen % PAY_AES_BLOCK_SIZE != 0 || iLen > INT_MAX)
+		return false;
+
+	EVP_CIPHER_CTX* pCtx = EVP_CIPHER_CTX_new();
+	if (!pCtx)
+		return false;
+
+	//the plain text is never longer than the cipher text
+	strOut.resize(iLen);
+	unsigned char* pOut = (unsigned char*)&strOut[0];
+	int iUpdateLen = 0, iFinalLen = 0;
+	bool bRet = EVP_CIPHER_CTX_copy(pCtx, m_pCtx) == 1 &&
+		EVP_DecryptUpdate(pCtx, pOut, &iUpdateLen, pData, (int)iLen) == 1 &&
+		EVP_DecryptFinal_ex(pCtx, pOut + iUpdateLen, &iFinalLen) == 1;
+	EVP_CIPHER_CTX_free(pCtx);
+
+	strOut.resize(bRet ? iUpdateLen + iFinalLen : 0);
+	return bRet;
+}
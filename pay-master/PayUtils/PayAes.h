@@ -0,0 +1,37 @@
+#pragma once
+#include <string>
+#include <memory>
+#include <cstddef>
+
+typedef struct evp_cipher_ctx_st EVP_CIPHER_CTX;
+
+namespace SAPay {
+
+/**
+* @name CPayAes256Ecb
+*
+* @brief								aes-256-ecb decryption with pkcs7 padding through openssl evp (aes-ni when the
+*										cpu has it). the key schedule is expanded once, each decrypt copies the prepared
+*										context so one instance is shared by any number of threads
+*/
+class CPayAes256Ecb
+{
+public:
+	//one instance per key in the process, released with its last user
+	static std::shared_ptr<CPayAes256Ecb> get(const std::string& strKey);
+
+	//strKey is 32 bytes
+	explicit CPayAes256Ecb(const std::string& strKey);
+	~CPayAes256Ecb();
+
+	CPayAes256Ecb(const CPayAes256Ecb&) = delete;
+	CPayAes256Ecb& operator=(const CPayAes256Ecb&) = delete;
+
+	//false on a bad key, a length that is not whole blocks or bad padding
+	bool decrypt(const unsigned char* pData, size_t iLen, std::string& strOut) const;
+
+private:
+	EVP_CIPHER_CTX* m_pCtx;
+};
+
+}
@@ -0,0 +1,110 @@
+#include "PayArena.h"
+#include <new>
+#include <cstdint>
+#include <algorithm>
+
+using namespace SAPay;
+using namespace std;
+
+//resource of the outermost open scope on this thread
+static thread_local CPayMemoryResource* t_pCurrent = nullptr;
+
+static CPayMonotonicArena& threadArena()
+{
+	static thread_local CPayMonotonicArena t_arena;
+	return t_arena;
+}
+
+CPayMonotonicArena::CPayMonotonicArena(size_t iInitialSize) :
+	m_pBlocks(nullptr),
+	m_pCur(nullptr),
+	m_pEnd(nullptr),
+	m_iNextSize(max<size_t>(iInitialSize, 256)),
+	m_iUsed(0)
+{
+}
+
+CPayMonotonicArena::~CPayMonotonicArena()
+{
+	while (m_pBlocks)
+	{
+		CBlock* pNext = m_pBlocks->pNext;
+		::operator delete(m_pBlocks);
+		m_pBlocks = pNext;
+	}
+}
+
+void* CPayMonotonicArena::allocate(size_t iBytes, size_t iAlign)
+{
+	uintptr_t iCur = ((uintptr_t)m_pCur + iAlign - 1) & ~(uintptr_t)(iAlign - 1);
+	if (!m_pCur || iCur + iBytes > (uintptr_t)m_pEnd)
+	{
+		//the header keeps the data max_align_t aligned
+		size_t iHeader = (sizeof(CBlock) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+		size_t iSize = max(m_iNextSize, iBytes + iAlign + iHeader);
+		CBlock* pBlock = (CBlock*)::operator new(iSize);
+		pBlock->pNext = m_pBlocks;
+		pBlock->iSize = iSize;
+		m_pBlocks = pBlock;
+		m_pCur = (char*)pBlock + iHeader;
+		m_pEnd = (char*)pBlock + iSize;
+		m_iNextSize = iSize * 2;
+		iCur = ((uintptr_t)m_pCur + iAlign - 1) & ~(uintptr_t)(iAlign - 1);
+	}
+
+	m_pCur = (char*)(iCur + iBytes);
+	m_iUsed += iBytes;
+	return (void*)iCur;
+}
+
+void CPayMonotonicArena::release()
+{
+	if (!m_pBlocks)
+		return;
+
+	//the newest block is the largest
+	CBlock* pKeep = m_pBlocks;
+	CBlock* pBlock = pKeep->pNext;
+	while (pBlock)
+	{
+		CBlock* pNext = pBlock->pNext;
+		::operator delete(pBlock);
+		pBlock = pNext;
+	}
+	pKeep->pNext = nullptr;
+
+	size_t iHeader = (sizeof(CBlock) + alignof(max_align_t) - 1) / alignof(max_align_t) * alignof(max_align_t);
+	m_pCur = (char*)pKeep + iHeader;
+	m_pEnd = (char*)pKeep + pKeep->iSize;
+	m_iNextSize = pKeep->iSize * 2;
+	m_iUsed = 0;
+}
+
+CPayArenaScope::CPayArenaScope() :
+	CPayArenaScope(nullptr)
+{
+}
+
+CPayArenaScope::CPayArenaScope(CPayMemoryResource* pResource) :
+	m_pResource(t_pCurrent),
+	m_pPrevious(t_pCurrent),
+	m_bReleaseOnExit(false)
+{
+	if (!m_pResource && pResource)
+	{
+		m_pResource = pResource;
+	}
+	else if (!m_pResource)
+	{
+		m_pResource = &threadArena();
+		m_bReleaseOnExit = true;
+	}
+	t_pCurrent = m_pResource;
+}
+
+CPayArenaScope::~CPayArenaScope()
+{
+	t_pCurrent = m_pPrevious;
+	if (m_bReleaseOnExit)
+		threadArena().release();
+}
@@ -0,0 +1,111 @@
+#pragma once
+#include <cstddef>
+#include <string>
+
+namespace SAPay {
+
+//same contract as std::pmr::memory_resource, which vs2015 does not have
+class CPayMemoryResource
+{
+public:
+	virtual ~CPayMemoryResource() {}
+
+	virtual void* allocate(size_t iBytes, size_t iAlign = alignof(std::max_align_t)) = 0;
+	virtual void deallocate(void* p, size_t iBytes, size_t iAlign = alignof(std::max_align_t)) = 0;
+};
+
+/**
+* @name CPayMonotonicArena
+*
+* @brief								bump allocation from blocks that double in size, deallocate does nothing.
+*										release() frees everything at once and keeps the largest block for the next round.
+*										not thread safe, each thread has its own through CPayArenaScope
+*/
+class CPayMonotonicArena : public CPayMemoryResource
+{
+public:
+	explicit CPayMonotonicArena(size_t iInitialSize = 4096);
+	~CPayMonotonicArena();
+
+	CPayMonotonicArena(const CPayMonotonicArena&) = delete;
+	CPayMonotonicArena& operator=(const CPayMonotonicArena&) = delete;
+
+	void* allocate(size_t iBytes, size_t iAlign = alignof(std::max_align_t)) override;
+	void deallocate(void*, size_t, size_t = alignof(std::max_align_t)) override {}
+
+	void release();
+
+	//bytes handed out since the last release
+	size_t getUsed() const { return m_iUsed; }
+
+private:
+	struct CBlock
+	{
+		CBlock* pNext;
+		size_t iSize;
+	};
+
+	CBlock* m_pBlocks;
+	char* m_pCur;
+	char* m_pEnd;
+	size_t m_iNextSize;
+	size_t m_iUsed;
+};
+
+/**
+* @name CPayArenaScope
+*
+* @brief								working memory for one call. the outermost scope on a thread picks the resource:
+*										the one passed in, or the thread's CPayMonotonicArena, which is released when that
+*										scope ends. nested scopes share it. nothing allocated in a scope may outlive it
+*/
+class CPayArenaScope
+{
+public:
+	CPayArenaScope();
+
+	//pResource is only used if no scope is open on this thread yet, nullptr for the thread's arena
+	explicit CPayArenaScope(CPayMemoryResource* pResource);
+	~CPayArenaScope();
+
+	CPayArenaScope(const CPayArenaScope&) = delete;
+	CPayArenaScope& operator=(const CPayArenaScope&) = delete;
+
+	CPayMemoryResource* resource() const { return m_pResource; }
+
+private:
+	CPayMemoryResource* m_pResource;
+	CPayMemoryResource* m_pPrevious;
+	bool m_bReleaseOnExit;
+};
+
+//std allocator over a CPayMemoryResource, like std::pmr::polymorphic_allocator
+template<typename T>
+class CPayArenaAllocator
+{
+public:
+	using value_type = T;
+
+	CPayArenaAllocator(CPayMemoryResource* pResource) noexcept : m_pResource(pResource) {}
+
+	template<typename U>
+	CPayArenaAllocator(const CPayArenaAllocator<U>& other) noexcept : m_pResource(other.resource()) {}
+
+	T* allocate(size_t n) { return (T*)m_pResource->allocate(n * sizeof(T), alignof(T)); }
+	void deallocate(T* p, size_t n) { m_pResource->deallocate(p, n * sizeof(T), alignof(T)); }
+
+	CPayMemoryResource* resource() const { return m_pResource; }
+
+private:
+	CPayMemoryResource* m_pResource;
+};
+
+template<typename T, typename U>
+bool operator==(const CPayArenaAllocator<T>& a, const CPayArenaAllocator<U>& b) { return a.resource() == b.resource(); }
+
+template<typename T, typename U>
+bool operator!=(const CPayArenaAllocator<T>& a, const CPayArenaAllocator<U>& b) { return a.resource() != b.resource(); }
+
+using CPayArenaString = std::basic_string<char, std::char_traits<char>, CPayArenaAllocator<char>>;
+
+}
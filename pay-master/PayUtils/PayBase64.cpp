@@ -0,0 +1,274 @@
+#include "PayBase64.h"
+#include <cstring>
+#include <cstdint>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define PAY_BASE64_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+//msvc emits avx2 intrinsics without /arch, gcc and clang need it per function
+#if defined(PAY_BASE64_AVX2) && !defined(_MSC_VER)
+#define PAY_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define PAY_AVX2_TARGET
+#endif
+
+//any value with the high bit set is outside the alphabet
+#define PAY_BASE64_INVALID 0xff
+
+using namespace SAPay;
+using namespace std;
+
+static const char s_szAlphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+struct CDecodeTable
+{
+	CDecodeTable()
+	{
+		memset(values, PAY_BASE64_INVALID, sizeof(values));
+		for (int i = 0; i < 64; ++i)
+			values[(unsigned char)s_szAlphabet[i]] = (unsigned char)i;
+	}
+
+	unsigned char values[256];
+};
+
+static const unsigned char* getDecodeTable()
+{
+	static const CDecodeTable s_table;
+	return s_table.values;
+}
+
+#ifdef PAY_BASE64_AVX2
+//24 input bytes, 12 per 128 bit lane, into 32 sextets
+PAY_AVX2_TARGET static __m256i encodeReshuffle(__m256i in)
+{
+	in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+		10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+	__m256i t0 = _mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00));
+	__m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+	__m256i t2 = _mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0));
+	__m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+	return _mm256_or_si256(t1, t3);
+}
+
+//sextets to ascii: add the offset of the alphabet range each value falls in
+PAY_AVX2_TARGET static __m256i encodeTranslate(__m256i in)
+{
+	const __m256i offsets = _mm256_setr_epi8(
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+		65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+	__m256i indices = _mm256_subs_epu8(in, _mm256_set1_epi8(51));
+	indices = _mm256_sub_epi8(indices, _mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+	return _mm256_add_epi8(in, _mm256_shuffle_epi8(offsets, indices));
+}
+
+//returns the bytes consumed, a multiple of 24
+PAY_AVX2_TARGET static size_t encodeAvx2(const unsigned char* pIn, size_t iLen, char* pOut)
+{
+	size_t iDone = 0;
+
+	//the high lane reads 16 bytes from +12
+	for (; iLen - iDone >= 28; iDone += 24, pOut += 32)
+	{
+		__m128i lo = _mm_loadu_si128((const __m128i*)(pIn + iDone));
+		__m128i hi = _mm_loadu_si128((const __m128i*)(pIn + iDone + 12));
+		__m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+		_mm256_storeu_si256((__m256i*)pOut, encodeTranslate(encodeReshuffle(in)));
+	}
+	return iDone;
+}
+
+//returns the chars consumed, a multiple of 32. stops before a block holding anything outside the alphabet
+PAY_AVX2_TARGET static size_t decodeAvx2(const char* pIn, size_t iLen, unsigned char* pOut)
+{
+	const __m256i lutLo = _mm256_setr_epi8(
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+		0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+	const __m256i lutHi = _mm256_setr_epi8(
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+		0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+	const __m256i lutRoll = _mm256_setr_epi8(
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+		0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m256i mask2F = _mm256_set1_epi8(0x2f);
+
+	size_t iDone = 0;
+
+	//each store writes 32 bytes of which 24 are output, 48 chars left keep it inside the output
+	//and the padded last quad out of the vector loop
+	for (; iLen - iDone >= 48; iDone += 32, pOut += 24)
+	{
+		__m256i in = _mm256_loadu_si256((const __m256i*)(pIn + iDone));
+		__m256i hiNibbles = _mm256_and_si256(_mm256_srli_epi32(in, 4), mask2F);
+		__m256i loNibbles = _mm256_and_si256(in, mask2F);
+		__m256i hi = _mm256_shuffle_epi8(lutHi, hiNibbles);
+		__m256i lo = _mm256_shuffle_epi8(lutLo, loNibbles);
+		if (!_mm256_testz_si256(lo, hi))
+			break;
+
+		__m256i eq2F = _mm256_cmpeq_epi8(in, mask2F);
+		__m256i roll = _mm256_shuffle_epi8(lutRoll, _mm256_add_epi8(eq2F, hiNibbles));
+		in = _mm256_add_epi8(in, roll);
+
+		//pack four sextets into three bytes in each dword, then the 12 bytes of each lane together
+		__m256i merged = _mm256_maddubs_epi16(in, _mm256_set1_epi32(0x01400140));
+		merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+		merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+			2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+		merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+		_mm256_storeu_si256((__m256i*)pOut, merged);
+	}
+	return iDone;
+}
+#endif
+
+bool CPayBase64::hasAvx2()
+{
+#ifdef PAY_BASE64_AVX2
+	static const bool s_bAvx2 = []()
+	{
+#ifdef _MSC_VER
+		int regs[4];
+		__cpuid(regs, 0);
+		if (regs[0] < 7)
+			return false;
+
+		//avx2 needs the os to save ymm registers
+		__cpuid(regs, 1);
+		if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6)
+			return false;
+		__cpuidex(regs, 7, 0);
+		return (regs[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}();
+	return s_bAvx2;
+#else
+	return false;
+#endif
+}
+
+size_t CPayBase64::getDecodedSize(const char* pData, size_t iLen)
+{
+	if (iLen % 4 != 0 || iLen == 0)
+		return 0;
+
+	size_t iSize = iLen / 4 * 3;
+	if (pData[iLen - 1] == '=')
+		--iSize;
+	if (pData[iLen - 2] == '=')
+		--iSize;
+	return iSize;
+}
+
+void CPayBase64::encode(const void* pData, size_t iLen, char* pOut)
+{
+	const unsigned char* pIn = (const unsigned char*)pData;
+	size_t i = 0;
+#ifdef PAY_BASE64_AVX2
+	if (iLen >= 28 && hasAvx2())
+	{
+		i = encodeAvx2(pIn, iLen, pOut);
+		pOut += i / 3 * 4;
+	}
+#endif
+
+	for (; i + 3 <= iLen; i += 3, pOut += 4)
+	{
+		uint32_t iValue = (pIn[i] << 16) | (pIn[i + 1] << 8) | pIn[i + 2];
+		pOut[0] = s_szAlphabet[(iValue >> 18) & 0x3f];
+		pOut[1] = s_szAlphabet[(iValue >> 12) & 0x3f];
+		pOut[2] = s_szAlphabet[(iValue >> 6) & 0x3f];
+		pOut[3] = s_szAlphabet[iValue & 0x3f];
+	}
+
+	if (i < iLen)
+	{
+		uint32_t iValue = pIn[i] << 16;
+		if (i + 1 < iLen)
+			iValue |= pIn[i + 1] << 8;
+		pOut[0] = s_szAlphabet[(iValue >> 18) & 0x3f];
+		pOut[1] = s_szAlphabet[(iValue >> 12) & 0x3f];
+		pOut[2] = i + 1 < iLen ? s_szAlphabet[(iValue >> 6) & 0x3f] : '=';
+		pOut[3] = '=';
+	}
+}
+
+string CPayBase64::encode(const void* pData, size_t iLen)
+{
+	string strOut(getEncodedSize(iLen), '\0');
+	if (!strOut.empty())
+		encode(pData, iLen, &strOut[0]);
+	return strOut;
+}
+
+bool CPayBase64::decode(const char* pData, size_t iLen, unsigned char* pOut)
+{
+	if (iLen % 4 != 0)
+		return false;
+	if (iLen == 0)
+		return true;
+
+	const unsigned char* pTable = getDecodeTable();
+	size_t i = 0;
+#ifdef PAY_BASE64_AVX2
+	if (iLen >= 48 && hasAvx2())
+	{
+		i = decodeAvx2(pData, iLen, pOut);
+		pOut += i / 4 * 3;
+	}
+#endif
+
+	//every quad but the last has no padding
+	for (; i + 4 < iLen; i += 4, pOut += 3)
+	{
+		uint32_t a = pTable[(unsigned char)pData[i]];
+		uint32_t b = pTable[(unsigned char)pData[i + 1]];
+		uint32_t c = pTable[(unsigned char)pData[i + 2]];
+		uint32_t d = pTable[(unsigned char)pData[i + 3]];
+		if (((a | b | c | d) & 0x80) != 0)
+			return false;
+		uint32_t iValue = (a << 18) | (b << 12) | (c << 6) | d;
+		pOut[0] = (unsigned char)(iValue >> 16);
+		pOut[1] = (unsigned char)(iValue >> 8);
+		pOut[2] = (unsigned char)iValue;
+	}
+
+	bool bPad2 = pData[i + 2] == '=';
+	bool bPad3 = pData[i + 3] == '=';
+	if (bPad2 && !bPad3)
+		return false;
+
+	uint32_t a = pTable[(unsigned char)pData[i]];
+	uint32_t b = pTable[(unsigned char)pData[i + 1]];
+	uint32_t c = bPad2 ? 0 : pTable[(unsigned char)pData[i + 2]];
+	uint32_t d = bPad3 ? 0 : pTable[(unsigned char)pData[i + 3]];
+	if (((a | b | c | d) & 0x80) != 0)
+		return false;
+	uint32_t iValue = (a << 18) | (b << 12) | (c << 6) | d;
+	pOut[0] = (unsigned char)(iValue >> 16);
+	if (!bPad2)
+		pOut[1] = (unsigned char)(iValue >> 8);
+	if (!bPad3)
+		pOut[2] = (unsigned char)iValue;
+	return true;
+}
+
+bool CPayBase64::decode(const string& strData, string& strOut)
+{
+	if (strData.size() % 4 != 0)
+		return false;
+
+	strOut.resize(getDecodedSize(strData.data(), strData.size()));
+	if (strOut.empty())
+		return strData.empty();
+	return decode(strData.data(), strData.size(), (unsigned char*)&strOut[0]);
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+namespace SAPay {
+
+/**
+* @name CPayBase64
+*
+* @brief								standard alphabet base64 with padding (rfc 4648), no line breaks.
+*										24 bytes per step with avx2 when the cpu has it, checked once per process,
+*										scalar table lookup otherwise and for the tail. output is sized exactly up front
+*/
+class CPayBase64
+{
+public:
+	static size_t getEncodedSize(size_t iLen) { return (iLen + 2) / 3 * 4; }
+
+	//0 if iLen is not a multiple of 4
+	static size_t getDecodedSize(const char* pData, size_t iLen);
+
+	//pOut holds getEncodedSize(iLen) chars, no terminator is written
+	static void encode(const void* pData, size_t iLen, char* pOut);
+	static std::string encode(const void* pData, size_t iLen);
+
+	//pOut holds getDecodedSize bytes. false on a char outside the alphabet, misplaced padding
+	//or a length that is not a multiple of 4
+	static bool decode(const char* pData, size_t iLen, unsigned char* pOut);
+	static bool decode(const std::string& strData, std::string& strOut);
+
+	static bool hasAvx2();
+};
+
+}
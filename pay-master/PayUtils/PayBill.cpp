@@ -0,0 +1,655 @@
+#include "PayBill.h"
+#include "PayJournal.h"
+#include <cstring>
+#include <algorithm>
+#include <zlib.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PAY_BILL_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//zip record signatures
+#define PAY_ZIP_LOCAL_HEADER 0x04034b50
+#define PAY_ZIP_DATA_DESCRIPTOR 0x08074b50
+#define PAY_ZIP_LOCAL_HEADER_SIZE 30
+
+//general purpose flag: sizes and crc follow the data
+#define PAY_ZIP_FLAG_DESCRIPTOR 0x08
+
+using namespace SAPay;
+using namespace std;
+
+static int lowestBit(unsigned int iMask)
+{
+#ifdef _MSC_VER
+	unsigned long iIndex = 0;
+	_BitScanForward(&iIndex, iMask);
+	return (int)iIndex;
+#else
+	return __builtin_ctz(iMask);
+#endif
+}
+
+static const char* findByte(const char* p, const char* pEnd, char c)
+{
+#ifdef PAY_BILL_SSE2
+	const __m128i needle = _mm_set1_epi8(c);
+	for (; pEnd - p >= 16; p += 16)
+	{
+		int iMask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), needle));
+		if (iMask != 0)
+			return p + lowestBit((unsigned int)iMask);
+	}
+#endif
+	return (const char*)memchr(p, c, pEnd - p);
+}
+
+static unsigned int readLE16(const char* p)
+{
+	const unsigned char* q = (const unsigned char*)p;
+	return q[0] | (q[1] << 8);
+}
+
+static unsigned int readLE32(const char* p)
+{
+	const unsigned char* q = (const unsigned char*)p;
+	return q[0] | (q[1] << 8) | (q[2] << 16) | ((unsigned int)q[3] << 24);
+}
+
+CPayCsvSplitter::CPayCsvSplitter(const CPayBillRowFunc& onRow) :
+	m_onRow(onRow)
+{
+}
+
+bool CPayCsvSplitter::write(const char* pData, size_t iLen)
+{
+	const char* p = pData;
+	const char* pEnd = pData + iLen;
+	while (p < pEnd)
+	{
+		const char* pNewLine = findByte(p, pEnd, '\n');
+		if (pNewLine == NULL)
+		{
+			m_strCarry.append(p, pEnd - p);
+			return true;
+		}
+
+		bool bRet = false;
+		if (m_strCarry.empty())
+		{
+			bRet = splitLine(p, pNewLine - p);
+		}
+		else
+		{
+			m_strCarry.append(p, pNewLine - p);
+			bRet = splitLine(m_strCarry.data(), m_strCarry.size());
+			m_strCarry.clear();
+		}
+		if (!bRet)
+			return false;
+		p = pNewLine + 1;
+	}
+	return true;
+}
+
+bool CPayCsvSplitter::finish()
+{
+	if (m_strCarry.empty())
+		return true;
+	bool bRet = splitLine(m_strCarry.data(), m_strCarry.size());
+	m_strCarry.clear();
+	return bRet;
+}
+
+void CPayCsvSplitter::pushField(const char* pData, size_t iLen)
+{
+	while (iLen > 0 && (*pData == ' ' || *pData == '\t'))
+	{
+		++pData;
+		--iLen;
+	}
+	if (iLen > 0 && *pData == '`')
+	{
+		++pData;
+		--iLen;
+	}
+	while (iLen > 0 && (pData[iLen - 1] == ' ' || pData[iLen - 1] == '\t'))
+		--iLen;
+
+	CPayBillField field;
+	field.pData = pData;
+	field.iLen = iLen;
+	m_row.push_back(field);
+}
+
+bool CPayCsvSplitter::splitLine(const char* pLine, size_t iLen)
+{
+	if (iLen > 0 && pLine[iLen - 1] == '\r')
+		--iLen;
+	if (iLen == 0)
+		return true;
+
+	m_row.clear();
+	const char* p = pLine;
+	const char* pEnd = pLine + iLen;
+	const char* pField = pLine;
+#ifdef PAY_BILL_SSE2
+	const __m128i comma = _mm_set1_epi8(',');
+	const __m128i quote = _mm_set1_epi8('"');
+	for (; pEnd - p >= 16; p += 16)
+	{
+		__m128i chunk = _mm_loadu_si128((const __m128i*)p);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, quote)) != 0)
+			return splitQuotedLine(pLine, iLen);
+
+		unsigned int iMask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, comma));
+		while (iMask != 0)
+		{
+			const char* pComma = p + lowestBit(iMask);
+			pushField(pField, pComma - pField);
+			pField = pComma + 1;
+			iMask &= iMask - 1;
+		}
+	}
+#endif
+	for (; p < pEnd; ++p)
+	{
+		if (*p == '"')
+			return splitQuotedLine(pLine, iLen);
+		if (*p == ',')
+		{
+			pushField(pField, p - pField);
+			pField = p + 1;
+		}
+	}
+	pushField(pField, pEnd - pField);
+	return m_onRow(m_row);
+}
+
+bool CPayCsvSplitter::splitQuotedLine(const char* pLine, size_t iLen)
+{
+	//unquoting never grows the line, so the fields keep pointing at the same buffer
+	m_strUnquoted.clear();
+	m_strUnquoted.reserve(iLen);
+	vector<pair<size_t, size_t>> vecBounds;
+	size_t iStart = 0;
+	bool bQuoted = false;
+	for (size_t i = 0; i < iLen; ++i)
+	{
+		char c = pLine[i];
+		if (bQuoted)
+		{
+			if (c != '"')
+				m_strUnquoted += c;
+			else if (i + 1 < iLen && pLine[i + 1] == '"')
+			{
+				m_strUnquoted += '"';
+				++i;
+			}
+			else
+				bQuoted = false;
+		}
+		else if (c == '"')
+			bQuoted = true;
+		else if (c == ',')
+		{
+			vecBounds.push_back(make_pair(iStart, m_strUnquoted.size() - iStart));
+			iStart = m_strUnquoted.size();
+		}
+		else
+			m_strUnquoted += c;
+	}
+	vecBounds.push_back(make_pair(iStart, m_strUnquoted.size() - iStart));
+
+	m_row.clear();
+	for (auto itr = vecBounds.begin(); itr != vecBounds.end(); ++itr)
+		pushField(m_strUnquoted.data() + itr->first, itr->second);
+	return m_onRow(m_row);
+}
+
+CPayBillReader::CPayBillReader(CPayBillCompression iCompression, const CPayBillRowFunc& onRow, const EntryFilter& entryFilter /*= EntryFilter()*/) :
+	m_iCompression(iCompression),
+	m_entryFilter(entryFilter),
+	m_splitter(onRow),
+	m_pStream(new z_stream_s()),
+	m_bStreamInit(false),
+	m_bStopped(false),
+	m_bCorrupt(false),
+	m_bInStream(false),
+	m_iZipState(ZIP_HEADER),
+	m_iZipNeed(4),
+	m_iZipNameLen(0),
+	m_iZipMethod(0),
+	m_iZipFlags(0),
+	m_llZipRemain(0),
+	m_bZipEmit(false)
+{
+	if (m_iCompression == PAY_BILL_PLAIN)
+		return;
+
+	m_vecOut.resize(PAY_BILL_CHUNK_SIZE);
+	//16 + MAX_WBITS expects a gzip wrapper, a negative window raw deflate as stored in zip entries
+	int iWindowBits = m_iCompression == PAY_BILL_GZIP ? 16 + MAX_WBITS : -MAX_WBITS;
+	m_bStreamInit = inflateInit2(m_pStream.get(), iWindowBits) == Z_OK;
+	if (!m_bStreamInit)
+		m_bCorrupt = true;
+}
+
+CPayBillReader::~CPayBillReader()
+{
+	if (m_bStreamInit)
+		inflateEnd(m_pStream.get());
+}
+
+bool CPayBillReader::write(const char* pData, size_t iLen)
+{
+	if (m_bStopped || m_bCorrupt)
+		return false;
+
+	switch (m_iCompression)
+	{
+	case PAY_BILL_GZIP:
+		return writeGzip((const unsigned char*)pData, iLen);
+	case PAY_BILL_ZIP:
+		return writeZip((const unsigned char*)pData, iLen);
+	default:
+		return emit(pData, iLen);
+	}
+}
+
+bool CPayBillReader::finish()
+{
+	if (m_bStopped || m_bCorrupt)
+		return false;
+
+	if (m_iCompression == PAY_BILL_GZIP && m_bInStream)
+		return setCorrupt();
+
+	//zip entries are flushed as they end, a truncated archive stops inside one
+	if (m_iCompression == PAY_BILL_ZIP)
+	{
+		if (m_iZipState != ZIP_DONE && (m_iZipState != ZIP_HEADER || !m_strZipPending.empty()))
+			return setCorrupt();
+		return true;
+	}
+
+	if (!m_splitter.finish())
+	{
+		m_bStopped = true;
+		return false;
+	}
+	return true;
+}
+
+bool CPayBillReader::emit(const char* pData, size_t iLen)
+{
+	if (!m_splitter.write(pData, iLen))
+	{
+		m_bStopped = true;
+		return false;
+	}
+	return true;
+}
+
+bool CPayBillReader::setCorrupt()
+{
+	m_bCorrupt = true;
+	return false;
+}
+
+bool CPayBillReader::inflateInput(const unsigned char*& pData, size_t& iLen, bool bEmit, bool& bStreamEnd)
+{
+	z_stream_s& stream = *m_pStream;
+	bStreamEnd = false;
+	stream.next_in = const_cast<Bytef*>(pData);
+	stream.avail_in = (uInt)iLen;
+	do
+	{
+		stream.next_out = &m_vecOut[0];
+		stream.avail_out = (uInt)m_vecOut.size();
+		int iRet = inflate(&stream, Z_NO_FLUSH);
+		if (iRet == Z_BUF_ERROR)
+			break;
+		if (iRet != Z_OK && iRet != Z_STREAM_END)
+			return setCorrupt();
+
+		size_t iOut = m_vecOut.size() - stream.avail_out;
+		if (bEmit && iOut > 0 && !emit((const char*)&m_vecOut[0], iOut))
+			return false;
+		if (iRet == Z_STREAM_END)
+		{
+			bStreamEnd = true;
+			break;
+		}
+	} while (stream.avail_in > 0 || stream.avail_out == 0);
+
+	pData += iLen - stream.avail_in;
+	iLen = stream.avail_in;
+	return true;
+}
+
+bool CPayBillReader::writeGzip(const unsigned char* pData, size_t iLen)
+{
+	while (iLen > 0)
+	{
+		m_bInStream = true;
+		bool bStreamEnd = false;
+		if (!inflateInput(pData, iLen, true, bStreamEnd))
+			return false;
+		if (bStreamEnd)
+		{
+			//the next member, if any, starts right after
+			m_bInStream = false;
+			inflateReset(m_pStream.get());
+		}
+	}
+	return true;
+}
+
+bool CPayBillReader::writeZip(const unsigned char* pData, size_t iLen)
+{
+	while (iLen > 0 && m_iZipState != ZIP_DONE)
+	{
+		if (m_iZipState == ZIP_DATA)
+		{
+			if (m_iZipMethod == 0)
+			{
+				size_t iTake = (size_t)min<unsigned long long>(iLen, m_llZipRemain);
+				if (m_bZipEmit && !emit((const char*)pData, iTake))
+					return false;
+				pData += iTake;
+				iLen -= iTake;
+				m_llZipRemain -= iTake;
+				if (m_llZipRemain == 0 && !endZipEntry())
+					return false;
+			}
+			else
+			{
+				bool bStreamEnd = false;
+				if (!inflateInput(pData, iLen, m_bZipEmit, bStreamEnd))
+					return false;
+				if (bStreamEnd && !endZipEntry())
+					return false;
+			}
+			continue;
+		}
+
+		size_t iTake = min(iLen, m_iZipNeed - m_strZipPending.size());
+		m_strZipPending.append((const char*)pData, iTake);
+		pData += iTake;
+		iLen -= iTake;
+		if (m_strZipPending.size() < m_iZipNeed)
+			break;
+
+		if (m_iZipState == ZIP_HEADER)
+		{
+			if (m_iZipNeed == 4)
+			{
+				//the central directory follows the last entry, nothing after it is data
+				if (readLE32(m_strZipPending.data()) != PAY_ZIP_LOCAL_HEADER)
+				{
+					m_iZipState = ZIP_DONE;
+					break;
+				}
+				m_iZipNeed = PAY_ZIP_LOCAL_HEADER_SIZE;
+				continue;
+			}
+
+			const char* pHeader = m_strZipPending.data();
+			m_iZipFlags = readLE16(pHeader + 6);
+			m_iZipMethod = readLE16(pHeader + 8);
+			m_llZipRemain = readLE32(pHeader + 18);
+			m_iZipNameLen = readLE16(pHeader + 26);
+			m_iZipNeed = m_iZipNameLen + readLE16(pHeader + 28);
+			m_strZipPending.clear();
+			m_iZipState = ZIP_NAME;
+			if (m_iZipNeed == 0 && !beginZipEntry())
+				return false;
+		}
+		else if (m_iZipState == ZIP_NAME)
+		{
+			if (!beginZipEntry())
+				return false;
+		}
+		else if (m_iZipState == ZIP_DESCRIPTOR)
+		{
+			//the signature of the descriptor is optional
+			if (m_iZipNeed == 4)
+			{
+				m_iZipNeed = readLE32(m_strZipPending.data()) == PAY_ZIP_DATA_DESCRIPTOR ? 16 : 12;
+				continue;
+			}
+			m_strZipPending.clear();
+			m_iZipNeed = 4;
+			m_iZipState = ZIP_HEADER;
+		}
+	}
+	return true;
+}
+
+bool CPayBillReader::beginZipEntry()
+{
+	string strName = m_strZipPending.substr(0, m_iZipNameLen);
+	m_strZipPending.clear();
+	if (m_iZipMethod != 0 && m_iZipMethod != Z_DEFLATED)
+		return setCorrupt();
+
+	//a stored entry with a trailing descriptor gives no way to find its end
+	if (m_iZipMethod == 0 && (m_iZipFlags & PAY_ZIP_FLAG_DESCRIPTOR))
+		return setCorrupt();
+
+	bool bDirectory = !strName.empty() && strName[strName.size() - 1] == '/';
+	m_bZipEmit = !bDirectory && (!m_entryFilter || m_entryFilter(strName));
+	if (m_iZipMethod == Z_DEFLATED)
+		inflateReset(m_pStream.get());
+	m_iZipState = ZIP_DATA;
+	if (m_iZipMethod == 0 && m_llZipRemain == 0)
+		return endZipEntry();
+	return true;
+}
+
+bool CPayBillReader::endZipEntry()
+{
+	if (m_bZipEmit && !m_splitter.finish())
+	{
+		m_bStopped = true;
+		return false;
+	}
+
+	m_strZipPending.clear();
+	m_iZipNeed = 4;
+	m_iZipState = (m_iZipFlags & PAY_ZIP_FLAG_DESCRIPTOR) ? ZIP_DESCRIPTOR : ZIP_HEADER;
+	return true;
+}
+
+CPayBillReconciler::CPayBillReconciler(const CPayBillColumns& columns, const MismatchFunc& onMismatch) :
+	m_columns(columns),
+	m_onMismatch(onMismatch),
+	m_iHeaderWidth(0),
+	m_iRows(0)
+{
+}
+
+void CPayBillReconciler::makeKey(const char* pOutTradeNo, size_t iOutTradeNoLen, const char* pOutRefundNo, size_t iOutRefundNoLen, string& strKey)
+{
+	strKey.assign(pOutTradeNo, iOutTradeNoLen);
+	if (iOutRefundNoLen == 0)
+		return;
+	strKey += '|';
+	strKey.append(pOutRefundNo, iOutRefundNoLen);
+}
+
+void CPayBillReconciler::addOrder(const string& strOutTradeNo, long long llAmount)
+{
+	addRefund(strOutTradeNo, "", llAmount);
+}
+
+void CPayBillReconciler::addRefund(const string& strOutTradeNo, const string& strOutRefundNo, long long llAmount)
+{
+	string strKey;
+	makeKey(strOutTradeNo.data(), strOutTradeNo.size(), strOutRefundNo.data(), strOutRefundNo.size(), strKey);
+	CExpected& expected = m_mapExpected[strKey];
+	expected.strOutTradeNo = strOutTradeNo;
+	expected.strOutRefundNo = strOutRefundNo;
+	expected.llAmount = llAmount;
+	expected.bSeen = false;
+}
+
+void CPayBillReconciler::addInDoubt(const CPayJournal& journal, CPayProvider iProvider, const string& strAccount)
+{
+	vector<CPayJournalEntry> vecEntries = journal.getInDoubt();
+	for (auto itr = vecEntries.begin(); itr != vecEntries.end(); ++itr)
+	{
+		if (itr->iProvider != iProvider || itr->strAccount != strAccount)
+			continue;
+
+		//withdrawals never show in a trade bill
+		string strKey;
+		if (itr->iOperation == PAY_OP_PREPAY)
+			makeKey(itr->strOutTradeNo.data(), itr->strOutTradeNo.size(), NULL, 0, strKey);
+		else if (itr->iOperation == PAY_OP_REFUND)
+			makeKey(itr->strOutTradeNo.data(), itr->strOutTradeNo.size(), itr->strRequestNo.data(), itr->strRequestNo.size(), strKey);
+		else
+			continue;
+		m_mapInDoubt[strKey] = itr->llId;
+	}
+}
+
+bool CPayBillReconciler::onRow(const CPayBillRow& row)
+{
+	if (row.empty() || (!row[0].empty() && row[0].pData[0] == '#'))
+		return true;
+	if (m_iHeaderWidth == 0)
+	{
+		m_iHeaderWidth = row.size();
+		return true;
+	}
+	if (row.size() != m_iHeaderWidth ||
+		m_columns.iOutTradeNo < 0 ||
+		(size_t)m_columns.iOutTradeNo >= row.size())
+	{
+		return true;
+	}
+	++m_iRows;
+
+	const CPayBillField& outTradeNo = row[m_columns.iOutTradeNo];
+	CPayBillField outRefundNo = { NULL, 0 };
+	if (m_columns.iOutRefundNo >= 0 && (size_t)m_columns.iOutRefundNo < row.size())
+	{
+		//wechat fills the refund columns of a payment with 0
+		outRefundNo = row[m_columns.iOutRefundNo];
+		if (outRefundNo.iLen == 1 && outRefundNo.pData[0] == '0')
+			outRefundNo.iLen = 0;
+	}
+
+	int iAmountColumn = outRefundNo.empty() ? m_columns.iAmount : m_columns.iRefundAmount;
+	long long llBillAmount = -1;
+	if (iAmountColumn >= 0 && (size_t)iAmountColumn < row.size() &&
+		parseFen(row[iAmountColumn].pData, row[iAmountColumn].iLen, llBillAmount))
+	{
+		//alipay books refunds as negative amounts
+		llBillAmount = llBillAmount < 0 ? -llBillAmount : llBillAmount;
+	}
+	else
+		llBillAmount = -1;
+
+	makeKey(outTradeNo.pData, outTradeNo.iLen, outRefundNo.pData, outRefundNo.iLen, m_strKey);
+	if (!m_mapInDoubt.empty())
+	{
+		auto itrInDoubt = m_mapInDoubt.find(m_strKey);
+		if (itrInDoubt != m_mapInDoubt.end())
+		{
+			CPayBillMismatch mismatch;
+			mismatch.iType = PAY_BILL_IN_DOUBT_SETTLED;
+			mismatch.strOutTradeNo = outTradeNo.str();
+			mismatch.strOutRefundNo = outRefundNo.str();
+			mismatch.llBillAmount = llBillAmount;
+			mismatch.llJournalId = itrInDoubt->second;
+			m_mapInDoubt.erase(itrInDoubt);
+			m_onMismatch(mismatch);
+		}
+	}
+
+	auto itr = m_mapExpected.find(m_strKey);
+	if (itr == m_mapExpected.end())
+	{
+		CPayBillMismatch mismatch;
+		mismatch.iType = PAY_BILL_MISSING_LOCAL;
+		mismatch.strOutTradeNo = outTradeNo.str();
+		mismatch.strOutRefundNo = outRefundNo.str();
+		mismatch.llBillAmount = llBillAmount;
+		m_onMismatch(mismatch);
+		return true;
+	}
+
+	CExpected& expected = itr->second;
+	expected.bSeen = true;
+	if (llBillAmount != expected.llAmount)
+	{
+		CPayBillMismatch mismatch;
+		mismatch.iType = PAY_BILL_AMOUNT_MISMATCH;
+		mismatch.strOutTradeNo = expected.strOutTradeNo;
+		mismatch.strOutRefundNo = expected.strOutRefundNo;
+		mismatch.llBillAmount = llBillAmount;
+		mismatch.llLocalAmount = expected.llAmount;
+		m_onMismatch(mismatch);
+	}
+	return true;
+}
+
+void CPayBillReconciler::finish()
+{
+	for (auto itr = m_mapExpected.begin(); itr != m_mapExpected.end(); ++itr)
+	{
+		if (itr->second.bSeen)
+			continue;
+
+		CPayBillMismatch mismatch;
+		mismatch.iType = PAY_BILL_MISSING_REMOTE;
+		mismatch.strOutTradeNo = itr->second.strOutTradeNo;
+		mismatch.strOutRefundNo = itr->second.strOutRefundNo;
+		mismatch.llLocalAmount = itr->second.llAmount;
+		m_onMismatch(mismatch);
+	}
+}
+
+bool CPayBillReconciler::parseFen(const char* pData, size_t iLen, long long& llFen)
+{
+	const char* p = pData;
+	const char* pEnd = pData + iLen;
+	bool bNegative = false;
+	if (p < pEnd && (*p == '-' || *p == '+'))
+		bNegative = *p++ == '-';
+	if (p == pEnd)
+		return false;
+
+	long long llValue = 0;
+	int iDigits = 0;
+	for (; p < pEnd && *p >= '0' && *p <= '9'; ++p, ++iDigits)
+		llValue = llValue * 10 + (*p - '0');
+	if (iDigits == 0 || iDigits > 15)
+		return false;
+
+	int iDecimals = 0;
+	if (p < pEnd && *p == '.')
+	{
+		for (++p; p < pEnd && *p >= '0' && *p <= '9'; ++p, ++iDecimals)
+		{
+			if (iDecimals == 2)
+				return false;
+			llValue = llValue * 10 + (*p - '0');
+		}
+	}
+	if (p != pEnd)
+		return false;
+	for (; iDecimals < 2; ++iDecimals)
+		llValue *= 10;
+
+	llFen = bNegative ? -llValue : llValue;
+	return true;
+}
@@ -0,0 +1,254 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <unordered_map>
+#include "PayMetrics.h"
+
+//inflated bytes handed to the csv splitter at a time
+#define PAY_BILL_CHUNK_SIZE (64 * 1024)
+
+struct z_stream_s;
+
+namespace SAPay {
+
+class CPayJournal;
+
+enum CPayBillCompression
+{
+	PAY_BILL_PLAIN,
+
+	//one or more gzip members
+	PAY_BILL_GZIP,
+
+	//every selected entry of the archive is read in order, entries are stored or deflated
+	PAY_BILL_ZIP
+};
+
+//one csv field, points into the splitter buffer and is only valid during the row callback
+struct CPayBillField
+{
+	const char* pData;
+	size_t iLen;
+
+	std::string str() const { return std::string(pData, iLen); }
+	bool empty() const { return iLen == 0; }
+};
+
+using CPayBillRow = std::vector<CPayBillField>;
+
+//false stops the download
+using CPayBillRowFunc = std::function<bool(const CPayBillRow&)>;
+
+/**
+* @name CPayCsvSplitter
+*
+* @brief								incremental csv splitter, only the current partial line is buffered.
+*										line ends and separators are found 16 bytes at a time with sse2,
+*										lines holding a quote take the scalar path (no newline inside quotes).
+*										fields are trimmed of blanks and of the ` wechat puts before numbers
+*/
+class CPayCsvSplitter
+{
+public:
+	explicit CPayCsvSplitter(const CPayBillRowFunc& onRow);
+
+	bool write(const char* pData, size_t iLen);
+
+	//last line without a trailing newline
+	bool finish();
+
+private:
+	bool splitLine(const char* pLine, size_t iLen);
+	bool splitQuotedLine(const char* pLine, size_t iLen);
+	void pushField(const char* pData, size_t iLen);
+
+	CPayBillRowFunc m_onRow;
+	std::string m_strCarry;
+	std::string m_strUnquoted;
+	CPayBillRow m_row;
+};
+
+/**
+* @name CPayBillReader
+*
+* @brief								decompresses a bill as it is downloaded and feeds it to a CPayCsvSplitter,
+*										memory stays at one PAY_BILL_CHUNK_SIZE buffer plus one line whatever the file size
+*/
+class CPayBillReader
+{
+public:
+	//name of a zip entry as stored in the archive, false skips the entry
+	using EntryFilter = std::function<bool(const std::string&)>;
+
+	CPayBillReader(CPayBillCompression iCompression, const CPayBillRowFunc& onRow, const EntryFilter& entryFilter = EntryFilter());
+	~CPayBillReader();
+
+	CPayBillReader(const CPayBillReader&) = delete;
+	CPayBillReader& operator=(const CPayBillReader&) = delete;
+
+	//false once the row callback stopped or the data is corrupt
+	bool write(const char* pData, size_t iLen);
+	bool finish();
+
+	bool isStopped() const { return m_bStopped; }
+	bool isCorrupt() const { return m_bCorrupt; }
+
+private:
+	enum CZipState
+	{
+		ZIP_HEADER,
+		ZIP_NAME,
+		ZIP_DATA,
+		ZIP_DESCRIPTOR,
+		ZIP_DONE
+	};
+
+	bool writeGzip(const unsigned char* pData, size_t iLen);
+	bool writeZip(const unsigned char* pData, size_t iLen);
+
+	//runs inflate over the input, consumed bytes are removed from pData/iLen
+	bool inflateInput(const unsigned char*& pData, size_t& iLen, bool bEmit, bool& bStreamEnd);
+
+	bool beginZipEntry();
+	bool endZipEntry();
+	bool emit(const char* pData, size_t iLen);
+	bool setCorrupt();
+
+	CPayBillCompression m_iCompression;
+	EntryFilter m_entryFilter;
+	CPayCsvSplitter m_splitter;
+	std::unique_ptr<z_stream_s> m_pStream;
+	bool m_bStreamInit;
+	std::vector<unsigned char> m_vecOut;
+	bool m_bStopped;
+	bool m_bCorrupt;
+
+	//a gzip member was started and has not ended
+	bool m_bInStream;
+
+	//zip entry being read
+	CZipState m_iZipState;
+	std::string m_strZipPending;
+	size_t m_iZipNeed;
+	size_t m_iZipNameLen;
+	int m_iZipMethod;
+	int m_iZipFlags;
+	unsigned long long m_llZipRemain;
+	bool m_bZipEmit;
+};
+
+//column index of each field in the bill rows, -1 if the bill has no such column
+struct CPayBillColumns
+{
+	CPayBillColumns() :
+		iOutTradeNo(-1),
+		iAmount(-1),
+		iOutRefundNo(-1),
+		iRefundAmount(-1) {}
+
+	int iOutTradeNo;
+
+	//yuan
+	int iAmount;
+
+	//a row with a refund number is a refund of iOutTradeNo
+	int iOutRefundNo;
+	int iRefundAmount;
+};
+
+enum CPayBillMismatchType
+{
+	//in the bill but not added to the reconciler
+	PAY_BILL_MISSING_LOCAL,
+
+	//added but not in the bill, reported by finish
+	PAY_BILL_MISSING_REMOTE,
+
+	PAY_BILL_AMOUNT_MISMATCH,
+
+	//left in doubt by the journal, the bill shows it went through
+	PAY_BILL_IN_DOUBT_SETTLED
+};
+
+struct CPayBillMismatch
+{
+	CPayBillMismatch() :
+		iType(PAY_BILL_MISSING_LOCAL),
+		llBillAmount(-1),
+		llLocalAmount(-1),
+		llJournalId(0) {}
+
+	CPayBillMismatchType iType;
+	std::string strOutTradeNo;
+	std::string strOutRefundNo;
+
+	//fen, -1 if unknown
+	long long llBillAmount;
+	long long llLocalAmount;
+
+	//PAY_BILL_IN_DOUBT_SETTLED only
+	unsigned long long llJournalId;
+};
+
+/**
+* @name CPayBillReconciler
+*
+* @brief								joins the rows of a streamed bill against our orders of the day
+*										through a hash index on out_trade_no (and out_refund_no for refunds).
+*										only our side is held in memory, the bill is never materialized.
+*										the first row not starting with # is the header, rows of another width
+*										(summary lines) are ignored
+*/
+class CPayBillReconciler
+{
+public:
+	using MismatchFunc = std::function<void(const CPayBillMismatch&)>;
+
+	CPayBillReconciler(const CPayBillColumns& columns, const MismatchFunc& onMismatch);
+
+	CPayBillReconciler(const CPayBillReconciler&) = delete;
+	CPayBillReconciler& operator=(const CPayBillReconciler&) = delete;
+
+	void addOrder(const std::string& strOutTradeNo, long long llAmount);
+	void addRefund(const std::string& strOutTradeNo, const std::string& strOutRefundNo, long long llAmount);
+
+	//prepay and refund intents of strAccount the journal has no outcome for
+	void addInDoubt(const CPayJournal& journal, CPayProvider iProvider, const std::string& strAccount);
+
+	//CPayBillRowFunc, never stops the download
+	bool onRow(const CPayBillRow& row);
+
+	//reports what the bill never mentioned
+	void finish();
+
+	size_t getRowCount() const { return m_iRows; }
+
+	//"-12.34" to -1234, false if it is not an amount with at most two decimals
+	static bool parseFen(const char* pData, size_t iLen, long long& llFen);
+
+private:
+	struct CExpected
+	{
+		std::string strOutTradeNo;
+		std::string strOutRefundNo;
+		long long llAmount;
+		bool bSeen;
+	};
+
+	//out_trade_no, or out_trade_no|out_refund_no for refunds
+	static void makeKey(const char* pOutTradeNo, size_t iOutTradeNoLen, const char* pOutRefundNo, size_t iOutRefundNoLen, std::string& strKey);
+
+	CPayBillColumns m_columns;
+	MismatchFunc m_onMismatch;
+	std::unordered_map<std::string, CExpected> m_mapExpected;
+	std::unordered_map<std::string, unsigned long long> m_mapInDoubt;
+	size_t m_iHeaderWidth;
+	size_t m_iRows;
+
+	//reused by onRow, no allocation per row once grown
+	std::string m_strKey;
+};
+
+}
@@ -0,0 +1,36 @@
+#include "PayBufferPool.h"
+#include <vector>
+
+using namespace SAPay;
+using namespace std;
+
+static vector<string>& idleBuffers()
+{
+	static thread_local vector<string> t_vecIdle;
+	return t_vecIdle;
+}
+
+void CPayBufferPool::acquire(string& strBuffer)
+{
+	strBuffer.clear();
+	vector<string>& vecIdle = idleBuffers();
+	if (vecIdle.empty() || strBuffer.capacity() >= vecIdle.back().capacity())
+		return;
+	strBuffer.swap(vecIdle.back());
+	vecIdle.pop_back();
+}
+
+void CPayBufferPool::release(string& strBuffer)
+{
+	if (strBuffer.capacity() < PAY_BUFFER_POOL_MIN_CAPACITY || strBuffer.capacity() > PAY_BUFFER_POOL_MAX_CAPACITY)
+		return;
+
+	vector<string>& vecIdle = idleBuffers();
+	if (vecIdle.size() >= PAY_BUFFER_POOL_MAX_IDLE)
+		return;
+	if (vecIdle.capacity() == 0)
+		vecIdle.reserve(PAY_BUFFER_POOL_MAX_IDLE);
+	strBuffer.clear();
+	vecIdle.emplace_back();
+	vecIdle.back().swap(strBuffer);
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+//idle buffers kept per thread
+#define PAY_BUFFER_POOL_MAX_IDLE 8
+
+//smaller buffers are not worth keeping
+#define PAY_BUFFER_POOL_MIN_CAPACITY 256
+
+//a buffer grown past this is freed instead of kept, one huge resps should not pin its memory
+#define PAY_BUFFER_POOL_MAX_CAPACITY (256 * 1024)
+
+namespace SAPay {
+
+/**
+* @name CPayBufferPool
+*
+* @brief								per thread free list of resps buffers, so a body is received into memory that is
+*										already the right size instead of growing a fresh string chunk by chunk.
+*										acquire swaps an idle buffer into the caller's string, emptied but with its capacity,
+*										release takes the string's buffer back. the two may run on different threads
+*/
+class CPayBufferPool
+{
+public:
+	static void acquire(std::string& strBuffer);
+	static void release(std::string& strBuffer);
+};
+
+//pooled string for one scope
+class CPayPooledBuffer
+{
+public:
+	CPayPooledBuffer() { CPayBufferPool::acquire(m_strBuffer); }
+	~CPayPooledBuffer() { CPayBufferPool::release(m_strBuffer); }
+
+	CPayPooledBuffer(const CPayPooledBuffer&) = delete;
+	CPayPooledBuffer& operator=(const CPayPooledBuffer&) = delete;
+
+	std::string& get() { return m_strBuffer; }
+
+private:
+	std::string m_strBuffer;
+};
+
+}
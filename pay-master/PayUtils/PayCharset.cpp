@@ -0,0 +1,225 @@
+#include "PayCharset.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PAY_CHARSET_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+//gbk double byte range
+#define PAY_GBK_LEAD_FIRST 0x81
+#define PAY_GBK_LEAD_LAST 0xFE
+#define PAY_GBK_TRAIL_FIRST 0x40
+#define PAY_GBK_TRAIL_LAST 0xFE
+#define PAY_GBK_TRAIL_COUNT (PAY_GBK_TRAIL_LAST - PAY_GBK_TRAIL_FIRST + 1)
+
+using namespace SAPay;
+using namespace std;
+
+static const unsigned short s_gbkToUnicode[(PAY_GBK_LEAD_LAST - PAY_GBK_LEAD_FIRST + 1) * PAY_GBK_TRAIL_COUNT] = {
+#include "PayGbkTable.inc"
+};
+
+//every gbk character is in the bmp, so the reverse table is indexed by the code point directly
+struct CUnicodeToGbk
+{
+	CUnicodeToGbk() :
+		table(0x10000, 0)
+	{
+		for (size_t i = 0; i < sizeof(s_gbkToUnicode) / sizeof(s_gbkToUnicode[0]); ++i)
+		{
+			if (s_gbkToUnicode[i] != 0)
+			{
+				table[s_gbkToUnicode[i]] = (unsigned short)(
+					((i / PAY_GBK_TRAIL_COUNT + PAY_GBK_LEAD_FIRST) << 8) | (i % PAY_GBK_TRAIL_COUNT + PAY_GBK_TRAIL_FIRST));
+			}
+		}
+	}
+
+	vector<unsigned short> table;
+};
+
+//built on first use, 128k
+static const vector<unsigned short>& unicodeToGbk()
+{
+	static const CUnicodeToGbk s_unicodeToGbk;
+	return s_unicodeToGbk.table;
+}
+
+static int lowestBit(unsigned int iMask)
+{
+#ifdef _MSC_VER
+	unsigned long iIndex = 0;
+	_BitScanForward(&iIndex, iMask);
+	return (int)iIndex;
+#else
+	return __builtin_ctz(iMask);
+#endif
+}
+
+//bytes below 0x80 from p on
+static size_t asciiPrefix(const unsigned char* p, const unsigned char* pEnd)
+{
+	const unsigned char* pStart = p;
+#ifdef PAY_CHARSET_SSE2
+	for (; pEnd - p >= 16; p += 16)
+	{
+		int iMask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p));
+		if (iMask != 0)
+			return p - pStart + lowestBit((unsigned int)iMask);
+	}
+#endif
+	while (p < pEnd && *p < 0x80)
+		++p;
+	return p - pStart;
+}
+
+static bool isContinuation(unsigned char c)
+{
+	return (c & 0xC0) == 0x80;
+}
+
+//one multibyte sequence at p, its length or 0 if it is not well formed
+static size_t decodeUtf8(const unsigned char* p, const unsigned char* pEnd, uint32_t& iCodePoint)
+{
+	size_t iLeft = pEnd - p;
+	unsigned char c = p[0];
+	if (c >= 0xC2 && c <= 0xDF)
+	{
+		if (iLeft < 2 || !isContinuation(p[1]))
+			return 0;
+		iCodePoint = ((c & 0x1F) << 6) | (p[1] & 0x3F);
+		return 2;
+	}
+	if (c >= 0xE0 && c <= 0xEF)
+	{
+		if (iLeft < 3 || !isContinuation(p[1]) || !isContinuation(p[2]))
+			return 0;
+		iCodePoint = ((c & 0x0F) << 12) | ((p[1] & 0x3F) << 6) | (p[2] & 0x3F);
+		//overlong or a surrogate
+		if (iCodePoint < 0x800 || (iCodePoint >= 0xD800 && iCodePoint <= 0xDFFF))
+			return 0;
+		return 3;
+	}
+	if (c >= 0xF0 && c <= 0xF4)
+	{
+		if (iLeft < 4 || !isContinuation(p[1]) || !isContinuation(p[2]) || !isContinuation(p[3]))
+			return 0;
+		iCodePoint = ((c & 0x07) << 18) | ((p[1] & 0x3F) << 12) | ((p[2] & 0x3F) << 6) | (p[3] & 0x3F);
+		if (iCodePoint < 0x10000 || iCodePoint > 0x10FFFF)
+			return 0;
+		return 4;
+	}
+	return 0;
+}
+
+bool CPayCharset::isUtf8(boost::string_view str)
+{
+	const unsigned char* p = (const unsigned char*)str.data();
+	const unsigned char* pEnd = p + str.size();
+	for (;;)
+	{
+		p += asciiPrefix(p, pEnd);
+		if (p == pEnd)
+			return true;
+
+		uint32_t iCodePoint = 0;
+		size_t iSize = decodeUtf8(p, pEnd, iCodePoint);
+		if (iSize == 0)
+			return false;
+		p += iSize;
+	}
+}
+
+bool CPayCharset::utf8ToGbk(boost::string_view utf8, string& strGbk)
+{
+	//a character never takes more bytes in gbk than in utf-8
+	strGbk.resize(utf8.size());
+	if (utf8.empty())
+		return true;
+
+	const vector<unsigned short>& table = unicodeToGbk();
+	const unsigned char* p = (const unsigned char*)utf8.data();
+	const unsigned char* pEnd = p + utf8.size();
+	char* pBegin = &strGbk[0];
+	char* pOut = pBegin;
+	for (;;)
+	{
+		size_t iAscii = asciiPrefix(p, pEnd);
+		memcpy(pOut, p, iAscii);
+		p += iAscii;
+		pOut += iAscii;
+		if (p == pEnd)
+			break;
+
+		uint32_t iCodePoint = 0;
+		size_t iSize = decodeUtf8(p, pEnd, iCodePoint);
+		unsigned short iGbk = iSize != 0 && iCodePoint < table.size() ? table[iCodePoint] : 0;
+		if (iGbk == 0)
+		{
+			strGbk.clear();
+			return false;
+		}
+		*pOut++ = (char)(iGbk >> 8);
+		*pOut++ = (char)(iGbk & 0xFF);
+		p += iSize;
+	}
+	strGbk.resize(pOut - pBegin);
+	return true;
+}
+
+bool CPayCharset::gbkToUtf8(boost::string_view gbk, string& strUtf8)
+{
+	//ascii stays one byte, a double byte character takes at most three
+	strUtf8.resize(gbk.size() + gbk.size() / 2);
+	if (gbk.empty())
+		return true;
+
+	const unsigned char* p = (const unsigned char*)gbk.data();
+	const unsigned char* pEnd = p + gbk.size();
+	char* pBegin = &strUtf8[0];
+	char* pOut = pBegin;
+	for (;;)
+	{
+		size_t iAscii = asciiPrefix(p, pEnd);
+		memcpy(pOut, p, iAscii);
+		p += iAscii;
+		pOut += iAscii;
+		if (p == pEnd)
+			break;
+
+		unsigned int iCodePoint = 0;
+		if (pEnd - p >= 2 &&
+			p[0] >= PAY_GBK_LEAD_FIRST && p[0] <= PAY_GBK_LEAD_LAST &&
+			p[1] >= PAY_GBK_TRAIL_FIRST && p[1] <= PAY_GBK_TRAIL_LAST)
+		{
+			iCodePoint = s_gbkToUnicode[(p[0] - PAY_GBK_LEAD_FIRST) * PAY_GBK_TRAIL_COUNT + p[1] - PAY_GBK_TRAIL_FIRST];
+		}
+		if (iCodePoint == 0)
+		{
+			strUtf8.clear();
+			return false;
+		}
+
+		if (iCodePoint < 0x800)
+		{
+			*pOut++ = (char)(0xC0 | (iCodePoint >> 6));
+			*pOut++ = (char)(0x80 | (iCodePoint & 0x3F));
+		}
+		else
+		{
+			*pOut++ = (char)(0xE0 | (iCodePoint >> 12));
+			*pOut++ = (char)(0x80 | ((iCodePoint >> 6) & 0x3F));
+			*pOut++ = (char)(0x80 | (iCodePoint & 0x3F));
+		}
+		p += 2;
+	}
+	strUtf8.resize(pOut - pBegin);
+	return true;
+}
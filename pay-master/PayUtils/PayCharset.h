@@ -0,0 +1,27 @@
+#pragma once
+#include <string>
+#include <boost/utility/string_view.hpp>
+
+namespace SAPay {
+
+/**
+* @name CPayCharset
+*
+* @brief								gbk (code page 936) <-> utf-8 from an embedded table, no system locale involved.
+*										ascii runs are found 16 bytes at a time with sse2 and copied as is,
+*										only the multibyte characters between them are decoded
+*/
+class CPayCharset
+{
+public:
+	//strict utf-8: no overlong forms, surrogates, code points above U+10FFFF or truncated sequences
+	static bool isUtf8(boost::string_view str);
+
+	//false on input that is not valid utf-8, or a character gbk cannot represent
+	static bool utf8ToGbk(boost::string_view utf8, std::string& strGbk);
+
+	//false on a byte pair that is not assigned in gbk
+	static bool gbkToUtf8(boost::string_view gbk, std::string& strUtf8);
+};
+
+}
@@ -0,0 +1,74 @@
+#include "PayExecutor.h"
+#include <algorithm>
+
+using namespace SAPay;
+using namespace std;
+
+CPayExecutor& CPayExecutor::cpu()
+{
+	static CPayExecutor s_executor(max(1, (int)thread::hardware_concurrency()));
+	return s_executor;
+}
+
+CPayExecutor& CPayExecutor::io()
+{
+	static CPayExecutor s_executor(PAY_EXECUTOR_IO_THREADS);
+	return s_executor;
+}
+
+CPayExecutor::CPayExecutor(int iThreads) :
+	m_bStop(false)
+{
+	for (int i = 0; i < max(1, iThreads); ++i)
+		m_vecThreads.emplace_back(&CPayExecutor::run, this);
+}
+
+CPayExecutor::~CPayExecutor()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_bStop = true;
+	}
+	m_condTask.notify_all();
+	for (auto itr = m_vecThreads.begin(); itr != m_vecThreads.end(); ++itr)
+		itr->join();
+}
+
+void CPayExecutor::post(function<void()> task)
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_queTasks.push_back(std::move(task));
+	}
+	m_condTask.notify_one();
+}
+
+size_t CPayExecutor::getPending() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	return m_queTasks.size();
+}
+
+void CPayExecutor::run()
+{
+	for (;;)
+	{
+		function<void()> task;
+		{
+			unique_lock<mutex> lock(m_mutex);
+			m_condTask.wait(lock, [this]() { return m_bStop || !m_queTasks.empty(); });
+			if (m_queTasks.empty())
+				return;
+			task = std::move(m_queTasks.front());
+			m_queTasks.pop_front();
+		}
+
+		try
+		{
+			task();
+		}
+		catch (...)
+		{
+		}
+	}
+}
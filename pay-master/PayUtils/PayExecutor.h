@@ -0,0 +1,66 @@
+#pragma once
+#include <deque>
+#include <mutex>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <type_traits>
+#include <condition_variable>
+
+//threads of CPayExecutor::io(), each one blocks on a gateway call
+#define PAY_EXECUTOR_IO_THREADS 32
+
+namespace SAPay {
+
+/**
+* @name CPayExecutor
+*
+* @brief								fixed size thread pool with a fifo queue.
+*										cpu() runs request building and signing, io() runs the blocking http calls,
+*										so a staged call never holds a cpu thread while waiting on the network.
+*										a task that throws is dropped, its promise breaks
+*/
+class CPayExecutor
+{
+public:
+	//one thread per core
+	static CPayExecutor& cpu();
+
+	//PAY_EXECUTOR_IO_THREADS threads
+	static CPayExecutor& io();
+
+	explicit CPayExecutor(int iThreads);
+
+	//runs what is queued then joins
+	~CPayExecutor();
+
+	CPayExecutor(const CPayExecutor&) = delete;
+	CPayExecutor& operator=(const CPayExecutor&) = delete;
+
+	void post(std::function<void()> task);
+
+	template<typename F>
+	std::future<typename std::result_of<F()>::type> submit(F func)
+	{
+		using R = typename std::result_of<F()>::type;
+		std::shared_ptr<std::packaged_task<R()>> pTask = std::make_shared<std::packaged_task<R()>>(std::move(func));
+		std::future<R> result = pTask->get_future();
+		post([pTask]() { (*pTask)(); });
+		return result;
+	}
+
+	size_t getPending() const;
+
+private:
+	void run();
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condTask;
+	std::deque<std::function<void()>> m_queTasks;
+	bool m_bStop;
+	std::vector<std::thread> m_vecThreads;
+};
+
+}
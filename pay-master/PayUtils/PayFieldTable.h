@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+#include <boost/utility/string_view.hpp>
+
+//slot without a field
+#define PAY_FIELD_EMPTY 0xff
+
+//fnv-1a offset basis, the usual seed
+#define PAY_FIELD_SEED 0x811c9dc5u
+
+namespace SAPay {
+
+//fnv-1a in one return statement so it folds as a c++11 constexpr (vs2015)
+constexpr uint32_t payFieldHash(const char* sz, uint32_t iHash)
+{
+	return *sz == 0 ? iHash : payFieldHash(sz + 1, (uint32_t)(((iHash ^ (unsigned char)*sz) * 16777619ull) & 0xffffffffu));
+}
+
+inline uint32_t payFieldHash(boost::string_view str, uint32_t iHash)
+{
+	for (auto itr = str.begin(); itr != str.end(); ++itr)
+		iHash = (uint32_t)(((iHash ^ (unsigned char)*itr) * 16777619ull) & 0xffffffffu);
+	return iHash;
+}
+
+template<typename T>
+struct CPayField
+{
+	const char* szName;
+	T value;
+};
+
+/**
+* @name CPayFieldTable
+*
+* @brief								perfect hash from a fixed vocabulary (field names, status strings) to a value,
+*										built at compile time. a name lands in slot hash >> (32 - iBits); the seed is picked
+*										so no two names share a slot and isPerfect() is checked with static_assert next
+*										to each table. a lookup hashes once and compares one name, nothing is allocated
+*/
+template<typename T, size_t N, size_t iBits>
+class CPayFieldTable
+{
+	static_assert(N < PAY_FIELD_EMPTY, "too many fields");
+	static_assert(iBits > 0 && iBits < 16 && ((size_t)1 << iBits) >= N, "not enough slots");
+
+public:
+	template<size_t... I>
+	constexpr CPayFieldTable(const CPayField<T>* pFields, uint32_t iSeed, std::index_sequence<I...>) :
+		m_pFields(pFields),
+		m_iSeed(iSeed),
+		m_slots{ findField(pFields, iSeed, I, 0)... }
+	{
+	}
+
+	constexpr bool isPerfect() const { return countFields(0) == N; }
+
+	bool find(boost::string_view str, T& value) const
+	{
+		unsigned char iField = m_slots[payFieldHash(str, m_iSeed) >> (32 - iBits)];
+		if (iField == PAY_FIELD_EMPTY || str != m_pFields[iField].szName)
+			return false;
+		value = m_pFields[iField].value;
+		return true;
+	}
+
+	T find(boost::string_view str, const T& defaultValue) const
+	{
+		T value;
+		return find(str, value) ? value : defaultValue;
+	}
+
+private:
+	//first field in the slot, a collision leaves the later field out of the table
+	static constexpr unsigned char findField(const CPayField<T>* pFields, uint32_t iSeed, size_t iSlot, size_t i)
+	{
+		return i == N ? (unsigned char)PAY_FIELD_EMPTY :
+			(payFieldHash(pFields[i].szName, iSeed) >> (32 - iBits)) == iSlot ? (unsigned char)i :
+			findField(pFields, iSeed, iSlot, i + 1);
+	}
+
+	constexpr size_t countFields(size_t iSlot) const
+	{
+		return iSlot == ((size_t)1 << iBits) ? 0 : (m_slots[iSlot] != PAY_FIELD_EMPTY ? 1 : 0) + countFields(iSlot + 1);
+	}
+
+	const CPayField<T>* m_pFields;
+	uint32_t m_iSeed;
+	unsigned char m_slots[(size_t)1 << iBits];
+};
+
+template<size_t iBits, typename T, size_t N>
+constexpr CPayFieldTable<T, N, iBits> makePayFieldTable(const CPayField<T>(&fields)[N], uint32_t iSeed = PAY_FIELD_SEED)
+{
+	return CPayFieldTable<T, N, iBits>(fields, iSeed, std::make_index_sequence<(size_t)1 << iBits>());
+}
+
+}
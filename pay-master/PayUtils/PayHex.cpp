@@ -0,0 +1,127 @@
+#include "PayHex.h"
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PAY_HEX_SSE2
+#include <emmintrin.h>
+#endif
+
+//any value above 15 is not a hex digit
+#define PAY_HEX_INVALID 0xff
+
+using namespace SAPay;
+using namespace std;
+
+struct CHexTables
+{
+	CHexTables()
+	{
+		static const char szLower[] = "0123456789abcdef";
+		static const char szUpper[] = "0123456789ABCDEF";
+		for (int i = 0; i < 256; ++i)
+		{
+			lower[i * 2] = szLower[i >> 4];
+			lower[i * 2 + 1] = szLower[i & 0x0f];
+			upper[i * 2] = szUpper[i >> 4];
+			upper[i * 2 + 1] = szUpper[i & 0x0f];
+		}
+
+		memset(values, PAY_HEX_INVALID, sizeof(values));
+		for (int i = 0; i < 16; ++i)
+		{
+			values[(unsigned char)szLower[i]] = (unsigned char)i;
+			values[(unsigned char)szUpper[i]] = (unsigned char)i;
+		}
+	}
+
+	//two chars per byte value
+	char lower[512];
+	char upper[512];
+	unsigned char values[256];
+};
+
+static const CHexTables& getTables()
+{
+	static const CHexTables s_tables;
+	return s_tables;
+}
+
+#ifdef PAY_HEX_SSE2
+//16 bytes into 32 chars: split nibbles, interleave them high first, then '0' + n (+ 7 or 39 above 9)
+static size_t encodeSse2(const unsigned char* pIn, size_t iLen, char* pOut, bool bUpper)
+{
+	const __m128i lowMask = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8(bUpper ? 'A' - '0' - 10 : 'a' - '0' - 10);
+
+	size_t iDone = 0;
+	for (; iLen - iDone >= 16; iDone += 16, pOut += 32)
+	{
+		__m128i in = _mm_loadu_si128((const __m128i*)(pIn + iDone));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(in, 4), lowMask);
+		__m128i lo = _mm_and_si128(in, lowMask);
+		__m128i first = _mm_unpacklo_epi8(hi, lo);
+		__m128i second = _mm_unpackhi_epi8(hi, lo);
+		first = _mm_add_epi8(_mm_add_epi8(first, zero), _mm_and_si128(_mm_cmpgt_epi8(first, nine), alpha));
+		second = _mm_add_epi8(_mm_add_epi8(second, zero), _mm_and_si128(_mm_cmpgt_epi8(second, nine), alpha));
+		_mm_storeu_si128((__m128i*)pOut, first);
+		_mm_storeu_si128((__m128i*)(pOut + 16), second);
+	}
+	return iDone;
+}
+#endif
+
+void CPayHex::encode(const void* pData, size_t iLen, char* pOut, bool bUpper)
+{
+	const unsigned char* pIn = (const unsigned char*)pData;
+	size_t i = 0;
+#ifdef PAY_HEX_SSE2
+	if (iLen >= 16)
+	{
+		i = encodeSse2(pIn, iLen, pOut, bUpper);
+		pOut += i * 2;
+	}
+#endif
+
+	const char* pTable = bUpper ? getTables().upper : getTables().lower;
+	for (; i < iLen; ++i, pOut += 2)
+	{
+		pOut[0] = pTable[pIn[i] * 2];
+		pOut[1] = pTable[pIn[i] * 2 + 1];
+	}
+}
+
+string CPayHex::encode(const void* pData, size_t iLen, bool bUpper)
+{
+	string strOut(iLen * 2, '\0');
+	if (!strOut.empty())
+		encode(pData, iLen, &strOut[0], bUpper);
+	return strOut;
+}
+
+bool CPayHex::decode(const char* pData, size_t iLen, unsigned char* pOut)
+{
+	if (iLen % 2 != 0)
+		return false;
+
+	const unsigned char* pValues = getTables().values;
+	unsigned int iSeen = 0;
+	for (size_t i = 0; i < iLen; i += 2)
+	{
+		unsigned int iHi = pValues[(unsigned char)pData[i]];
+		unsigned int iLo = pValues[(unsigned char)pData[i + 1]];
+		iSeen |= iHi | iLo;
+		*pOut++ = (unsigned char)((iHi << 4) | (iLo & 0x0f));
+	}
+	return (iSeen & 0xf0) == 0;
+}
+
+bool CPayHex::decode(const string& strHex, string& strOut)
+{
+	if (strHex.size() % 2 != 0)
+		return false;
+
+	strOut.resize(strHex.size() / 2);
+	return strOut.empty() || decode(strHex.data(), strHex.size(), (unsigned char*)&strOut[0]);
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <string>
+#include <cstddef>
+
+namespace SAPay {
+
+/**
+* @name CPayHex
+*
+* @brief								hex encoding for digests, signatures and rsa output.
+*										encode looks each byte up in a 256 entry pair table, 16 bytes per step with sse2
+*										on long input. decode accepts both cases and checks validity once at the end
+*/
+class CPayHex
+{
+public:
+	//pOut holds 2 * iLen chars, no terminator is written
+	static void encode(const void* pData, size_t iLen, char* pOut, bool bUpper = false);
+	static std::string encode(const void* pData, size_t iLen, bool bUpper = false);
+
+	//pOut holds iLen / 2 bytes, false on an odd length or a char that is not hex
+	static bool decode(const char* pData, size_t iLen, unsigned char* pOut);
+	static bool decode(const std::string& strHex, std::string& strOut);
+};
+
+}
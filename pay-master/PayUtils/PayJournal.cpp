@@ -0,0 +1,387 @@
+#include "PayJournal.h"
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <boost/crc.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+using namespace SAPay;
+using namespace std;
+using boost::interprocess::file_mapping;
+using boost::interprocess::mapped_region;
+using boost::interprocess::read_write;
+
+#define JOURNAL_MAGIC 0x4C4E4A50
+#define JOURNAL_VERSION 1
+#define JOURNAL_HEADER_SIZE 64
+
+//size, crc, generation, type/provider/operation/outcome, id, time
+#define JOURNAL_RECORD_FIXED_SIZE 32
+#define JOURNAL_RECORD_ALIGN 8
+#define JOURNAL_MAX_FIELD 0xFFFF
+
+#define JOURNAL_RECORD_INTENT 1
+#define JOURNAL_RECORD_OUTCOME 2
+
+struct CPayJournal::CSegment
+{
+	int iIndex;
+	unsigned int iGeneration;
+	unsigned long long llSize;
+	file_mapping mapping;
+	mapped_region region;
+
+	char* base() { return (char*)region.get_address(); }
+};
+
+template<typename T>
+static T readPod(const char* p)
+{
+	T value;
+	memcpy(&value, p, sizeof(T));
+	return value;
+}
+
+template<typename T>
+static void writePod(char* p, T value)
+{
+	memcpy(p, &value, sizeof(T));
+}
+
+static unsigned int checksum(const char* p, size_t iLen)
+{
+	boost::crc_32_type crc;
+	crc.process_bytes(p, iLen);
+	return crc.checksum();
+}
+
+static size_t fieldSize(const string& strField)
+{
+	return 2 + min<size_t>(strField.size(), JOURNAL_MAX_FIELD);
+}
+
+static size_t recordSize(const CPayJournalEntry& entry)
+{
+	size_t iSize = JOURNAL_RECORD_FIXED_SIZE + fieldSize(entry.strAccount) + fieldSize(entry.strOutTradeNo) + fieldSize(entry.strRequestNo);
+	return (iSize + JOURNAL_RECORD_ALIGN - 1) / JOURNAL_RECORD_ALIGN * JOURNAL_RECORD_ALIGN;
+}
+
+static char* writeField(char* p, const string& strField)
+{
+	unsigned short iLen = (unsigned short)min<size_t>(strField.size(), JOURNAL_MAX_FIELD);
+	writePod(p, iLen);
+	memcpy(p + 2, strField.data(), iLen);
+	return p + 2 + iLen;
+}
+
+static bool readField(const char*& p, const char* pEnd, string& strField)
+{
+	if (pEnd - p < 2)
+		return false;
+	unsigned short iLen = readPod<unsigned short>(p);
+	if (pEnd - p - 2 < iLen)
+		return false;
+	strField.assign(p + 2, iLen);
+	p += 2 + iLen;
+	return true;
+}
+
+static unsigned long long fileSize(const string& strPath)
+{
+	ifstream file(strPath, ios::in | ios::binary | ios::ate);
+	if (!file)
+		return 0;
+	return (unsigned long long)file.tellg();
+}
+
+static string segmentPath(const string& strPath, int iIndex)
+{
+	return strPath + (iIndex == 0 ? ".0" : ".1");
+}
+
+CPayJournal::CPayJournal(const string& strPath, const CPayJournalOptions& options /*= CPayJournalOptions()*/) :
+	m_strPath(strPath),
+	m_options(options),
+	m_llOffset(JOURNAL_HEADER_SIZE),
+	m_llFlushedOffset(JOURNAL_HEADER_SIZE),
+	m_llTicket(0),
+	m_llDurableTicket(0),
+	m_llNextId(1),
+	m_bStop(false)
+{
+	recover();
+	m_threadFlush = thread(&CPayJournal::flushLoop, this);
+}
+
+CPayJournal::~CPayJournal()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_bStop = true;
+	}
+	m_condAppended.notify_one();
+	m_threadFlush.join();
+}
+
+shared_ptr<CPayJournal::CSegment> CPayJournal::openSegment(int iIndex, unsigned long long llSize, unsigned int iGeneration, bool bCreate)
+{
+	string strSegmentPath = segmentPath(m_strPath, iIndex);
+	if (bCreate && fileSize(strSegmentPath) < llSize)
+	{
+		//preallocate, the tail reads as zero which ends the scan
+		filebuf file;
+		file.open(strSegmentPath.c_str(), ios::in | ios::out | ios::trunc | ios::binary);
+		file.pubseekoff(llSize - 1, ios::beg);
+		file.sputc(0);
+	}
+
+	shared_ptr<CSegment> pSegment = std::make_shared<CSegment>();
+	pSegment->iIndex = iIndex;
+	pSegment->mapping = file_mapping(strSegmentPath.c_str(), read_write);
+	pSegment->region = mapped_region(pSegment->mapping, read_write);
+	pSegment->llSize = pSegment->region.get_size();
+	pSegment->iGeneration = iGeneration;
+	if (bCreate)
+	{
+		char* pHeader = pSegment->base();
+		writePod<unsigned int>(pHeader, JOURNAL_MAGIC);
+		writePod<unsigned int>(pHeader + 4, JOURNAL_VERSION);
+		writePod<unsigned int>(pHeader + 8, iGeneration);
+		writePod<unsigned long long>(pHeader + 16, pSegment->llSize);
+	}
+	return pSegment;
+}
+
+void CPayJournal::recover()
+{
+	vector<shared_ptr<CSegment>> vecSegments;
+	for (int iIndex = 0; iIndex < 2; ++iIndex)
+	{
+		if (fileSize(segmentPath(m_strPath, iIndex)) < JOURNAL_HEADER_SIZE)
+			continue;
+
+		shared_ptr<CSegment> pSegment = openSegment(iIndex, 0, 0, false);
+		const char* pHeader = pSegment->base();
+		if (readPod<unsigned int>(pHeader) != JOURNAL_MAGIC || readPod<unsigned int>(pHeader + 4) != JOURNAL_VERSION)
+			continue;
+		pSegment->iGeneration = readPod<unsigned int>(pHeader + 8);
+		vecSegments.push_back(pSegment);
+	}
+
+	//the older segment first: an interrupted rotation leaves the newer one incomplete
+	sort(vecSegments.begin(), vecSegments.end(), [](const shared_ptr<CSegment>& pLeft, const shared_ptr<CSegment>& pRight)
+	{
+		return pLeft->iGeneration < pRight->iGeneration;
+	});
+	for (auto itr = vecSegments.begin(); itr != vecSegments.end(); ++itr)
+		scan(**itr);
+
+	if (vecSegments.empty())
+	{
+		m_pSegment = openSegment(0, m_options.llSegmentSize, 1, true);
+		m_llOffset = JOURNAL_HEADER_SIZE;
+		m_pSegment->region.flush(0, JOURNAL_HEADER_SIZE, false);
+	}
+	else
+	{
+		//scan left m_llOffset at the end of the newest segment
+		m_pSegment = vecSegments.back();
+	}
+	m_llFlushedOffset = m_llOffset;
+}
+
+void CPayJournal::scan(CSegment& segment)
+{
+	const char* pBase = segment.base();
+	unsigned long long llOffset = JOURNAL_HEADER_SIZE;
+	while (llOffset + JOURNAL_RECORD_FIXED_SIZE <= segment.llSize)
+	{
+		//a torn or stale record ends the segment
+		const char* pRecord = pBase + llOffset;
+		unsigned int iSize = readPod<unsigned int>(pRecord);
+		if (iSize < JOURNAL_RECORD_FIXED_SIZE ||
+			iSize % JOURNAL_RECORD_ALIGN != 0 ||
+			llOffset + iSize > segment.llSize ||
+			readPod<unsigned int>(pRecord + 8) != segment.iGeneration ||
+			readPod<unsigned int>(pRecord + 4) != checksum(pRecord + 8, iSize - 8))
+		{
+			break;
+		}
+
+		unsigned char iType = (unsigned char)pRecord[12];
+		CPayJournalEntry entry;
+		entry.iProvider = (CPayProvider)(unsigned char)pRecord[13];
+		entry.iOperation = (CPayOperation)(unsigned char)pRecord[14];
+		unsigned char iOutcome = (unsigned char)pRecord[15];
+		entry.llId = readPod<unsigned long long>(pRecord + 16);
+		entry.llTimeMs = readPod<long long>(pRecord + 24);
+		const char* p = pRecord + JOURNAL_RECORD_FIXED_SIZE;
+		const char* pEnd = pRecord + iSize;
+		if (!readField(p, pEnd, entry.strAccount) ||
+			!readField(p, pEnd, entry.strOutTradeNo) ||
+			!readField(p, pEnd, entry.strRequestNo))
+		{
+			break;
+		}
+
+		if (iType == JOURNAL_RECORD_INTENT)
+			m_mapInDoubt[entry.llId] = entry;
+		else if (iType == JOURNAL_RECORD_OUTCOME && iOutcome != PAY_JOURNAL_UNKNOWN)
+			m_mapInDoubt.erase(entry.llId);
+		m_llNextId = max(m_llNextId, entry.llId + 1);
+		llOffset += iSize;
+	}
+	m_llOffset = llOffset;
+}
+
+void CPayJournal::writeRecord(CSegment& segment, unsigned char iType, unsigned char iOutcome, const CPayJournalEntry& entry)
+{
+	size_t iSize = recordSize(entry);
+	char* pRecord = segment.base() + m_llOffset;
+	writePod<unsigned int>(pRecord, (unsigned int)iSize);
+	writePod<unsigned int>(pRecord + 8, segment.iGeneration);
+	pRecord[12] = (char)iType;
+	pRecord[13] = (char)entry.iProvider;
+	pRecord[14] = (char)entry.iOperation;
+	pRecord[15] = (char)iOutcome;
+	writePod<unsigned long long>(pRecord + 16, entry.llId);
+	writePod<long long>(pRecord + 24, entry.llTimeMs);
+	char* p = pRecord + JOURNAL_RECORD_FIXED_SIZE;
+	p = writeField(p, entry.strAccount);
+	p = writeField(p, entry.strOutTradeNo);
+	p = writeField(p, entry.strRequestNo);
+	memset(p, 0, pRecord + iSize - p);
+	writePod<unsigned int>(pRecord + 4, checksum(pRecord + 8, iSize - 8));
+	m_llOffset += iSize;
+}
+
+unsigned long long CPayJournal::append(unsigned char iType, unsigned char iOutcome, const CPayJournalEntry& entry)
+{
+	size_t iSize = recordSize(entry);
+	if (m_llOffset + iSize > m_pSegment->llSize)
+		rotate(iSize);
+	writeRecord(*m_pSegment, iType, iOutcome, entry);
+	m_condAppended.notify_one();
+	return ++m_llTicket;
+}
+
+void CPayJournal::rotate(unsigned long long llNeeded)
+{
+	//everything in the old segment becomes durable, rotation is rare enough to fsync under the lock
+	m_pSegment->region.flush(m_llFlushedOffset, m_llOffset - m_llFlushedOffset, false);
+	m_llDurableTicket = m_llTicket;
+	m_condDurable.notify_all();
+
+	unsigned long long llInDoubtSize = JOURNAL_HEADER_SIZE + llNeeded;
+	for (auto itr = m_mapInDoubt.begin(); itr != m_mapInDoubt.end(); ++itr)
+		llInDoubtSize += recordSize(itr->second);
+	unsigned long long llSize = max(m_options.llSegmentSize, llInDoubtSize * 2);
+
+	//only what is still in doubt moves to the other segment
+	m_pSegment = openSegment(1 - m_pSegment->iIndex, llSize, m_pSegment->iGeneration + 1, true);
+	m_llOffset = JOURNAL_HEADER_SIZE;
+	for (auto itr = m_mapInDoubt.begin(); itr != m_mapInDoubt.end(); ++itr)
+		writeRecord(*m_pSegment, JOURNAL_RECORD_INTENT, PAY_JOURNAL_UNKNOWN, itr->second);
+	m_pSegment->region.flush(0, m_llOffset, false);
+	m_llFlushedOffset = m_llOffset;
+}
+
+void CPayJournal::waitDurable(unique_lock<mutex>& lock, unsigned long long llTicket)
+{
+	m_condDurable.wait(lock, [this, llTicket]() { return m_llDurableTicket >= llTicket; });
+}
+
+void CPayJournal::flushLoop()
+{
+	unique_lock<mutex> lock(m_mutex);
+	for (;;)
+	{
+		m_condAppended.wait(lock, [this]() { return m_bStop || m_llDurableTicket < m_llTicket; });
+		if (m_llDurableTicket >= m_llTicket)
+			return;
+
+		if (m_options.iGroupCommitUs > 0 && !m_bStop)
+		{
+			lock.unlock();
+			this_thread::sleep_for(chrono::microseconds(m_options.iGroupCommitUs));
+			lock.lock();
+		}
+
+		//one fsync for every record appended since the last one, appends go on meanwhile
+		shared_ptr<CSegment> pSegment = m_pSegment;
+		unsigned long long llFrom = m_llFlushedOffset;
+		unsigned long long llTo = m_llOffset;
+		unsigned long long llTicket = m_llTicket;
+		lock.unlock();
+		if (llTo > llFrom)
+			pSegment->region.flush(llFrom, llTo - llFrom, false);
+		lock.lock();
+
+		//a rotation in between already made these records durable
+		if (pSegment == m_pSegment && llTo > m_llFlushedOffset)
+			m_llFlushedOffset = llTo;
+		m_llDurableTicket = max(m_llDurableTicket, llTicket);
+		m_condDurable.notify_all();
+	}
+}
+
+unsigned long long CPayJournal::begin(
+	CPayProvider iProvider,
+	CPayOperation iOperation,
+	const string& strAccount,
+	const string& strOutTradeNo,
+	const string& strRequestNo /*= string("")*/
+)
+{
+	CPayJournalEntry entry;
+	entry.iProvider = iProvider;
+	entry.iOperation = iOperation;
+	entry.llTimeMs = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	entry.strAccount = strAccount;
+	entry.strOutTradeNo = strOutTradeNo;
+	entry.strRequestNo = strRequestNo;
+
+	unique_lock<mutex> lock(m_mutex);
+	entry.llId = m_llNextId++;
+	unsigned long long llTicket = append(JOURNAL_RECORD_INTENT, PAY_JOURNAL_UNKNOWN, entry);
+	unsigned long long llId = entry.llId;
+	m_mapInDoubt.emplace(llId, std::move(entry));
+	if (m_options.bSyncIntent)
+		waitDurable(lock, llTicket);
+	return llId;
+}
+
+void CPayJournal::end(unsigned long long llId, CPayJournalOutcome iOutcome)
+{
+	lock_guard<mutex> lock(m_mutex);
+	auto itr = m_mapInDoubt.find(llId);
+	if (itr == m_mapInDoubt.end())
+		return;
+
+	CPayJournalEntry entry;
+	entry.llId = llId;
+	entry.iProvider = itr->second.iProvider;
+	entry.iOperation = itr->second.iOperation;
+	entry.llTimeMs = chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	append(JOURNAL_RECORD_OUTCOME, (unsigned char)iOutcome, entry);
+	if (iOutcome != PAY_JOURNAL_UNKNOWN)
+		m_mapInDoubt.erase(itr);
+}
+
+vector<CPayJournalEntry> CPayJournal::getInDoubt() const
+{
+	lock_guard<mutex> lock(m_mutex);
+	vector<CPayJournalEntry> vecEntries;
+	vecEntries.reserve(m_mapInDoubt.size());
+	for (auto itr = m_mapInDoubt.begin(); itr != m_mapInDoubt.end(); ++itr)
+		vecEntries.push_back(itr->second);
+	return vecEntries;
+}
+
+void CPayJournal::sync()
+{
+	unique_lock<mutex> lock(m_mutex);
+	waitDurable(lock, m_llTicket);
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "PayMetrics.h"
+
+namespace SAPay {
+
+enum CPayJournalOutcome
+{
+	//the gateway gave a final answer, nothing to follow up
+	PAY_JOURNAL_SUCCEEDED,
+	PAY_JOURNAL_FAILED,
+
+	//sent but the answer is unknown (timeout, unparsable or unverified resps), stays in doubt
+	PAY_JOURNAL_UNKNOWN
+};
+
+//an operation whose intent was written but no final outcome
+struct CPayJournalEntry
+{
+	unsigned long long llId;
+	CPayProvider iProvider;
+	CPayOperation iOperation;
+
+	//wall clock ms of the intent
+	long long llTimeMs;
+
+	//app_id/mch_id
+	std::string strAccount;
+	std::string strOutTradeNo;
+
+	//out_request_no/out_refund_no, empty for prepay and withdraw
+	std::string strRequestNo;
+};
+
+struct CPayJournalOptions
+{
+	CPayJournalOptions() :
+		llSegmentSize(64 * 1024 * 1024),
+		iGroupCommitUs(0),
+		bSyncIntent(true) {}
+
+	//size of one mapped segment, grown on rotation if the in-doubt operations do not fit
+	unsigned long long llSegmentSize;
+
+	//the flusher waits this long after the first pending record to gather more into one fsync
+	int iGroupCommitUs;
+
+	//begin returns only once the intent is on disk, otherwise it may be lost with the machine
+	bool bSyncIntent;
+};
+
+/**
+* @name CPayJournal
+*
+* @brief								append only write-ahead journal of the calls that move money.
+*										begin records the intent before the request is sent, end the outcome after the resps.
+*										records are copied into a memory mapped segment under a mutex, a flusher thread
+*										fsyncs them in groups so concurrent callers share one fsync.
+*										two segment files are used in turn: when the active one is full the operations
+*										still in doubt are rewritten into the other one, nothing else is kept.
+*										opening the journal scans both segments, getInDoubt then lists what needs
+*										a queryPayStatus/queryRefund before being retried.
+*										throws boost::interprocess::interprocess_exception if a segment cannot be mapped
+*/
+class CPayJournal
+{
+public:
+	//segments are strPath.0 and strPath.1
+	explicit CPayJournal(const std::string& strPath, const CPayJournalOptions& options = CPayJournalOptions());
+	~CPayJournal();
+
+	CPayJournal(const CPayJournal&) = delete;
+	CPayJournal& operator=(const CPayJournal&) = delete;
+
+	//id of the operation, pass it to end
+	unsigned long long begin(
+		CPayProvider iProvider,
+		CPayOperation iOperation,
+		const std::string& strAccount,
+		const std::string& strOutTradeNo,
+		const std::string& strRequestNo = std::string("")
+	);
+
+	//never waits for the disk, a lost outcome only makes the operation in doubt again
+	void end(unsigned long long llId, CPayJournalOutcome iOutcome);
+
+	//in doubt operations, oldest first
+	std::vector<CPayJournalEntry> getInDoubt() const;
+
+	//wait until everything appended so far is on disk
+	void sync();
+
+private:
+	struct CSegment;
+
+	std::shared_ptr<CSegment> openSegment(int iIndex, unsigned long long llSize, unsigned int iGeneration, bool bCreate);
+	void recover();
+	void scan(CSegment& segment);
+
+	//under m_mutex, returns the ticket of the record
+	unsigned long long append(
+		unsigned char iType,
+		unsigned char iOutcome,
+		const CPayJournalEntry& entry
+	);
+	void writeRecord(CSegment& segment, unsigned char iType, unsigned char iOutcome, const CPayJournalEntry& entry);
+	void rotate(unsigned long long llNeeded);
+	void waitDurable(std::unique_lock<std::mutex>& lock, unsigned long long llTicket);
+	void flushLoop();
+
+	std::string m_strPath;
+	CPayJournalOptions m_options;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condAppended;
+	std::condition_variable m_condDurable;
+	std::shared_ptr<CSegment> m_pSegment;
+	unsigned long long m_llOffset;
+	unsigned long long m_llFlushedOffset;
+
+	//one ticket per record, durable once m_llDurableTicket reaches it
+	unsigned long long m_llTicket;
+	unsigned long long m_llDurableTicket;
+	unsigned long long m_llNextId;
+	std::map<unsigned long long, CPayJournalEntry> m_mapInDoubt;
+	bool m_bStop;
+
+	std::thread m_threadFlush;
+};
+
+}
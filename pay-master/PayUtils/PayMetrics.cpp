@@ -0,0 +1,527 @@
+#include "PayMetrics.h"
+#include "HttpClient.h"
+#include <map>
+#include <tuple>
+#include <cstring>
+#include <boost/format.hpp>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+using namespace SAPay;
+using namespace std;
+using namespace std::chrono;
+
+std::atomic<bool> CPayMetrics::s_bEnabled(false);
+std::atomic<CPayHistogram*> CPayMetrics::s_histograms[PAY_PROVIDER_COUNT][PAY_OP_COUNT][PAY_PHASE_COUNT];
+
+static thread_local const CPayMetricsScope* t_pCurrentScope = nullptr;
+
+#define ERROR_SHARD_CAPACITY 256
+#define ERROR_SHARD_MAX_PROBE 16
+#define ERROR_CODE_MAX_LENGTH 63
+#define ERROR_CODE_OVERFLOW "_overflow"
+
+//error counters of one thread, open addressing, only the owning thread inserts or increments
+struct CPayErrorShard
+{
+	struct Entry
+	{
+		std::atomic<bool> bReady;
+		uint32_t iHash;
+		unsigned char iProvider;
+		unsigned char iOperation;
+		unsigned char iErrorClass;
+		char szCode[ERROR_CODE_MAX_LENGTH + 1];
+		std::atomic<uint64_t> llCount;
+	};
+
+	CPayErrorShard() : bOwned(true), pNext(nullptr)
+	{
+		for (int i = 0; i < PAY_PROVIDER_COUNT; ++i)
+			for (int j = 0; j < PAY_OP_COUNT; ++j)
+			{
+				requests[i][j].store(0, memory_order_relaxed);
+				for (int k = 0; k < PAY_ERROR_CLASS_COUNT; ++k)
+					overflow[i][j][k].store(0, memory_order_relaxed);
+			}
+		for (int i = 0; i < ERROR_SHARD_CAPACITY; ++i)
+		{
+			entries[i].bReady.store(false, memory_order_relaxed);
+			entries[i].llCount.store(0, memory_order_relaxed);
+		}
+	}
+
+	static void increment(std::atomic<uint64_t>& counter)
+	{
+		//single writer, a plain load/store avoids the locked add
+		counter.store(counter.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	}
+
+	Entry* findOrInsert(uint32_t iHash, int iProvider, int iOperation, int iErrorClass, const char* pcCode, size_t iCodeLen)
+	{
+		for (int iProbe = 0; iProbe < ERROR_SHARD_MAX_PROBE; ++iProbe)
+		{
+			Entry& entry = entries[(iHash + iProbe) & (ERROR_SHARD_CAPACITY - 1)];
+			if (!entry.bReady.load(memory_order_relaxed))
+			{
+				entry.iHash = iHash;
+				entry.iProvider = (unsigned char)iProvider;
+				entry.iOperation = (unsigned char)iOperation;
+				entry.iErrorClass = (unsigned char)iErrorClass;
+				memcpy(entry.szCode, pcCode, iCodeLen);
+				entry.szCode[iCodeLen] = 0;
+				//publish the key before readers may look at it
+				entry.bReady.store(true, memory_order_release);
+				return &entry;
+			}
+			if (entry.iHash == iHash &&
+				entry.iProvider == iProvider &&
+				entry.iOperation == iOperation &&
+				entry.iErrorClass == iErrorClass &&
+				strncmp(entry.szCode, pcCode, iCodeLen) == 0 &&
+				entry.szCode[iCodeLen] == 0)
+			{
+				return &entry;
+			}
+		}
+		return nullptr;
+	}
+
+	std::atomic<bool> bOwned;
+	CPayErrorShard* pNext;
+	std::atomic<uint64_t> requests[PAY_PROVIDER_COUNT][PAY_OP_COUNT];
+	//codes that did not fit into entries
+	std::atomic<uint64_t> overflow[PAY_PROVIDER_COUNT][PAY_OP_COUNT][PAY_ERROR_CLASS_COUNT];
+	Entry entries[ERROR_SHARD_CAPACITY];
+};
+
+static std::atomic<CPayErrorShard*> s_pErrorShards(nullptr);
+
+//hands the shard back when its thread exits, the next new thread adopts it and keeps counting
+struct CPayErrorShardHolder
+{
+	CPayErrorShardHolder() : pShard(nullptr) {}
+	~CPayErrorShardHolder()
+	{
+		if (pShard != nullptr)
+			pShard->bOwned.store(false, memory_order_release);
+	}
+
+	CPayErrorShard* get()
+	{
+		if (pShard != nullptr)
+			return pShard;
+
+		for (CPayErrorShard* pFree = s_pErrorShards.load(memory_order_acquire); pFree != nullptr; pFree = pFree->pNext)
+		{
+			bool bOwned = false;
+			if (!pFree->bOwned.load(memory_order_relaxed) &&
+				pFree->bOwned.compare_exchange_strong(bOwned, true, memory_order_acquire))
+			{
+				pShard = pFree;
+				return pShard;
+			}
+		}
+
+		CPayErrorShard* pNewShard = new CPayErrorShard();
+		CPayErrorShard* pHead = s_pErrorShards.load(memory_order_relaxed);
+		do
+		{
+			pNewShard->pNext = pHead;
+		} while (!s_pErrorShards.compare_exchange_weak(pHead, pNewShard, memory_order_release, memory_order_relaxed));
+		pShard = pNewShard;
+		return pShard;
+	}
+
+	CPayErrorShard* pShard;
+};
+
+static thread_local CPayErrorShardHolder t_errorShard;
+
+static uint32_t hashErrorKey(int iProvider, int iOperation, int iErrorClass, const char* pcCode, size_t iCodeLen)
+{
+	//fnv-1a
+	uint32_t iHash = 2166136261u;
+	iHash = (iHash ^ (uint32_t)iProvider) * 16777619u;
+	iHash = (iHash ^ (uint32_t)iOperation) * 16777619u;
+	iHash = (iHash ^ (uint32_t)iErrorClass) * 16777619u;
+	for (size_t i = 0; i < iCodeLen; ++i)
+		iHash = (iHash ^ (unsigned char)pcCode[i]) * 16777619u;
+	return iHash;
+}
+
+//prometheus label values escape backslash, quote and newline
+static string escapeLabel(const char* pcValue)
+{
+	string strEscaped;
+	for (; *pcValue; ++pcValue)
+	{
+		if (*pcValue == '\\' || *pcValue == '"')
+		{
+			strEscaped += '\\';
+			strEscaped += *pcValue;
+		}
+		else if (*pcValue == '\n')
+			strEscaped += "\\n";
+		else
+			strEscaped += *pcValue;
+	}
+	return strEscaped;
+}
+
+static int highestBit(uint64_t llValue)
+{
+#ifdef _MSC_VER
+	unsigned long index = 0;
+	_BitScanReverse64(&index, llValue);
+	return (int)index;
+#else
+	return 63 - __builtin_clzll(llValue);
+#endif
+}
+
+static uint64_t elapsedMicros(const steady_clock::time_point& start)
+{
+	return (uint64_t)duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+CPayHistogram::CPayHistogram() :
+	m_llCount(0),
+	m_llSum(0),
+	m_llMax(0)
+{
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+		m_buckets[i].store(0, memory_order_relaxed);
+}
+
+int CPayHistogram::bucketIndex(uint64_t llValue)
+{
+	if (llValue < (uint64_t)SUB_BUCKET_COUNT)
+		return (int)llValue;
+
+	int iMsb = highestBit(llValue);
+	return (iMsb - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT + (int)(llValue >> (iMsb - SUB_BUCKET_BITS)) - SUB_BUCKET_COUNT;
+}
+
+uint64_t CPayHistogram::bucketUpperBound(int iIndex)
+{
+	if (iIndex < SUB_BUCKET_COUNT)
+		return (uint64_t)iIndex;
+
+	int iShift = iIndex / SUB_BUCKET_COUNT - 1;
+	uint64_t llLower = (uint64_t)(SUB_BUCKET_COUNT + iIndex % SUB_BUCKET_COUNT) << iShift;
+	return llLower + (((uint64_t)1 << iShift) - 1);
+}
+
+void CPayHistogram::record(uint64_t llValue)
+{
+	static const uint64_t llMaxTrackable = ((uint64_t)1 << MAX_VALUE_BITS) - 1;
+	if (llValue > llMaxTrackable)
+		llValue = llMaxTrackable;
+
+	m_buckets[bucketIndex(llValue)].fetch_add(1, memory_order_relaxed);
+	m_llCount.fetch_add(1, memory_order_relaxed);
+	m_llSum.fetch_add(llValue, memory_order_relaxed);
+
+	uint64_t llMax = m_llMax.load(memory_order_relaxed);
+	while (llValue > llMax && !m_llMax.compare_exchange_weak(llMax, llValue, memory_order_relaxed))
+	{
+	}
+}
+
+void CPayHistogram::reset()
+{
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+		m_buckets[i].store(0, memory_order_relaxed);
+	m_llCount.store(0, memory_order_relaxed);
+	m_llSum.store(0, memory_order_relaxed);
+	m_llMax.store(0, memory_order_relaxed);
+}
+
+uint64_t CPayHistogram::getQuantile(double dQuantile) const
+{
+	uint64_t llCount = getCount();
+	if (llCount == 0)
+		return 0;
+
+	//buckets are read without a snapshot, clamp the rank to what is actually visible
+	uint64_t llRank = (uint64_t)(dQuantile * (double)llCount + 0.5);
+	if (llRank == 0)
+		llRank = 1;
+
+	uint64_t llSeen = 0;
+	for (int i = 0; i < BUCKET_COUNT; ++i)
+	{
+		llSeen += m_buckets[i].load(memory_order_relaxed);
+		if (llSeen >= llRank)
+		{
+			uint64_t llUpper = bucketUpperBound(i);
+			uint64_t llMax = getMax();
+			return llUpper < llMax ? llUpper : llMax;
+		}
+	}
+	return getMax();
+}
+
+void CPayMetrics::record(CPayProvider iProvider, CPayOperation iOperation, CPayPhase iPhase, uint64_t llMicros)
+{
+	std::atomic<CPayHistogram*>& slot = s_histograms[iProvider][iOperation][iPhase];
+	CPayHistogram* pHistogram = slot.load(memory_order_acquire);
+	if (pHistogram == nullptr)
+	{
+		CPayHistogram* pNewHistogram = new CPayHistogram();
+		if (slot.compare_exchange_strong(pHistogram, pNewHistogram, memory_order_acq_rel, memory_order_acquire))
+			pHistogram = pNewHistogram;
+		else
+			delete pNewHistogram;
+	}
+	pHistogram->record(llMicros);
+}
+
+void CPayMetrics::recordHttpTimings(const CHttpTimings& timings)
+{
+	const CPayMetricsScope* pScope = CPayMetricsScope::current();
+	if (pScope == nullptr)
+		return;
+
+	CPayProvider iProvider = pScope->getProvider();
+	CPayOperation iOperation = pScope->getOperation();
+	//curl reports every phase as an offset from the start of the transfer
+	record(iProvider, iOperation, PAY_PHASE_DNS, timings.llNameLookup);
+	if (timings.llConnect >= timings.llNameLookup)
+		record(iProvider, iOperation, PAY_PHASE_CONNECT, timings.llConnect - timings.llNameLookup);
+	//appconnect is 0 for plain http and reused connections
+	if (timings.llAppConnect >= timings.llConnect && timings.llAppConnect > 0)
+		record(iProvider, iOperation, PAY_PHASE_TLS, timings.llAppConnect - timings.llConnect);
+	if (timings.llStartTransfer >= timings.llPreTransfer)
+		record(iProvider, iOperation, PAY_PHASE_SERVER, timings.llStartTransfer - timings.llPreTransfer);
+	if (timings.llTotal >= timings.llStartTransfer)
+		record(iProvider, iOperation, PAY_PHASE_TRANSFER, timings.llTotal - timings.llStartTransfer);
+	record(iProvider, iOperation, PAY_PHASE_NETWORK, timings.llTotal);
+}
+
+const CPayHistogram* CPayMetrics::getHistogram(CPayProvider iProvider, CPayOperation iOperation, CPayPhase iPhase)
+{
+	return s_histograms[iProvider][iOperation][iPhase].load(memory_order_acquire);
+}
+
+void CPayMetrics::countRequest(CPayProvider iProvider, CPayOperation iOperation)
+{
+	CPayErrorShard::increment(t_errorShard.get()->requests[iProvider][iOperation]);
+}
+
+void CPayMetrics::countError(CPayProvider iProvider, CPayOperation iOperation, CPayErrorClass iErrorClass, const string& strCode)
+{
+	const char* pcCode = strCode.c_str();
+	size_t iCodeLen = strCode.size() > ERROR_CODE_MAX_LENGTH ? ERROR_CODE_MAX_LENGTH : strCode.size();
+
+	CPayErrorShard* pShard = t_errorShard.get();
+	uint32_t iHash = hashErrorKey(iProvider, iOperation, iErrorClass, pcCode, iCodeLen);
+	CPayErrorShard::Entry* pEntry = pShard->findOrInsert(iHash, iProvider, iOperation, iErrorClass, pcCode, iCodeLen);
+	//too many distinct codes on this thread, keep the class count right at least
+	CPayErrorShard::increment(pEntry != nullptr ?
+		pEntry->llCount :
+		pShard->overflow[iProvider][iOperation][iErrorClass]);
+}
+
+void CPayMetrics::getErrorCounters(vector<CPayErrorCounter>& vecCounters)
+{
+	map<tuple<int, int, int, string>, uint64_t> mapMerged;
+	for (CPayErrorShard* pShard = s_pErrorShards.load(memory_order_acquire); pShard != nullptr; pShard = pShard->pNext)
+	{
+		for (int i = 0; i < ERROR_SHARD_CAPACITY; ++i)
+		{
+			const CPayErrorShard::Entry& entry = pShard->entries[i];
+			if (!entry.bReady.load(memory_order_acquire))
+				continue;
+			mapMerged[make_tuple((int)entry.iProvider, (int)entry.iOperation, (int)entry.iErrorClass, string(entry.szCode))] +=
+				entry.llCount.load(memory_order_relaxed);
+		}
+
+		for (int iProvider = 0; iProvider < PAY_PROVIDER_COUNT; ++iProvider)
+		{
+			for (int iOperation = 0; iOperation < PAY_OP_COUNT; ++iOperation)
+			{
+				for (int iErrorClass = 0; iErrorClass < PAY_ERROR_CLASS_COUNT; ++iErrorClass)
+				{
+					uint64_t llCount = pShard->overflow[iProvider][iOperation][iErrorClass].load(memory_order_relaxed);
+					if (llCount > 0)
+						mapMerged[make_tuple(iProvider, iOperation, iErrorClass, string(ERROR_CODE_OVERFLOW))] += llCount;
+				}
+			}
+		}
+	}
+
+	for (auto itr = mapMerged.begin(); itr != mapMerged.end(); ++itr)
+	{
+		CPayErrorCounter counter;
+		counter.iProvider = (CPayProvider)get<0>(itr->first);
+		counter.iOperation = (CPayOperation)get<1>(itr->first);
+		counter.iErrorClass = (CPayErrorClass)get<2>(itr->first);
+		counter.strCode = get<3>(itr->first);
+		counter.llCount = itr->second;
+		vecCounters.push_back(counter);
+	}
+}
+
+uint64_t CPayMetrics::getRequestCount(CPayProvider iProvider, CPayOperation iOperation)
+{
+	uint64_t llCount = 0;
+	for (CPayErrorShard* pShard = s_pErrorShards.load(memory_order_acquire); pShard != nullptr; pShard = pShard->pNext)
+		llCount += pShard->requests[iProvider][iOperation].load(memory_order_relaxed);
+	return llCount;
+}
+
+void CPayMetrics::dump(string& strOut)
+{
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+	strOut.append("# TYPE sapay_phase_latency_us summary\n");
+	for (int iProvider = 0; iProvider < PAY_PROVIDER_COUNT; ++iProvider)
+	{
+		for (int iOperation = 0; iOperation < PAY_OP_COUNT; ++iOperation)
+		{
+			for (int iPhase = 0; iPhase < PAY_PHASE_COUNT; ++iPhase)
+			{
+				const CPayHistogram* pHistogram = s_histograms[iProvider][iOperation][iPhase].load(memory_order_acquire);
+				if (pHistogram == nullptr || pHistogram->getCount() == 0)
+					continue;
+
+				string strLabels = (boost::format("provider=\"%s\",operation=\"%s\",phase=\"%s\"")
+					% getProviderName((CPayProvider)iProvider)
+					% getOperationName((CPayOperation)iOperation)
+					% getPhaseName((CPayPhase)iPhase)).str();
+
+				for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); ++i)
+				{
+					strOut.append((boost::format("sapay_phase_latency_us{%s,quantile=\"%g\"} %llu\n")
+						% strLabels % quantiles[i] % pHistogram->getQuantile(quantiles[i])).str());
+				}
+				strOut.append((boost::format("sapay_phase_latency_us_sum{%s} %llu\n") % strLabels % pHistogram->getSum()).str());
+				strOut.append((boost::format("sapay_phase_latency_us_count{%s} %llu\n") % strLabels % pHistogram->getCount()).str());
+			}
+		}
+	}
+
+	strOut.append("# TYPE sapay_requests_total counter\n");
+	for (int iProvider = 0; iProvider < PAY_PROVIDER_COUNT; ++iProvider)
+	{
+		for (int iOperation = 0; iOperation < PAY_OP_COUNT; ++iOperation)
+		{
+			uint64_t llCount = getRequestCount((CPayProvider)iProvider, (CPayOperation)iOperation);
+			if (llCount == 0)
+				continue;
+			strOut.append((boost::format("sapay_requests_total{provider=\"%s\",operation=\"%s\"} %llu\n")
+				% getProviderName((CPayProvider)iProvider)
+				% getOperationName((CPayOperation)iOperation)
+				% llCount).str());
+		}
+	}
+
+	vector<CPayErrorCounter> vecCounters;
+	getErrorCounters(vecCounters);
+	strOut.append("# TYPE sapay_errors_total counter\n");
+	for (auto itr = vecCounters.begin(); itr != vecCounters.end(); ++itr)
+	{
+		strOut.append((boost::format("sapay_errors_total{provider=\"%s\",operation=\"%s\",class=\"%s\",code=\"%s\"} %llu\n")
+			% getProviderName(itr->iProvider)
+			% getOperationName(itr->iOperation)
+			% getErrorClassName(itr->iErrorClass)
+			% escapeLabel(itr->strCode.c_str())
+			% itr->llCount).str());
+	}
+}
+
+void CPayMetrics::reset()
+{
+	for (int iProvider = 0; iProvider < PAY_PROVIDER_COUNT; ++iProvider)
+	{
+		for (int iOperation = 0; iOperation < PAY_OP_COUNT; ++iOperation)
+		{
+			for (int iPhase = 0; iPhase < PAY_PHASE_COUNT; ++iPhase)
+			{
+				CPayHistogram* pHistogram = s_histograms[iProvider][iOperation][iPhase].load(memory_order_acquire);
+				if (pHistogram != nullptr)
+					pHistogram->reset();
+			}
+		}
+	}
+}
+
+const char* CPayMetrics::getProviderName(CPayProvider iProvider)
+{
+	static const char* names[PAY_PROVIDER_COUNT] = { "alipay", "wechat" };
+	return iProvider < PAY_PROVIDER_COUNT ? names[iProvider] : "unknow";
+}
+
+const char* CPayMetrics::getOperationName(CPayOperation iOperation)
+{
+	static const char* names[PAY_OP_COUNT] = { "prepay", "refund", "withdraw", "query", "query_refund", "login", "download_bill" };
+	return iOperation < PAY_OP_COUNT ? names[iOperation] : "unknow";
+}
+
+const char* CPayMetrics::getPhaseName(CPayPhase iPhase)
+{
+	static const char* names[PAY_PHASE_COUNT] = {
+		"build", "sign",
+		"dns", "connect", "tls", "server", "transfer", "network",
+		"parse", "verify",
+		"total"
+	};
+	return iPhase < PAY_PHASE_COUNT ? names[iPhase] : "unknow";
+}
+
+const char* CPayMetrics::getErrorClassName(CPayErrorClass iErrorClass)
+{
+	static const char* names[PAY_ERROR_CLASS_COUNT] = { "network", "parse", "verify", "sub_code", "config", "circuit_open", "rate_limited", "refund_exceeded", "unknow" };
+	return iErrorClass < PAY_ERROR_CLASS_COUNT ? names[iErrorClass] : "unknow";
+}
+
+CPayMetricsScope::CPayMetricsScope(CPayProvider iProvider, CPayOperation iOperation) :
+	m_bActive(false),
+	m_iProvider(iProvider),
+	m_iOperation(iOperation)
+{
+	if (t_pCurrentScope == nullptr && CPayMetrics::isEnabled())
+	{
+		m_bActive = true;
+		m_start = steady_clock::now();
+		t_pCurrentScope = this;
+		CPayMetrics::countRequest(iProvider, iOperation);
+	}
+}
+
+CPayMetricsScope::~CPayMetricsScope()
+{
+	if (m_bActive)
+	{
+		CPayMetrics::record(m_iProvider, m_iOperation, PAY_PHASE_TOTAL, elapsedMicros(m_start));
+		t_pCurrentScope = nullptr;
+	}
+}
+
+const CPayMetricsScope* CPayMetricsScope::current()
+{
+	return t_pCurrentScope;
+}
+
+void CPayMetricsScope::countError(CPayErrorClass iErrorClass, const string& strCode)
+{
+	if (t_pCurrentScope != nullptr)
+		CPayMetrics::countError(t_pCurrentScope->getProvider(), t_pCurrentScope->getOperation(), iErrorClass, strCode);
+}
+
+CPayPhaseTimer::CPayPhaseTimer(CPayPhase iPhase) :
+	m_pScope(t_pCurrentScope),
+	m_iPhase(iPhase)
+{
+	if (m_pScope != nullptr)
+		m_start = steady_clock::now();
+}
+
+CPayPhaseTimer::~CPayPhaseTimer()
+{
+	if (m_pScope != nullptr)
+		CPayMetrics::record(m_pScope->getProvider(), m_pScope->getOperation(), m_iPhase, elapsedMicros(m_start));
+}
@@ -0,0 +1,230 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace SAPay {
+
+struct CHttpTimings;
+
+enum CPayProvider
+{
+	PAY_PROVIDER_ALIPAY,
+	PAY_PROVIDER_WECHAT,
+	PAY_PROVIDER_COUNT
+};
+
+enum CPayOperation
+{
+	PAY_OP_PREPAY,
+	PAY_OP_REFUND,
+	PAY_OP_WITHDRAW,
+	PAY_OP_QUERY,
+	PAY_OP_QUERY_REFUND,
+	PAY_OP_LOGIN,
+	PAY_OP_DOWNLOAD_BILL,
+	PAY_OP_COUNT
+};
+
+enum CPayPhase
+{
+	//request building, sign included
+	PAY_PHASE_BUILD,
+	PAY_PHASE_SIGN,
+
+	//curl CURLINFO_*_TIME
+	PAY_PHASE_DNS,
+	PAY_PHASE_CONNECT,
+	PAY_PHASE_TLS,
+	PAY_PHASE_SERVER,
+	PAY_PHASE_TRANSFER,
+	PAY_PHASE_NETWORK,
+
+	//json/xml parse and sign verify
+	PAY_PHASE_PARSE,
+	PAY_PHASE_VERIFY,
+
+	//whole api call
+	PAY_PHASE_TOTAL,
+	PAY_PHASE_COUNT
+};
+
+enum CPayErrorClass
+{
+	//curl error, code is the curl return code
+	PAY_ERROR_CLASS_NETWORK,
+
+	//resps is not valid json/xml or misses a field
+	PAY_ERROR_CLASS_PARSE,
+
+	PAY_ERROR_CLASS_VERIFY,
+
+	//alipay sub_code, wechat err_code/return_msg
+	PAY_ERROR_CLASS_SUB_CODE,
+
+	//missing cert/app secret
+	PAY_ERROR_CLASS_CONFIG,
+
+	//circuit breaker open, nothing was sent
+	PAY_ERROR_CLASS_CIRCUIT_OPEN,
+
+	//shed by the client side rate limiter, nothing was sent
+	PAY_ERROR_CLASS_RATE_LIMITED,
+
+	//more than the refund ledger allows, nothing was sent
+	PAY_ERROR_CLASS_REFUND_EXCEEDED,
+
+	PAY_ERROR_CLASS_UNKNOW,
+	PAY_ERROR_CLASS_COUNT
+};
+
+struct CPayErrorCounter
+{
+	CPayProvider iProvider;
+	CPayOperation iOperation;
+	CPayErrorClass iErrorClass;
+	std::string strCode;
+	uint64_t llCount;
+};
+
+/**
+* @name CPayHistogram
+*
+* @brief								log-linear (hdr style) latency histogram in microseconds,
+*										16 sub buckets per power of two (~6% precision), lock-free record
+*/
+class CPayHistogram
+{
+public:
+	static const int SUB_BUCKET_BITS = 4;
+	static const int SUB_BUCKET_COUNT = 1 << SUB_BUCKET_BITS;
+	static const int MAX_VALUE_BITS = 36;
+	static const int BUCKET_COUNT = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) * SUB_BUCKET_COUNT;
+
+	CPayHistogram();
+
+	void record(uint64_t llValue);
+	void reset();
+
+	uint64_t getCount() const { return m_llCount.load(std::memory_order_relaxed); }
+	uint64_t getSum() const { return m_llSum.load(std::memory_order_relaxed); }
+	uint64_t getMax() const { return m_llMax.load(std::memory_order_relaxed); }
+
+	//dQuantile in [0, 1], returns 0 when empty
+	uint64_t getQuantile(double dQuantile) const;
+
+private:
+	static int bucketIndex(uint64_t llValue);
+	static uint64_t bucketUpperBound(int iIndex);
+
+	std::atomic<uint64_t> m_llCount;
+	std::atomic<uint64_t> m_llSum;
+	std::atomic<uint64_t> m_llMax;
+	std::atomic<uint64_t> m_buckets[BUCKET_COUNT];
+};
+
+/**
+* @name CPayMetrics
+*
+* @brief								process wide latency registry, one histogram per provider/operation/phase.
+*										histograms are created on first record, recording never locks.
+*										disabled by default, a disabled registry costs one relaxed atomic load per api call
+*/
+class CPayMetrics
+{
+public:
+	static void setEnabled(bool bEnabled) { s_bEnabled.store(bEnabled, std::memory_order_relaxed); }
+	static bool isEnabled() { return s_bEnabled.load(std::memory_order_relaxed); }
+
+	static void record(CPayProvider iProvider, CPayOperation iOperation, CPayPhase iPhase, uint64_t llMicros);
+
+	//record curl phases into the histograms of the current CPayMetricsScope
+	static void recordHttpTimings(const CHttpTimings& timings);
+
+	//nullptr if nothing was recorded yet
+	static const CPayHistogram* getHistogram(CPayProvider iProvider, CPayOperation iOperation, CPayPhase iPhase);
+
+	/**
+	* @name countError
+	*
+	* @brief								counters live in per-thread shards, the owning thread is the only writer
+	*										so counting never locks nor contends, readers merge every shard.
+	*										strCode is truncated to 63 bytes
+	*/
+	static void countRequest(CPayProvider iProvider, CPayOperation iOperation);
+	static void countError(CPayProvider iProvider, CPayOperation iOperation, CPayErrorClass iErrorClass, const std::string& strCode);
+
+	//merged over all threads, one element per provider/operation/class/code
+	static void getErrorCounters(std::vector<CPayErrorCounter>& vecCounters);
+	static uint64_t getRequestCount(CPayProvider iProvider, CPayOperation iOperation);
+
+	//prometheus text format, latency summaries with p50/p90/p99/p999 quantiles, request and error counters
+	static void dump(std::string& strOut);
+
+	//reset latency histograms only, counters are monotonic
+	static void reset();
+
+	static const char* getProviderName(CPayProvider iProvider);
+	static const char* getOperationName(CPayOperation iOperation);
+	static const char* getPhaseName(CPayPhase iPhase);
+	static const char* getErrorClassName(CPayErrorClass iErrorClass);
+
+private:
+	static std::atomic<bool> s_bEnabled;
+	static std::atomic<CPayHistogram*> s_histograms[PAY_PROVIDER_COUNT][PAY_OP_COUNT][PAY_PHASE_COUNT];
+};
+
+/**
+* @name CPayMetricsScope
+*
+* @brief								marks the current thread as running an api call and records PAY_PHASE_TOTAL,
+*										nested scopes are ignored so prepayWithSign -> prepay counts once
+*/
+class CPayMetricsScope
+{
+public:
+	CPayMetricsScope(CPayProvider iProvider, CPayOperation iOperation);
+	~CPayMetricsScope();
+
+	CPayMetricsScope(const CPayMetricsScope&) = delete;
+	CPayMetricsScope& operator=(const CPayMetricsScope&) = delete;
+
+	CPayProvider getProvider() const { return m_iProvider; }
+	CPayOperation getOperation() const { return m_iOperation; }
+
+	//count an error for the current scope, no-op without one
+	static void countError(CPayErrorClass iErrorClass, const std::string& strCode);
+
+	//scope of the current thread, nullptr if none or metrics disabled
+	static const CPayMetricsScope* current();
+
+private:
+	bool m_bActive;
+	CPayProvider m_iProvider;
+	CPayOperation m_iOperation;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+/**
+* @name CPayPhaseTimer
+*
+* @brief								steady_clock span recorded into the current CPayMetricsScope on destruction
+*/
+class CPayPhaseTimer
+{
+public:
+	explicit CPayPhaseTimer(CPayPhase iPhase);
+	~CPayPhaseTimer();
+
+	CPayPhaseTimer(const CPayPhaseTimer&) = delete;
+	CPayPhaseTimer& operator=(const CPayPhaseTimer&) = delete;
+
+private:
+	const CPayMetricsScope* m_pScope;
+	CPayPhase m_iPhase;
+	std::chrono::steady_clock::time_point m_start;
+};
+
+}
@@ -0,0 +1,228 @@
+#pragma once
+#include <list>
+#include <algorithm>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <chrono>
+#include <functional>
+#include <unordered_map>
+#include <boost/optional.hpp>
+#include "PaySingleFlight.h"
+
+namespace SAPay {
+
+//specialized next to each resps type: static bool isFinal(const TResps&)
+template<typename TResps>
+struct CPayOrderTraits;
+
+struct CPayOrderCacheOptions
+{
+	CPayOrderCacheOptions() :
+		iPendingTtlMs(2000),
+		iMaxEntries(100000) {}
+
+	//pending states (waiting for the buyer) are queried again after this long
+	int iPendingTtlMs;
+
+	//oldest entries are dropped beyond this
+	size_t iMaxEntries;
+};
+
+/**
+* @name CPayOrderCache
+*
+* @brief								order state by account and out_trade_no, fed by query results and verified notifies.
+*										final states never expire, pending ones live iPendingTtlMs, a pending state
+*										never replaces a final one. concurrent misses on the same order share one load,
+*										its result or error goes to every waiting caller. errors are not cached, nor is a load
+*										that was running when erase was called for its order, it may predate a refund
+*/
+template<typename TResps, typename TError>
+class CPayOrderCache
+{
+public:
+	using LoadFunc = std::function<bool(TResps&, boost::optional<TError>&)>;
+
+	explicit CPayOrderCache(const CPayOrderCacheOptions& options = CPayOrderCacheOptions()) :
+		m_options(options),
+		m_iMaxEntriesPerShard(std::max<size_t>(1, options.iMaxEntries / SHARD_COUNT)) {}
+
+	CPayOrderCache(const CPayOrderCache&) = delete;
+	CPayOrderCache& operator=(const CPayOrderCache&) = delete;
+
+	static std::string makeKey(const std::string& strAccount, const std::string& strOutTradeNo)
+	{
+		return strAccount + "|" + strOutTradeNo;
+	}
+
+	//cached state only, false on miss or expiry
+	bool get(const std::string& strKey, TResps& resps)
+	{
+		CShard& shard = getShard(strKey);
+		std::lock_guard<std::mutex> lock(shard.mutexShard);
+		std::shared_ptr<const TResps> pResps = find(shard, strKey);
+		if (!pResps)
+			return false;
+		resps = *pResps;
+		return true;
+	}
+
+	void put(const std::string& strKey, const TResps& resps)
+	{
+		std::shared_ptr<const TResps> pResps = std::make_shared<TResps>(resps);
+		CShard& shard = getShard(strKey);
+		std::lock_guard<std::mutex> lock(shard.mutexShard);
+		store(shard, strKey, pResps);
+	}
+
+	//after a refund or anything else that moves a final state
+	void erase(const std::string& strKey)
+	{
+		CShard& shard = getShard(strKey);
+		std::lock_guard<std::mutex> lock(shard.mutexShard);
+		auto itrLoad = shard.mapLoads.find(strKey);
+		if (itrLoad != shard.mapLoads.end())
+			++itrLoad->second.llGeneration;
+		auto itr = shard.mapEntries.find(strKey);
+		if (itr == shard.mapEntries.end())
+			return;
+		shard.listOrder.erase(itr->second.itrOrder);
+		shard.mapEntries.erase(itr);
+	}
+
+	//cached state, otherwise the result of load, shared with every concurrent caller of strKey
+	bool getOrLoad(const std::string& strKey, TResps& resps, boost::optional<TError>& error, const LoadFunc& load)
+	{
+		if (get(strKey, resps))
+			return true;
+
+		return m_singleFlight.call(strKey, resps, error, [this, &strKey, &load](TResps& flightResps, boost::optional<TError>& flightError)
+		{
+			//a flight that ended between the miss and the call already stored its result
+			if (get(strKey, flightResps))
+				return true;
+			unsigned long long llGeneration = beginLoad(strKey);
+			bool bLoaded = load(flightResps, flightError);
+
+			//stored before the flight ends, so no caller sees neither
+			endLoad(strKey, llGeneration, bLoaded ? &flightResps : nullptr);
+			return bLoaded;
+		});
+	}
+
+private:
+	enum { SHARD_COUNT = 16 };
+
+	struct CEntry
+	{
+		std::shared_ptr<const TResps> pResps;
+
+		//0 never expires
+		long long llExpireMs;
+		typename std::list<std::string>::iterator itrOrder;
+	};
+
+	//loads in flight for one key, erase bumps the generation
+	struct CLoad
+	{
+		CLoad() :iRefs(0), llGeneration(0) {}
+
+		int iRefs;
+		unsigned long long llGeneration;
+	};
+
+	struct CShard
+	{
+		std::mutex mutexShard;
+		std::unordered_map<std::string, CEntry> mapEntries;
+
+		//only keys with a load running, so it stays small
+		std::unordered_map<std::string, CLoad> mapLoads;
+
+		//insertion order, oldest first
+		std::list<std::string> listOrder;
+	};
+
+	static long long nowMs()
+	{
+		return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	CShard& getShard(const std::string& strKey)
+	{
+		return m_shards[std::hash<std::string>()(strKey) % SHARD_COUNT];
+	}
+
+	unsigned long long beginLoad(const std::string& strKey)
+	{
+		CShard& shard = getShard(strKey);
+		std::lock_guard<std::mutex> lock(shard.mutexShard);
+		CLoad& load = shard.mapLoads[strKey];
+		++load.iRefs;
+		return load.llGeneration;
+	}
+
+	//pResps is dropped if the order was erased since beginLoad
+	void endLoad(const std::string& strKey, unsigned long long llGeneration, const TResps* pResps)
+	{
+		std::shared_ptr<const TResps> pStored;
+		if (pResps)
+			pStored = std::make_shared<TResps>(*pResps);
+		CShard& shard = getShard(strKey);
+		std::lock_guard<std::mutex> lock(shard.mutexShard);
+		auto itrLoad = shard.mapLoads.find(strKey);
+		if (pStored && itrLoad->second.llGeneration == llGeneration)
+			store(shard, strKey, pStored);
+		if (--itrLoad->second.iRefs == 0)
+			shard.mapLoads.erase(itrLoad);
+	}
+
+	//under the shard lock
+	std::shared_ptr<const TResps> find(CShard& shard, const std::string& strKey)
+	{
+		auto itr = shard.mapEntries.find(strKey);
+		if (itr == shard.mapEntries.end())
+			return nullptr;
+		if (itr->second.llExpireMs != 0 && itr->second.llExpireMs <= nowMs())
+		{
+			shard.listOrder.erase(itr->second.itrOrder);
+			shard.mapEntries.erase(itr);
+			return nullptr;
+		}
+		return itr->second.pResps;
+	}
+
+	//under the shard lock
+	void store(CShard& shard, const std::string& strKey, const std::shared_ptr<const TResps>& pResps)
+	{
+		bool bFinal = CPayOrderTraits<TResps>::isFinal(*pResps);
+		auto itr = shard.mapEntries.find(strKey);
+		if (itr != shard.mapEntries.end())
+		{
+			//a late pending answer must not hide a final state from a notify
+			if (itr->second.llExpireMs == 0 && !bFinal)
+				return;
+			itr->second.pResps = pResps;
+			itr->second.llExpireMs = bFinal ? 0 : nowMs() + m_options.iPendingTtlMs;
+			return;
+		}
+
+		while (shard.mapEntries.size() >= m_iMaxEntriesPerShard && !shard.listOrder.empty())
+		{
+			shard.mapEntries.erase(shard.listOrder.front());
+			shard.listOrder.pop_front();
+		}
+		CEntry& entry = shard.mapEntries[strKey];
+		entry.pResps = pResps;
+		entry.llExpireMs = bFinal ? 0 : nowMs() + m_options.iPendingTtlMs;
+		entry.itrOrder = shard.listOrder.insert(shard.listOrder.end(), strKey);
+	}
+
+	CPayOrderCacheOptions m_options;
+	size_t m_iMaxEntriesPerShard;
+	CShard m_shards[SHARD_COUNT];
+	CPaySingleFlight<TResps, TError> m_singleFlight;
+};
+
+}
@@ -0,0 +1,131 @@
+#include "PayRateLimiter.h"
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+
+using namespace SAPay;
+using namespace std;
+using namespace std::chrono;
+
+#define NS_PER_SECOND 1000000000.0
+
+//one decrease per cooldown, a burst of throttled resps only halves the rate once
+#define RATE_DECREASE_COOLDOWN_NS 500000000LL
+
+static long long qpsToIntervalNs(double dQps)
+{
+	return dQps > 0 ? max(1LL, (long long)(NS_PER_SECOND / dQps)) : 0;
+}
+
+CPayRateLimiter* CPayRateLimiter::get(const string& strKey)
+{
+	static mutex s_mutex;
+	static map<string, unique_ptr<CPayRateLimiter>> s_mapLimiters;
+
+	lock_guard<mutex> lock(s_mutex);
+	unique_ptr<CPayRateLimiter>& pLimiter = s_mapLimiters[strKey];
+	if (!pLimiter)
+		pLimiter.reset(new CPayRateLimiter());
+	return pLimiter.get();
+}
+
+string CPayRateLimiter::makeKey(const string& strAccount, const string& strMethod)
+{
+	return strAccount + "|" + strMethod;
+}
+
+CPayRateLimiter::CPayRateLimiter() :
+	m_llTatNs(0),
+	m_llIntervalNs(0),
+	m_llMinIntervalNs(0),
+	m_llMaxIntervalNs(0),
+	m_llMaxQueueDelayNs(0),
+	m_llLastDecreaseNs(0),
+	m_iBurst(1),
+	m_dIncreaseQps(1)
+{
+}
+
+long long CPayRateLimiter::nowNs()
+{
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void CPayRateLimiter::configure(const CPayRateLimit& rateLimit)
+{
+	long long llMinInterval = qpsToIntervalNs(rateLimit.dQps);
+	long long llMaxInterval = max(llMinInterval, qpsToIntervalNs(min(rateLimit.dMinQps, rateLimit.dQps)));
+	m_iBurst.store(max(1, rateLimit.iBurst), memory_order_relaxed);
+	m_llMaxQueueDelayNs.store((long long)rateLimit.iMaxQueueDelayMs * 1000000LL, memory_order_relaxed);
+	m_dIncreaseQps.store(rateLimit.dIncreaseQps, memory_order_relaxed);
+	m_llMinIntervalNs.store(llMinInterval, memory_order_relaxed);
+	m_llMaxIntervalNs.store(llMaxInterval, memory_order_relaxed);
+	m_llIntervalNs.store(llMinInterval, memory_order_relaxed);
+}
+
+bool CPayRateLimiter::acquire()
+{
+	long long llInterval = m_llIntervalNs.load(memory_order_relaxed);
+	if (llInterval <= 0)
+		return true;
+
+	long long llTolerance = (m_iBurst.load(memory_order_relaxed) - 1) * llInterval;
+	long long llMaxDelay = m_llMaxQueueDelayNs.load(memory_order_relaxed);
+	long long llNow = nowNs();
+	long long llTat = m_llTatNs.load(memory_order_relaxed);
+	for (;;)
+	{
+		long long llStart = max(llTat, llNow);
+		long long llWait = llStart - llTolerance - llNow;
+		if (llWait > llMaxDelay)
+			return false;
+
+		//reserve the slot first, then wait for it outside of any shared state
+		if (m_llTatNs.compare_exchange_weak(llTat, llStart + llInterval, memory_order_relaxed))
+		{
+			if (llWait > 0)
+				this_thread::sleep_for(nanoseconds(llWait));
+			return true;
+		}
+	}
+}
+
+void CPayRateLimiter::onSuccess()
+{
+	long long llInterval = m_llIntervalNs.load(memory_order_relaxed);
+	long long llMinInterval = m_llMinIntervalNs.load(memory_order_relaxed);
+	if (llInterval <= llMinInterval)
+		return;
+
+	//additive increase: qps grows by dIncreaseQps per second of traffic at the current rate
+	double dQps = NS_PER_SECOND / llInterval;
+	double dNewQps = dQps + m_dIncreaseQps.load(memory_order_relaxed) / dQps;
+	long long llNewInterval = max(llMinInterval, qpsToIntervalNs(dNewQps));
+	m_llIntervalNs.compare_exchange_strong(llInterval, llNewInterval, memory_order_relaxed);
+}
+
+void CPayRateLimiter::onThrottled()
+{
+	long long llInterval = m_llIntervalNs.load(memory_order_relaxed);
+	if (llInterval <= 0)
+		return;
+
+	long long llNow = nowNs();
+	long long llLastDecrease = m_llLastDecreaseNs.load(memory_order_relaxed);
+	if (llNow - llLastDecrease < RATE_DECREASE_COOLDOWN_NS ||
+		!m_llLastDecreaseNs.compare_exchange_strong(llLastDecrease, llNow, memory_order_relaxed))
+		return;
+
+	//multiplicative decrease
+	long long llNewInterval = min(m_llMaxIntervalNs.load(memory_order_relaxed), llInterval * 2);
+	m_llIntervalNs.compare_exchange_strong(llInterval, llNewInterval, memory_order_relaxed);
+}
+
+double CPayRateLimiter::getCurrentQps() const
+{
+	long long llInterval = m_llIntervalNs.load(memory_order_relaxed);
+	return llInterval > 0 ? NS_PER_SECOND / llInterval : 0;
+}
@@ -0,0 +1,74 @@
+#pragma once
+#include <atomic>
+#include <string>
+
+namespace SAPay {
+
+struct CPayRateLimit
+{
+	CPayRateLimit() :
+		dQps(0),
+		iBurst(1),
+		iMaxQueueDelayMs(0),
+		dMinQps(1),
+		dIncreaseQps(1) {}
+
+	//ceiling of the provider, <= 0 disables the limiter
+	double dQps;
+	int iBurst;
+
+	//excess calls wait up to this long for a slot, 0 sheds them at once
+	int iMaxQueueDelayMs;
+
+	//throttling halves the rate down to dMinQps, every second of successful traffic gives back dIncreaseQps
+	double dMinQps;
+	double dIncreaseQps;
+};
+
+/**
+* @name CPayRateLimiter
+*
+* @brief								GCRA token bucket, one per app_id/mch_id and api method for the whole process.
+*										acquire is a single CAS on the theoretical arrival time, no lock.
+*										the rate adapts AIMD style between dMinQps and dQps from throttling sub_codes
+*/
+class CPayRateLimiter
+{
+public:
+	//never freed, strKey is app id/mch id and method, see makeKey
+	static CPayRateLimiter* get(const std::string& strKey);
+	static std::string makeKey(const std::string& strAccount, const std::string& strMethod);
+
+	CPayRateLimiter();
+
+	CPayRateLimiter(const CPayRateLimiter&) = delete;
+	CPayRateLimiter& operator=(const CPayRateLimiter&) = delete;
+
+	void configure(const CPayRateLimit& rateLimit);
+
+	//false if the call has to be shed, otherwise may sleep up to iMaxQueueDelayMs
+	bool acquire();
+
+	void onSuccess();
+	void onThrottled();
+
+	//0 if disabled
+	double getCurrentQps() const;
+
+private:
+	static long long nowNs();
+
+	//theoretical arrival time of the next call
+	std::atomic<long long> m_llTatNs;
+
+	//current emission interval, 0 if disabled
+	std::atomic<long long> m_llIntervalNs;
+	std::atomic<long long> m_llMinIntervalNs;
+	std::atomic<long long> m_llMaxIntervalNs;
+	std::atomic<long long> m_llMaxQueueDelayNs;
+	std::atomic<long long> m_llLastDecreaseNs;
+	std::atomic<int> m_iBurst;
+	std::atomic<double> m_dIncreaseQps;
+};
+
+}
@@ -0,0 +1,159 @@
+#include "PayRefundLedger.h"
+#include <algorithm>
+#include <functional>
+
+using namespace SAPay;
+using namespace std;
+
+CPayRefundLedger::CPayRefundLedger(const CPayRefundLedgerOptions& options) :
+	m_options(options),
+	m_iMaxEntriesPerShard(max<size_t>(1, options.iMaxEntries / SHARD_COUNT))
+{
+}
+
+string CPayRefundLedger::makeKey(const string& strAccount, const string& strOutTradeNo)
+{
+	return strAccount + "|" + strOutTradeNo;
+}
+
+CPayRefundLedger::CShard& CPayRefundLedger::getShard(const string& strKey)
+{
+	return m_shards[hash<string>()(strKey) % SHARD_COUNT];
+}
+
+CPayRefundLedger::CEntry& CPayRefundLedger::findOrAdd(CShard& shard, const string& strKey)
+{
+	auto itr = shard.mapEntries.find(strKey);
+	if (itr != shard.mapEntries.end())
+		return itr->second;
+
+	while (shard.mapEntries.size() >= m_iMaxEntriesPerShard && !shard.listOrder.empty())
+	{
+		shard.mapEntries.erase(shard.listOrder.front());
+		shard.listOrder.pop_front();
+	}
+	CEntry& entry = shard.mapEntries[strKey];
+	entry.itrOrder = shard.listOrder.insert(shard.listOrder.end(), strKey);
+	return entry;
+}
+
+void CPayRefundLedger::setCaptured(const string& strKey, long long llFen)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	findOrAdd(shard, strKey).llCaptured = llFen;
+}
+
+CPayRefundReserve CPayRefundLedger::reserve(const string& strKey, const string& strRefundNo, long long llFen)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strKey);
+	if (itr == shard.mapEntries.end() || itr->second.llCaptured < 0)
+		return PAY_REFUND_UNTRACKED;
+
+	//a retry of a settled or in-flight refund number refunds nothing more at the gateway
+	CEntry& entry = itr->second;
+	if (entry.setSettled.count(strRefundNo) != 0)
+		return PAY_REFUND_RESERVED;
+	auto itrReserved = entry.mapReserved.find(strRefundNo);
+	if (itrReserved != entry.mapReserved.end())
+	{
+		++itrReserved->second.iRefs;
+		return PAY_REFUND_RESERVED;
+	}
+
+	if (llFen > entry.llCaptured - entry.llRefunded - entry.llReserved)
+		return PAY_REFUND_EXCEEDED;
+
+	CReservation& reservation = entry.mapReserved[strRefundNo];
+	reservation.llFen = llFen;
+	reservation.iRefs = 1;
+	entry.llReserved += llFen;
+	return PAY_REFUND_RESERVED;
+}
+
+void CPayRefundLedger::commit(const string& strKey, const string& strRefundNo, long long llFen)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	CEntry& entry = findOrAdd(shard, strKey);
+	if (!entry.setSettled.insert(strRefundNo).second)
+		return;
+
+	auto itrReserved = entry.mapReserved.find(strRefundNo);
+	if (itrReserved != entry.mapReserved.end())
+	{
+		entry.llReserved -= itrReserved->second.llFen;
+		entry.mapReserved.erase(itrReserved);
+	}
+	entry.llRefunded += llFen;
+}
+
+void CPayRefundLedger::release(const string& strKey, const string& strRefundNo)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strKey);
+	if (itr == shard.mapEntries.end())
+		return;
+
+	CEntry& entry = itr->second;
+	auto itrReserved = entry.mapReserved.find(strRefundNo);
+	if (itrReserved == entry.mapReserved.end())
+		return;
+	entry.llReserved -= itrReserved->second.llFen;
+	entry.mapReserved.erase(itrReserved);
+}
+
+void CPayRefundLedger::cancel(const string& strKey, const string& strRefundNo)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strKey);
+	if (itr == shard.mapEntries.end())
+		return;
+
+	CEntry& entry = itr->second;
+	auto itrReserved = entry.mapReserved.find(strRefundNo);
+	if (itrReserved == entry.mapReserved.end() || --itrReserved->second.iRefs > 0)
+		return;
+	entry.llReserved -= itrReserved->second.llFen;
+	entry.mapReserved.erase(itrReserved);
+}
+
+bool CPayRefundLedger::getBalance(const string& strKey, CPayRefundBalance& balance)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strKey);
+	if (itr == shard.mapEntries.end() || itr->second.llCaptured < 0)
+		return false;
+
+	balance.llCaptured = itr->second.llCaptured;
+	balance.llRefunded = itr->second.llRefunded;
+	balance.llReserved = itr->second.llReserved;
+	return true;
+}
+
+void CPayRefundLedger::erase(const string& strKey)
+{
+	CShard& shard = getShard(strKey);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strKey);
+	if (itr == shard.mapEntries.end())
+		return;
+	shard.listOrder.erase(itr->second.itrOrder);
+	shard.mapEntries.erase(itr);
+}
+
+size_t CPayRefundLedger::size() const
+{
+	size_t iSize = 0;
+	for (int i = 0; i < SHARD_COUNT; ++i)
+	{
+		lock_guard<mutex> lock(m_shards[i].mutexShard);
+		iSize += m_shards[i].mapEntries.size();
+	}
+	return iSize;
+}
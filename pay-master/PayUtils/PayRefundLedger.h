@@ -0,0 +1,137 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace SAPay {
+
+struct CPayRefundLedgerOptions
+{
+	CPayRefundLedgerOptions() :
+		iMaxEntries(100000) {}
+
+	//oldest orders are dropped beyond this, their refunds then go to the gateway unchecked
+	size_t iMaxEntries;
+};
+
+enum CPayRefundReserve
+{
+	//held against the order until commit or release
+	PAY_REFUND_RESERVED,
+
+	//captured amount not known yet, nothing held, the gateway decides
+	PAY_REFUND_UNTRACKED,
+
+	//more than the refundable balance, nothing held
+	PAY_REFUND_EXCEEDED
+};
+
+//fen
+struct CPayRefundBalance
+{
+	CPayRefundBalance() :
+		llCaptured(0),
+		llRefunded(0),
+		llReserved(0) {}
+
+	long long getRefundable() const { return llCaptured - llRefunded - llReserved; }
+
+	long long llCaptured;
+	long long llRefunded;
+
+	//refunds sent and not answered yet, or answered with an unknown outcome
+	long long llReserved;
+};
+
+/**
+* @name CPayRefundLedger
+*
+* @brief								captured and refunded fen by account and out_trade_no, so over-refunds are
+*										rejected before the round trip. a refund reserves its amount under the shard
+*										lock, concurrent partial refunds of one order can not together pass the balance.
+*										a reservation is committed on success, released on a definite failure and kept
+*										while the outcome is unknown. a refund number is counted once however often
+*										it is retried, so refunded is the sum of the settled refund numbers and never a
+*										total reported by the gateway. the captured amount only comes from the gateway, a query or a
+*										notify, never from the caller
+*/
+class CPayRefundLedger
+{
+public:
+	explicit CPayRefundLedger(const CPayRefundLedgerOptions& options = CPayRefundLedgerOptions());
+
+	CPayRefundLedger(const CPayRefundLedger&) = delete;
+	CPayRefundLedger& operator=(const CPayRefundLedger&) = delete;
+
+	static std::string makeKey(const std::string& strAccount, const std::string& strOutTradeNo);
+
+	//total paid by the buyer, from a query, a notify or a refund answer of the gateway
+	void setCaptured(const std::string& strKey, long long llFen);
+
+	CPayRefundReserve reserve(const std::string& strKey, const std::string& strRefundNo, long long llFen);
+
+	//the gateway accepted the refund or a refund query found it settled, tracked or not
+	void commit(const std::string& strKey, const std::string& strRefundNo, long long llFen);
+
+	//the gateway rejected the refund or closed it, every send of the number is released at once
+	void release(const std::string& strKey, const std::string& strRefundNo);
+
+	//this send never reached the gateway, only its own hold goes and earlier in doubt sends stay held
+	void cancel(const std::string& strKey, const std::string& strRefundNo);
+
+	//false if the order is not tracked
+	bool getBalance(const std::string& strKey, CPayRefundBalance& balance);
+
+	void erase(const std::string& strKey);
+
+	size_t size() const;
+
+private:
+	enum { SHARD_COUNT = 16 };
+
+	struct CReservation
+	{
+		long long llFen;
+
+		//concurrent sends of the same refund number hold it once
+		int iRefs;
+	};
+
+	struct CEntry
+	{
+		CEntry() :
+			llCaptured(-1),
+			llRefunded(0),
+			llReserved(0) {}
+
+		//-1 until a query reports it
+		long long llCaptured;
+		long long llRefunded;
+		long long llReserved;
+		std::unordered_map<std::string, CReservation> mapReserved;
+		std::unordered_set<std::string> setSettled;
+		std::list<std::string>::iterator itrOrder;
+	};
+
+	struct CShard
+	{
+		mutable std::mutex mutexShard;
+		std::unordered_map<std::string, CEntry> mapEntries;
+
+		//insertion order, oldest first
+		std::list<std::string> listOrder;
+	};
+
+	CShard& getShard(const std::string& strKey);
+
+	//under the shard lock, creates the entry and evicts the oldest beyond the limit
+	CEntry& findOrAdd(CShard& shard, const std::string& strKey);
+
+	CPayRefundLedgerOptions m_options;
+	size_t m_iMaxEntriesPerShard;
+	CShard m_shards[SHARD_COUNT];
+};
+
+}
@@ -0,0 +1,188 @@
+#include "PayResilience.h"
+#include "PayMetrics.h"
+#include "HttpClient.h"
+#include <map>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <algorithm>
+#include <curl/curl.h>
+
+using namespace SAPay;
+using namespace std;
+using namespace std::chrono;
+
+#define RETRY_TOKEN_UNIT 10
+#define RETRY_TOKEN_MAX 100
+
+CPayCircuitBreaker* CPayCircuitBreaker::get(const string& strEndpoint)
+{
+	static mutex s_mutex;
+	static map<string, unique_ptr<CPayCircuitBreaker>> s_mapBreakers;
+
+	lock_guard<mutex> lock(s_mutex);
+	unique_ptr<CPayCircuitBreaker>& pBreaker = s_mapBreakers[strEndpoint];
+	if (!pBreaker)
+		pBreaker.reset(new CPayCircuitBreaker());
+	return pBreaker.get();
+}
+
+CPayCircuitBreaker::CPayCircuitBreaker(int iFailureThreshold /*= 5*/, int iOpenMs /*= 10000*/) :
+	m_iState(STATE_CLOSED),
+	m_iFailures(0),
+	m_llOpenUntilMs(0),
+	m_iFailureThreshold(iFailureThreshold),
+	m_iOpenMs(iOpenMs),
+	m_iRetryTokens(RETRY_TOKEN_MAX)
+{
+}
+
+void CPayCircuitBreaker::configure(int iFailureThreshold, int iOpenMs)
+{
+	m_iFailureThreshold.store(iFailureThreshold, memory_order_relaxed);
+	m_iOpenMs.store(iOpenMs, memory_order_relaxed);
+}
+
+long long CPayCircuitBreaker::nowMs()
+{
+	return duration_cast<milliseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+bool CPayCircuitBreaker::allowRequest()
+{
+	int iState = m_iState.load(memory_order_acquire);
+	if (iState == STATE_CLOSED)
+		return true;
+	if (iState == STATE_HALF_OPEN)
+		return false;
+
+	if (nowMs() < m_llOpenUntilMs.load(memory_order_relaxed))
+		return false;
+
+	//open period is over, the first caller becomes the probe
+	return m_iState.compare_exchange_strong(iState, STATE_HALF_OPEN, memory_order_acq_rel);
+}
+
+void CPayCircuitBreaker::onSuccess()
+{
+	m_iFailures.store(0, memory_order_relaxed);
+	if (m_iState.load(memory_order_relaxed) != STATE_CLOSED)
+		m_iState.store(STATE_CLOSED, memory_order_release);
+
+	int iTokens = m_iRetryTokens.load(memory_order_relaxed);
+	while (iTokens < RETRY_TOKEN_MAX &&
+		!m_iRetryTokens.compare_exchange_weak(iTokens, iTokens + 1, memory_order_relaxed))
+	{
+	}
+}
+
+void CPayCircuitBreaker::onFailure()
+{
+	int iFailures = m_iFailures.fetch_add(1, memory_order_relaxed) + 1;
+	int iState = m_iState.load(memory_order_acquire);
+	if (iState == STATE_HALF_OPEN ||
+		(iState == STATE_CLOSED && iFailures >= m_iFailureThreshold.load(memory_order_relaxed)))
+	{
+		m_llOpenUntilMs.store(nowMs() + m_iOpenMs.load(memory_order_relaxed), memory_order_relaxed);
+		m_iState.compare_exchange_strong(iState, STATE_OPEN, memory_order_acq_rel);
+	}
+}
+
+bool CPayCircuitBreaker::isOpen() const
+{
+	return m_iState.load(memory_order_relaxed) != STATE_CLOSED;
+}
+
+bool CPayCircuitBreaker::tryAcquireRetry()
+{
+	int iTokens = m_iRetryTokens.load(memory_order_relaxed);
+	while (iTokens >= RETRY_TOKEN_UNIT)
+	{
+		if (m_iRetryTokens.compare_exchange_weak(iTokens, iTokens - RETRY_TOKEN_UNIT, memory_order_relaxed))
+			return true;
+	}
+	return false;
+}
+
+bool CPayResilience::isSafeToResend(int iNetWorkCode)
+{
+	switch (iNetWorkCode)
+	{
+	case CURLE_COULDNT_RESOLVE_PROXY:
+	case CURLE_COULDNT_RESOLVE_HOST:
+	case CURLE_COULDNT_CONNECT:
+	case CURLE_SSL_CONNECT_ERROR:
+		return true;
+	default:
+		return false;
+	}
+}
+
+int CPayResilience::backoffDelayMs(const CPayRetryPolicy& policy, int iAttempt)
+{
+	static thread_local mt19937 s_random(random_device{}());
+
+	long long llCeil = policy.iBaseDelayMs;
+	for (int i = 0; i < iAttempt && llCeil < policy.iMaxDelayMs; ++i)
+		llCeil <<= 1;
+	llCeil = min<long long>(llCeil, policy.iMaxDelayMs);
+	if (llCeil <= 0)
+		return 0;
+	return uniform_int_distribution<int>(0, (int)llCeil)(s_random);
+}
+
+int CPayResilience::hedgeDelayMs(const CPayRetryPolicy& policy)
+{
+	const CPayMetricsScope* pScope = CPayMetricsScope::current();
+	if (pScope == nullptr)
+		return policy.iHedgeDelayMs;
+
+	const CPayHistogram* pHistogram = CPayMetrics::getHistogram(pScope->getProvider(), pScope->getOperation(), PAY_PHASE_NETWORK);
+	if (pHistogram == nullptr || pHistogram->getCount() < (uint64_t)policy.iHedgeMinSamples)
+		return policy.iHedgeDelayMs;
+
+	return max(1, (int)(pHistogram->getQuantile(0.95) / 1000));
+}
+
+CPayCallRet CPayResilience::execute(
+	const CPayRetryPolicy& policy,
+	CPayCircuitBreaker* pBreaker,
+	CPayIdempotency iIdempotency,
+	const CPayHttpAttempt& attempt,
+	string& strResps,
+	CHttpTimings* pTimings,
+	int& iNetWorkCode
+)
+{
+	bool bHedge = policy.bHedge && iIdempotency == PAY_CALL_READ_ONLY;
+	CHttpHedge hedge;
+	if (bHedge)
+	{
+		hedge.iDelayMs = hedgeDelayMs(policy);
+		//a half open breaker has its probe in flight already, hedges spend the same budget as retries
+		hedge.allow = [pBreaker]() { return pBreaker == nullptr || (pBreaker->allowRequest() && pBreaker->tryAcquireRetry()); };
+	}
+	for (int iAttempt = 0; ; ++iAttempt)
+	{
+		if (pBreaker && !pBreaker->allowRequest())
+			return PAY_CALL_CIRCUIT_OPEN;
+
+		strResps.clear();
+		iNetWorkCode = attempt(strResps, pTimings, bHedge ? &hedge : nullptr);
+		if (pBreaker && iNetWorkCode == 0)
+			pBreaker->onSuccess();
+		else if (pBreaker)
+			pBreaker->onFailure();
+		if (iNetWorkCode == 0)
+			return PAY_CALL_SUCCESS;
+
+		if (iAttempt + 1 >= policy.iMaxAttempts ||
+			(iIdempotency == PAY_CALL_NON_IDEMPOTENT && !isSafeToResend(iNetWorkCode)) ||
+			(pBreaker && !pBreaker->tryAcquireRetry()))
+		{
+			return PAY_CALL_NETWORK_ERROR;
+		}
+
+		this_thread::sleep_for(milliseconds(backoffDelayMs(policy, iAttempt)));
+	}
+}
@@ -0,0 +1,143 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <string>
+
+namespace SAPay {
+
+struct CHttpTimings;
+struct CHttpHedge;
+
+//how safe a gateway call is to send twice
+enum CPayIdempotency
+{
+	//prepay, withdraw, small program login: resent only when the request never left (dns/connect failed)
+	PAY_CALL_NON_IDEMPOTENT,
+
+	//refund keyed by out_request_no/out_refund_no: resent on any network error
+	PAY_CALL_IDEMPOTENT,
+
+	//query: resent on any network error and hedged when slow
+	PAY_CALL_READ_ONLY
+};
+
+enum CPayCallRet
+{
+	PAY_CALL_SUCCESS,
+	PAY_CALL_NETWORK_ERROR,
+
+	//circuit breaker is open, nothing was sent
+	PAY_CALL_CIRCUIT_OPEN
+};
+
+struct CPayRetryPolicy
+{
+	CPayRetryPolicy() :
+		iMaxAttempts(3),
+		iBaseDelayMs(50),
+		iMaxDelayMs(1000),
+		bHedge(true),
+		iHedgeDelayMs(300),
+		iHedgeMinSamples(100) {}
+
+	//1 disables retry
+	int iMaxAttempts;
+
+	//full jitter backoff, sleep is random in [0, min(iMaxDelayMs, iBaseDelayMs * 2^attempt)]
+	int iBaseDelayMs;
+	int iMaxDelayMs;
+
+	//hedge read only calls: send a second copy when the first one is slower than the p95 network
+	//latency of the operation, iHedgeDelayMs is used until CPayMetrics has iHedgeMinSamples samples
+	bool bHedge;
+	int iHedgeDelayMs;
+	int iHedgeMinSamples;
+};
+
+/**
+* @name CPayCircuitBreaker
+*
+* @brief								per endpoint breaker, opens after iFailureThreshold consecutive network errors,
+*										fails fast for iOpenMs then lets a single probe through (half open).
+*										also holds the retry budget of the endpoint: every success earns 0.1 retry,
+*										at most 10 banked, so retries and hedges add at most ~10% load upstream
+*/
+class CPayCircuitBreaker
+{
+public:
+	//one breaker per endpoint for the whole process, never freed
+	static CPayCircuitBreaker* get(const std::string& strEndpoint);
+
+	CPayCircuitBreaker(int iFailureThreshold = 5, int iOpenMs = 10000);
+
+	CPayCircuitBreaker(const CPayCircuitBreaker&) = delete;
+	CPayCircuitBreaker& operator=(const CPayCircuitBreaker&) = delete;
+
+	void configure(int iFailureThreshold, int iOpenMs);
+
+	//false while open, true for the single half open probe
+	bool allowRequest();
+	void onSuccess();
+	void onFailure();
+	bool isOpen() const;
+
+	bool tryAcquireRetry();
+
+private:
+	enum
+	{
+		STATE_CLOSED,
+		STATE_OPEN,
+		STATE_HALF_OPEN
+	};
+
+	static long long nowMs();
+
+	std::atomic<int> m_iState;
+	std::atomic<int> m_iFailures;
+	std::atomic<long long> m_llOpenUntilMs;
+	std::atomic<int> m_iFailureThreshold;
+	std::atomic<int> m_iOpenMs;
+
+	//in tenths of a retry
+	std::atomic<int> m_iRetryTokens;
+};
+
+//one http attempt, returns the curl code. pHedge is handed to CHttpClient, nullptr when the call is not hedged
+using CPayHttpAttempt = std::function<int(std::string& strResps, CHttpTimings* pTimings, const CHttpHedge* pHedge)>;
+
+class CPayResilience
+{
+public:
+	/**
+	* @name execute
+	*
+	* @brief								run attempt under the breaker with retries, hedge read only calls.
+	*										every attempt runs on the calling thread, the hedge is a second transfer
+	*										in the same curl multi handle
+	*
+	* @param pBreaker						may be nullptr
+	* @param strResps						resps of the successful attempt
+	* @param pTimings						timings of the attempt that produced the result, may be nullptr
+	* @param iNetWorkCode					curl code of the last attempt
+	*/
+	static CPayCallRet execute(
+		const CPayRetryPolicy& policy,
+		CPayCircuitBreaker* pBreaker,
+		CPayIdempotency iIdempotency,
+		const CPayHttpAttempt& attempt,
+		std::string& strResps,
+		CHttpTimings* pTimings,
+		int& iNetWorkCode
+	);
+
+	//curl codes meaning the request never reached the server
+	static bool isSafeToResend(int iNetWorkCode);
+
+	static int backoffDelayMs(const CPayRetryPolicy& policy, int iAttempt);
+
+	//p95 network latency of the current CPayMetricsScope operation, policy.iHedgeDelayMs without enough samples
+	static int hedgeDelayMs(const CPayRetryPolicy& policy);
+};
+
+}
@@ -0,0 +1,89 @@
+#include "PaySessionStore.h"
+#include <chrono>
+#include <algorithm>
+#include <functional>
+
+using namespace SAPay;
+using namespace std;
+
+CPaySessionStore::CPaySessionStore(const CPaySessionStoreOptions& options) :
+	m_options(options),
+	m_iMaxEntriesPerShard(max<size_t>(1, options.iMaxEntries / SHARD_COUNT))
+{
+}
+
+long long CPaySessionStore::nowMs()
+{
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+CPaySessionStore::CShard& CPaySessionStore::getShard(const string& strOpenId)
+{
+	return m_shards[hash<string>()(strOpenId) % SHARD_COUNT];
+}
+
+bool CPaySessionStore::get(const string& strOpenId, CPaySession& session)
+{
+	CShard& shard = getShard(strOpenId);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strOpenId);
+	if (itr == shard.mapEntries.end())
+		return false;
+	if (itr->second.llExpireMs <= nowMs())
+	{
+		shard.listRecent.erase(itr->second.itrRecent);
+		shard.mapEntries.erase(itr);
+		return false;
+	}
+
+	shard.listRecent.splice(shard.listRecent.begin(), shard.listRecent, itr->second.itrRecent);
+	session = itr->second.session;
+	return true;
+}
+
+void CPaySessionStore::put(const CPaySession& session)
+{
+	CShard& shard = getShard(session.strOpenId);
+	lock_guard<mutex> lock(shard.mutexShard);
+	long long llExpireMs = nowMs() + m_options.iTtlMs;
+	auto itr = shard.mapEntries.find(session.strOpenId);
+	if (itr != shard.mapEntries.end())
+	{
+		itr->second.session = session;
+		itr->second.llExpireMs = llExpireMs;
+		shard.listRecent.splice(shard.listRecent.begin(), shard.listRecent, itr->second.itrRecent);
+		return;
+	}
+
+	while (shard.mapEntries.size() >= m_iMaxEntriesPerShard && !shard.listRecent.empty())
+	{
+		shard.mapEntries.erase(shard.listRecent.back());
+		shard.listRecent.pop_back();
+	}
+	CEntry& entry = shard.mapEntries[session.strOpenId];
+	entry.session = session;
+	entry.llExpireMs = llExpireMs;
+	entry.itrRecent = shard.listRecent.insert(shard.listRecent.begin(), session.strOpenId);
+}
+
+void CPaySessionStore::erase(const string& strOpenId)
+{
+	CShard& shard = getShard(strOpenId);
+	lock_guard<mutex> lock(shard.mutexShard);
+	auto itr = shard.mapEntries.find(strOpenId);
+	if (itr == shard.mapEntries.end())
+		return;
+	shard.listRecent.erase(itr->second.itrRecent);
+	shard.mapEntries.erase(itr);
+}
+
+size_t CPaySessionStore::size() const
+{
+	size_t iSize = 0;
+	for (int i = 0; i < SHARD_COUNT; ++i)
+	{
+		lock_guard<mutex> lock(m_shards[i].mutexShard);
+		iSize += m_shards[i].mapEntries.size();
+	}
+	return iSize;
+}
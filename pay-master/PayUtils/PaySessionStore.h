@@ -0,0 +1,81 @@
+#pragma once
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace SAPay {
+
+struct CPaySession
+{
+	std::string strOpenId;
+	std::string strSessionKey;
+};
+
+struct CPaySessionStoreOptions
+{
+	CPaySessionStoreOptions() :
+		iTtlMs(24 * 3600 * 1000),
+		iMaxEntries(1000000) {}
+
+	//a session is dropped this long after its login, the client then logs in again
+	int iTtlMs;
+
+	//least recently read sessions are dropped beyond this
+	size_t iMaxEntries;
+};
+
+/**
+* @name CPaySessionStore
+*
+* @brief								mini-program sessions by openid, bounded by ttl and lru.
+*										16 shards, each a map plus a recency list under its own mutex,
+*										a read moves the session to the front of its shard
+*/
+class CPaySessionStore
+{
+public:
+	explicit CPaySessionStore(const CPaySessionStoreOptions& options = CPaySessionStoreOptions());
+
+	CPaySessionStore(const CPaySessionStore&) = delete;
+	CPaySessionStore& operator=(const CPaySessionStore&) = delete;
+
+	//false on miss or expiry
+	bool get(const std::string& strOpenId, CPaySession& session);
+
+	//replaces the session of the same openid and restarts its ttl
+	void put(const CPaySession& session);
+
+	void erase(const std::string& strOpenId);
+
+	size_t size() const;
+
+private:
+	enum { SHARD_COUNT = 16 };
+
+	struct CEntry
+	{
+		CPaySession session;
+		long long llExpireMs;
+		std::list<std::string>::iterator itrRecent;
+	};
+
+	struct CShard
+	{
+		mutable std::mutex mutexShard;
+		std::unordered_map<std::string, CEntry> mapEntries;
+
+		//most recently read first
+		std::list<std::string> listRecent;
+	};
+
+	static long long nowMs();
+
+	CShard& getShard(const std::string& strOpenId);
+
+	CPaySessionStoreOptions m_options;
+	size_t m_iMaxEntriesPerShard;
+	CShard m_shards[SHARD_COUNT];
+};
+
+}
@@ -0,0 +1,445 @@
+#include "PaySettledStore.h"
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define PAY_SETTLED_MAGIC 0x54535350
+#define PAY_SETTLED_VERSION 1
+
+//every column starts on a cache line
+#define PAY_SETTLED_ALIGN 64
+
+using namespace SAPay;
+using namespace std;
+using boost::interprocess::file_mapping;
+using boost::interprocess::mapped_region;
+using boost::interprocess::read_only;
+
+namespace SAPay {
+
+struct CPaySettledHeader
+{
+	uint32_t iMagic;
+	uint32_t iVersion;
+	uint64_t llRows;
+	int64_t llMinTime;
+	int64_t llMaxTime;
+	uint32_t iStatusCount;
+	uint32_t iStringCount;
+
+	//byte offsets from the start of the file
+	uint64_t llTimeOffset;
+	uint64_t llAmountOffset;
+	uint64_t llStatusOffset;
+	uint64_t llProviderOffset;
+	uint64_t llOutTradeNoOffset;
+	uint64_t llTradeNoOffset;
+	uint64_t llStatusIdsOffset;
+	uint64_t llStringOffsetsOffset;
+	uint64_t llStringDataOffset;
+	uint64_t llStringDataSize;
+	uint64_t llFileSize;
+};
+
+}
+
+struct CPaySettledStore::CMapping
+{
+	file_mapping mapping;
+	mapped_region region;
+};
+
+static uint64_t alignUp(uint64_t llOffset)
+{
+	return (llOffset + PAY_SETTLED_ALIGN - 1) / PAY_SETTLED_ALIGN * PAY_SETTLED_ALIGN;
+}
+
+static int lowestBit64(uint64_t llMask)
+{
+#ifdef _MSC_VER
+	unsigned long iIndex = 0;
+	_BitScanForward64(&iIndex, llMask);
+	return (int)iIndex;
+#else
+	return __builtin_ctzll(llMask);
+#endif
+}
+
+CPaySettledWriter::CPaySettledWriter()
+{
+}
+
+uint32_t CPaySettledWriter::intern(const string& str)
+{
+	auto itr = m_mapStrings.find(str);
+	if (itr != m_mapStrings.end())
+		return itr->second;
+
+	uint32_t iId = (uint32_t)m_vecStrings.size();
+	m_vecStrings.push_back(str);
+	m_mapStrings[str] = iId;
+	return iId;
+}
+
+bool CPaySettledWriter::add(const CPaySettledTxn& txn)
+{
+	uint8_t iStatus = 0;
+	auto itr = m_mapStatus.find(txn.strStatus);
+	if (itr != m_mapStatus.end())
+	{
+		iStatus = itr->second;
+	}
+	else
+	{
+		if (m_vecStatusIds.size() >= 255)
+			return false;
+		iStatus = (uint8_t)m_vecStatusIds.size();
+		m_vecStatusIds.push_back(intern(txn.strStatus));
+		m_mapStatus[txn.strStatus] = iStatus;
+	}
+
+	m_vecTime.push_back(txn.llTime);
+	m_vecAmount.push_back(txn.llAmount);
+	m_vecStatus.push_back(iStatus);
+	m_vecProvider.push_back((uint8_t)txn.iProvider);
+	m_vecOutTradeNo.push_back(intern(txn.strOutTradeNo));
+	m_vecTradeNo.push_back(intern(txn.strTradeNo));
+	return true;
+}
+
+template<typename T>
+static void writeColumn(ofstream& file, uint64_t llOffset, const vector<T>& vecColumn, const vector<size_t>& vecOrder)
+{
+	file.seekp(llOffset);
+	vector<T> vecSorted(vecColumn.size());
+	for (size_t i = 0; i < vecOrder.size(); ++i)
+		vecSorted[i] = vecColumn[vecOrder[i]];
+	if (!vecSorted.empty())
+		file.write((const char*)&vecSorted[0], vecSorted.size() * sizeof(T));
+}
+
+//the data is on disk before the rename makes it the store
+static bool syncFile(const string& strPath)
+{
+#ifdef _WIN32
+	HANDLE hFile = CreateFileA(strPath.c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hFile == INVALID_HANDLE_VALUE)
+		return false;
+	BOOL bFlushed = FlushFileBuffers(hFile);
+	CloseHandle(hFile);
+	return bFlushed != FALSE;
+#else
+	int fd = open(strPath.c_str(), O_WRONLY);
+	if (fd < 0)
+		return false;
+	int iRet = fsync(fd);
+	close(fd);
+	return iRet == 0;
+#endif
+}
+
+//one step, a crash leaves either the old or the new store in place, never none
+static bool replaceFile(const string& strFrom, const string& strTo)
+{
+#ifdef _WIN32
+	return MoveFileExA(strFrom.c_str(), strTo.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != FALSE;
+#else
+	return rename(strFrom.c_str(), strTo.c_str()) == 0;
+#endif
+}
+
+bool CPaySettledWriter::commit(const string& strPath)
+{
+	uint64_t llStringDataSize = 0;
+	for (auto itr = m_vecStrings.begin(); itr != m_vecStrings.end(); ++itr)
+		llStringDataSize += itr->size();
+	if (llStringDataSize > UINT32_MAX)
+		return false;
+
+	size_t iRows = m_vecTime.size();
+	vector<size_t> vecOrder(iRows);
+	for (size_t i = 0; i < iRows; ++i)
+		vecOrder[i] = i;
+	stable_sort(vecOrder.begin(), vecOrder.end(), [this](size_t a, size_t b) { return m_vecTime[a] < m_vecTime[b]; });
+
+	CPaySettledHeader header;
+	memset(&header, 0, sizeof(header));
+	header.iMagic = PAY_SETTLED_MAGIC;
+	header.iVersion = PAY_SETTLED_VERSION;
+	header.llRows = iRows;
+	header.llMinTime = iRows ? m_vecTime[vecOrder.front()] : 0;
+	header.llMaxTime = iRows ? m_vecTime[vecOrder.back()] : 0;
+	header.iStatusCount = (uint32_t)m_vecStatusIds.size();
+	header.iStringCount = (uint32_t)m_vecStrings.size();
+	header.llTimeOffset = alignUp(sizeof(header));
+	header.llAmountOffset = alignUp(header.llTimeOffset + iRows * sizeof(int64_t));
+	header.llStatusOffset = alignUp(header.llAmountOffset + iRows * sizeof(int64_t));
+	header.llProviderOffset = alignUp(header.llStatusOffset + iRows);
+	header.llOutTradeNoOffset = alignUp(header.llProviderOffset + iRows);
+	header.llTradeNoOffset = alignUp(header.llOutTradeNoOffset + iRows * sizeof(uint32_t));
+	header.llStatusIdsOffset = alignUp(header.llTradeNoOffset + iRows * sizeof(uint32_t));
+	header.llStringOffsetsOffset = alignUp(header.llStatusIdsOffset + header.iStatusCount * sizeof(uint32_t));
+	header.llStringDataOffset = alignUp(header.llStringOffsetsOffset + (header.iStringCount + 1) * sizeof(uint32_t));
+	header.llStringDataSize = llStringDataSize;
+	header.llFileSize = header.llStringDataOffset + llStringDataSize;
+
+	string strTmpPath = strPath + ".tmp";
+	{
+		ofstream file(strTmpPath.c_str(), ios::binary | ios::trunc);
+		if (!file)
+			return false;
+		file.write((const char*)&header, sizeof(header));
+		writeColumn(file, header.llTimeOffset, m_vecTime, vecOrder);
+		writeColumn(file, header.llAmountOffset, m_vecAmount, vecOrder);
+		writeColumn(file, header.llStatusOffset, m_vecStatus, vecOrder);
+		writeColumn(file, header.llProviderOffset, m_vecProvider, vecOrder);
+		writeColumn(file, header.llOutTradeNoOffset, m_vecOutTradeNo, vecOrder);
+		writeColumn(file, header.llTradeNoOffset, m_vecTradeNo, vecOrder);
+
+		file.seekp(header.llStatusIdsOffset);
+		if (!m_vecStatusIds.empty())
+			file.write((const char*)&m_vecStatusIds[0], m_vecStatusIds.size() * sizeof(uint32_t));
+
+		vector<uint32_t> vecStringOffsets;
+		vecStringOffsets.reserve(m_vecStrings.size() + 1);
+		uint32_t iOffset = 0;
+		for (auto itr = m_vecStrings.begin(); itr != m_vecStrings.end(); ++itr)
+		{
+			vecStringOffsets.push_back(iOffset);
+			iOffset += (uint32_t)itr->size();
+		}
+		vecStringOffsets.push_back(iOffset);
+		file.seekp(header.llStringOffsetsOffset);
+		file.write((const char*)&vecStringOffsets[0], vecStringOffsets.size() * sizeof(uint32_t));
+
+		file.seekp(header.llStringDataOffset);
+		for (auto itr = m_vecStrings.begin(); itr != m_vecStrings.end(); ++itr)
+			file.write(itr->data(), itr->size());
+		file.flush();
+		if (!file)
+			return false;
+	}
+
+	return syncFile(strTmpPath) && replaceFile(strTmpPath, strPath);
+}
+
+//a corrupt header can hold any offset, the sum must not wrap past the check
+static bool fitsIn(uint64_t llOffset, uint64_t llBytes, uint64_t llSize)
+{
+	return llOffset <= llSize && llBytes <= llSize - llOffset;
+}
+
+CPaySettledStore::CPaySettledStore(const string& strPath) :
+	m_pMapping(new CMapping()),
+	m_pHeader(nullptr),
+	m_pTime(nullptr),
+	m_pAmount(nullptr),
+	m_pStatus(nullptr),
+	m_pProvider(nullptr),
+	m_pOutTradeNo(nullptr),
+	m_pTradeNo(nullptr),
+	m_pStatusIds(nullptr),
+	m_pStringOffsets(nullptr),
+	m_pStringData(nullptr)
+{
+	m_pMapping->mapping = file_mapping(strPath.c_str(), read_only);
+	m_pMapping->region = mapped_region(m_pMapping->mapping, read_only);
+	const char* pBase = (const char*)m_pMapping->region.get_address();
+	uint64_t llSize = m_pMapping->region.get_size();
+	if (llSize < sizeof(CPaySettledHeader))
+		return;
+
+	const CPaySettledHeader* pHeader = (const CPaySettledHeader*)pBase;
+	uint64_t llRows = pHeader->llRows;
+	if (pHeader->iMagic != PAY_SETTLED_MAGIC ||
+		pHeader->iVersion != PAY_SETTLED_VERSION ||
+		pHeader->llFileSize > llSize ||
+		llRows > llSize ||
+		!fitsIn(pHeader->llTimeOffset, llRows * sizeof(int64_t), llSize) ||
+		!fitsIn(pHeader->llAmountOffset, llRows * sizeof(int64_t), llSize) ||
+		!fitsIn(pHeader->llStatusOffset, llRows, llSize) ||
+		!fitsIn(pHeader->llProviderOffset, llRows, llSize) ||
+		!fitsIn(pHeader->llOutTradeNoOffset, llRows * sizeof(uint32_t), llSize) ||
+		!fitsIn(pHeader->llTradeNoOffset, llRows * sizeof(uint32_t), llSize) ||
+		!fitsIn(pHeader->llStatusIdsOffset, pHeader->iStatusCount * sizeof(uint32_t), llSize) ||
+		!fitsIn(pHeader->llStringOffsetsOffset, (pHeader->iStringCount + 1ULL) * sizeof(uint32_t), llSize) ||
+		!fitsIn(pHeader->llStringDataOffset, pHeader->llStringDataSize, llSize) ||
+		pHeader->llTimeOffset % PAY_SETTLED_ALIGN != 0 ||
+		pHeader->llAmountOffset % PAY_SETTLED_ALIGN != 0 ||
+		pHeader->llOutTradeNoOffset % PAY_SETTLED_ALIGN != 0 ||
+		pHeader->llTradeNoOffset % PAY_SETTLED_ALIGN != 0 ||
+		pHeader->llStatusIdsOffset % PAY_SETTLED_ALIGN != 0 ||
+		pHeader->llStringOffsetsOffset % PAY_SETTLED_ALIGN != 0)
+	{
+		return;
+	}
+
+	const uint32_t* pStringOffsets = (const uint32_t*)(pBase + pHeader->llStringOffsetsOffset);
+	const uint32_t* pStatusIds = (const uint32_t*)(pBase + pHeader->llStatusIdsOffset);
+	const uint8_t* pStatus = (const uint8_t*)(pBase + pHeader->llStatusOffset);
+	const uint32_t* pOutTradeNo = (const uint32_t*)(pBase + pHeader->llOutTradeNoOffset);
+	const uint32_t* pTradeNo = (const uint32_t*)(pBase + pHeader->llTradeNoOffset);
+
+	//checked once here so the accessors can index without bounds checks
+	for (uint32_t i = 0; i < pHeader->iStringCount; ++i)
+	{
+		if (pStringOffsets[i] > pStringOffsets[i + 1])
+			return;
+	}
+	if (pStringOffsets[pHeader->iStringCount] != pHeader->llStringDataSize)
+		return;
+	for (uint32_t i = 0; i < pHeader->iStatusCount; ++i)
+	{
+		if (pStatusIds[i] >= pHeader->iStringCount)
+			return;
+	}
+	for (uint64_t i = 0; i < llRows; ++i)
+	{
+		if (pStatus[i] >= pHeader->iStatusCount ||
+			pOutTradeNo[i] >= pHeader->iStringCount ||
+			pTradeNo[i] >= pHeader->iStringCount)
+		{
+			return;
+		}
+	}
+
+	m_pTime = (const int64_t*)(pBase + pHeader->llTimeOffset);
+	m_pAmount = (const int64_t*)(pBase + pHeader->llAmountOffset);
+	m_pStatus = pStatus;
+	m_pProvider = (const uint8_t*)(pBase + pHeader->llProviderOffset);
+	m_pOutTradeNo = pOutTradeNo;
+	m_pTradeNo = pTradeNo;
+	m_pStatusIds = pStatusIds;
+	m_pStringOffsets = pStringOffsets;
+	m_pStringData = pBase + pHeader->llStringDataOffset;
+	m_pHeader = pHeader;
+}
+
+CPaySettledStore::~CPaySettledStore()
+{
+}
+
+size_t CPaySettledStore::size() const
+{
+	return m_pHeader ? (size_t)m_pHeader->llRows : 0;
+}
+
+string CPaySettledStore::getString(uint32_t iId) const
+{
+	return string(m_pStringData + m_pStringOffsets[iId], m_pStringOffsets[iId + 1] - m_pStringOffsets[iId]);
+}
+
+string CPaySettledStore::getStatus(size_t iRow) const
+{
+	return getString(m_pStatusIds[m_pStatus[iRow]]);
+}
+
+string CPaySettledStore::getOutTradeNo(size_t iRow) const
+{
+	return getString(m_pOutTradeNo[iRow]);
+}
+
+string CPaySettledStore::getTradeNo(size_t iRow) const
+{
+	return getString(m_pTradeNo[iRow]);
+}
+
+void CPaySettledStore::prepare(
+	const CPaySettledFilter& filter,
+	size_t& iBegin,
+	size_t& iEnd,
+	uint8_t* pStatusMatch,
+	uint8_t* pProviderMatch
+) const
+{
+	size_t iRows = size();
+	iBegin = lower_bound(m_pTime, m_pTime + iRows, filter.llBeginTime) - m_pTime;
+	iEnd = lower_bound(m_pTime + iBegin, m_pTime + iRows, filter.llEndTime) - m_pTime;
+
+	memset(pStatusMatch, filter.vecStatus.empty() ? 1 : 0, 256);
+	for (auto itr = filter.vecStatus.begin(); itr != filter.vecStatus.end(); ++itr)
+	{
+		for (uint32_t i = 0; m_pHeader && i < m_pHeader->iStatusCount; ++i)
+		{
+			if (getString(m_pStatusIds[i]) == *itr)
+				pStatusMatch[i] = 1;
+		}
+	}
+
+	memset(pProviderMatch, 0, 256);
+	for (int i = 0; i < PAY_PROVIDER_COUNT; ++i)
+		pProviderMatch[i] = filter.iProvider < 0 || filter.iProvider == i;
+}
+
+uint64_t CPaySettledStore::matchBlock(
+	const CPaySettledFilter& filter,
+	size_t iBase,
+	size_t iCount,
+	const uint8_t* pStatusMatch,
+	const uint8_t* pProviderMatch
+) const
+{
+	const int64_t* pAmount = m_pAmount + iBase;
+	const uint8_t* pStatus = m_pStatus + iBase;
+	const uint8_t* pProvider = m_pProvider + iBase;
+	int64_t llMin = filter.llMinAmount;
+	int64_t llMax = filter.llMaxAmount;
+	uint64_t llMask = 0;
+	for (size_t j = 0; j < iCount; ++j)
+	{
+		uint64_t llPass = (uint64_t)((pAmount[j] >= llMin) & (pAmount[j] <= llMax) & pStatusMatch[pStatus[j]] & pProviderMatch[pProvider[j]]);
+		llMask |= llPass << j;
+	}
+	return llMask;
+}
+
+void CPaySettledStore::scan(const CPaySettledFilter& filter, vector<uint32_t>& vecRows) const
+{
+	size_t iBegin = 0, iEnd = 0;
+	uint8_t statusMatch[256], providerMatch[256];
+	prepare(filter, iBegin, iEnd, statusMatch, providerMatch);
+	for (size_t i = iBegin; i < iEnd; i += 64)
+	{
+		uint64_t llMask = matchBlock(filter, i, min<size_t>(64, iEnd - i), statusMatch, providerMatch);
+		while (llMask != 0)
+		{
+			vecRows.push_back((uint32_t)(i + lowestBit64(llMask)));
+			llMask &= llMask - 1;
+		}
+	}
+}
+
+CPaySettledSummary CPaySettledStore::summarize(const CPaySettledFilter& filter) const
+{
+	CPaySettledSummary summary;
+	size_t iBegin = 0, iEnd = 0;
+	uint8_t statusMatch[256], providerMatch[256];
+	prepare(filter, iBegin, iEnd, statusMatch, providerMatch);
+	for (size_t i = iBegin; i < iEnd; i += 64)
+	{
+		size_t iCount = min<size_t>(64, iEnd - i);
+		uint64_t llMask = matchBlock(filter, i, iCount, statusMatch, providerMatch);
+		const int64_t* pAmount = m_pAmount + i;
+		for (size_t j = 0; j < iCount; ++j)
+		{
+			int64_t llPass = (int64_t)((llMask >> j) & 1);
+			summary.llCount += llPass;
+			summary.llAmount += pAmount[j] & -llPass;
+		}
+	}
+	return summary;
+}
@@ -0,0 +1,171 @@
+#pragma once
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <unordered_map>
+#include "PayMetrics.h"
+
+namespace SAPay {
+
+struct CPaySettledHeader;
+
+//one settled payment or refund
+struct CPaySettledTxn
+{
+	CPaySettledTxn() :
+		iProvider(PAY_PROVIDER_ALIPAY),
+		llTime(0),
+		llAmount(0) {}
+
+	CPayProvider iProvider;
+
+	//unix seconds of the settlement
+	long long llTime;
+
+	//fen, negative for refunds
+	long long llAmount;
+
+	//gateway status string, TRADE_SUCCESS, SUCCESS, REFUND...
+	std::string strStatus;
+	std::string strOutTradeNo;
+
+	//trade_no/transaction_id
+	std::string strTradeNo;
+};
+
+/**
+* @name CPaySettledWriter
+*
+* @brief								builds one store file (a day or a month of history) in memory and writes it on commit.
+*										rows are sorted by time, statuses are dictionary encoded on one byte,
+*										out_trade_no and trade_no are interned into a shared string table
+*/
+class CPaySettledWriter
+{
+public:
+	CPaySettledWriter();
+
+	CPaySettledWriter(const CPaySettledWriter&) = delete;
+	CPaySettledWriter& operator=(const CPaySettledWriter&) = delete;
+
+	//false once 255 distinct statuses were seen
+	bool add(const CPaySettledTxn& txn);
+
+	size_t size() const { return m_vecTime.size(); }
+
+	//writes strPath.tmp, flushes it to disk and renames it over strPath in one step, false on io error
+	bool commit(const std::string& strPath);
+
+private:
+	uint32_t intern(const std::string& str);
+
+	std::vector<int64_t> m_vecTime;
+	std::vector<int64_t> m_vecAmount;
+	std::vector<uint8_t> m_vecStatus;
+	std::vector<uint8_t> m_vecProvider;
+	std::vector<uint32_t> m_vecOutTradeNo;
+	std::vector<uint32_t> m_vecTradeNo;
+
+	//status dictionary, values are string ids
+	std::vector<uint32_t> m_vecStatusIds;
+	std::unordered_map<std::string, uint8_t> m_mapStatus;
+
+	std::vector<std::string> m_vecStrings;
+	std::unordered_map<std::string, uint32_t> m_mapStrings;
+};
+
+struct CPaySettledFilter
+{
+	CPaySettledFilter() :
+		llBeginTime(INT64_MIN),
+		llEndTime(INT64_MAX),
+		llMinAmount(INT64_MIN),
+		llMaxAmount(INT64_MAX),
+		iProvider(-1) {}
+
+	//[llBeginTime, llEndTime)
+	long long llBeginTime;
+	long long llEndTime;
+
+	//inclusive, fen
+	long long llMinAmount;
+	long long llMaxAmount;
+
+	//empty matches every status
+	std::vector<std::string> vecStatus;
+
+	//CPayProvider, -1 matches both
+	int iProvider;
+};
+
+struct CPaySettledSummary
+{
+	CPaySettledSummary() :
+		llCount(0),
+		llAmount(0) {}
+
+	long long llCount;
+	long long llAmount;
+};
+
+/**
+* @name CPaySettledStore
+*
+* @brief								read only view of a file written by CPaySettledWriter, mapped and never copied.
+*										the time range is found by binary search on the sorted time column, the other
+*										filters run branch free over 64 rows at a time into a match mask.
+*										columns are in the byte order of the writer.
+*										throws boost::interprocess::interprocess_exception if the file cannot be mapped
+*/
+class CPaySettledStore
+{
+public:
+	explicit CPaySettledStore(const std::string& strPath);
+	~CPaySettledStore();
+
+	CPaySettledStore(const CPaySettledStore&) = delete;
+	CPaySettledStore& operator=(const CPaySettledStore&) = delete;
+
+	//false if the file is not a store or is truncated, the store is then empty
+	bool isValid() const { return m_pHeader != nullptr; }
+
+	size_t size() const;
+
+	long long getTime(size_t iRow) const { return m_pTime[iRow]; }
+	long long getAmount(size_t iRow) const { return m_pAmount[iRow]; }
+	CPayProvider getProvider(size_t iRow) const { return (CPayProvider)m_pProvider[iRow]; }
+	std::string getStatus(size_t iRow) const;
+	std::string getOutTradeNo(size_t iRow) const;
+	std::string getTradeNo(size_t iRow) const;
+
+	//matching rows in time order
+	void scan(const CPaySettledFilter& filter, std::vector<uint32_t>& vecRows) const;
+
+	CPaySettledSummary summarize(const CPaySettledFilter& filter) const;
+
+private:
+	struct CMapping;
+
+	std::string getString(uint32_t iId) const;
+
+	//row range of the time filter and the per row lookup tables of the others
+	void prepare(const CPaySettledFilter& filter, size_t& iBegin, size_t& iEnd, uint8_t* pStatusMatch, uint8_t* pProviderMatch) const;
+
+	//bit j set if row iBase + j passes, iCount <= 64
+	uint64_t matchBlock(const CPaySettledFilter& filter, size_t iBase, size_t iCount, const uint8_t* pStatusMatch, const uint8_t* pProviderMatch) const;
+
+	std::unique_ptr<CMapping> m_pMapping;
+	const CPaySettledHeader* m_pHeader;
+	const int64_t* m_pTime;
+	const int64_t* m_pAmount;
+	const uint8_t* m_pStatus;
+	const uint8_t* m_pProvider;
+	const uint32_t* m_pOutTradeNo;
+	const uint32_t* m_pTradeNo;
+	const uint32_t* m_pStatusIds;
+	const uint32_t* m_pStringOffsets;
+	const char* m_pStringData;
+};
+
+}
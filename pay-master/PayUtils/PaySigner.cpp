@@ -0,0 +1,252 @@
+#include "PaySigner.h"
+#include "RSAUtils.h"
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#endif
+
+//empty polls before a pinned worker sleeps
+#define PAY_SIGNER_SPIN_COUNT 64
+
+using namespace SAPay;
+using namespace std;
+using namespace std::chrono;
+
+static void pinToCore(thread& worker, int iCore)
+{
+#ifdef _WIN32
+	SetThreadAffinityMask(worker.native_handle(), (DWORD_PTR)1 << iCore);
+#elif defined(__linux__)
+	cpu_set_t cpuSet;
+	CPU_ZERO(&cpuSet);
+	CPU_SET(iCore, &cpuSet);
+	pthread_setaffinity_np(worker.native_handle(), sizeof(cpuSet), &cpuSet);
+#endif
+}
+
+static uint64_t elapsedMicros(const steady_clock::time_point& start)
+{
+	return (uint64_t)duration_cast<microseconds>(steady_clock::now() - start).count();
+}
+
+CPaySigner::CPaySigner(const string& strPrivKey, const CPaySignerOptions& options) :
+	m_iMask(0),
+	m_iEnqueuePos(0),
+	m_iDequeuePos(0),
+	m_iIdle(0),
+	m_bStop(false),
+	m_iSpinCount(options.bPinWorkers ? PAY_SIGNER_SPIN_COUNT : 1),
+	m_pKey(CRSAUtils::load_privKey(strPrivKey)),
+	m_llSigned(0),
+	m_llInline(0),
+	m_llFailed(0)
+{
+	size_t iSize = 2;
+	while (iSize < options.iQueueSize)
+		iSize <<= 1;
+	m_iMask = iSize - 1;
+	m_pCells.reset(new CCell[iSize]);
+	for (size_t i = 0; i < iSize; ++i)
+	{
+		m_pCells[i].iSeq.store(i, memory_order_relaxed);
+		m_pCells[i].pTask = nullptr;
+	}
+
+	int iCores = max(1, (int)thread::hardware_concurrency());
+	int iWorkers = options.iWorkers > 0 ? options.iWorkers : iCores;
+	for (int i = 0; i < iWorkers; ++i)
+		m_vecWorkerKeys.push_back(CRSAUtils::parse_privKey(strPrivKey));
+	for (int i = 0; i < iWorkers; ++i)
+	{
+		m_vecWorkers.emplace_back(&CPaySigner::run, this, i);
+		if (options.bPinWorkers)
+			pinToCore(m_vecWorkers.back(), i % iCores);
+	}
+}
+
+CPaySigner::~CPaySigner()
+{
+	{
+		lock_guard<mutex> lock(m_mutexIdle);
+		m_bStop = true;
+	}
+	m_condIdle.notify_all();
+	for (auto itr = m_vecWorkers.begin(); itr != m_vecWorkers.end(); ++itr)
+		itr->join();
+}
+
+bool CPaySigner::push(CTask* pTask)
+{
+	size_t iPos = m_iEnqueuePos.load(memory_order_relaxed);
+	CCell* pCell = nullptr;
+	for (;;)
+	{
+		pCell = &m_pCells[iPos & m_iMask];
+		size_t iSeq = pCell->iSeq.load(memory_order_acquire);
+		intptr_t iDiff = (intptr_t)iSeq - (intptr_t)iPos;
+		if (iDiff == 0)
+		{
+			if (m_iEnqueuePos.compare_exchange_weak(iPos, iPos + 1, memory_order_relaxed))
+				break;
+		}
+		else if (iDiff < 0)
+			return false;
+		else
+			iPos = m_iEnqueuePos.load(memory_order_relaxed);
+	}
+	pCell->pTask = pTask;
+	pCell->iSeq.store(iPos + 1, memory_order_release);
+	return true;
+}
+
+CPaySigner::CTask* CPaySigner::pop()
+{
+	size_t iPos = m_iDequeuePos.load(memory_order_relaxed);
+	CCell* pCell = nullptr;
+	for (;;)
+	{
+		pCell = &m_pCells[iPos & m_iMask];
+		size_t iSeq = pCell->iSeq.load(memory_order_acquire);
+		intptr_t iDiff = (intptr_t)iSeq - (intptr_t)(iPos + 1);
+		if (iDiff == 0)
+		{
+			if (m_iDequeuePos.compare_exchange_weak(iPos, iPos + 1, memory_order_relaxed))
+				break;
+		}
+		else if (iDiff < 0)
+			return nullptr;
+		else
+			iPos = m_iDequeuePos.load(memory_order_relaxed);
+	}
+	CTask* pTask = pCell->pTask;
+	pCell->iSeq.store(iPos + m_iMask + 1, memory_order_release);
+	return pTask;
+}
+
+void CPaySigner::wake(bool bAll)
+{
+	//pairs with the increment of m_iIdle before a worker rechecks the ring
+	atomic_thread_fence(memory_order_seq_cst);
+	if (m_iIdle.load(memory_order_relaxed) == 0)
+		return;
+
+	lock_guard<mutex> lock(m_mutexIdle);
+	if (bAll)
+		m_condIdle.notify_all();
+	else
+		m_condIdle.notify_one();
+}
+
+future<string> CPaySigner::sign(const string& strContent)
+{
+	unique_ptr<CTask> pTask(new CTask());
+	pTask->strContent = strContent;
+	pTask->tpSubmit = steady_clock::now();
+	future<string> result = pTask->promise.get_future();
+	if (push(pTask.get()))
+	{
+		pTask.release();
+		wake(false);
+		return result;
+	}
+
+	//back pressure: the caller pays for its own signature instead of queueing unbounded
+	m_llInline.fetch_add(1, memory_order_relaxed);
+	execute(pTask.release(), m_pKey.get());
+	return result;
+}
+
+string CPaySigner::signInline(boost::string_view content)
+{
+	m_llInline.fetch_add(1, memory_order_relaxed);
+	return signWith(content, m_pKey.get());
+}
+
+vector<future<string>> CPaySigner::signBatch(const vector<string>& vecContent)
+{
+	vector<future<string>> vecResults;
+	vecResults.reserve(vecContent.size());
+	vector<CTask*> vecInline;
+	steady_clock::time_point tpSubmit = steady_clock::now();
+	for (auto itr = vecContent.begin(); itr != vecContent.end(); ++itr)
+	{
+		CTask* pTask = new CTask();
+		pTask->strContent = *itr;
+		pTask->tpSubmit = tpSubmit;
+		vecResults.push_back(pTask->promise.get_future());
+		if (!push(pTask))
+			vecInline.push_back(pTask);
+	}
+	wake(true);
+
+	m_llInline.fetch_add(vecInline.size(), memory_order_relaxed);
+	for (auto itr = vecInline.begin(); itr != vecInline.end(); ++itr)
+		execute(*itr, m_pKey.get());
+	return vecResults;
+}
+
+void CPaySigner::execute(CTask* pTask, rsa_st* pKey)
+{
+	unique_ptr<CTask> pOwned(pTask);
+	m_queueLatency.record(elapsedMicros(pTask->tpSubmit));
+	pTask->promise.set_value(signWith(pTask->strContent, pKey));
+}
+
+string CPaySigner::signWith(boost::string_view content, rsa_st* pKey)
+{
+	steady_clock::time_point tpStart = steady_clock::now();
+	string strSign = CRSAUtils::rsa_sign_with_base64(content, pKey);
+	m_signLatency.record(elapsedMicros(tpStart));
+	m_llSigned.fetch_add(1, memory_order_relaxed);
+	if (strSign.empty())
+		m_llFailed.fetch_add(1, memory_order_relaxed);
+	return strSign;
+}
+
+void CPaySigner::run(int iWorker)
+{
+	rsa_st* pKey = m_vecWorkerKeys[iWorker].get();
+	int iSpins = 0;
+	for (;;)
+	{
+		CTask* pTask = pop();
+		if (pTask)
+		{
+			execute(pTask, pKey);
+			iSpins = 0;
+			continue;
+		}
+		if (++iSpins < m_iSpinCount)
+		{
+			this_thread::yield();
+			continue;
+		}
+
+		iSpins = 0;
+		unique_lock<mutex> lock(m_mutexIdle);
+		m_iIdle.fetch_add(1, memory_order_seq_cst);
+		m_condIdle.wait(lock, [this]()
+		{
+			return m_bStop || m_iEnqueuePos.load(memory_order_seq_cst) != m_iDequeuePos.load(memory_order_seq_cst);
+		});
+		m_iIdle.fetch_sub(1, memory_order_relaxed);
+
+		//the destructor waits for the ring to drain
+		if (m_bStop && m_iEnqueuePos.load() == m_iDequeuePos.load())
+			return;
+	}
+}
+
+CPaySignerStats CPaySigner::getStats() const
+{
+	CPaySignerStats stats;
+	size_t iEnqueuePos = m_iEnqueuePos.load(memory_order_relaxed);
+	size_t iDequeuePos = m_iDequeuePos.load(memory_order_relaxed);
+	stats.iQueueDepth = iEnqueuePos > iDequeuePos ? iEnqueuePos - iDequeuePos : 0;
+	stats.llSigned = m_llSigned.load(memory_order_relaxed);
+	stats.llInline = m_llInline.load(memory_order_relaxed);
+	stats.llFailed = m_llFailed.load(memory_order_relaxed);
+	return stats;
+}
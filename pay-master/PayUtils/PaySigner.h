@@ -0,0 +1,140 @@
+#pragma once
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include <boost/utility/string_view.hpp>
+#include "PayMetrics.h"
+
+struct rsa_st;
+
+namespace SAPay {
+
+struct CPaySignerOptions
+{
+	CPaySignerOptions() :
+		iWorkers(0),
+		iQueueSize(4096),
+		bPinWorkers(false) {}
+
+	//0 is one per core
+	int iWorkers;
+
+	//rounded up to a power of two, a full queue signs on the caller
+	size_t iQueueSize;
+
+	//worker i runs on core i % cores and polls a while before sleeping, only for cores set aside for signing
+	bool bPinWorkers;
+};
+
+struct CPaySignerStats
+{
+	CPaySignerStats() :
+		iQueueDepth(0),
+		llSigned(0),
+		llInline(0),
+		llFailed(0) {}
+
+	size_t iQueueDepth;
+	uint64_t llSigned;
+
+	//signed on the submitting thread, by signInline or because the queue was full
+	uint64_t llInline;
+
+	//empty signature, bad key
+	uint64_t llFailed;
+};
+
+/**
+* @name CPaySigner
+*
+* @brief								RSA2 (sha256) signing service for request building.
+*										submitters push into a bounded lock-free ring and never take a lock unless a worker sleeps,
+*										each worker holds its own parse of the private key so signatures do not contend on one RSA.
+*										futures carry the base64 signature, empty if signing failed, like CRSAUtils::rsa_sign_with_base64
+*/
+class CPaySigner
+{
+public:
+	explicit CPaySigner(const std::string& strPrivKey, const CPaySignerOptions& options = CPaySignerOptions());
+
+	//signs what is queued then joins
+	~CPaySigner();
+
+	CPaySigner(const CPaySigner&) = delete;
+	CPaySigner& operator=(const CPaySigner&) = delete;
+
+	std::future<std::string> sign(const std::string& strContent);
+
+	//on the calling thread, for a caller that would only wait on the future
+	std::string signInline(boost::string_view content);
+
+	//one future per content, in order, workers are woken once for the batch
+	std::vector<std::future<std::string>> signBatch(const std::vector<std::string>& vecContent);
+
+	CPaySignerStats getStats() const;
+
+	//microseconds from submit until a worker takes the content
+	const CPayHistogram& getQueueLatency() const { return m_queueLatency; }
+
+	//microseconds of the rsa operation
+	const CPayHistogram& getSignLatency() const { return m_signLatency; }
+
+private:
+	struct CTask
+	{
+		std::string strContent;
+		std::promise<std::string> promise;
+		std::chrono::steady_clock::time_point tpSubmit;
+	};
+
+	//bounded mpmc ring, a cell is free for position pos when its sequence equals pos
+	struct CCell
+	{
+		std::atomic<size_t> iSeq;
+		CTask* pTask;
+	};
+
+	//false if full
+	bool push(CTask* pTask);
+
+	//nullptr if empty
+	CTask* pop();
+
+	void wake(bool bAll);
+	void run(int iWorker);
+	void execute(CTask* pTask, rsa_st* pKey);
+	std::string signWith(boost::string_view content, rsa_st* pKey);
+
+	std::unique_ptr<CCell[]> m_pCells;
+	size_t m_iMask;
+	alignas(64) std::atomic<size_t> m_iEnqueuePos;
+	alignas(64) std::atomic<size_t> m_iDequeuePos;
+
+	//workers waiting for work
+	alignas(64) std::atomic<int> m_iIdle;
+	std::mutex m_mutexIdle;
+	std::condition_variable m_condIdle;
+	bool m_bStop;
+
+	//empty polls before a worker sleeps
+	int m_iSpinCount;
+
+	//shared parse for signing on a submitter when the queue is full
+	std::shared_ptr<rsa_st> m_pKey;
+	std::vector<std::shared_ptr<rsa_st>> m_vecWorkerKeys;
+	std::vector<std::thread> m_vecWorkers;
+
+	std::atomic<uint64_t> m_llSigned;
+	std::atomic<uint64_t> m_llInline;
+	std::atomic<uint64_t> m_llFailed;
+	CPayHistogram m_queueLatency;
+	CPayHistogram m_signLatency;
+};
+
+}
@@ -0,0 +1,134 @@
+#pragma once
+#include <mutex>
+#include <memory>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <condition_variable>
+#include <boost/optional.hpp>
+
+namespace SAPay {
+
+/**
+* @name CPaySingleFlight
+*
+* @brief								coalesces identical in-flight calls: the first caller of a key runs the call,
+*										every caller arriving before it returns waits and gets a copy of its result
+*										or error. nothing is kept once the call returns
+*/
+template<typename TResps, typename TError>
+class CPaySingleFlight
+{
+public:
+	using CallFunc = std::function<bool(TResps&, boost::optional<TError>&)>;
+
+	CPaySingleFlight() {}
+
+	CPaySingleFlight(const CPaySingleFlight&) = delete;
+	CPaySingleFlight& operator=(const CPaySingleFlight&) = delete;
+
+	//one per resps type for the whole process, keys carry the account and the api method
+	static CPaySingleFlight& shared()
+	{
+		static CPaySingleFlight s_singleFlight;
+		return s_singleFlight;
+	}
+
+	//app id/mch id, api method (provider specific) and the business key (out_trade_no...)
+	static std::string makeKey(const std::string& strAccount, const std::string& strMethod, const std::string& strBizKey)
+	{
+		return strAccount + "|" + strMethod + "|" + strBizKey;
+	}
+
+	bool call(const std::string& strKey, TResps& resps, boost::optional<TError>& error, const CallFunc& func)
+	{
+		CShard& shard = getShard(strKey);
+		std::shared_ptr<CFlight> pFlight;
+		{
+			std::unique_lock<std::mutex> lock(shard.mutexShard);
+			for (;;)
+			{
+				auto itr = shard.mapFlights.find(strKey);
+				if (itr == shard.mapFlights.end())
+					break;
+
+				std::shared_ptr<CFlight> pOther = itr->second;
+				pOther->condDone.wait(lock, [&pOther]() { return pOther->bDone; });
+				if (pOther->bAbandoned)
+					continue;
+				error = pOther->error;
+				if (pOther->bRet)
+					resps = pOther->resps;
+				return pOther->bRet;
+			}
+			pFlight = std::make_shared<CFlight>();
+			shard.mapFlights[strKey] = pFlight;
+		}
+
+		bool bRet = false;
+		try
+		{
+			bRet = func(resps, error);
+		}
+		catch (...)
+		{
+			finish(shard, strKey, pFlight, false, resps, error, true);
+			throw;
+		}
+		finish(shard, strKey, pFlight, bRet, resps, error, false);
+		return bRet;
+	}
+
+private:
+	enum { SHARD_COUNT = 16 };
+
+	struct CFlight
+	{
+		CFlight() : bDone(false), bAbandoned(false), bRet(false) {}
+
+		bool bDone;
+
+		//the call threw, waiters try again
+		bool bAbandoned;
+		bool bRet;
+		TResps resps;
+		boost::optional<TError> error;
+		std::condition_variable condDone;
+	};
+
+	struct CShard
+	{
+		std::mutex mutexShard;
+		std::unordered_map<std::string, std::shared_ptr<CFlight>> mapFlights;
+	};
+
+	CShard& getShard(const std::string& strKey)
+	{
+		return m_shards[std::hash<std::string>()(strKey) % SHARD_COUNT];
+	}
+
+	void finish(
+		CShard& shard,
+		const std::string& strKey,
+		const std::shared_ptr<CFlight>& pFlight,
+		bool bRet,
+		const TResps& resps,
+		const boost::optional<TError>& error,
+		bool bAbandoned
+	)
+	{
+		std::lock_guard<std::mutex> lock(shard.mutexShard);
+		shard.mapFlights.erase(strKey);
+		pFlight->bDone = true;
+		pFlight->bAbandoned = bAbandoned;
+		pFlight->bRet = bRet;
+		if (bRet)
+			pFlight->resps = resps;
+		pFlight->error = error;
+		pFlight->condDone.notify_all();
+	}
+
+	CShard m_shards[SHARD_COUNT];
+};
+
+}
@@ -0,0 +1,369 @@
+#include "PayXml.h"
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+using namespace SAPay;
+using namespace std;
+
+#define PAY_XML_CDATA_BEGIN "<![CDATA["
+#define PAY_XML_CDATA_END "]]>"
+
+static bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool startsWith(const char* p, const char* pEnd, const char* sz)
+{
+	size_t iLen = strlen(sz);
+	return (size_t)(pEnd - p) >= iLen && memcmp(p, sz, iLen) == 0;
+}
+
+//just past the next sz, pEnd if there is none
+static const char* skipPast(const char* p, const char* pEnd, const char* sz)
+{
+	size_t iLen = strlen(sz);
+	const char* pFound = search(p, pEnd, sz, sz + iLen);
+	return pFound == pEnd ? pEnd : pFound + iLen;
+}
+
+//whitespace, the declaration, comments and doctype between tags
+static const char* skipMisc(const char* p, const char* pEnd)
+{
+	for (;;)
+	{
+		while (p < pEnd && isSpace(*p))
+			++p;
+		if (startsWith(p, pEnd, "<?"))
+			p = skipPast(p, pEnd, "?>");
+		else if (startsWith(p, pEnd, "<!--"))
+			p = skipPast(p, pEnd, "-->");
+		else if (startsWith(p, pEnd, "<!") && !startsWith(p, pEnd, PAY_XML_CDATA_BEGIN))
+			p = skipPast(p, pEnd, ">");
+		else
+			return p;
+	}
+}
+
+//p is just past '<' and ends just past '>', attributes are skipped
+static bool readTag(const char*& p, const char* pEnd, boost::string_view& name, bool& bEmpty)
+{
+	const char* pName = p;
+	while (p < pEnd && !isSpace(*p) && *p != '>' && *p != '/')
+		++p;
+	name = boost::string_view(pName, p - pName);
+
+	char cQuote = 0;
+	for (; p < pEnd; ++p)
+	{
+		if (cQuote)
+		{
+			if (*p == cQuote)
+				cQuote = 0;
+		}
+		else if (*p == '"' || *p == '\'')
+		{
+			cQuote = *p;
+		}
+		else if (*p == '>')
+		{
+			bEmpty = p[-1] == '/';
+			++p;
+			return !name.empty();
+		}
+	}
+	return false;
+}
+
+static size_t encodeUtf8(unsigned long iCode, char* pOut)
+{
+	if (iCode < 0x80)
+	{
+		pOut[0] = (char)iCode;
+		return 1;
+	}
+	if (iCode < 0x800)
+	{
+		pOut[0] = (char)(0xc0 | (iCode >> 6));
+		pOut[1] = (char)(0x80 | (iCode & 0x3f));
+		return 2;
+	}
+	if (iCode < 0x10000)
+	{
+		pOut[0] = (char)(0xe0 | (iCode >> 12));
+		pOut[1] = (char)(0x80 | ((iCode >> 6) & 0x3f));
+		pOut[2] = (char)(0x80 | (iCode & 0x3f));
+		return 3;
+	}
+	pOut[0] = (char)(0xf0 | (iCode >> 18));
+	pOut[1] = (char)(0x80 | ((iCode >> 12) & 0x3f));
+	pOut[2] = (char)(0x80 | ((iCode >> 6) & 0x3f));
+	pOut[3] = (char)(0x80 | (iCode & 0x3f));
+	return 4;
+}
+
+//p is at '&', pOut has room for 4 bytes. a reference never decodes longer than it is written.
+//0 if it is not one we know, the '&' is then kept as is
+static size_t decodeEntity(const char* p, const char* pEnd, char* pOut, size_t& iWritten)
+{
+	static const struct { const char* szName; char c; } s_entities[] = {
+		{ "&lt;", '<' }, { "&gt;", '>' }, { "&amp;", '&' }, { "&quot;", '"' }, { "&apos;", '\'' }
+	};
+	for (auto& entity : s_entities)
+	{
+		if (startsWith(p, pEnd, entity.szName))
+		{
+			*pOut = entity.c;
+			iWritten = 1;
+			return strlen(entity.szName);
+		}
+	}
+
+	if (!startsWith(p, pEnd, "&#"))
+		return 0;
+	const char* pDigit = p + 2;
+	bool bHex = pDigit < pEnd && (*pDigit == 'x' || *pDigit == 'X');
+	if (bHex)
+		++pDigit;
+	unsigned long iCode = 0;
+	const char* pCur = pDigit;
+	for (; pCur < pEnd && *pCur != ';' && pCur - pDigit < 8; ++pCur)
+	{
+		int iDigit;
+		if (*pCur >= '0' && *pCur <= '9')
+			iDigit = *pCur - '0';
+		else if (bHex && *pCur >= 'a' && *pCur <= 'f')
+			iDigit = *pCur - 'a' + 10;
+		else if (bHex && *pCur >= 'A' && *pCur <= 'F')
+			iDigit = *pCur - 'A' + 10;
+		else
+			return 0;
+		iCode = iCode * (bHex ? 16 : 10) + iDigit;
+	}
+	if (pCur == pDigit || pCur == pEnd || *pCur != ';' || iCode == 0 || iCode > 0x10ffff)
+		return 0;
+	iWritten = encodeUtf8(iCode, pOut);
+	return pCur + 1 - p;
+}
+
+//one contiguous piece of the source stays a view of it, a value made of more pieces or holding entities is
+//assembled in strDecoded. decoded values never outgrow the source, so once strDecoded is reserved to the source
+//size the views already handed out into it stay valid
+class CXmlValue
+{
+public:
+	CXmlValue(CPayArenaString& strDecoded, size_t iSourceLen) :
+		m_strDecoded(strDecoded),
+		m_iSourceLen(iSourceLen),
+		m_pView(nullptr),
+		m_iViewLen(0),
+		m_bOwned(false),
+		m_iStart(0) {}
+
+	void append(const char* p, size_t iLen)
+	{
+		if (iLen == 0)
+			return;
+		if (!m_bOwned && m_pView == nullptr)
+		{
+			m_pView = p;
+			m_iViewLen = iLen;
+			return;
+		}
+		own();
+		m_strDecoded.append(p, iLen);
+	}
+
+	//a text run, entities decoded
+	void appendText(const char* p, const char* pEnd)
+	{
+		const char* pPlain = p;
+		while (p < pEnd)
+		{
+			char szDecoded[4];
+			size_t iWritten = 0;
+			size_t iRead = *p == '&' ? decodeEntity(p, pEnd, szDecoded, iWritten) : 0;
+			if (iRead == 0)
+			{
+				++p;
+				continue;
+			}
+			append(pPlain, p - pPlain);
+			own();
+			m_strDecoded.append(szDecoded, iWritten);
+			p += iRead;
+			pPlain = p;
+		}
+		append(pPlain, p - pPlain);
+	}
+
+	boost::string_view view() const
+	{
+		if (m_bOwned)
+			return boost::string_view(m_strDecoded.data() + m_iStart, m_strDecoded.size() - m_iStart);
+		return boost::string_view(m_pView, m_iViewLen);
+	}
+
+private:
+	void own()
+	{
+		if (m_bOwned)
+			return;
+		//only the first value of a parse gets here with a short buffer, nothing points into it yet
+		if (m_strDecoded.capacity() < m_iSourceLen)
+			m_strDecoded.reserve(m_iSourceLen);
+		m_bOwned = true;
+		m_iStart = m_strDecoded.size();
+		if (m_pView)
+			m_strDecoded.append(m_pView, m_iViewLen);
+	}
+
+	CPayArenaString& m_strDecoded;
+	size_t m_iSourceLen;
+	const char* m_pView;
+	size_t m_iViewLen;
+	bool m_bOwned;
+	size_t m_iStart;
+};
+
+//p is just past <name> and ends past </name>. bText is false for an element holding child elements
+static bool readValue(const char*& p, const char* pEnd, boost::string_view name, CXmlValue& value, bool& bText)
+{
+	bText = false;
+	for (;;)
+	{
+		if (p >= pEnd)
+			return false;
+		if (startsWith(p, pEnd, PAY_XML_CDATA_BEGIN))
+		{
+			const char* pBegin = p + strlen(PAY_XML_CDATA_BEGIN);
+			p = skipPast(pBegin, pEnd, PAY_XML_CDATA_END);
+			if (p == pEnd)
+				return false;
+			value.append(pBegin, p - strlen(PAY_XML_CDATA_END) - pBegin);
+			bText = true;
+		}
+		else if (startsWith(p, pEnd, "<!--"))
+		{
+			p = skipPast(p, pEnd, "-->");
+		}
+		else if (*p == '<')
+		{
+			break;
+		}
+		else
+		{
+			//outer whitespace of a text run is dropped, as tinyxml did
+			while (p < pEnd && isSpace(*p))
+				++p;
+			const char* pRun = p;
+			while (p < pEnd && *p != '<')
+				++p;
+			const char* pRunEnd = p;
+			while (pRunEnd > pRun && isSpace(pRunEnd[-1]))
+				--pRunEnd;
+			value.appendText(pRun, pRunEnd);
+			bText = bText || pRunEnd > pRun;
+		}
+	}
+
+	if (p + 1 >= pEnd)
+		return false;
+	if (p[1] != '/')
+	{
+		//not flat, skip to our own closing tag
+		bText = false;
+		for (;;)
+		{
+			p = skipPast(p, pEnd, "</");
+			if (p == pEnd)
+				return false;
+			if ((size_t)(pEnd - p) > name.size() && memcmp(p, name.data(), name.size()) == 0 && p[name.size()] == '>')
+			{
+				p += name.size() + 1;
+				return true;
+			}
+		}
+	}
+
+	p += 2;
+	boost::string_view closeName;
+	bool bEmpty = false;
+	return readTag(p, pEnd, closeName, bEmpty) && closeName == name;
+}
+
+CPayXmlFields::CPayXmlFields(CPayMemoryResource* pResource) :
+	m_vecFields(CPayArenaAllocator<CField>(pResource)),
+	m_strDecoded(CPayArenaAllocator<char>(pResource))
+{
+}
+
+bool CPayXmlFields::parse(const char* pData, size_t iLen)
+{
+	m_vecFields.clear();
+	m_strDecoded.clear();
+	const char* p = pData;
+	const char* pEnd = pData + iLen;
+	boost::string_view root;
+	bool bEmpty = false;
+	bool bClosed = false;
+
+	p = skipMisc(p, pEnd);
+	if (p < pEnd && *p == '<' && readTag(++p, pEnd, root, bEmpty))
+	{
+		bClosed = bEmpty;
+		while (!bClosed)
+		{
+			p = skipMisc(p, pEnd);
+			p = std::find(p, pEnd, '<');
+			if (pEnd - p < 2)
+				break;
+			if (startsWith(p, pEnd, PAY_XML_CDATA_BEGIN))
+			{
+				p = skipPast(p, pEnd, PAY_XML_CDATA_END);
+				continue;
+			}
+
+			boost::string_view name;
+			if (p[1] == '/')
+			{
+				p += 2;
+				bClosed = readTag(p, pEnd, name, bEmpty) && name == root;
+				break;
+			}
+			bool bText = false;
+			CXmlValue value(m_strDecoded, iLen);
+			if (!readTag(++p, pEnd, name, bEmpty) ||
+				(!bEmpty && !readValue(p, pEnd, name, value, bText)))
+			{
+				break;
+			}
+			if (bText)
+				m_vecFields.push_back(CField(name, value.view()));
+		}
+	}
+
+	//dictionary order, then the last of a repeated name wins
+	stable_sort(m_vecFields.begin(), m_vecFields.end(),
+		[](const CField& a, const CField& b) { return a.first < b.first; });
+	auto itrOut = m_vecFields.begin();
+	for (auto itr = m_vecFields.begin(); itr != m_vecFields.end(); ++itr)
+	{
+		if (itr + 1 != m_vecFields.end() && (itr + 1)->first == itr->first)
+			continue;
+		*itrOut++ = *itr;
+	}
+	m_vecFields.erase(itrOut, m_vecFields.end());
+	return bClosed;
+}
+
+bool CPayXmlFields::find(boost::string_view name, boost::string_view& value) const
+{
+	auto itr = lower_bound(m_vecFields.begin(), m_vecFields.end(), name,
+		[](const CField& field, boost::string_view key) { return field.first < key; });
+	if (itr == m_vecFields.end() || itr->first != name)
+		return false;
+	value = itr->second;
+	return true;
+}
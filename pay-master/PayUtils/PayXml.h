@@ -0,0 +1,51 @@
+#pragma once
+#include <string>
+#include <vector>
+#include <utility>
+#include <cstddef>
+#include <boost/utility/string_view.hpp>
+#include "PayArena.h"
+
+namespace SAPay {
+
+/**
+* @name CPayXmlFields
+*
+* @brief								the flat <xml><name>value</name>...</xml> wechat sends, read without copying or touching
+*										the buffer: each field is a pair of views into it. only a value split over several cdata
+*										sections or holding entities is decoded into the fields' own storage.
+*										fields are in dictionary order like the map they replace, a repeated name keeps its
+*										last value, an element without text or with child elements is left out.
+*										the views are valid while both the buffer and the fields are alive. the field list and
+*										decoded values come from the given resource, usually that of the call's CPayArenaScope
+*/
+class CPayXmlFields
+{
+public:
+	using CField = std::pair<boost::string_view, boost::string_view>;
+	using CFieldVector = std::vector<CField, CPayArenaAllocator<CField>>;
+	using const_iterator = CFieldVector::const_iterator;
+
+	explicit CPayXmlFields(CPayMemoryResource* pResource);
+
+	//values may point into the fields themselves
+	CPayXmlFields(const CPayXmlFields&) = delete;
+	CPayXmlFields& operator=(const CPayXmlFields&) = delete;
+
+	//false if there is no root element or it is not closed, the fields read before a malformed part are kept
+	bool parse(const char* pData, size_t iLen);
+
+	bool find(boost::string_view name, boost::string_view& value) const;
+
+	const_iterator begin() const { return m_vecFields.begin(); }
+	const_iterator end() const { return m_vecFields.end(); }
+	bool empty() const { return m_vecFields.empty(); }
+
+private:
+	CFieldVector m_vecFields;
+
+	//decoded values, reserved to the source size on first use so it never moves during a parse
+	CPayArenaString m_strDecoded;
+};
+
+}
@@ -1,5 +1,10 @@
 #include "RSAUtils.h"
 #include "Utils/Utils.h"
+#include "PayBase64.h"
+#include "PayHex.h"
+#include <vector>
+#include <map>
+#include <mutex>
 
 #define RSA_ENC_DATA_SIZE 128
 #define RSA_PLAIN_TEXT_SIZE (RSA_ENC_DATA_SIZE - 11)
@@ -7,10 +12,6 @@
 //Կ󳤶512ֽ 
 #define  MAX_RSA_KEY_LENGTH 512 
 
-#ifndef XRSA_KEY_BITS
-#define XRSA_KEY_BITS (2048)
-#endif
-
 using namespace SAPay;
 using namespace std;
 
@@ -131,13 +132,7 @@ string CRSAUtils::rsa_encrypt(RSA* rsaPubKey, RSA* rsaPrivKey, const string& pla
 		totalSize += len;
 	}
 
-	char *hexData = new char[totalSize * 2 + 1];
-	CharHexConverter::char2Hex((char*)encryptedData, totalSize, hexData);
-
-
-	strEncryptedText.append(hexData, totalSize * 2);
-
-	delete hexData;
+	strEncryptedText = CPayHex::encode(encryptedData, totalSize);
 	delete encryptedData;
 
 	return strEncryptedText;
@@ -150,6 +145,9 @@ string CRSAUtils::rsa_decrypt(RSA* rsaPubKey, RSA* rsaPrivKey, const string& enc
 	}
 
 	const int SINGLE_HEX_BLOCK_SIZE = RSA_ENC_DATA_SIZE * 2;
+	if (encryptedHexText.length() % SINGLE_HEX_BLOCK_SIZE != 0) {
+		return "";
+	}
 
 	char* pcEncText = (char*)encryptedHexText.c_str();
 	unsigned char * pcText = new  unsigned char[encryptedHexText.length()/2];
@@ -157,8 +155,11 @@ string CRSAUtils::rsa_decrypt(RSA* rsaPubKey, RSA* rsaPrivKey, const string& enc
 	int plainIndex = 0;
 	for (int i = 0; i < encryptedHexText.length(); i += SINGLE_HEX_BLOCK_SIZE) {
 
-		char encData[RSA_ENC_DATA_SIZE + 1] = { 0 };
-		CharHexConverter::hex2Char(&pcEncText[i], SINGLE_HEX_BLOCK_SIZE, (char*)encData);
+		unsigned char encData[RSA_ENC_DATA_SIZE] = { 0 };
+		if (!CPayHex::decode(&pcEncText[i], SINGLE_HEX_BLOCK_SIZE, encData)) {
+			delete pcText;
+			return "";
+		}
 
 		unsigned char decrypted[RSA_PLAIN_TEXT_SIZE + 1] = { 0 };
 		int len = 0;
@@ -184,92 +185,108 @@ string CRSAUtils::rsa_decrypt(RSA* rsaPubKey, RSA* rsaPrivKey, const string& enc
 	return plainText;
 }
 
-string CRSAUtils::base64Encode(const unsigned char *bytes, int len) {
-
-	BIO *bmem = NULL;
-	BIO *b64 = NULL;
-	BUF_MEM *bptr = NULL;
+shared_ptr<RSA> CRSAUtils::load_key(const string& key, bool isPublic)
+{
+	//Կͻ˳ʱЧ,ȫͷź´½
+	//pemsha256Ϊ,˽ԿĲפڴ
+	static mutex s_mutex;
+	static map<pair<bool, string>, weak_ptr<RSA>> s_mapKeys;
+
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256((const unsigned char*)key.data(), key.size(), digest);
+	pair<bool, string> cacheKey(isPublic, string((const char*)digest, sizeof(digest)));
+
+	lock_guard<mutex> lock(s_mutex);
+	weak_ptr<RSA>& pCached = s_mapKeys[cacheKey];
+	shared_ptr<RSA> pKey = pCached.lock();
+	if (!pKey)
+	{
+		RSA* rsa = rsa_key_from_buffer(key, isPublic);
+		if (rsa == NULL)
+		{
+			s_mapKeys.erase(cacheKey);
+			return nullptr;
+		}
+		pKey.reset(rsa, RSA_free);
+		pCached = pKey;
+
+		//ֻԿռλ
+		for (auto itr = s_mapKeys.begin(); itr != s_mapKeys.end();)
+		{
+			if (itr->second.expired())
+				itr = s_mapKeys.erase(itr);
+			else
+				++itr;
+		}
+	}
+	return pKey;
+}
 
-	b64 = BIO_new(BIO_f_base64());
-	BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-	bmem = BIO_new(BIO_s_mem());
-	b64 = BIO_push(b64, bmem);
-	BIO_write(b64, bytes, len);
-	BIO_flush(b64);
-	BIO_get_mem_ptr(b64, &bptr);
+shared_ptr<RSA> CRSAUtils::load_pubKey(const string& key)
+{
+	return load_key(key, true);
+}
 
-	string str = string(bptr->data, bptr->length);
-	BIO_free_all(b64);
-	return str;
+shared_ptr<RSA> CRSAUtils::load_privKey(const string& key)
+{
+	return load_key(key, false);
 }
 
-bool CRSAUtils::base64Decode(const string &str, unsigned char *bytes, int &len) 
+shared_ptr<RSA> CRSAUtils::parse_privKey(const string& key)
 {
-	const char *cstr = str.c_str();
-	BIO *bmem = NULL;
-	BIO *b64 = NULL;
-
-	b64 = BIO_new(BIO_f_base64());
-	BIO_set_flags(b64, BIO_FLAGS_BASE64_NO_NL);
-	bmem = BIO_new_mem_buf((void *)cstr, strlen(cstr));
-	b64 = BIO_push(b64, bmem);
-	len = BIO_read(b64, bytes, len);
-
-	BIO_free_all(b64);
-	return len > 0;
+	RSA* rsa = rsa_key_from_buffer(key, false);
+	if (rsa == NULL)
+		return nullptr;
+	return shared_ptr<RSA>(rsa, RSA_free);
 }
 
 bool CRSAUtils::rsa_verify_from_pubKey_with_base64(const string &content, const string &sign, const string &key)
 {
-	bool result = false;
-	const char *key_cstr = key.c_str();
-	int key_len = strlen(key_cstr);
-	BIO *p_key_bio = BIO_new_mem_buf((void *)key_cstr, key_len);
-	RSA *p_rsa = PEM_read_bio_RSA_PUBKEY(p_key_bio, NULL, NULL, NULL);
+	RSA* p_rsa = rsa_key_from_buffer(key, true);
+	bool result = rsa_verify_with_base64(content, sign, p_rsa);
+	RSA_free(p_rsa);
+	return result;
+}
 
-	if (p_rsa != NULL) {
-		const char *cstr = content.c_str();
+bool CRSAUtils::rsa_verify_with_base64(const string &content, const string &sign, RSA* p_rsa)
+{
+	bool result = false;
+	string sign_bytes;
+	//ǩȱԿ
+	if (p_rsa != NULL && CPayBase64::decode(sign, sign_bytes) && sign_bytes.size() == (size_t)RSA_size(p_rsa)) {
 		unsigned char hash[SHA256_DIGEST_LENGTH] = { 0 };
-		SHA256((unsigned char *)cstr, strlen(cstr), hash);
-		unsigned char sign_cstr[XRSA_KEY_BITS / 8] = { 0 };
-		int len = XRSA_KEY_BITS / 8;
-		base64Decode(sign, sign_cstr, len);
-		unsigned int sign_len = XRSA_KEY_BITS / 8;
-		int r = RSA_verify(NID_sha256, hash, SHA256_DIGEST_LENGTH, (unsigned char *)sign_cstr, sign_len, p_rsa);
+		SHA256((const unsigned char *)content.data(), content.size(), hash);
+		int r = RSA_verify(NID_sha256, hash, SHA256_DIGEST_LENGTH, (unsigned char *)sign_bytes.data(), (unsigned int)sign_bytes.size(), p_rsa);
 
 		if (r > 0) {
 			result = true;
 		}
 	}
-
-	RSA_free(p_rsa);
-	BIO_free(p_key_bio);
 	return result;
 }
 
 string CRSAUtils::rsa_sign_from_privKey_with_base64(const string& content, const string& key)
 {
-	string signed_str;
-	const char *key_cstr = key.c_str();
-	int key_len = strlen(key_cstr);
-	BIO *p_key_bio = BIO_new_mem_buf((void *)key_cstr, key_len);
-	RSA *p_rsa = PEM_read_bio_RSAPrivateKey(p_key_bio, NULL, NULL, NULL);
+	RSA* p_rsa = rsa_key_from_buffer(key, false);
+	string signed_str = rsa_sign_with_base64(content, p_rsa);
+	RSA_free(p_rsa);
+	return signed_str;
+}
 
+string CRSAUtils::rsa_sign_with_base64(boost::string_view content, RSA* p_rsa)
+{
+	string signed_str;
 	if (p_rsa != NULL) {
 
-		const char *cstr = content.c_str();
 		unsigned char hash[SHA256_DIGEST_LENGTH] = { 0 };
-		SHA256((unsigned char *)cstr, strlen(cstr), hash);
-		unsigned char sign[XRSA_KEY_BITS / 8] = { 0 };
-		unsigned int sign_len = sizeof(sign);
-		int r = RSA_sign(NID_sha256, hash, SHA256_DIGEST_LENGTH, sign, &sign_len, p_rsa);
+		SHA256((const unsigned char *)content.data(), content.size(), hash);
+		vector<unsigned char> sign(RSA_size(p_rsa));
+		unsigned int sign_len = (unsigned int)sign.size();
+		int r = RSA_sign(NID_sha256, hash, SHA256_DIGEST_LENGTH, &sign[0], &sign_len, p_rsa);
 
-		if (0 != r && sizeof(sign) == sign_len) {
-			signed_str = base64Encode(sign, sign_len);
+		if (0 != r && sign.size() == sign_len) {
+			signed_str = CPayBase64::encode(&sign[0], sign_len);
 		}
 	}
-
-	RSA_free(p_rsa);
-	BIO_free(p_key_bio);
 	return signed_str;
 }
\ No newline at end of file
@@ -1,5 +1,7 @@
 #pragma once
 #include <string>
+#include <memory>
+#include <boost/utility/string_view.hpp>
 #include <openssl/pem.h>
 #include <openssl/rsa.h>
 
@@ -14,6 +16,17 @@ public:
 	//ǩ
 	static std::string rsa_sign_from_privKey_with_base64(const std::string& content, const std::string& key);
 
+	//Կ/˽Կ,ͬpemֻһ,̼߳乲,ʧܷnullptr
+	static std::shared_ptr<RSA> load_pubKey(const std::string& key);
+	static std::shared_ptr<RSA> load_privKey(const std::string& key);
+
+	//ÿ½˽Կ,ù,ǩ̸߳Գһ,ʧܷnullptr
+	static std::shared_ptr<RSA> parse_privKey(const std::string& key);
+
+	//ʹѽԿǩ/ǩ
+	static bool rsa_verify_with_base64(const std::string &content, const std::string &sign, RSA* pKey);
+	static std::string rsa_sign_with_base64(boost::string_view content, RSA* pKey);
+
 	//Կܡ
 	static std::string rsa_encrypt_from_pubKey(const std::string& plainText, const std::string& pubKeyBuffer);
 
@@ -31,17 +44,13 @@ private:
 	//ȡԿ/˽Կ
 	static RSA* rsa_key_from_buffer(const std::string& keyBuff, bool isPublic);
 
+	static std::shared_ptr<RSA> load_key(const std::string& key, bool isPublic);
+
 	//Կ/˽Կܡ
 	static std::string rsa_encrypt(RSA* rsaPubKey, RSA* rsaPrivKey, const std::string& plainText);
 
 	//˽Կ/Կܡ
 	static std::string rsa_decrypt(RSA* rsaPubKey, RSA* rsaPrivKey, const std::string& encryptedText);
-
-	//base64
-	static std::string base64Encode(const unsigned char *bytes, int len);
-
-	//base64
-	static bool base64Decode(const std::string &str, unsigned char *bytes, int &len);
 };
 
 }
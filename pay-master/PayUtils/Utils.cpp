@@ -1,5 +1,7 @@
 #include "Utils.h"
-#include <codecvt>
+#include "PayHex.h"
+#include "PayCharset.h"
+#include <stdexcept>
 #include <random>
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/date_time/gregorian/gregorian.hpp>
@@ -11,81 +13,25 @@ using namespace boost;
 using namespace boost::posix_time;
 using namespace boost::gregorian;
 
-using WCHAR_GBK = codecvt_byname<wchar_t, char, mbstate_t>;
-using WCHAR_UTF8 = codecvt_utf8<wchar_t>;
-
-#ifdef _WIN32
-#define GBK_NAME ".936"
-#else
-#define GBK_NAME "zh_CN.GBK"
-#endif
-
-bool ch_trans::is_utf8(const char* str)
+bool ch_trans::is_utf8(boost::string_view str)
 {
-	if (str == 0) 
-	{
-		return false;
-	}
-
-	bool IsUTF8 = true;
-	unsigned char* start = (unsigned char*)str;
-	unsigned char* end = (unsigned char*)str + strlen(str);
-	while (start < end)
-	{
-		if (*start < 0x80) // (10000000): ֵС0x80ΪASCIIַ  
-		{
-			start++;
-		}
-		else if (*start < (0xC0)) // (11000000): ֵ0x800xC0֮ΪЧUTF-8ַ  
-		{
-			IsUTF8 = false;
-			break;
-		}
-		else if (*start < (0xE0)) // (11100000): ˷ΧΪ2ֽUTF-8ַ  
-		{
-			if (start >= end - 1)
-				break;
-			if ((start[1] & (0xC0)) != 0x80)
-			{
-				IsUTF8 = false;
-				break;
-			}
-			start += 2;
-		}
-		else if (*start < (0xF0)) // (11110000): ˷ΧΪ3ֽUTF-8ַ  
-		{
-			if (start >= end - 2)
-				break;
-			if ((start[1] & (0xC0)) != 0x80 || (start[2] & (0xC0)) != 0x80)
-			{
-				IsUTF8 = false;
-				break;
-			}
-			start += 3;
-		}
-		else
-		{
-			IsUTF8 = false;
-			break;
-		}
-	}
-	return IsUTF8;
+	return CPayCharset::isUtf8(str);
 }
 
-string ch_trans::utf8_to_ascii(const string& utf8)
+string ch_trans::utf8_to_ascii(boost::string_view utf8)
 {
-	wstring_convert<WCHAR_GBK>  cvtGBK(new WCHAR_GBK(GBK_NAME));
-	wstring_convert<WCHAR_UTF8> cvtUTF8;
-	wstring ustr = cvtUTF8.from_bytes(utf8);
-	return cvtGBK.to_bytes(ustr);
+	string strGbk;
+	if (!CPayCharset::utf8ToGbk(utf8, strGbk))
+		throw range_error("utf8_to_ascii: not utf-8 or not representable in gbk");
+	return strGbk;
 }
 
-string ch_trans::ascii_to_utf8(const string& ascii)
+string ch_trans::ascii_to_utf8(boost::string_view ascii)
 {
-	wstring_convert<WCHAR_GBK>  cvtGBK(new WCHAR_GBK(GBK_NAME));
-	wstring_convert<WCHAR_UTF8> cvtUTF8;
-	wstring ustr = cvtGBK.from_bytes(ascii);
-	return cvtUTF8.to_bytes(ustr);
+	string strUtf8;
+	if (!CPayCharset::gbkToUtf8(ascii, strUtf8))
+		throw range_error("ascii_to_utf8: not gbk");
+	return strUtf8;
 }
 
 void CUtils::split_string(string str, const string& strToken, vector<std::string>& vecStr)
@@ -159,8 +105,8 @@ string CUtils::getDelayTime(
 
 int CUtils::get_random_int(int start, int end) {
 
-	std::random_device rd;
-	std::mt19937 gen(rd());
+	//seeded once per thread, shared clients build nonces on every worker thread
+	static thread_local std::mt19937 gen(std::random_device{}());
 	std::uniform_int_distribution<> dis(start, end);
 
 	return dis(gen);
@@ -204,26 +150,26 @@ string CUtils::i2str(long long ll)
 	return lexical_cast<string>(ll);
 }
 
-vector<string> CUtils::createDictionaryWithMap(map<string, string> mapNameValue)
+vector<string> CUtils::createDictionaryWithMap(const map<string, string>& mapNameValue)
 {
+	//a map is already ordered by name
 	vector<string> vecDictionary;
-	while (mapNameValue.size() > 0)
-	{
-		auto itr = mapNameValue.begin();
-		for (auto itrr = mapNameValue.begin(); itrr != mapNameValue.end(); ++itrr)
-		{
-			if (itr->first > itrr->first)
-				itr = itrr;
-		}
+	vecDictionary.reserve(mapNameValue.size());
+	for (auto itr = mapNameValue.begin(); itr != mapNameValue.end(); ++itr)
 		vecDictionary.push_back(itr->first);
-		mapNameValue.erase(itr);
-	}
 	return vecDictionary;
 }
 
 string CUtils::UrlEncode(const std::string& str)
 {
-	std::string strTemp = "";
+	std::string strTemp;
+	UrlEncode(str, strTemp);
+	return strTemp;
+}
+
+void CUtils::UrlEncode(const std::string& str, std::string& strOut)
+{
+	strOut.reserve(strOut.size() + str.size() * 3 / 2);
 	size_t length = str.length();
 	for (size_t i = 0; i < length; i++)
 	{
@@ -232,19 +178,19 @@ string CUtils::UrlEncode(const std::string& str)
 			(str[i] == '_') ||
 			(str[i] == '.') ||
 			(str[i] == '~'))
-			strTemp += str[i];
+			strOut += str[i];
 		else if (str[i] == ' ')
-			strTemp += "+";
+			strOut += '+';
 		else
 		{
-			strTemp += '%';
-			strTemp += CharHexConverter::ToHex((unsigned char)str[i] >> 4);
-			strTemp += CharHexConverter::ToHex((unsigned char)str[i] % 16);
+			strOut += '%';
+			strOut += CharHexConverter::ToHex((unsigned char)str[i] >> 4);
+			strOut += CharHexConverter::ToHex((unsigned char)str[i] % 16);
 		}
 	}
-	return strTemp;
 }
 
+//appends in place, the old a = a + "&" + ... copied the whole string for every field
 void CUtils::AppendContent(
 	const std::string& strName, 
 	const std::string& strValue, 
@@ -253,16 +199,8 @@ void CUtils::AppendContent(
 	bool bNeedSep /*= true*/
 )
 {
-	if (bNeedSep)
-	{
-		strTotalString = strTotalString + "&" + strName + "=" + UrlEncode(strValue);
-		strClearString = strClearString + "&" + strName + "=" + strValue;
-	}
-	else
-	{
-		strTotalString = strName + "=" + UrlEncode(strValue);
-		strClearString = strName + "=" + strValue;
-	}
+	AppendContentWithUrlEncode(strName, strValue, strTotalString, bNeedSep);
+	AppendContentWithoutUrlEncode(strName, strValue, strClearString, bNeedSep);
 }
 
 void CUtils::AppendContentWithUrlEncode(
@@ -272,9 +210,13 @@ void CUtils::AppendContentWithUrlEncode(
 	bool bNeedSep /*= true*/
 )
 {
-	bNeedSep ?
-		strTotalString = strTotalString + "&" + strName + "=" + UrlEncode(strValue) :
-		strTotalString = strName + "=" + UrlEncode(strValue);
+	if (bNeedSep)
+		strTotalString += '&';
+	else
+		strTotalString.clear();
+	strTotalString += strName;
+	strTotalString += '=';
+	UrlEncode(strValue, strTotalString);
 }
 void CUtils::AppendContentWithoutUrlEncode(
 	const std::string& strName,
@@ -283,47 +225,26 @@ void CUtils::AppendContentWithoutUrlEncode(
 	bool bNeedSep /*= true*/
 )
 {
-	bNeedSep ?
-		strClearString = strClearString + "&" + strName + "=" + strValue:
-		strClearString = strName + "=" + strValue;
+	if (!bNeedSep)
+		strClearString.clear();
+	AppendPair(strClearString, strName, strValue, bNeedSep);
 }
 
 void CharHexConverter::hex2Char(char *pszHexStr, int iSize, char *pucCharStr)
 {
-	int i;
-	unsigned char ch;
 	if (iSize % 2 != 0) return;
-	for (i = 0; i < iSize / 2; i++)
-	{
-		Hex2Char(pszHexStr + 2 * i, &ch);
-		pucCharStr[i] = ch;
-	}
+	CPayHex::decode(pszHexStr, iSize, (unsigned char*)pucCharStr);
 }
 void CharHexConverter::char2Hex(char *pucCharStr, int iSize, char *pszHexStr)
 {
-	int i;
-	char szHex[3];
-	pszHexStr[0] = 0;
-	for (i = 0; i < iSize; i++)
-	{
-		Char2Hex(pucCharStr[i], szHex);
-		strcat(pszHexStr, szHex);
-	}
+	//pszHexStr holds 2 * iSize + 1 chars
+	CPayHex::encode(pucCharStr, iSize, pszHexStr);
+	pszHexStr[2 * iSize] = 0;
 }
 
 void CharHexConverter::Char2Hex(unsigned char ch, char *szHex)
 {
-	int i;
-	unsigned char byte[2];
-	byte[0] = ch / 16;
-	byte[1] = ch % 16;
-	for (i = 0; i < 2; i++)
-	{
-		if (byte[i] >= 0 && byte[i] <= 9)
-			szHex[i] = '0' + byte[i];
-		else
-			szHex[i] = 'a' + byte[i] - 10;
-	}
+	CPayHex::encode(&ch, 1, szHex);
 	szHex[2] = 0;
 }
 
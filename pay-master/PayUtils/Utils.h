@@ -2,6 +2,7 @@
 #include <map>
 #include <vector>
 #include <string>
+#include <boost/utility/string_view.hpp>
 
 namespace SAPay {
 
@@ -14,24 +15,49 @@ public:
 	static std::string i2str(int i);
 	static std::string i2str(long long ll);
 
-	static std::vector<std::string> createDictionaryWithMap(std::map<std::string, std::string> mapNameValue);
+	static std::vector<std::string> createDictionaryWithMap(const std::map<std::string, std::string>& mapNameValue);
 
 	static std::string getCurentTime(bool bExtended = true);
 	static std::string getDelayTime(long long llDelay, bool bExtended = true, const std::string& strOriginalTime = std::string(""));
 	static std::string getCurentTimeStampStr();
 
 	static std::string UrlEncode(const std::string& str);
+	//appends to strOut
+	static void UrlEncode(const std::string& str, std::string& strOut);
 	static void AppendContent(const std::string& strName, const std::string& strValue, std::string& strTotalString, std::string& strClearString = std::string(""), bool bNeedSep = true);
 	static void AppendContentWithUrlEncode(const std::string& strName, const std::string& strValue, std::string& strTotalString, bool bNeedSep = true);
 	static void AppendContentWithoutUrlEncode(const std::string& strName, const std::string& strValue, std::string& strClearString, bool bNeedSep = true);
+
+	//as above with the content to sign in any string, e.g. a CPayArenaString
+	template<typename TString>
+	static void AppendContent(const std::string& strName, const std::string& strValue, std::string& strTotalString, TString& clear, bool bNeedSep = true)
+	{
+		AppendContentWithUrlEncode(strName, strValue, strTotalString, bNeedSep);
+		if (!bNeedSep)
+			clear.clear();
+		AppendPair(clear, strName, strValue, bNeedSep);
+	}
+
+	//name=value appended in place to any string, e.g. a CPayArenaString holding content that is only signed
+	template<typename TString>
+	static void AppendPair(TString& str, boost::string_view name, boost::string_view value, bool bNeedSep = true)
+	{
+		if (bNeedSep)
+			str += '&';
+		str.append(name.data(), name.size());
+		str += '=';
+		str.append(value.data(), value.size());
+	}
 };
 
+//gbk <-> utf-8 through CPayCharset, independent of the system locales. the conversions throw std::range_error
+//on input that cannot be converted
 class ch_trans
 {
 public:
-	static bool is_utf8(const char* str);
-	static std::string utf8_to_ascii(const std::string& utf8);
-	static std::string ascii_to_utf8(const std::string& ascii);
+	static bool is_utf8(boost::string_view str);
+	static std::string utf8_to_ascii(boost::string_view utf8);
+	static std::string ascii_to_utf8(boost::string_view ascii);
 };
 
 class CharHexConverter {